@@ -0,0 +1,184 @@
+/* arena_tlb.c - TLB misses reading a hot set from malloc() vs the slab arena
+ *
+ * Allocates a hot set of objects sized like static assets (log-uniform
+ * from 512 bytes to 64 KiB) three times: with malloc(), from the slab
+ * arena on 4 KiB pages (-G) and from the arena on huge pages. Each time it
+ * reads a few cache lines of randomly chosen objects, as responses to
+ * random cached files do, and reports ns per object, dTLB load misses per
+ * thousand objects (from perf_event_open, when the kernel allows it) and
+ * how much of the process is backed by transparent huge pages.
+ *
+ * Usage: bench_arena_tlb [-m hot set MiB] [-n objects read]
+ */
+#define _GNU_SOURCE
+#include "../src/slab_arena.h"
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_OBJECT 512
+#define MAX_OBJECT (64 * 1024)
+#define LINES_READ 4            // cache lines read per object
+
+typedef struct {
+    char* data;
+    size_t size;
+} object_t;
+
+static volatile uint64_t sink;
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// dTLB read misses of this thread, user space only; -1 if perf is not allowed
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// AnonHugePages of the process, in KiB
+static long anon_huge_kb(void) {
+    FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb = 0;
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return kb;
+}
+
+// about log-uniform: a random octave between MIN_OBJECT and MAX_OBJECT,
+// then uniform within it
+static size_t object_size(uint64_t* state) {
+    int octaves = __builtin_ctz(MAX_OBJECT / MIN_OBJECT);
+    size_t base = (size_t) MIN_OBJECT << (next_random(state) % octaves);
+    return base + next_random(state) % base;
+}
+
+static void run(const char* mode, bool arena, size_t hot_bytes, long reads) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t capacity = hot_bytes / MIN_OBJECT + 1;
+    object_t* objects = calloc(capacity, sizeof(object_t));
+    size_t count = 0;
+    size_t total = 0;
+    while (total < hot_bytes && count < capacity) {
+        size_t size = object_size(&state);
+        char* data = arena ? arena_alloc(size) : malloc(size);
+        if (data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(data, (int) count, size);
+        objects[count++] = (object_t) {data, size};
+        total += size;
+    }
+
+    int counter = open_dtlb_counter();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now_ns();
+    uint64_t sum = 0;
+    for (long i = 0; i < reads; i++) {
+        object_t* object = &objects[next_random(&state) % count];
+        size_t stride = object->size / LINES_READ;
+        for (int line = 0; line < LINES_READ; line++) {
+            sum += (unsigned char) object->data[line * stride];
+        }
+    }
+    double elapsed = now_ns() - start;
+    uint64_t misses = 0;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = 0;
+        }
+        close(counter);
+    }
+    sink += sum;
+
+    printf("%s: objects: %zu hot_mib: %.0f ns_per_object: %.1f", mode, count, total / 1048576.0,
+           elapsed / reads);
+    if (counter >= 0) {
+        printf(" dtlb_misses_per_1k: %.1f", misses * 1000.0 / reads);
+    } else {
+        printf(" dtlb_misses_per_1k: n/a");
+    }
+    printf(" anon_huge_mib: %.0f\n", anon_huge_kb() / 1024.0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (arena) {
+            arena_free(objects[i].data, objects[i].size);
+        } else {
+            free(objects[i].data);
+        }
+    }
+    free(objects);
+}
+
+int main(int argc, char* argv[]) {
+    size_t hot_mib = 256;
+    long reads = 20 * 1000 * 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            hot_mib = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            reads = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m hot set MiB] [-n objects read]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (hot_mib == 0 || reads <= 0) {
+        fprintf(stderr, "Usage: %s [-m hot set MiB] [-n objects read]\n", argv[0]);
+        return 1;
+    }
+    int probe = open_dtlb_counter();
+    if (probe < 0) {
+        perror("perf_event_open (dTLB misses will read n/a; try kernel.perf_event_paranoid=1)");
+    } else {
+        close(probe);
+    }
+
+    size_t hot_bytes = hot_mib * 1024 * 1024;
+    run("malloc", false, hot_bytes, reads);
+    arena_init(false);
+    run("arena_4k", true, hot_bytes, reads);
+    arena_init(true);
+    run("arena_huge", true, hot_bytes, reads);
+    return 0;
+}
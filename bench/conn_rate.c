@@ -0,0 +1,132 @@
+/* conn_rate.c - new connections per second against a running server
+ *
+ * Each client thread loops: connect, send one "Connection: close" GET,
+ * read until EOF, close. Reports completed connections per second and
+ * connect failures.
+ *
+ * Usage: conn_rate [-t threads] [-d seconds] [-F] host port path
+ *   -F  send the request in the SYN with TCP Fast Open
+ */
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct addrinfo* target;
+static char request[1024];
+static size_t request_len;
+static bool fastopen = false;
+static atomic_bool stop = false;
+static atomic_ulong completed = 0;
+static atomic_ulong failed = 0;
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one connection, true if the whole reply was read
+static bool one_connection(void) {
+    int fd = socket(target->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = false;
+    if (fastopen) {
+        ok = sendto(fd, request, request_len, MSG_FASTOPEN, target->ai_addr,
+                    target->ai_addrlen) == (ssize_t) request_len;
+    } else {
+        ok = connect(fd, target->ai_addr, target->ai_addrlen) == 0 &&
+             write(fd, request, request_len) == (ssize_t) request_len;
+    }
+
+    char buf[16384];
+    ssize_t n = 0;
+    size_t total = 0;
+    while (ok && (n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+    }
+    close(fd);
+    return ok && n == 0 && total > 0;
+}
+
+static void* client(void* arg) {
+    (void) arg;
+    while (!atomic_load(&stop)) {
+        if (one_connection()) {
+            atomic_fetch_add(&completed, 1);
+        } else {
+            atomic_fetch_add(&failed, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int threads = 4;
+    int seconds = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:F")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'F':
+            fastopen = true;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || threads <= 0 || seconds <= 0) {
+        goto usage;
+    }
+
+    const char* host = argv[optind];
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(host, argv[optind + 1], &hints, &target) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        return 1;
+    }
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                           argv[optind + 2], host);
+
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    double start = now_secs();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, client, NULL);
+    }
+    sleep(seconds);
+    atomic_store(&stop, true);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_secs() - start;
+
+    printf("threads: %d\nseconds: %.2f\nconnections: %lu\nfailed: %lu\n"
+           "connections_per_sec: %.0f\n",
+           threads, elapsed, atomic_load(&completed), atomic_load(&failed),
+           atomic_load(&completed) / elapsed);
+    free(tids);
+    freeaddrinfo(target);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-t threads] [-d seconds] [-F] host port path\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,337 @@
+/* h2_streams.c - many concurrent requests over one HTTP/2 connection
+ *
+ * Opens one prior-knowledge h2c connection and keeps -c streams in flight
+ * on it, starting a new one as each response ends. With -1 the same load
+ * goes over -c keep-alive HTTP/1.1 connections instead, one request in
+ * flight on each, for comparison. Reports requests per second, body
+ * throughput and request latency percentiles.
+ *
+ * Usage: h2_streams [-c streams] [-d seconds] [-1] host port path
+ */
+#define _GNU_SOURCE
+#include "../src/hpack.h"
+#include "../src/http2.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SAMPLES (1 << 20)
+#define STREAM_SLOTS 4096       // start times by stream id, more than can be in flight
+
+static struct addrinfo* target;
+static const char* host;
+static const char* path;
+static atomic_bool stop = false;
+static atomic_ulong completed = 0;
+static atomic_ulong failed = 0;
+static atomic_ulong body_bytes = 0;
+
+static double* samples;         // latencies in ms
+static atomic_ulong sample_count = 0;
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(double started) {
+    unsigned long i = atomic_fetch_add(&sample_count, 1);
+    if (i < MAX_SAMPLES) {
+        samples[i] = (now_secs() - started) * 1000;
+    }
+    atomic_fetch_add(&completed, 1);
+}
+
+static int open_connection(void) {
+    int fd = socket(target->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void put_frame_header(uint8_t* p, size_t len, uint8_t type, uint8_t flags,
+                             uint32_t stream) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = stream >> 24;
+    p[6] = stream >> 16;
+    p[7] = stream >> 8;
+    p[8] = stream;
+}
+
+static size_t put_window_update(uint8_t* p, uint32_t stream, uint32_t increment) {
+    put_frame_header(p, 4, H2_WINDOW_UPDATE, 0, stream);
+    p[9] = increment >> 24;
+    p[10] = increment >> 16;
+    p[11] = increment >> 8;
+    p[12] = increment;
+    return H2_FRAME_HEADER + 4;
+}
+
+typedef struct {
+    int fd;
+    hpack_table_t encoder;
+    hpack_table_t decoder;
+    uint32_t next_stream;
+    double started[STREAM_SLOTS];
+    uint8_t out[64 * 1024];
+    size_t out_len;
+} h2_client_t;
+
+static void queue_request(h2_client_t* c) {
+    uint8_t* frame = c->out + c->out_len;
+    size_t len = H2_FRAME_HEADER;
+    size_t cap = sizeof(c->out) - c->out_len - H2_FRAME_HEADER;
+    len += hpack_encode(&c->encoder, frame + len, cap, ":method", "GET", 3, true);
+    len += hpack_encode(&c->encoder, frame + len, cap, ":scheme", "http", 4, true);
+    len += hpack_encode(&c->encoder, frame + len, cap, ":path", path, strlen(path), true);
+    len += hpack_encode(&c->encoder, frame + len, cap, ":authority", host, strlen(host), true);
+    put_frame_header(frame, len - H2_FRAME_HEADER, H2_HEADERS,
+                     H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, c->next_stream);
+    c->started[(c->next_stream / 2) % STREAM_SLOTS] = now_secs();
+    c->next_stream += 2;
+    c->out_len += len;
+}
+
+static void flush_client(h2_client_t* c) {
+    if (c->out_len > 0 && !write_all(c->fd, c->out, c->out_len)) {
+        perror("write");
+        exit(1);
+    }
+    c->out_len = 0;
+}
+
+static void run_h2(int streams) {
+    h2_client_t* c = calloc(1, sizeof(h2_client_t));
+    c->fd = open_connection();
+    hpack_table_init(&c->encoder);
+    hpack_table_init(&c->decoder);
+    c->next_stream = 1;
+
+    // the largest windows, so flow control never stalls the server
+    memcpy(c->out, H2_PREFACE, H2_PREFACE_LEN);
+    c->out_len = H2_PREFACE_LEN;
+    put_frame_header(c->out + c->out_len, 6, H2_SETTINGS, 0, 0);
+    uint8_t* setting = c->out + c->out_len + H2_FRAME_HEADER;
+    setting[0] = 0;
+    setting[1] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    setting[2] = 0x7f;
+    setting[3] = setting[4] = setting[5] = 0xff;
+    c->out_len += H2_FRAME_HEADER + 6;
+    c->out_len += put_window_update(c->out + c->out_len, 0, H2_MAX_WINDOW - H2_DEFAULT_WINDOW);
+    for (int i = 0; i < streams; i++) {
+        queue_request(c);
+    }
+    flush_client(c);
+
+    static uint8_t in[256 * 1024];
+    size_t in_len = 0;
+    uint64_t unacked = 0;
+    header_view_t headers[64];
+    static char decoded[MAX_REQUEST_SIZE];
+    while (!atomic_load(&stop)) {
+        ssize_t n = read(c->fd, in + in_len, sizeof(in) - in_len);
+        if (n <= 0) {
+            fprintf(stderr, "connection closed by the server\n");
+            break;
+        }
+        in_len += n;
+        size_t pos = 0;
+        while (in_len - pos >= H2_FRAME_HEADER) {
+            const uint8_t* f = in + pos;
+            size_t len = (size_t) f[0] << 16 | f[1] << 8 | f[2];
+            if (in_len - pos < H2_FRAME_HEADER + len) {
+                break;
+            }
+            uint8_t type = f[3];
+            uint8_t flags = f[4];
+            uint32_t stream = ((uint32_t) f[5] << 24 | f[6] << 16 | f[7] << 8 | f[8]) & 0x7fffffff;
+            const uint8_t* payload = f + H2_FRAME_HEADER;
+            bool ended = false;
+            if (type == H2_HEADERS) {
+                // decoded only to keep the table in step
+                hpack_decode(&c->decoder, payload, len, decoded, sizeof(decoded), headers, 64);
+                ended = flags & H2_FLAG_END_STREAM;
+            } else if (type == H2_DATA) {
+                atomic_fetch_add(&body_bytes, len);
+                unacked += len;
+                ended = flags & H2_FLAG_END_STREAM;
+            } else if (type == H2_SETTINGS && !(flags & H2_FLAG_ACK)) {
+                put_frame_header(c->out + c->out_len, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+                c->out_len += H2_FRAME_HEADER;
+            } else if (type == H2_RST_STREAM) {
+                atomic_fetch_add(&failed, 1);
+                queue_request(c);
+            } else if (type == H2_GOAWAY) {
+                fprintf(stderr, "GOAWAY from the server\n");
+                atomic_store(&stop, true);
+            }
+            if (ended) {
+                record(c->started[(stream / 2) % STREAM_SLOTS]);
+                queue_request(c);
+            }
+            pos += H2_FRAME_HEADER + len;
+        }
+        memmove(in, in + pos, in_len - pos);
+        in_len -= pos;
+        if (unacked > (1u << 30)) {
+            c->out_len += put_window_update(c->out + c->out_len, 0, (uint32_t) unacked);
+            unacked = 0;
+        }
+        flush_client(c);
+    }
+    close(c->fd);
+    hpack_table_free(&c->encoder);
+    hpack_table_free(&c->decoder);
+    free(c);
+}
+
+// one keep-alive HTTP/1.1 connection, one request at a time
+static void* http1_client(void* arg) {
+    (void) arg;
+    int fd = open_connection();
+    char request[1024];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                               path, host);
+    static __thread char buf[256 * 1024];
+    while (!atomic_load(&stop)) {
+        double started = now_secs();
+        if (!write_all(fd, request, request_len)) {
+            break;
+        }
+        size_t have = 0;
+        char* end = NULL;
+        while (end == NULL) {
+            ssize_t n = read(fd, buf + have, sizeof(buf) - have - 1);
+            if (n <= 0) {
+                goto done;
+            }
+            have += n;
+            buf[have] = '\0';
+            end = strstr(buf, "\r\n\r\n");
+        }
+        char* length = strcasestr(buf, "Content-length:");
+        size_t body = length != NULL && length < end ? strtoul(length + 15, NULL, 10) : 0;
+        size_t header_len = end + 4 - buf;
+        size_t left = header_len + body > have ? header_len + body - have : 0;
+        while (left > 0) {
+            ssize_t n = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+            if (n <= 0) {
+                goto done;
+            }
+            left -= n;
+        }
+        atomic_fetch_add(&body_bytes, body);
+        record(started);
+    }
+done:
+    if (!atomic_load(&stop)) {
+        atomic_fetch_add(&failed, 1);
+    }
+    close(fd);
+    return NULL;
+}
+
+static void* h2_thread(void* arg) {
+    run_h2(*(int*) arg);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+    int streams = 32;
+    int seconds = 5;
+    bool http1 = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:1")) != -1) {
+        switch (opt) {
+        case 'c':
+            streams = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case '1':
+            http1 = true;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || streams <= 0 || streams > H2_MAX_STREAMS || seconds <= 0) {
+        goto usage;
+    }
+
+    host = argv[optind];
+    path = argv[optind + 2];
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(host, argv[optind + 1], &hints, &target) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        return 1;
+    }
+    samples = malloc(MAX_SAMPLES * sizeof(double));
+
+    int threads = http1 ? streams : 1;
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    double start = now_secs();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, http1 ? http1_client : h2_thread, &streams);
+    }
+    sleep(seconds);
+    atomic_store(&stop, true);
+    // the readers may sit in read(); their sockets go when the process exits
+    double elapsed = now_secs() - start;
+
+    unsigned long n = atomic_load(&sample_count);
+    n = n < MAX_SAMPLES ? n : MAX_SAMPLES;
+    qsort(samples, n, sizeof(double), compare_doubles);
+    printf("mode: %s\nconcurrency: %d\nseconds: %.2f\nrequests: %lu\nfailed: %lu\n"
+           "requests_per_sec: %.0f\nmb_per_sec: %.1f\nlatency_p50_ms: %.3f\n"
+           "latency_p99_ms: %.3f\n",
+           http1 ? "http/1.1" : "h2c", streams, elapsed, atomic_load(&completed),
+           atomic_load(&failed), atomic_load(&completed) / elapsed,
+           atomic_load(&body_bytes) / elapsed / 1e6, n > 0 ? samples[n / 2] : 0.0,
+           n > 0 ? samples[n * 99 / 100] : 0.0);
+    free(tids);
+    freeaddrinfo(target);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-c streams] [-d seconds] [-1] host port path\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,95 @@
+/* hash.c - throughput of the content hashes used for ETags and digests
+ *
+ * Hashes buffers of several sizes over and over, in cache and out of it,
+ * and reports GB/s for XXH3 (one call and streamed in 16 KiB reads, as a
+ * cache fill does) and for SHA-256.
+ *
+ * Usage: bench_hash [-b bytes per measurement]
+ */
+#include "../src/content_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STREAM_CHUNK 16384
+
+static volatile uint64_t sink;
+
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double xxh3_oneshot(const uint8_t* data, size_t size, long rounds) {
+    double start = cpu_ns();
+    for (long i = 0; i < rounds; i++) {
+        sink += xxh3_64(data, size);
+    }
+    return cpu_ns() - start;
+}
+
+static double xxh3_streamed(const uint8_t* data, size_t size, long rounds) {
+    double start = cpu_ns();
+    for (long i = 0; i < rounds; i++) {
+        xxh3_state_t state;
+        xxh3_init(&state);
+        for (size_t off = 0; off < size; off += STREAM_CHUNK) {
+            xxh3_update(&state, data + off, size - off < STREAM_CHUNK ? size - off : STREAM_CHUNK);
+        }
+        sink += xxh3_digest(&state);
+    }
+    return cpu_ns() - start;
+}
+
+static double sha256_oneshot(const uint8_t* data, size_t size, long rounds) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    double start = cpu_ns();
+    for (long i = 0; i < rounds; i++) {
+        sha256(data, size, digest);
+        sink += digest[0];
+    }
+    return cpu_ns() - start;
+}
+
+int main(int argc, char* argv[]) {
+    double total = 4e9;  // bytes hashed per measurement
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        if (opt == 'b') {
+            total = atof(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-b bytes per measurement]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const size_t sizes[] = {64, 1024, 16384, 262144, 64 << 20};
+    size_t max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    uint8_t* data = malloc(max_size);
+    if (data == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < max_size; i++) {
+        data[i] = (uint8_t) (i * 2654435761u >> 13);
+    }
+
+    printf("xxh3 kernel: %s\n", xxh3_kernel());
+    printf("%10s %14s %14s %14s\n", "bytes", "xxh3 GB/s", "streamed GB/s", "sha256 GB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+        long rounds = (long) (total / size) + 1;
+        double bytes = (double) size * rounds;
+        double oneshot = xxh3_oneshot(data, size, rounds);
+        double streamed = xxh3_streamed(data, size, rounds);
+        // SHA-256 is two orders of magnitude slower, give it a tenth of the bytes
+        long sha_rounds = rounds / 10 + 1;
+        double sha = sha256_oneshot(data, size, sha_rounds);
+        printf("%10zu %14.2f %14.2f %14.3f\n", size, bytes / oneshot, bytes / streamed,
+               (double) size * sha_rounds / sha);
+    }
+    free(data);
+    return 0;
+}
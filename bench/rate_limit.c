@@ -0,0 +1,93 @@
+/* rate_limit.c - cost of one rate limit check
+ *
+ * Runs rate_limit_connection()-style checks (per address and per /24)
+ * against a working set of client addresses, single threaded and with
+ * several threads sharing the table, and reports CPU nanoseconds per check.
+ *
+ * Usage: bench_rate_limit [-n checks] [-c clients] [-t threads]
+ */
+#include "../src/rate_limit.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static long checks = 20000000;
+static uint32_t clients = 10000;
+
+// CPU time of the whole process, so oversubscribed threads don't inflate the result
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* run(void* arg) {
+    uint32_t seed = (uint32_t) (uintptr_t) arg * 2654435761u + 1;
+    unsigned long allowed = 0;
+    for (long i = 0; i < checks; i++) {
+        // xorshift over the working set, time advancing 1 ms per 1000 checks
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        uint32_t ip = 0x0A000000u + seed % clients;
+        uint64_t now = (uint64_t) i / 1000;
+        allowed += rate_limit_take(RATE_CONN_IP, ip, now) &&
+                   rate_limit_take(RATE_CONN_NET24, ip & 0xFFFFFF00u, now);
+    }
+    return (void*) allowed;
+}
+
+static void measure(int threads) {
+    rate_limit_reset();
+    rate_limit_configure("conn=100/200,conn24=10000/20000");
+
+    pthread_t tids[64];
+    unsigned long allowed = 0;
+    double start = cpu_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, run, (void*) (uintptr_t) i);
+    }
+    for (int i = 0; i < threads; i++) {
+        void* result;
+        pthread_join(tids[i], &result);
+        allowed += (unsigned long) result;
+    }
+    double elapsed = cpu_ns() - start;
+
+    printf("threads: %d  checks: %ld  clients: %u  allowed: %.1f%%  ns/check: %.1f\n",
+           threads, checks * threads, clients, 100.0 * allowed / (checks * threads),
+           elapsed / (checks * threads));
+}
+
+int main(int argc, char* argv[]) {
+    int threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            checks = atol(optarg);
+            break;
+        case 'c':
+            clients = (uint32_t) atol(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n checks] [-c clients] [-t threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1 || threads > 64 || clients == 0 || checks <= 0) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+
+    measure(1);
+    if (threads > 1) {
+        measure(threads);
+    }
+    return 0;
+}
@@ -0,0 +1,628 @@
+/* replay.c - re-drive traffic recorded with httpd -R against a server
+ *
+ * Reads a capture file and replays its requests with the original
+ * connection patterns: requests recorded on one connection go out on one
+ * connection, one at a time and in order, and each connection opens when
+ * its first request was recorded. -s sets the pace: 1 is real time, N is
+ * N times faster, 0 sends every request as soon as its connection is
+ * free. Bodies were not recorded; requests that had one send filler of
+ * the same length. Reports throughput, status classes, request latency
+ * percentiles and how far behind schedule requests went out.
+ *
+ * Usage: replay [-s speed] [-c max connections] host port capture
+ */
+#define _GNU_SOURCE
+#include "../src/capture.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define IN_BUFFER 16384         // response header block and unparsed body bytes per connection
+#define MAX_EVENTS 256
+#define LATE_MS 10.0            // requests sent this late count as behind schedule
+
+typedef struct {
+    uint64_t time_us;
+    uint64_t conn_id;
+    uint32_t body_len;
+    uint16_t head_len;
+    uint16_t flags;
+    const char* head;
+    size_t order;               // position in the file, to keep sorting stable
+} request_t;
+
+/* Response parser states */
+enum { READ_HEAD, READ_BODY, READ_CHUNK_SIZE, READ_CHUNK_DATA, READ_TRAILER, READ_UNTIL_CLOSE };
+
+typedef struct conn {
+    size_t* requests;           // indexes into the request array, in order
+    int count;
+    int capacity;
+    int next;                   // request being sent or waited on
+
+    int fd;                     // -1 while closed
+    bool connecting;
+    bool waiting;               // in the schedule heap
+    double due_ms;              // when the next request should go out
+    int served_here;            // responses on the current socket
+
+    const char* out;            // request bytes not yet written
+    size_t out_len;
+    size_t filler_left;         // body filler still to send
+    bool send_last_chunk;       // a chunked body, sent empty
+
+    char in[IN_BUFFER];
+    size_t in_len;
+    int state;
+    size_t remaining;           // body or chunk bytes still expected
+    bool head_request;
+    bool close_after;           // the response said the connection ends with it
+    int status;
+    double started_ms;
+} conn_t;
+
+static request_t* requests;
+static size_t request_count;
+static conn_t* conns;
+static int conn_count;
+static struct addrinfo* target;
+static int epoll_fd;
+static double speed = 1;
+static double start_ms;
+static uint64_t first_us;
+
+static conn_t** heap;           // connections waiting for their next request's time
+static int heap_len;
+
+static double* latencies;
+static double* lags;
+static size_t done_count;
+static unsigned long statuses[6];
+static unsigned long errors, reconnects, late;
+static int finished;            // connections through their script
+static double body_bytes;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_requests(const void* a, const void* b) {
+    const request_t* x = a;
+    const request_t* y = b;
+    if (x->time_us != y->time_us) {
+        return x->time_us < y->time_us ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static double due_of(size_t request) {
+    if (speed <= 0) {
+        return 0;
+    }
+    return start_ms + (double) (requests[request].time_us - first_us) / 1000.0 / speed;
+}
+
+static void load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    char* data = malloc(st.st_size + 1);
+    if (data == NULL || read(fd, data, st.st_size) != st.st_size ||
+        st.st_size < CAPTURE_MAGIC_LEN || memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        exit(1);
+    }
+    close(fd);
+
+    size_t capacity = 1024;
+    requests = malloc(capacity * sizeof(request_t));
+    for (off_t off = CAPTURE_MAGIC_LEN; off + (off_t) sizeof(capture_record_t) <= st.st_size;) {
+        capture_record_t record;
+        memcpy(&record, data + off, sizeof(record));
+        off += sizeof(record);
+        if (off + record.head_len > st.st_size) {
+            fprintf(stderr, "%s: truncated record, ignoring the rest\n", path);
+            break;
+        }
+        if (request_count == capacity) {
+            capacity *= 2;
+            requests = realloc(requests, capacity * sizeof(request_t));
+        }
+        requests[request_count] = (request_t) {
+            .time_us = record.time_us, .conn_id = record.conn_id, .body_len = record.body_len,
+            .head_len = record.head_len, .flags = record.flags, .head = data + off,
+            .order = request_count,
+        };
+        request_count++;
+        off += record.head_len;
+    }
+    if (request_count == 0) {
+        fprintf(stderr, "%s: no requests\n", path);
+        exit(1);
+    }
+    // blocks from several processes may be out of order
+    qsort(requests, request_count, sizeof(request_t), compare_requests);
+    first_us = requests[0].time_us;
+
+    // group by connection, connections in the order they first sent something
+    size_t slots = 16;
+    while (slots < request_count * 2) {
+        slots *= 2;
+    }
+    int* table = malloc(slots * sizeof(int));
+    memset(table, -1, slots * sizeof(int));
+    conns = calloc(request_count, sizeof(conn_t));
+    for (size_t i = 0; i < request_count; i++) {
+        size_t slot = (requests[i].conn_id * 0x9e3779b97f4a7c15ULL) >> 20 & (slots - 1);
+        while (table[slot] >= 0 &&
+               requests[conns[table[slot]].requests[0]].conn_id != requests[i].conn_id) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (table[slot] < 0) {
+            table[slot] = conn_count++;
+        }
+        conn_t* c = &conns[table[slot]];
+        if (c->count == c->capacity) {
+            c->capacity = c->capacity ? c->capacity * 2 : 4;
+            c->requests = realloc(c->requests, c->capacity * sizeof(size_t));
+        }
+        c->requests[c->count++] = i;
+    }
+    free(table);
+}
+
+static void heap_push(conn_t* c) {
+    int i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2]->due_ms > c->due_ms) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+    c->waiting = true;
+}
+
+static conn_t* heap_pop(void) {
+    conn_t* top = heap[0];
+    conn_t* last = heap[--heap_len];
+    int i = 0;
+    while (2 * i + 1 < heap_len) {
+        int child = 2 * i + 1;
+        if (child + 1 < heap_len && heap[child + 1]->due_ms < heap[child]->due_ms) {
+            child++;
+        }
+        if (last->due_ms <= heap[child]->due_ms) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    top->waiting = false;
+    return top;
+}
+
+static void close_conn(conn_t* c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static bool open_conn(conn_t* c) {
+    c->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return false;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close_conn(c);
+        return false;
+    }
+    c->connecting = true;
+    c->served_here = 0;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+    return true;
+}
+
+static void want_write(conn_t* c, bool on) {
+    struct epoll_event event = {.events = EPOLLIN | (on ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+static void flush_out(conn_t* c);
+static void finish_conn(conn_t* c);
+
+// start the next request of c: now, or when the schedule says so
+static void schedule(conn_t* c, double now) {
+    request_t* r = &requests[c->requests[c->next]];
+    c->due_ms = due_of(c->requests[c->next]);
+    if (c->due_ms > now) {
+        heap_push(c);
+        return;
+    }
+    double lag = now - c->due_ms;
+    lags[c->requests[c->next]] = speed > 0 ? lag : 0;
+    if (speed > 0 && lag > LATE_MS) {
+        late++;
+    }
+    c->out = r->head;
+    c->out_len = r->head_len;
+    c->filler_left = r->body_len;
+    c->send_last_chunk = r->flags & CAPTURE_CHUNKED;
+    c->head_request = r->head_len >= 5 && memcmp(r->head, "HEAD ", 5) == 0;
+    c->state = READ_HEAD;
+    c->in_len = 0;
+    c->close_after = false;
+    c->started_ms = now;
+    if (c->fd < 0 && !open_conn(c)) {
+        // nothing to send the rest on
+        for (int i = c->next; i < c->count; i++) {
+            latencies[c->requests[i]] = -1;
+            errors++;
+        }
+        finish_conn(c);
+        return;
+    }
+    if (!c->connecting) {
+        flush_out(c);
+    }
+}
+
+static void finish_conn(conn_t* c) {
+    close_conn(c);
+    c->next = c->count;
+    finished++;
+}
+
+// a response is complete: record it, move on to the next request
+static void response_done(conn_t* c, double now) {
+    size_t index = c->requests[c->next];
+    latencies[index] = now - c->started_ms;
+    statuses[c->status / 100 <= 5 ? c->status / 100 : 0]++;
+    done_count++;
+    c->served_here++;
+    if (c->close_after) {
+        close_conn(c);
+    }
+    if (++c->next == c->count) {
+        finish_conn(c);
+        return;
+    }
+    if (c->fd < 0) {
+        reconnects++;
+    }
+    schedule(c, now);
+}
+
+static void fail_request(conn_t* c, double now) {
+    // a keep-alive connection the server closed between requests: resend on a new one
+    if (c->served_here > 0 && c->in_len == 0 && c->state == READ_HEAD) {
+        close_conn(c);
+        reconnects++;
+        schedule(c, now);
+        return;
+    }
+    latencies[c->requests[c->next]] = -1;
+    errors++;
+    close_conn(c);
+    if (++c->next < c->count) {
+        schedule(c, now);
+    } else {
+        finish_conn(c);
+    }
+}
+
+static void flush_out(conn_t* c) {
+    static const char filler[16384];
+    for (;;) {
+        const char* data = c->out;
+        size_t len = c->out_len;
+        if (len == 0 && c->filler_left > 0) {
+            data = filler;
+            len = c->filler_left < sizeof(filler) ? c->filler_left : sizeof(filler);
+        } else if (len == 0 && c->send_last_chunk) {
+            c->out = "0\r\n\r\n";
+            c->out_len = 5;
+            c->send_last_chunk = false;
+            continue;
+        }
+        if (len == 0) {
+            want_write(c, false);
+            return;
+        }
+        ssize_t n = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            want_write(c, true);
+            return;
+        }
+        if (n <= 0) {
+            fail_request(c, now_ms());
+            return;
+        }
+        if (c->out_len > 0) {
+            c->out += n;
+            c->out_len -= n;
+        } else {
+            c->filler_left -= n;
+        }
+    }
+}
+
+static char* find_line_end(char* p, size_t len) {
+    return memmem(p, len, "\r\n", 2);
+}
+
+static void consume(conn_t* c, size_t n) {
+    memmove(c->in, c->in + n, c->in_len - n);
+    c->in_len -= n;
+}
+
+// parse what has arrived; Returns: 1 when the response is complete, 0 for more, -1 on garbage
+static int parse(conn_t* c) {
+    for (;;) {
+        switch (c->state) {
+        case READ_HEAD: {
+            char* end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+            if (end == NULL) {
+                return c->in_len == IN_BUFFER ? -1 : 0;
+            }
+            size_t head_len = end + 4 - c->in;
+            *end = '\0';
+            if (strncmp(c->in, "HTTP/1.", 7) != 0 || c->in_len < 12) {
+                return -1;
+            }
+            c->status = atoi(c->in + 9);
+            bool http10 = c->in[7] == '0';
+            bool chunked = false, keep_alive = false, has_length = false;
+            size_t length = 0;
+            for (char* line = strstr(c->in, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+                char* field = line + 2;
+                if (strncasecmp(field, "Content-Length:", 15) == 0) {
+                    length = strtoull(field + 15, NULL, 10);
+                    has_length = true;
+                } else if (strncasecmp(field, "Transfer-Encoding:", 18) == 0) {
+                    chunked = strcasestr(field, "chunked") != NULL;
+                } else if (strncasecmp(field, "Connection:", 11) == 0) {
+                    c->close_after = c->close_after || strcasestr(field, "close") != NULL;
+                    keep_alive = strcasestr(field, "keep-alive") != NULL;
+                }
+            }
+            c->close_after = c->close_after || (http10 && !keep_alive);
+            consume(c, head_len);
+            if (c->status >= 100 && c->status < 200) {
+                c->close_after = false;
+                continue;  // 100 Continue and friends, the real response follows
+            }
+            if (c->head_request || c->status == 204 || c->status == 304) {
+                return 1;
+            }
+            if (chunked) {
+                c->state = READ_CHUNK_SIZE;
+            } else if (has_length) {
+                c->state = READ_BODY;
+                c->remaining = length;
+            } else {
+                c->state = READ_UNTIL_CLOSE;
+                c->close_after = true;
+            }
+            continue;
+        }
+        case READ_BODY:
+        case READ_CHUNK_DATA: {
+            size_t n = c->in_len < c->remaining ? c->in_len : c->remaining;
+            consume(c, n);
+            c->remaining -= n;
+            body_bytes += n;
+            if (c->remaining > 0) {
+                return 0;
+            }
+            if (c->state == READ_BODY) {
+                return 1;
+            }
+            c->state = READ_CHUNK_SIZE;
+            continue;
+        }
+        case READ_CHUNK_SIZE:
+        case READ_TRAILER: {
+            char* end = find_line_end(c->in, c->in_len);
+            if (end == NULL) {
+                return c->in_len == IN_BUFFER ? -1 : 0;
+            }
+            size_t line_len = end + 2 - c->in;
+            if (c->state == READ_TRAILER) {
+                consume(c, line_len);
+                if (line_len == 2) {
+                    return 1;
+                }
+                continue;
+            }
+            size_t size = strtoull(c->in, NULL, 16);
+            consume(c, line_len);
+            if (size == 0) {
+                c->state = READ_TRAILER;
+            } else {
+                c->state = READ_CHUNK_DATA;
+                c->remaining = size + 2;  // and its CRLF
+            }
+            continue;
+        }
+        case READ_UNTIL_CLOSE:
+            body_bytes += c->in_len;
+            c->in_len = 0;
+            return 0;
+        }
+    }
+}
+
+static void on_event(conn_t* c, uint32_t events) {
+    double now = now_ms();
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            fail_request(c, now);
+            return;
+        }
+        c->connecting = false;
+        flush_out(c);
+        return;
+    }
+    if ((events & EPOLLOUT) && (c->out_len > 0 || c->filler_left > 0 || c->send_last_chunk)) {
+        flush_out(c);
+        if (c->fd < 0) {
+            return;
+        }
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, IN_BUFFER - c->in_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        if (c->state == READ_UNTIL_CLOSE && n == 0) {
+            close_conn(c);
+            response_done(c, now);
+        } else {
+            fail_request(c, now);
+        }
+        return;
+    }
+    c->in_len += n;
+    int rc = parse(c);
+    if (rc < 0) {
+        fail_request(c, now);
+    } else if (rc > 0) {
+        if (c->in_len > 0) {
+            c->close_after = true;  // bytes past the response: we do not pipeline, give up on it
+        }
+        response_done(c, now);
+    }
+}
+
+static double percentile(const double* sorted, size_t n, double p) {
+    return n == 0 ? 0 : sorted[(size_t) (p / 100 * (n - 1))];
+}
+
+int main(int argc, char* argv[]) {
+    int max_open = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'c':
+            max_open = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || speed < 0 || max_open <= 0) {
+        goto usage;
+    }
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &target) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", argv[optind]);
+        return 1;
+    }
+    load(argv[optind + 2]);
+    for (int i = 0; i < conn_count; i++) {
+        conns[i].fd = -1;
+    }
+    heap = malloc(conn_count * sizeof(conn_t*));
+    latencies = calloc(request_count, sizeof(double));
+    lags = calloc(request_count, sizeof(double));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    // connections start in the order they did in the capture
+    start_ms = now_ms();
+    int next_conn = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (finished < conn_count) {
+        double now = now_ms();
+        while (next_conn < conn_count && next_conn - finished < max_open &&
+               due_of(conns[next_conn].requests[0]) <= now) {
+            schedule(&conns[next_conn++], now);
+        }
+        while (heap_len > 0 && heap[0]->due_ms <= now) {
+            schedule(heap_pop(), now);
+        }
+        if (finished == conn_count) {
+            break;
+        }
+
+        double wake = -1;
+        if (heap_len > 0) {
+            wake = heap[0]->due_ms;
+        }
+        if (next_conn < conn_count && next_conn - finished < max_open) {
+            double due = due_of(conns[next_conn].requests[0]);
+            wake = wake < 0 || due < wake ? due : wake;
+        }
+        int timeout = wake < 0 ? 1000 : wake <= now ? 0 : (int) (wake - now) + 1;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < ready; i++) {
+            on_event(events[i].data.ptr, events[i].events);
+        }
+    }
+    double elapsed = (now_ms() - start_ms) / 1000;
+
+    size_t samples = 0;
+    for (size_t i = 0; i < request_count; i++) {
+        if (latencies[i] >= 0) {
+            latencies[samples++] = latencies[i];
+        }
+    }
+    qsort(latencies, samples, sizeof(double), compare_doubles);
+    qsort(lags, request_count, sizeof(double), compare_doubles);
+    double span = (requests[request_count - 1].time_us - first_us) / 1e6;
+    char pace[32] = "max";
+    if (speed > 0) {
+        snprintf(pace, sizeof(pace), "%g", speed);
+    }
+    printf("captured_requests: %zu\ncaptured_connections: %d\ncaptured_seconds: %.2f\n"
+           "speed: %s\nseconds: %.2f\nrequests: %zu\nerrors: %lu\nreconnects: %lu\n"
+           "requests_per_sec: %.0f\nmb_per_sec: %.2f\n",
+           request_count, conn_count, span, pace, elapsed,
+           done_count, errors, reconnects, done_count / elapsed, body_bytes / elapsed / 1e6);
+    printf("status_1xx: %lu\nstatus_2xx: %lu\nstatus_3xx: %lu\nstatus_4xx: %lu\n"
+           "status_5xx: %lu\n", statuses[1], statuses[2], statuses[3], statuses[4], statuses[5]);
+    printf("latency_p50_ms: %.3f\nlatency_p90_ms: %.3f\nlatency_p99_ms: %.3f\n"
+           "latency_p999_ms: %.3f\nlatency_max_ms: %.3f\n",
+           percentile(latencies, samples, 50), percentile(latencies, samples, 90),
+           percentile(latencies, samples, 99), percentile(latencies, samples, 99.9),
+           samples > 0 ? latencies[samples - 1] : 0.0);
+    if (speed > 0) {
+        printf("behind_schedule: %lu\nlag_p50_ms: %.3f\nlag_p99_ms: %.3f\n", late,
+               percentile(lags, request_count, 50), percentile(lags, request_count, 99));
+    }
+    freeaddrinfo(target);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-s speed (1 = real time, 0 = max)] [-c max connections] "
+                    "host port capture\n", argv[0]);
+    return 1;
+}
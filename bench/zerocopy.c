@@ -0,0 +1,204 @@
+/* zerocopy.c - CPU spent per gigabyte of cached bodies, copied vs MSG_ZEROCOPY
+ *
+ * Caches one file of -s bytes and sends it through send_response() in a
+ * loop over a loopback TCP connection, once with plain copies and once
+ * with MSG_ZEROCOPY (-Z at the same size), while a reader thread drains
+ * the other end. Reports CPU seconds per GB for the sending thread and
+ * for the whole process, and how many zero-copy completions the kernel
+ * had to copy anyway. Loopback always copies on delivery, so run it with
+ * -p against a discard server on another host to see the full saving.
+ *
+ * Usage: zerocopy [-s bytes] [-d seconds] [-p host:port]
+ */
+#define _GNU_SOURCE
+#include "../src/file_cache.h"
+#include "../src/http_server.h"
+#include "../src/server_stats.h"
+#include "../src/zerocopy.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double now_secs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+           usage.ru_stime.tv_usec / 1e6;
+}
+
+static void* drain(void* arg) {
+    int fd = *(int*) arg;
+    static char buf[1 << 20];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+// a connected pair over loopback, or a connection to peer
+static int open_sender(const char* peer, int* reader) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int listener = -1;
+    *reader = -1;
+    if (peer != NULL) {
+        char host[256];
+        snprintf(host, sizeof(host), "%s", peer);
+        char* port = strrchr(host, ':');
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+        struct addrinfo* target;
+        if (port == NULL || (*port++ = '\0', getaddrinfo(host, port, &hints, &target)) != 0) {
+            fprintf(stderr, "cannot resolve %s\n", peer);
+            exit(1);
+        }
+        addr = *(struct sockaddr_in*) target->ai_addr;
+        freeaddrinfo(target);
+    } else {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+            getsockname(listener, (struct sockaddr*) &addr, &addr_len) < 0) {
+            perror("listen");
+            exit(1);
+        }
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    if (listener >= 0) {
+        *reader = accept(listener, NULL, NULL);
+        close(listener);
+    }
+    return fd;
+}
+
+typedef struct {
+    double seconds;
+    double bytes;
+    double thread_cpu;
+    double process_cpu;
+    unsigned long copied;
+    unsigned long sends;
+} run_t;
+
+static run_t run(const char* path, const struct stat* st, size_t threshold, int seconds,
+                 const char* peer) {
+    zerocopy_init(threshold);
+    int reader;
+    int fd = open_sender(peer, &reader);
+    pthread_t tid;
+    if (reader >= 0) {
+        pthread_create(&tid, NULL, drain, &reader);
+    }
+
+    unsigned long copied = STATS_GET(zerocopy_copied);
+    unsigned long sends = STATS_GET(zerocopy_sends);
+    double start = now_secs(CLOCK_MONOTONIC);
+    double start_cpu = now_secs(CLOCK_THREAD_CPUTIME_ID);
+    double start_process = process_cpu();
+    double bytes = 0;
+    while (now_secs(CLOCK_MONOTONIC) - start < seconds) {
+        // as a worker does: a reference per response, dropped by send_response()
+        http_response_t response = {.status_code = 200, .status_text = "OK",
+                                    .content_type = "application/octet-stream"};
+        response.cache_entry = file_cache_lookup(path, st);
+        response.content = response.cache_entry->content;
+        response.content_length = st->st_size;
+        if (send_response(fd, &response) < 0) {
+            fprintf(stderr, "send failed\n");
+            break;
+        }
+        bytes += st->st_size;
+    }
+    run_t result = {
+        .seconds = now_secs(CLOCK_MONOTONIC) - start,
+        .bytes = bytes,
+        .thread_cpu = now_secs(CLOCK_THREAD_CPUTIME_ID) - start_cpu,
+        .process_cpu = process_cpu() - start_process,
+        .copied = STATS_GET(zerocopy_copied) - copied,
+        .sends = STATS_GET(zerocopy_sends) - sends,
+    };
+    shutdown(fd, SHUT_WR);
+    if (reader >= 0) {
+        pthread_join(tid, NULL);
+        close(reader);
+    }
+    zerocopy_close(fd);
+    return result;
+}
+
+static void report(FILE* out, const char* mode, const run_t* r) {
+    double gb = r->bytes / 1e9;
+    fprintf(out, "%s: gb_per_sec: %.2f sender_cpu_per_gb: %.3f process_cpu_per_gb: %.3f",
+            mode, gb / r->seconds, r->thread_cpu / gb, r->process_cpu / gb);
+    if (r->sends > 0) {
+        fprintf(out, " zerocopy_sends: %lu copied_by_kernel: %lu", r->sends, r->copied);
+    }
+    fprintf(out, "\n");
+}
+
+int main(int argc, char* argv[]) {
+    size_t size = 60 * 1024;
+    int seconds = 3;
+    const char* peer = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            peer = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc != optind || size == 0 || size > SENDFILE_THRESHOLD || seconds <= 0) {
+        goto usage;
+    }
+
+    char path[] = "/tmp/bench_zerocopy_XXXXXX";
+    int fd = mkstemp(path);
+    char* data = calloc(1, size);
+    struct stat st;
+    if (fd < 0 || write(fd, data, size) != (ssize_t) size || fstat(fd, &st) < 0) {
+        perror("temp file");
+        return 1;
+    }
+    free(data);
+    file_cache_init(FILE_CACHE_DEFAULT_SIZE, 1, false);
+    file_cache_release(file_cache_fill(path, fd, &st));
+    close(fd);
+
+    // send_response() logs every response on stdout
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 1;
+    }
+    fprintf(out, "body_bytes: %zu\n", size);
+    run_t copy = run(path, &st, 0, seconds, peer);
+    report(out, "copy", &copy);
+    run_t zerocopy = run(path, &st, size, seconds, peer);
+    report(out, "zerocopy", &zerocopy);
+    unlink(path);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-s bytes (max %d)] [-d seconds] [-p host:port]\n", argv[0],
+            SENDFILE_THRESHOLD);
+    return 1;
+}
@@ -0,0 +1,70 @@
+/* buffer_pool.c */
+#include "buffer_pool.h"
+#include "cpu_affinity.h"
+#include "slab_arena.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+/* One free list per NUMA node, so a buffer first touched by a worker on one
+ * node is only ever handed out again on that node */
+typedef struct node_pool {
+    pthread_mutex_t lock;
+    pool_buf_t* free_list;
+    int free_count;
+} node_pool_t;
+
+static node_pool_t pools[MAX_NUMA_NODES] = {
+    [0 ... MAX_NUMA_NODES - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+};
+
+pool_buf_t* buffer_pool_get(void) {
+    node_pool_t* pool = &pools[affinity_current_node()];
+    pthread_mutex_lock(&pool->lock);
+    pool_buf_t* buf = pool->free_list;
+    if (buf != NULL) {
+        pool->free_list = buf->next;
+        pool->free_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buf == NULL && (buf = arena_alloc(sizeof(pool_buf_t))) == NULL) {
+        return NULL;
+    }
+    buf->next = NULL;
+    buf->len = 0;
+    return buf;
+}
+
+void buffer_pool_put(pool_buf_t* buf) {
+    if (buf == NULL) {
+        return;
+    }
+
+    // buffers come back on the node of the thread releasing them, which is
+    // the node that allocated them unless they crossed workers
+    node_pool_t* pool = &pools[affinity_current_node()];
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < POOL_MAX_FREE) {
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+        pool->free_count++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    arena_free(buf, sizeof(pool_buf_t));
+}
+
+void buffer_pool_cleanup(void) {
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        node_pool_t* pool = &pools[node];
+        pthread_mutex_lock(&pool->lock);
+        while (pool->free_list != NULL) {
+            pool_buf_t* next = pool->free_list->next;
+            arena_free(pool->free_list, sizeof(pool_buf_t));
+            pool->free_list = next;
+        }
+        pool->free_count = 0;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
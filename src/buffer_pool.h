@@ -0,0 +1,35 @@
+/* buffer_pool.h */
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/* Constants */
+#define POOL_BUF_SIZE (16384 - 2 * sizeof(size_t))  // payload bytes, so a buffer is one 16 KiB arena chunk
+#define POOL_MAX_FREE 256     // buffers kept around once released, per NUMA node
+
+/* A fixed-size buffer. Chained through next while it sits in the pool or
+ * in a caller's queue. */
+typedef struct pool_buf {
+    struct pool_buf* next;
+    size_t len;               // bytes of data in use
+    char data[POOL_BUF_SIZE];
+} pool_buf_t;
+
+/**
+ * Take a buffer from the pool, allocating one if the pool is empty
+ * Returns: an empty buffer, or NULL if out of memory
+ */
+pool_buf_t* buffer_pool_get(void);
+
+/**
+ * Give a buffer back. Buffers beyond POOL_MAX_FREE are freed.
+ */
+void buffer_pool_put(pool_buf_t* buf);
+
+/**
+ * Free every buffer currently in the pool
+ */
+void buffer_pool_cleanup(void);
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,128 @@
+/* capture.c */
+#include "capture.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static int capture_fd = -1;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static char buffer[CAPTURE_BUFFER];
+static size_t buffered;
+static uint64_t oldest_ms;              // when the first buffered record was added
+static atomic_uint next_connection;
+
+// header lines left out of the capture: credentials should not end up in a
+// file passed around for load tests, and a replayed h2c upgrade would
+// switch the connection away from HTTP/1.1
+static const char* const dropped_headers[] = {
+    "authorization", "proxy-authorization", "cookie", "upgrade", "http2-settings",
+};
+
+int capture_open(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (st.st_size == 0 &&
+        write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN) {
+        close(fd);
+        return -1;
+    }
+    capture_fd = fd;
+    return 0;
+}
+
+bool capture_enabled(void) {
+    return capture_fd >= 0;
+}
+
+uint64_t capture_connection_id(void) {
+    return (uint64_t) getpid() << 32 | (atomic_fetch_add(&next_connection, 1) + 1);
+}
+
+// one write() per block: with O_APPEND, blocks of different processes do
+// not interleave within each other (lock held)
+static void write_block(void) {
+    size_t done = 0;
+    while (done < buffered) {
+        ssize_t n = write(capture_fd, buffer + done, buffered - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("capture");
+            break;
+        }
+        done += (size_t) n;
+    }
+    buffered = 0;
+}
+
+static bool dropped(const char* line, size_t len) {
+    for (size_t i = 0; i < sizeof(dropped_headers) / sizeof(dropped_headers[0]); i++) {
+        size_t name_len = strlen(dropped_headers[i]);
+        if (len > name_len && line[name_len] == ':' &&
+            strncasecmp(line, dropped_headers[i], name_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void capture_request(uint64_t conn_id, const char* raw, const http_request_t* request) {
+    if (capture_fd < 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    capture_record_t record = {
+        .time_us = (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000,
+        .conn_id = conn_id,
+        .body_len = request->chunked || request->content_length > UINT32_MAX
+                        ? 0 : (uint32_t) request->content_length,
+        .flags = request->chunked ? CAPTURE_CHUNKED : 0,
+    };
+    size_t raw_len = strlen(raw);
+
+    pthread_mutex_lock(&capture_lock);
+    if (buffered + sizeof(record) + raw_len > CAPTURE_BUFFER) {
+        write_block();
+    }
+    if (buffered == 0) {
+        oldest_ms = monotonic_ms();
+    }
+    // copy the header block line by line, leaving out the dropped headers
+    char* head = buffer + buffered + sizeof(record);
+    size_t head_len = 0;
+    for (const char* line = raw; line < raw + raw_len;) {
+        const char* end = strstr(line, "\r\n");
+        size_t len = end != NULL ? (size_t) (end - line) + 2 : strlen(line);
+        if (!dropped(line, len)) {
+            memcpy(head + head_len, line, len);
+            head_len += len;
+        }
+        line += len;
+    }
+    record.head_len = (uint16_t) head_len;
+    memcpy(buffer + buffered, &record, sizeof(record));
+    buffered += sizeof(record) + head_len;
+    if (monotonic_ms() - oldest_ms >= CAPTURE_FLUSH_MS) {
+        write_block();
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_flush(void) {
+    if (capture_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&capture_lock);
+    write_block();
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,58 @@
+/* capture.h */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "http_server.h"
+
+/* Constants */
+#define CAPTURE_MAGIC "HTCAP001"        // first 8 bytes of a capture file
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_BUFFER (64 * 1024)      // records are written out in blocks of up to this size
+#define CAPTURE_FLUSH_MS 1000           // a block is written once its oldest record is this old
+
+/* Record flags */
+#define CAPTURE_CHUNKED 0x1             // the body was chunked; its size is unknown
+
+/* A capture file is CAPTURE_MAGIC and then records, each this header
+ * (host byte order) followed by head_len bytes: the request line and
+ * headers as the client sent them, minus credentials and h2c upgrade
+ * headers. Bodies are not kept, only their length. Records of one
+ * connection are in order; across processes, blocks may interleave, so
+ * readers sort by time. */
+typedef struct capture_record {
+    uint64_t time_us;           // CLOCK_REALTIME when the header block had been read
+    uint64_t conn_id;           // process id in the high half, connection number in the low
+    uint32_t body_len;          // Content-Length of the body, 0 if none or chunked
+    uint16_t head_len;
+    uint16_t flags;             // CAPTURE_*
+} capture_record_t;
+
+/**
+ * Append the requests of this process to path from now on. Call before
+ * forking workers; each process then buffers and writes its own blocks.
+ * Returns: 0 on success, -1 if the file could not be opened
+ */
+int capture_open(const char* path);
+
+/**
+ * Whether requests are being captured
+ */
+bool capture_enabled(void);
+
+/**
+ * A new connection number, unique across the processes writing the file
+ */
+uint64_t capture_connection_id(void);
+
+/**
+ * Record one parsed request of connection conn_id, stamped with the time
+ * now. raw is its header block as read, ending in the empty line.
+ */
+void capture_request(uint64_t conn_id, const char* raw, const http_request_t* request);
+
+/**
+ * Write out what is buffered. Call before the process exits.
+ */
+void capture_flush(void);
+
+#endif /* CAPTURE_H */
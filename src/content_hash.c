@@ -0,0 +1,519 @@
+/* content_hash.c */
+#include "content_hash.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* XXH3 parameters, see the xxHash specification (doc/xxhash_spec.md) */
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define STRIPE_LEN 64
+#define ACC_NB 8
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (STRIPE_LEN * STRIPES_PER_BLOCK)
+#define MIDSIZE_MAX 240
+
+static const uint8_t secret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// XXH3 is defined on little-endian words
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline uint64_t mix16(const uint8_t* input, const uint8_t* key) {
+    return mul128_fold64(read64(input) ^ read64(key), read64(input + 8) ^ read64(key + 8));
+}
+
+static uint64_t hash_0to16(const uint8_t* input, size_t len) {
+    if (len > 8) {
+        uint64_t lo = read64(input) ^ (read64(secret + 24) ^ read64(secret + 32));
+        uint64_t hi = read64(input + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+        uint64_t acc = len + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    if (len >= 4) {
+        uint64_t combined = read32(input + len - 4) + ((uint64_t) read32(input) << 32);
+        return rrmxmx(combined ^ (read64(secret + 8) ^ read64(secret + 16)), len);
+    }
+    if (len > 0) {
+        uint32_t combined = ((uint32_t) input[0] << 16) | ((uint32_t) input[len >> 1] << 24) |
+                            input[len - 1] | ((uint32_t) len << 8);
+        return xxh64_avalanche(combined ^ (uint64_t) (read32(secret) ^ read32(secret + 4)));
+    }
+    return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+}
+
+static uint64_t hash_17to128(const uint8_t* input, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += mix16(input + 48, secret + 96);
+                acc += mix16(input + len - 64, secret + 112);
+            }
+            acc += mix16(input + 32, secret + 64);
+            acc += mix16(input + len - 48, secret + 80);
+        }
+        acc += mix16(input + 16, secret + 32);
+        acc += mix16(input + len - 32, secret + 48);
+    }
+    acc += mix16(input, secret);
+    acc += mix16(input + len - 16, secret + 16);
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t hash_129to240(const uint8_t* input, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+    size_t rounds = len / 16;
+    for (size_t i = 0; i < 8; i++) {
+        acc += mix16(input + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+    for (size_t i = 8; i < rounds; i++) {
+        acc += mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += mix16(input + len - 16, secret + 136 - 17);
+    return xxh3_avalanche(acc);
+}
+
+/* Long inputs: 8 independent 64-bit lanes per 64-byte stripe, which is what
+ * makes XXH3 map onto SIMD registers. Each kernel provides accumulate_512
+ * (one stripe) and scramble (once per 1 KiB block). */
+
+static inline void accumulate_512_scalar(uint64_t* acc, const uint8_t* input, const uint8_t* key) {
+    for (int i = 0; i < ACC_NB; i++) {
+        uint64_t data = read64(input + 8 * i);
+        uint64_t data_key = data ^ read64(key + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (uint64_t) (uint32_t) data_key * (data_key >> 32);
+    }
+}
+
+static inline void scramble_scalar(uint64_t* acc, const uint8_t* key) {
+    for (int i = 0; i < ACC_NB; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(key + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+static inline void accumulate_512_sse2(uint64_t* acc, const uint8_t* input, const uint8_t* key) {
+    __m128i* xacc = (__m128i*) acc;
+    for (int i = 0; i < STRIPE_LEN / 16; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i*) (input + 16 * i));
+        __m128i data_key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*) (key + 16 * i)));
+        // low half of each lane times its high half
+        __m128i product = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        xacc[i] = _mm_add_epi64(product, _mm_add_epi64(xacc[i], swapped));
+    }
+}
+
+static inline void scramble_sse2(uint64_t* acc, const uint8_t* key) {
+    __m128i* xacc = (__m128i*) acc;
+    const __m128i prime = _mm_set1_epi32((int) PRIME32_1);
+    for (int i = 0; i < STRIPE_LEN / 16; i++) {
+        __m128i a = _mm_xor_si128(xacc[i], _mm_srli_epi64(xacc[i], 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*) (key + 16 * i)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        xacc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void accumulate_512_avx2(uint64_t* acc, const uint8_t* input, const uint8_t* key) {
+    __m256i* xacc = (__m256i*) acc;
+    for (int i = 0; i < STRIPE_LEN / 32; i++) {
+        __m256i data = _mm256_loadu_si256((const __m256i*) (input + 32 * i));
+        __m256i data_key = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i*) (key + 32 * i)));
+        __m256i product = _mm256_mul_epu32(data_key,
+                                           _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        xacc[i] = _mm256_add_epi64(product, _mm256_add_epi64(xacc[i], swapped));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void scramble_avx2(uint64_t* acc, const uint8_t* key) {
+    __m256i* xacc = (__m256i*) acc;
+    const __m256i prime = _mm256_set1_epi32((int) PRIME32_1);
+    for (int i = 0; i < STRIPE_LEN / 32; i++) {
+        __m256i a = _mm256_xor_si256(xacc[i], _mm256_srli_epi64(xacc[i], 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*) (key + 32 * i)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        xacc[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+}
+#endif
+
+static uint64_t merge_accs(const uint64_t* acc, uint64_t start) {
+    const uint8_t* key = secret + 11;
+    uint64_t result = start;
+    for (int i = 0; i < 4; i++) {
+        result += mul128_fold64(acc[2 * i] ^ read64(key + 16 * i), acc[2 * i + 1] ^ read64(key + 16 * i + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+// stripes of one block go to secret offsets 0, 8, 16, ...; full blocks are scrambled
+#define DEFINE_KERNEL(kernel, attr)                                                            \
+    attr static const uint8_t* consume_##kernel(uint64_t* acc, size_t* stripes_in_block,      \
+                                                const uint8_t* input, size_t stripes) {        \
+        while (stripes > 0) {                                                                  \
+            size_t take = STRIPES_PER_BLOCK - *stripes_in_block;                               \
+            if (take > stripes) {                                                              \
+                take = stripes;                                                                \
+            }                                                                                  \
+            const uint8_t* key = secret + *stripes_in_block * SECRET_CONSUME_RATE;             \
+            for (size_t s = 0; s < take; s++) {                                                \
+                accumulate_512_##kernel(acc, input + s * STRIPE_LEN, key + s * SECRET_CONSUME_RATE); \
+            }                                                                                  \
+            input += take * STRIPE_LEN;                                                        \
+            stripes -= take;                                                                   \
+            *stripes_in_block += take;                                                         \
+            if (*stripes_in_block == STRIPES_PER_BLOCK) {                                      \
+                scramble_##kernel(acc, secret + SECRET_SIZE - STRIPE_LEN);                     \
+                *stripes_in_block = 0;                                                         \
+            }                                                                                  \
+        }                                                                                      \
+        return input;                                                                          \
+    }                                                                                          \
+    attr static void last_stripe_##kernel(uint64_t* acc, const uint8_t* stripe) {             \
+        accumulate_512_##kernel(acc, stripe, secret + SECRET_SIZE - STRIPE_LEN - 7);           \
+    }                                                                                          \
+    attr static uint64_t hash_long_##kernel(const uint8_t* input, size_t len) {                \
+        _Alignas(32) uint64_t acc[ACC_NB] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,        \
+                                             PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};       \
+        size_t stripes_in_block = 0;                                                           \
+        /* every stripe but one that ends before the input does, then the final */            \
+        /* stripe, which always ends exactly at the end of the input */                       \
+        consume_##kernel(acc, &stripes_in_block, input, (len - 1) / STRIPE_LEN);               \
+        last_stripe_##kernel(acc, input + len - STRIPE_LEN);                                   \
+        return merge_accs(acc, len * PRIME64_1);                                               \
+    }
+
+typedef struct hash_kernel {
+    const char* name;
+    uint64_t (*hash_long)(const uint8_t* input, size_t len);
+    const uint8_t* (*consume)(uint64_t* acc, size_t* stripes_in_block, const uint8_t* input,
+                              size_t stripes);
+    void (*last_stripe)(uint64_t* acc, const uint8_t* stripe);
+} hash_kernel_t;
+
+#define KERNEL(kernel) {#kernel, hash_long_##kernel, consume_##kernel, last_stripe_##kernel}
+
+DEFINE_KERNEL(scalar, )
+static const hash_kernel_t scalar_kernel = KERNEL(scalar);
+#ifdef HAVE_X86_SIMD
+DEFINE_KERNEL(sse2, )
+DEFINE_KERNEL(avx2, __attribute__((target("avx2"))))
+static const hash_kernel_t sse2_kernel = KERNEL(sse2);
+static const hash_kernel_t avx2_kernel = KERNEL(avx2);
+#endif
+
+static const hash_kernel_t* kernel = &scalar_kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? &avx2_kernel : &sse2_kernel;
+#endif
+}
+
+uint64_t xxh3_64(const void* data, size_t len) {
+    const uint8_t* input = data;
+    if (len <= 16) {
+        return hash_0to16(input, len);
+    }
+    if (len <= 128) {
+        return hash_17to128(input, len);
+    }
+    if (len <= MIDSIZE_MAX) {
+        return hash_129to240(input, len);
+    }
+    pthread_once(&kernel_once, pick_kernel);
+    return kernel->hash_long(input, len);
+}
+
+const char* xxh3_kernel(void) {
+    pthread_once(&kernel_once, pick_kernel);
+    return kernel->name;
+}
+
+void xxh3_init(xxh3_state_t* state) {
+    static const uint64_t initial[ACC_NB] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                                             PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+    memcpy(state->acc, initial, sizeof(initial));
+    state->buffered = 0;
+    state->stripes_in_block = 0;
+    state->total_len = 0;
+    pthread_once(&kernel_once, pick_kernel);
+}
+
+/* Input is consumed a stripe at a time, except that at least one byte is
+ * always held back in buffer: the final stripe gets different treatment and
+ * we only know which one it is at digest time. The buffer's last stripe is
+ * kept filled with the latest consumed bytes for the same reason. */
+void xxh3_update(xxh3_state_t* state, const void* data, size_t len) {
+    const uint8_t* input = data;
+    const uint8_t* end = input + len;
+    state->total_len += len;
+
+    if (len <= XXH3_BUFFER_SIZE - state->buffered) {
+        memcpy(state->buffer + state->buffered, input, len);
+        state->buffered += len;
+        return;
+    }
+
+    if (state->buffered > 0) {
+        size_t fill = XXH3_BUFFER_SIZE - state->buffered;
+        memcpy(state->buffer + state->buffered, input, fill);
+        input += fill;
+        kernel->consume(state->acc, &state->stripes_in_block, state->buffer,
+                        XXH3_BUFFER_SIZE / STRIPE_LEN);
+        state->buffered = 0;
+    }
+
+    if ((size_t) (end - input) > XXH3_BUFFER_SIZE) {
+        size_t stripes = (size_t) (end - 1 - input) / STRIPE_LEN;
+        input = kernel->consume(state->acc, &state->stripes_in_block, input, stripes);
+        memcpy(state->buffer + XXH3_BUFFER_SIZE - STRIPE_LEN, input - STRIPE_LEN, STRIPE_LEN);
+    }
+
+    memcpy(state->buffer, input, (size_t) (end - input));
+    state->buffered = (size_t) (end - input);
+}
+
+uint64_t xxh3_digest(const xxh3_state_t* state) {
+    if (state->total_len <= MIDSIZE_MAX) {
+        return xxh3_64(state->buffer, (size_t) state->total_len);
+    }
+
+    _Alignas(32) uint64_t acc[ACC_NB];
+    memcpy(acc, state->acc, sizeof(acc));
+    uint8_t last[STRIPE_LEN];
+    const uint8_t* stripe;
+    if (state->buffered >= STRIPE_LEN) {
+        size_t stripes_in_block = state->stripes_in_block;
+        kernel->consume(acc, &stripes_in_block, state->buffer, (state->buffered - 1) / STRIPE_LEN);
+        stripe = state->buffer + state->buffered - STRIPE_LEN;
+    } else {
+        // the final stripe reaches back into bytes that were already consumed
+        size_t catchup = STRIPE_LEN - state->buffered;
+        memcpy(last, state->buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+        memcpy(last + catchup, state->buffer, state->buffered);
+        stripe = last;
+    }
+    kernel->last_stripe(acc, stripe);
+    return merge_accs(acc, state->total_len * PRIME64_1);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t state[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t* ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(sha256_ctx_t* ctx, const void* data, size_t len) {
+    const uint8_t* input = data;
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, input, take);
+        ctx->used += take;
+        input += take;
+        len -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        sha256_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    for (; len >= 64; input += 64, len -= 64) {
+        sha256_block(ctx->state, input);
+    }
+    memcpy(ctx->block, input, len);
+    ctx->used = len;
+}
+
+void sha256_final(sha256_ctx_t* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    sha256_block(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+void sha256_base64(const uint8_t digest[SHA256_DIGEST_SIZE], char out[SHA256_BASE64_SIZE]) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char* p = out;
+    int i = 0;
+    for (; i + 3 <= SHA256_DIGEST_SIZE; i += 3) {
+        uint32_t v = (uint32_t) digest[i] << 16 | (uint32_t) digest[i + 1] << 8 | digest[i + 2];
+        *p++ = alphabet[v >> 18];
+        *p++ = alphabet[(v >> 12) & 63];
+        *p++ = alphabet[(v >> 6) & 63];
+        *p++ = alphabet[v & 63];
+    }
+    // 32 = 3 * 10 + 2: two bytes left over, one '=' of padding
+    uint32_t v = (uint32_t) digest[i] << 16 | (uint32_t) digest[i + 1] << 8;
+    *p++ = alphabet[v >> 18];
+    *p++ = alphabet[(v >> 12) & 63];
+    *p++ = alphabet[(v >> 6) & 63];
+    *p++ = '=';
+    *p = '\0';
+}
@@ -0,0 +1,66 @@
+/* content_hash.h */
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BASE64_SIZE 45   // 44 characters plus the NUL
+#define XXH3_BUFFER_SIZE 256
+
+/* Incremental XXH3, for input that arrives in pieces (files read in chunks) */
+typedef struct xxh3_state {
+    _Alignas(32) uint64_t acc[8];
+    uint8_t buffer[XXH3_BUFFER_SIZE];
+    size_t buffered;          // bytes waiting in buffer
+    size_t stripes_in_block;  // stripes accumulated since the last scramble
+    uint64_t total_len;
+} xxh3_state_t;
+
+/* Incremental SHA-256 (FIPS 180-4) */
+typedef struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;          // bytes hashed so far
+    uint8_t block[64];
+    size_t used;              // bytes waiting in block
+} sha256_ctx_t;
+
+/**
+ * XXH3 64-bit hash with seed 0, bit-compatible with xxHash's XXH3_64bits().
+ * Inputs over 240 bytes run an SSE2 or, where the CPU has it, AVX2 kernel.
+ * Returns: the hash of len bytes at data
+ */
+uint64_t xxh3_64(const void* data, size_t len);
+
+void xxh3_init(xxh3_state_t* state);
+void xxh3_update(xxh3_state_t* state, const void* data, size_t len);
+
+/**
+ * Hash of everything passed to xxh3_update(), equal to xxh3_64() over it.
+ * The state is left unchanged and can take more input.
+ */
+uint64_t xxh3_digest(const xxh3_state_t* state);
+
+/**
+ * Name of the kernel xxh3_64() uses for long inputs on this CPU
+ * Returns: "avx2", "sse2" or "scalar"
+ */
+const char* xxh3_kernel(void);
+
+void sha256_init(sha256_ctx_t* ctx);
+void sha256_update(sha256_ctx_t* ctx, const void* data, size_t len);
+void sha256_final(sha256_ctx_t* ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * SHA-256 of len bytes at data, in one call
+ */
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Standard (padded) base64 of a SHA-256 digest, as used by Repr-Digest
+ */
+void sha256_base64(const uint8_t digest[SHA256_DIGEST_SIZE], char out[SHA256_BASE64_SIZE]);
+
+#endif /* CONTENT_HASH_H */
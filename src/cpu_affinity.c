@@ -0,0 +1,298 @@
+/* cpu_affinity.c */
+#define _GNU_SOURCE
+#include "cpu_affinity.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+worker_info_t worker_info[MAX_WORKERS];
+int num_workers = 0;
+
+static __thread int current_node = 0;
+static __thread int last_cpu = -1;
+
+int parse_cpu_list(const char* list, bool cpus[MAX_CPUS]) {
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= MAX_CPUS) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= MAX_CPUS) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus[cpu] = true;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// parse a sysfs/procfs file holding a CPU list, false if it can't be read
+static bool read_cpu_list(const char* path, bool cpus[MAX_CPUS]) {
+    char line[4096];
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fgets(line, sizeof(line), fp) != NULL && parse_cpu_list(line, cpus) == 0;
+    fclose(fp);
+    return ok;
+}
+
+static int cpu_to_node(int cpu) {
+    char path[128];
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        bool cpus[MAX_CPUS] = {false};
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_cpu_list(path, cpus) && cpus[cpu]) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+// lowest-numbered SMT sibling of cpu, cpu itself if the topology is unknown
+static int first_sibling(int cpu) {
+    char path[128];
+    bool siblings[MAX_CPUS] = {false};
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_cpus_list", cpu);
+    if (!read_cpu_list(path, siblings)) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (!read_cpu_list(path, siblings)) {
+            return cpu;
+        }
+    }
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (siblings[i]) {
+            return i;
+        }
+    }
+    return cpu;
+}
+
+static void mark_irq_cpus(int irq, bool cpus[MAX_CPUS]) {
+    char path[128];
+    snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+    if (!read_cpu_list(path, cpus)) {
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+        read_cpu_list(path, cpus);
+    }
+}
+
+// CPUs that the interrupts of any physical network device are routed to
+static void find_nic_irq_cpus(bool cpus[MAX_CPUS]) {
+    DIR* net = opendir("/sys/class/net");
+    if (net == NULL) {
+        return;
+    }
+
+    struct dirent* iface;
+    while ((iface = readdir(net)) != NULL) {
+        if (iface->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        // MSI/MSI-X vectors, one per queue on multiqueue NICs
+        snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", iface->d_name);
+        DIR* irqs = opendir(path);
+        if (irqs != NULL) {
+            struct dirent* irq;
+            while ((irq = readdir(irqs)) != NULL) {
+                if (irq->d_name[0] != '.') {
+                    mark_irq_cpus(atoi(irq->d_name), cpus);
+                }
+            }
+            closedir(irqs);
+            continue;
+        }
+        // legacy INTx line
+        snprintf(path, sizeof(path), "/sys/class/net/%s/device/irq", iface->d_name);
+        FILE* fp = fopen(path, "r");
+        if (fp != NULL) {
+            int irq;
+            if (fscanf(fp, "%d", &irq) == 1 && irq > 0) {
+                mark_irq_cpus(irq, cpus);
+            }
+            fclose(fp);
+        }
+    }
+    closedir(net);
+}
+
+int affinity_plan(const char* spec, bool exclude_irq_cpus) {
+    memset(worker_info, 0, sizeof(worker_info));
+    num_workers = 0;
+
+    if (spec == NULL) {
+        for (int i = 0; i < DEFAULT_WORKERS; i++) {
+            worker_info[i].id = i;
+            worker_info[i].cpu = -1;
+        }
+        num_workers = DEFAULT_WORKERS;
+        return num_workers;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return -1;
+    }
+
+    bool chosen[MAX_CPUS] = {false};
+    if (strcmp(spec, "cpus") == 0 || strcmp(spec, "cores") == 0) {
+        for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            chosen[cpu] = CPU_ISSET(cpu, &allowed);
+        }
+    } else if (parse_cpu_list(spec, chosen) < 0) {
+        return -1;
+    }
+
+    if (strcmp(spec, "cores") == 0) {
+        // keep one hyperthread per core so workers don't share an L1/L2
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (chosen[cpu]) {
+                int first = first_sibling(cpu);
+                if (first != cpu && chosen[first]) {
+                    chosen[cpu] = false;
+                }
+            }
+        }
+    }
+
+    if (exclude_irq_cpus) {
+        bool irq_cpus[MAX_CPUS] = {false};
+        find_nic_irq_cpus(irq_cpus);
+        bool remaining = false;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            remaining |= chosen[cpu] && !irq_cpus[cpu];
+        }
+        if (remaining) {
+            for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+                chosen[cpu] &= !irq_cpus[cpu];
+            }
+        } else {
+            fprintf(stderr, "affinity: every selected CPU handles NIC interrupts, keeping them\n");
+        }
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS && num_workers < MAX_WORKERS; cpu++) {
+        if (!chosen[cpu]) {
+            continue;
+        }
+        if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+            fprintf(stderr, "affinity: CPU %d is not available to this process\n", cpu);
+            return -1;
+        }
+        worker_info_t* worker = &worker_info[num_workers];
+        worker->id = num_workers;
+        worker->cpu = cpu;
+        worker->node = cpu_to_node(cpu);
+        num_workers++;
+    }
+
+    return num_workers > 0 ? num_workers : -1;
+}
+
+void affinity_keep_share(int index, int count) {
+    if (count <= 1 || num_workers == 0 || worker_info[0].cpu < 0) {
+        return;
+    }
+    int kept = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (i % count == index) {
+            memmove(&worker_info[kept], &worker_info[i], sizeof(worker_info_t));
+            worker_info[kept].id = kept;
+            kept++;
+        }
+    }
+    if (kept == 0) {
+        // more processes than CPUs: share one
+        memmove(&worker_info[0], &worker_info[index % num_workers], sizeof(worker_info_t));
+        worker_info[0].id = 0;
+        kept = 1;
+    }
+    num_workers = kept;
+}
+
+void affinity_enter_worker(worker_info_t* worker) {
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "affinity: could not pin worker %d to CPU %d\n",
+                    worker->id, worker->cpu);
+        }
+    }
+    // memory this thread touches first (its stack, glibc arena, pool buffers)
+    // is then placed on its own node by the default first-touch policy
+    current_node = worker->node;
+    last_cpu = sched_getcpu();
+}
+
+int affinity_current_node(void) {
+    return current_node;
+}
+
+void affinity_note_connection(worker_info_t* worker, int incoming_cpu) {
+    atomic_fetch_add_explicit(&worker->connections, 1, memory_order_relaxed);
+
+    int cpu = sched_getcpu();
+    if (incoming_cpu >= 0) {
+        if (incoming_cpu == cpu) {
+            atomic_fetch_add_explicit(&worker->local_connections, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&worker->remote_connections, 1, memory_order_relaxed);
+        }
+    }
+    if (last_cpu >= 0 && cpu != last_cpu) {
+        atomic_fetch_add_explicit(&worker->migrations, 1, memory_order_relaxed);
+    }
+    last_cpu = cpu;
+}
+
+size_t affinity_render(char* buf, size_t len) {
+    size_t used = 0;
+    for (int i = 0; i < num_workers && used + 1 < len; i++) {
+        worker_info_t* worker = &worker_info[i];
+        int n = snprintf(buf + used, len - used,
+            "worker%d_cpu: %d\n"
+            "worker%d_node: %d\n"
+            "worker%d_connections: %lu\n"
+            "worker%d_local_connections: %lu\n"
+            "worker%d_remote_connections: %lu\n"
+            "worker%d_migrations: %lu\n",
+            i, worker->cpu,
+            i, worker->node,
+            i, atomic_load_explicit(&worker->connections, memory_order_relaxed),
+            i, atomic_load_explicit(&worker->local_connections, memory_order_relaxed),
+            i, atomic_load_explicit(&worker->remote_connections, memory_order_relaxed),
+            i, atomic_load_explicit(&worker->migrations, memory_order_relaxed));
+        if (n < 0) {
+            break;
+        }
+        used += (size_t) n < len - used ? (size_t) n : len - used - 1;
+    }
+    if (len > 0) {
+        buf[used] = '\0';
+    }
+    return used;
+}
@@ -0,0 +1,77 @@
+/* cpu_affinity.h */
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Constants */
+#define MAX_WORKERS 256
+#define DEFAULT_WORKERS 5
+#define MAX_NUMA_NODES 8
+#define MAX_CPUS 1024
+
+/* One worker thread, where it runs and how well locality holds for it */
+typedef struct worker_info {
+    int id;
+    int cpu;                          // pinned CPU, -1 = left to the scheduler
+    int node;                         // NUMA node of cpu, 0 when unknown
+    atomic_ulong connections;
+    atomic_ulong local_connections;   // softirq ran on this worker's CPU (SO_INCOMING_CPU)
+    atomic_ulong remote_connections;  // softirq ran on another CPU
+    atomic_ulong migrations;          // ran somewhere other than the last CPU seen
+} worker_info_t;
+
+extern worker_info_t worker_info[MAX_WORKERS];
+extern int num_workers;
+
+/**
+ * Parse a kernel style CPU list such as "0-3,8,10-11", marking each CPU in cpus
+ * Returns: 0 on success, -1 on malformed input
+ */
+int parse_cpu_list(const char* list, bool cpus[MAX_CPUS]);
+
+/**
+ * Work out the worker layout from a --cpu-affinity spec:
+ *   NULL     DEFAULT_WORKERS unpinned workers
+ *   "cpus"   one worker per CPU the process may run on
+ *   "cores"  one worker per physical core (first SMT sibling)
+ *   LIST     one worker per CPU in a CPU list
+ * With exclude_irq_cpus, CPUs that service NIC interrupts are dropped
+ * unless that would leave nothing. Fills worker_info and num_workers.
+ * Returns: number of workers, or -1 on a bad spec
+ */
+int affinity_plan(const char* spec, bool exclude_irq_cpus);
+
+/**
+ * Called first thing in a worker: pin it to its CPU and remember its node
+ * so per-thread allocations land in local memory
+ */
+void affinity_enter_worker(worker_info_t* worker);
+
+/**
+ * NUMA node of the calling thread (0 outside pinned workers)
+ */
+int affinity_current_node(void);
+
+/**
+ * Update the locality counters of worker for a connection whose packets
+ * were processed on incoming_cpu (-1 when the kernel did not say)
+ */
+void affinity_note_connection(worker_info_t* worker, int incoming_cpu);
+
+/**
+ * In prefork mode, keep only this process's share of a pinned plan: every
+ * count-th worker starting at index, so processes get disjoint CPUs. An
+ * unpinned plan is kept whole in every process.
+ */
+void affinity_keep_share(int index, int count);
+
+/**
+ * Render the per-worker counters as "name: value" lines into buf
+ * Returns: number of bytes written (excluding the NUL)
+ */
+size_t affinity_render(char* buf, size_t len);
+
+#endif /* CPU_AFFINITY_H */
@@ -0,0 +1,648 @@
+/* dir_index.c */
+#include "dir_index.h"
+#include "content_hash.h"
+#include "http_headers.h"
+#include "network_utils.h"
+#include "response_stream.h"
+#include "server_stats.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+// changes that can alter an entry of a watched directory, and the directory going away
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct dir_entry {
+    char* name;
+    bool is_dir;
+    off_t size;
+    time_t mtime;
+} dir_entry_t;
+
+/* One directory as last read, its entries sorted by name */
+typedef struct dir_listing {
+    char* path;                 // NULL: free slot
+    char* url;                  // the request path it is rendered for
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int wd;                     // inotify watch, -1: none, reread when mtime moves
+    bool stale;                 // reread on next use: events were lost
+    dir_entry_t* entries;
+    size_t count;
+    size_t capacity;
+    dir_index_body_t* bodies[DIR_INDEX_FORMATS];
+    uint64_t last_used;
+} dir_listing_t;
+
+static bool index_enabled;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static dir_listing_t listings[DIR_INDEX_MAX_DIRS];
+static uint64_t use_clock;
+static int inotify_fd = -1;
+static pid_t inotify_pid;       // a forked worker opens its own, events go to one reader
+
+void dir_index_init(bool enabled) {
+    index_enabled = enabled;
+}
+
+bool dir_index_enabled(void) {
+    return index_enabled;
+}
+
+void dir_index_release(dir_index_body_t* body) {
+    if (body != NULL && atomic_fetch_sub(&body->refs, 1) == 1) {
+        free(body);
+    }
+}
+
+static void drop_bodies(dir_listing_t* listing) {
+    for (int i = 0; i < DIR_INDEX_FORMATS; i++) {
+        dir_index_release(listing->bodies[i]);
+        listing->bodies[i] = NULL;
+    }
+}
+
+static void clear_entries(dir_listing_t* listing) {
+    for (size_t i = 0; i < listing->count; i++) {
+        free(listing->entries[i].name);
+    }
+    listing->count = 0;
+}
+
+// the watch can be shared: the kernel hands out one wd per inode
+static void unwatch(dir_listing_t* listing) {
+    if (listing->wd < 0) {
+        return;
+    }
+    bool shared = false;
+    for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+        shared = shared || (&listings[i] != listing && listings[i].path != NULL &&
+                            listings[i].wd == listing->wd);
+    }
+    if (!shared) {
+        inotify_rm_watch(inotify_fd, listing->wd);
+    }
+    listing->wd = -1;
+}
+
+static void free_listing(dir_listing_t* listing) {
+    unwatch(listing);
+    drop_bodies(listing);
+    clear_entries(listing);
+    free(listing->entries);
+    free(listing->path);
+    free(listing->url);
+    memset(listing, 0, sizeof(*listing));
+    listing->wd = -1;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const dir_entry_t*) a)->name, ((const dir_entry_t*) b)->name);
+}
+
+// Returns: index of name, or -(insertion point) - 1 if it is not listed
+static long find_entry(const dir_listing_t* listing, const char* name) {
+    size_t low = 0, high = listing->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = strcmp(listing->entries[mid].name, name);
+        if (cmp == 0) {
+            return (long) mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -(long) low - 1;
+}
+
+static int reserve(dir_listing_t* listing, size_t count) {
+    if (count <= listing->capacity) {
+        return 0;
+    }
+    size_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    dir_entry_t* entries = realloc(listing->entries, capacity * sizeof(dir_entry_t));
+    if (entries == NULL) {
+        return -1;
+    }
+    listing->entries = entries;
+    listing->capacity = capacity;
+    return 0;
+}
+
+static void fill_entry(dir_entry_t* entry, const struct stat* st) {
+    entry->is_dir = S_ISDIR(st->st_mode);
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+}
+
+// dot files stay out of listings, as do half-written uploads (.name.upload.XXXXXX)
+static bool listed(const char* name) {
+    return name[0] != '.';
+}
+
+// read the whole directory again
+static int scan(dir_listing_t* listing) {
+    STATS_INC(dir_index_scans);
+    drop_bodies(listing);
+    clear_entries(listing);
+    DIR* dir = opendir(listing->path);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat st;
+        // a dangling symlink or a file deleted under us is simply not listed
+        if (!listed(ent->d_name) || fstatat(dirfd(dir), ent->d_name, &st, 0) < 0) {
+            continue;
+        }
+        if (reserve(listing, listing->count + 1) < 0 ||
+            (listing->entries[listing->count].name = strdup(ent->d_name)) == NULL) {
+            closedir(dir);
+            errno = ENOMEM;
+            return -1;
+        }
+        fill_entry(&listing->entries[listing->count++], &st);
+    }
+    closedir(dir);
+    qsort(listing->entries, listing->count, sizeof(dir_entry_t), compare_entries);
+    listing->stale = false;
+    return 0;
+}
+
+// one entry changed: stat it again, add, update or remove it
+static void update_entry(dir_listing_t* listing, const char* name) {
+    char path[PATH_MAX];
+    struct stat st;
+    bool exists = snprintf(path, sizeof(path), "%s/%s", listing->path, name) < (int) sizeof(path) &&
+                  stat(path, &st) == 0;
+    long index = find_entry(listing, name);
+    if (exists && index >= 0) {
+        fill_entry(&listing->entries[index], &st);
+    } else if (exists) {
+        size_t at = (size_t) (-index - 1);
+        char* copy = strdup(name);
+        if (copy == NULL || reserve(listing, listing->count + 1) < 0) {
+            free(copy);
+            listing->stale = true;
+            return;
+        }
+        memmove(&listing->entries[at + 1], &listing->entries[at],
+                (listing->count - at) * sizeof(dir_entry_t));
+        listing->entries[at].name = copy;
+        fill_entry(&listing->entries[at], &st);
+        listing->count++;
+    } else if (index >= 0) {
+        free(listing->entries[index].name);
+        memmove(&listing->entries[index], &listing->entries[index + 1],
+                (listing->count - (size_t) index - 1) * sizeof(dir_entry_t));
+        listing->count--;
+    } else {
+        return;  // created and gone again before we looked
+    }
+    STATS_INC(dir_index_updates);
+    drop_bodies(listing);
+}
+
+static void apply_event(const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // events were lost, nothing we hold can be trusted
+        for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+            listings[i].stale = true;
+        }
+        return;
+    }
+    for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+        dir_listing_t* listing = &listings[i];
+        if (listing->path == NULL || listing->wd != event->wd) {
+            continue;
+        }
+        if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // the directory went away; the next request finds out what is there now
+            if (event->mask & IN_IGNORED) {
+                listing->wd = -1;  // the kernel dropped the watch
+            }
+            listing->stale = true;
+        } else if (event->len > 0 && listed(event->name)) {
+            update_entry(listing, event->name);
+        }
+    }
+}
+
+// apply every event queued since the last request (lock held)
+static void drain_events(void) {
+    if (inotify_fd >= 0 && inotify_pid != getpid()) {
+        // inherited across fork: leave it to the parent, watch on our own
+        close(inotify_fd);
+        inotify_fd = -1;
+        for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+            listings[i].wd = -1;
+            listings[i].stale = true;
+        }
+    }
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        inotify_pid = getpid();
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            apply_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static dir_listing_t* find_listing(const char* path, const char* url) {
+    for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+        if (listings[i].path != NULL && strcmp(listings[i].path, path) == 0 &&
+            strcmp(listings[i].url, url) == 0) {
+            return &listings[i];
+        }
+    }
+    return NULL;
+}
+
+static dir_listing_t* new_listing(const char* path, const char* url) {
+    dir_listing_t* slot = NULL;
+    for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+        if (listings[i].path == NULL) {
+            slot = &listings[i];
+            break;
+        }
+        if (slot == NULL || listings[i].last_used < slot->last_used) {
+            slot = &listings[i];
+        }
+    }
+    if (slot->path != NULL) {
+        free_listing(slot);
+    }
+    slot->wd = -1;
+    slot->path = strdup(path);
+    slot->url = strdup(url);
+    if (slot->path == NULL || slot->url == NULL) {
+        free_listing(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+/* Growable text a body is rendered into */
+typedef struct text {
+    dir_index_body_t* body;
+    size_t capacity;
+    bool failed;
+} text_t;
+
+static void append(text_t* text, const char* data, size_t len) {
+    if (text->failed) {
+        return;
+    }
+    if (text->body->len + len > text->capacity) {
+        size_t capacity = text->capacity * 2 + len;
+        dir_index_body_t* body = realloc(text->body, sizeof(dir_index_body_t) + capacity);
+        if (body == NULL) {
+            text->failed = true;
+            return;
+        }
+        text->body = body;
+        text->capacity = capacity;
+    }
+    memcpy(text->body->data + text->body->len, data, len);
+    text->body->len += len;
+}
+
+static void append_str(text_t* text, const char* str) {
+    append(text, str, strlen(str));
+}
+
+static void append_html(text_t* text, const char* str) {
+    for (const char* p = str; *p != '\0'; p++) {
+        switch (*p) {
+        case '&': append_str(text, "&amp;"); break;
+        case '<': append_str(text, "&lt;"); break;
+        case '>': append_str(text, "&gt;"); break;
+        case '"': append_str(text, "&quot;"); break;
+        case '\'': append_str(text, "&#39;"); break;
+        default: append(text, p, 1);
+        }
+    }
+}
+
+// percent-encode everything but unreserved characters, for an href
+static void append_url(text_t* text, const char* str) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (const unsigned char* p = (const unsigned char*) str; *p != '\0'; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            *p == '-' || *p == '.' || *p == '_' || *p == '~') {
+            append(text, (const char*) p, 1);
+        } else {
+            char escaped[3] = {'%', hex[*p >> 4], hex[*p & 15]};
+            append(text, escaped, 3);
+        }
+    }
+}
+
+static void append_json(text_t* text, const char* str) {
+    append_str(text, "\"");
+    for (const unsigned char* p = (const unsigned char*) str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            char escaped[2] = {'\\', (char) *p};
+            append(text, escaped, 2);
+        } else if (*p < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+            append_str(text, escaped);
+        } else {
+            append(text, (const char*) p, 1);
+        }
+    }
+    append_str(text, "\"");
+}
+
+static void render_html(text_t* text, const dir_listing_t* listing) {
+    append_str(text, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of ");
+    append_html(text, listing->url);
+    append_str(text, "</title>\n</head>\n<body>\n<h1>Index of ");
+    append_html(text, listing->url);
+    append_str(text, "</h1>\n<table>\n<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n");
+    if (strcmp(listing->url, "/") != 0) {
+        append_str(text, "<tr><td><a href=\"../\">../</a></td><td></td><td>-</td></tr>\n");
+    }
+    for (size_t i = 0; i < listing->count && !text->failed; i++) {
+        const dir_entry_t* entry = &listing->entries[i];
+        char line[96];
+        struct tm tm;
+        gmtime_r(&entry->mtime, &tm);
+        append_str(text, "<tr><td><a href=\"");
+        append_url(text, entry->name);
+        append_str(text, entry->is_dir ? "/\">" : "\">");
+        append_html(text, entry->name);
+        strftime(line, sizeof(line), "</a></td><td>%Y-%m-%d %H:%M</td>", &tm);
+        append_str(text, entry->is_dir ? "/" : "");
+        append_str(text, line);
+        if (entry->is_dir) {
+            snprintf(line, sizeof(line), "<td>-</td></tr>\n");
+        } else {
+            snprintf(line, sizeof(line), "<td>%lld</td></tr>\n", (long long) entry->size);
+        }
+        append_str(text, line);
+    }
+    append_str(text, "</table>\n</body>\n</html>\n");
+}
+
+static void render_json(text_t* text, const dir_listing_t* listing) {
+    append_str(text, "[");
+    for (size_t i = 0; i < listing->count && !text->failed; i++) {
+        const dir_entry_t* entry = &listing->entries[i];
+        char line[96];
+        struct tm tm;
+        gmtime_r(&entry->mtime, &tm);
+        append_str(text, i == 0 ? "\n{\"name\":" : ",\n{\"name\":");
+        append_json(text, entry->name);
+        strftime(line, sizeof(line), ",\"mtime\":\"%Y-%m-%dT%H:%M:%SZ\"", &tm);
+        append_str(text, entry->is_dir ? ",\"type\":\"directory\"" : ",\"type\":\"file\"");
+        append_str(text, line);
+        if (!entry->is_dir) {
+            snprintf(line, sizeof(line), ",\"size\":%lld", (long long) entry->size);
+            append_str(text, line);
+        }
+        append_str(text, "}");
+    }
+    append_str(text, "\n]\n");
+}
+
+static dir_index_body_t* render(const dir_listing_t* listing, int format) {
+    STATS_INC(dir_index_renders);
+    text_t text = {.capacity = 512 + listing->count * (format == DIR_INDEX_HTML ? 160 : 100)};
+    text.body = malloc(sizeof(dir_index_body_t) + text.capacity);
+    if (text.body == NULL) {
+        return NULL;
+    }
+    text.body->len = 0;
+    if (format == DIR_INDEX_JSON) {
+        render_json(&text, listing);
+    } else {
+        render_html(&text, listing);
+    }
+    if (text.failed) {
+        free(text.body);
+        return NULL;
+    }
+    atomic_init(&text.body->refs, 1);  // the listing's
+    snprintf(text.body->etag, sizeof(text.body->etag), "\"%016llx\"",
+             (unsigned long long) xxh3_64(text.body->data, text.body->len));
+    return text.body;
+}
+
+dir_index_body_t* dir_index_render(const char* path, const char* url, const struct stat* st,
+                                   int format) {
+    pthread_mutex_lock(&index_lock);
+    drain_events();
+    dir_listing_t* listing = find_listing(path, url);
+    bool moved = listing != NULL &&
+                 (listing->mtime.tv_sec != st->st_mtim.tv_sec ||
+                  listing->mtime.tv_nsec != st->st_mtim.tv_nsec);
+    bool replaced = listing != NULL && (listing->dev != st->st_dev || listing->ino != st->st_ino);
+    bool fresh = listing == NULL;
+    if (fresh && (listing = new_listing(path, url)) == NULL) {
+        pthread_mutex_unlock(&index_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (fresh || replaced) {
+        // watch before reading, so nothing that changes in between is missed
+        unwatch(listing);
+        if (inotify_fd >= 0) {
+            listing->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+        }
+    }
+    // with a watch, events already told us what the new mtime is about
+    if (fresh || replaced || listing->stale || (moved && listing->wd < 0)) {
+        if (scan(listing) < 0) {
+            int err = errno;
+            free_listing(listing);
+            pthread_mutex_unlock(&index_lock);
+            errno = err;
+            return NULL;
+        }
+    }
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    listing->last_used = ++use_clock;
+
+    dir_index_body_t* body = listing->bodies[format];
+    if (body == NULL) {
+        body = listing->bodies[format] = render(listing, format);
+    } else {
+        STATS_INC(dir_index_hits);
+    }
+    if (body != NULL) {
+        atomic_fetch_add(&body->refs, 1);  // the caller's
+    } else {
+        errno = ENOMEM;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return body;
+}
+
+void dir_index_cleanup(void) {
+    pthread_mutex_lock(&index_lock);
+    for (int i = 0; i < DIR_INDEX_MAX_DIRS; i++) {
+        if (listings[i].path != NULL) {
+            free_listing(&listings[i]);
+        }
+    }
+    if (inotify_fd >= 0 && inotify_pid == getpid()) {
+        close(inotify_fd);
+    }
+    inotify_fd = -1;
+    pthread_mutex_unlock(&index_lock);
+}
+
+// the query has format=json, or Accept lists application/json (parameters and case aside)
+static bool wants_json(const http_request_t* request, const char* query) {
+    for (const char* p = query; p != NULL; p = strchr(p, '&')) {
+        p += *p == '&';
+        if (strncmp(p, "format=json", 11) == 0 && (p[11] == '\0' || p[11] == '&')) {
+            return true;
+        }
+    }
+    const header_view_t* accept = get_header(request, HDR_ACCEPT);
+    if (accept == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i + 16 <= accept->value_len; i++) {
+        if (strncasecmp(accept->value + i, "application/json", 16) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a response without a body: 301, 304 or an error
+// Returns: 0, or -1 when the connection has to be closed
+static int send_head(int client_fd, const http_request_t* request, int status,
+                     const char* status_text, const char* header, const char* value) {
+    char buf[MAX_URI_LENGTH + 512];
+    bool close_after = request->connection_close;
+    int n = snprintf(buf, sizeof(buf),
+        "HTTP/1.1 %d %s\r\n"
+        "Server: TinyServer\r\n"
+        "%s%s%s%s"
+        "%s"
+        "%s"
+        "\r\n",
+        status, status_text,
+        header != NULL ? header : "", header != NULL ? ": " : "",
+        header != NULL ? value : "", header != NULL ? "\r\n" : "",
+        // a 304 stands for a listing, which varies with Accept like the 200 does
+        status == 304 ? "Vary: Accept\r\n" : "Content-Length: 0\r\n",
+        close_after ? "Connection: close\r\n" :
+        request->version_minor == 0 ? "Connection: keep-alive\r\n" : "");
+    if (n < 0 || (size_t) n >= sizeof(buf) || rio_writen(client_fd, buf, (size_t) n) != n) {
+        return -1;
+    }
+    return close_after ? -1 : 0;
+}
+
+int dir_index_serve(int client_fd, const http_request_t* request, const char* docroot) {
+    if (!index_enabled ||
+        (strcmp(request->method, "GET") != 0 && strcmp(request->method, "HEAD") != 0)) {
+        return DIR_INDEX_PASS;
+    }
+    char url[MAX_URI_LENGTH];
+    if (decode_uri_path(request->uri, url, sizeof(url)) < 0) {
+        return DIR_INDEX_PASS;  // generate_response() answers 400
+    }
+    const char* query = strchr(request->uri, '?');
+    if (query != NULL) {
+        query++;
+    }
+
+    // "/" is index.html when there is one, as it always was
+    char combined_path[MAX_URI_LENGTH];
+    struct stat st;
+    if (strcmp(url, "/") == 0) {
+        snprintf(combined_path, sizeof(combined_path), "%s/index.html", docroot);
+        if (stat(combined_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            return DIR_INDEX_PASS;
+        }
+    }
+    snprintf(combined_path, sizeof(combined_path), "%s%s", docroot, url);
+    char* real_path = realpath(combined_path, NULL);
+    if (real_path == NULL || !inside_docroot(real_path, docroot) || stat(real_path, &st) < 0 ||
+        !S_ISDIR(st.st_mode)) {
+        free(real_path);
+        return DIR_INDEX_PASS;
+    }
+    if (!(st.st_mode & S_IROTH)) {
+        free(real_path);
+        return send_head(client_fd, request, 403, "Forbidden", NULL, NULL);
+    }
+
+    // relative links need the trailing slash; the Location is the path as the client wrote it
+    size_t url_len = strlen(url);
+    if (url[url_len - 1] != '/') {
+        char location[MAX_URI_LENGTH + 2];
+        size_t path_len = query != NULL ? (size_t) (query - 1 - request->uri) : strlen(request->uri);
+        snprintf(location, sizeof(location), "%.*s/%s%s", (int) path_len, request->uri,
+                 query != NULL ? "?" : "", query != NULL ? query : "");
+        free(real_path);
+        return send_head(client_fd, request, 301, "Moved Permanently", "Location", location);
+    }
+
+    int format = wants_json(request, query) ? DIR_INDEX_JSON : DIR_INDEX_HTML;
+    dir_index_body_t* body = dir_index_render(real_path, url, &st, format);
+    free(real_path);
+    if (body == NULL) {
+        return errno == EACCES ? send_head(client_fd, request, 403, "Forbidden", NULL, NULL)
+                               : send_head(client_fd, request, 500, "Internal Server Error",
+                                           NULL, NULL);
+    }
+
+    const header_view_t* if_none_match = get_header(request, HDR_IF_NONE_MATCH);
+    if (if_none_match != NULL &&
+        header_etag_matches(if_none_match->value, if_none_match->value_len, body->etag)) {
+        int rc = send_head(client_fd, request, 304, "Not Modified", "ETag", body->etag);
+        dir_index_release(body);
+        return rc;
+    }
+
+    // the body is already rendered; streaming it keeps the copy per response to a few buffers
+    char head[512];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Server: TinyServer\r\n"
+        "Content-type: %s\r\n"
+        "ETag: %s\r\n"
+        "Vary: Accept\r\n",
+        format == DIR_INDEX_JSON ? "application/json" : "text/html; charset=utf-8", body->etag);
+    response_stream_t stream;
+    int rc = stream_begin(&stream, client_fd, request, head, (size_t) n);
+    if (rc == 0) {
+        rc = stream_write(&stream, body->data, body->len);
+        if (rc == 0) {
+            rc = stream_end(&stream);
+        } else {
+            stream_abort(&stream);
+        }
+    }
+    dir_index_release(body);
+    return rc < 0 || stream.connection_close ? -1 : 0;
+}
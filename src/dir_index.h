@@ -0,0 +1,73 @@
+/* dir_index.h */
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include "http_server.h"
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+/* Constants */
+#define DIR_INDEX_MAX_DIRS 256      // listings kept, least recently used dropped first
+#define DIR_INDEX_PASS 1            // dir_index_serve(): not a directory, serve it as a file
+
+/* Listing formats */
+enum {
+    DIR_INDEX_HTML,
+    DIR_INDEX_JSON,
+    DIR_INDEX_FORMATS
+};
+
+/* One rendered listing. Immutable and reference counted: a listing that
+ * changes gets a new body, responses still sending the old one keep it. */
+typedef struct dir_index_body {
+    atomic_int refs;
+    size_t len;
+    char etag[ETAG_SIZE];           // strong ETag from a hash of data, quotes included
+    char data[];
+} dir_index_body_t;
+
+/**
+ * Turn directory listings on or off. Call before the workers start.
+ */
+void dir_index_init(bool enabled);
+
+/**
+ * Whether directories are listed
+ */
+bool dir_index_enabled(void);
+
+/**
+ * The listing of directory path (canonical, st from stat) in format, as
+ * seen at url (the request path, ending in '/'). A directory is read once;
+ * after that an inotify watch on it updates single entries as they change,
+ * and only a directory that could not be watched is read again, when its
+ * mtime moves. A body is rendered once per change.
+ * Returns: a reference on the body, or NULL with errno set if the directory
+ * cannot be read
+ */
+dir_index_body_t* dir_index_render(const char* path, const char* url, const struct stat* st,
+                                   int format);
+
+/**
+ * Drop a reference taken by dir_index_render
+ */
+void dir_index_release(dir_index_body_t* body);
+
+/**
+ * Answer a GET or HEAD for a directory under docroot: a 301 to the path
+ * with a trailing slash, a 304 if If-None-Match has the listing's ETag, or
+ * the listing, streamed. JSON when the query has format=json or Accept
+ * asks for application/json, HTML otherwise. "/" with an index.html, and
+ * anything that is not a readable directory inside docroot, is left to
+ * generate_response().
+ * Returns: 0 when a response was sent, DIR_INDEX_PASS when this is not a
+ * listing, -1 when the connection has to be closed
+ */
+int dir_index_serve(int client_fd, const http_request_t* request, const char* docroot);
+
+/**
+ * Forget every listing and close the inotify descriptor
+ */
+void dir_index_cleanup(void);
+
+#endif /* DIR_INDEX_H */
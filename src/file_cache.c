@@ -0,0 +1,454 @@
+/* file_cache.c */
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "cpu_affinity.h"
+#include "http_server.h"
+#include "probes.h"
+#include "server_stats.h"
+#include "slab_arena.h"
+#include <fcntl.h>
+#include <limits.h>
+
+/* One shard per NUMA node. A shard is a chained hash table plus an LRU list,
+ * both under the shard lock; hashing and reading happen outside it. */
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry_t* buckets[FILE_CACHE_BUCKETS];
+    cache_entry_t* lru_head;          // most recently used
+    cache_entry_t* lru_tail;
+    size_t bytes;
+} cache_shard_t;
+
+static cache_shard_t shards[MAX_NUMA_NODES] = {
+    [0 ... MAX_NUMA_NODES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static int shard_count = 1;
+static size_t shard_max_bytes = FILE_CACHE_DEFAULT_SIZE;
+static bool with_digests = false;
+
+// weak entries waiting for their hash, each holding a reference
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_ready = PTHREAD_COND_INITIALIZER;
+static cache_entry_t* hash_queue[FILE_CACHE_HASH_QUEUE];
+static int hash_head;
+static int hash_count;
+static pid_t hasher_pid;          // a forked worker starts its own hashing thread
+
+static cache_entry_t* fill(const char* path, int fd, const struct stat* st, int shard, bool defer);
+static void queue_hash(cache_entry_t* entry);
+
+void file_cache_init(size_t max_bytes, int nodes, bool digests) {
+    shard_count = nodes < 1 ? 1 : nodes > MAX_NUMA_NODES ? MAX_NUMA_NODES : nodes;
+    shard_max_bytes = max_bytes / shard_count;
+    with_digests = digests;
+}
+
+static cache_shard_t* local_shard(void) {
+    return &shards[affinity_current_node() % shard_count];
+}
+
+static bool entry_matches(const cache_entry_t* entry, const struct stat* st) {
+    // ctime catches rewrites that put the old mtime back (cp -p, rsync -t)
+    return entry->ino == st->st_ino && entry->dev == st->st_dev && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           entry->ctime.tv_sec == st->st_ctim.tv_sec && entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// entries, their paths and their content all come from the slab arena
+static void entry_free(cache_entry_t* entry) {
+    if (entry->content != NULL) {
+        arena_free(entry->content, (size_t) entry->size + 1);
+    }
+    if (entry->path != NULL) {
+        arena_free(entry->path, strlen(entry->path) + 1);
+    }
+    arena_free(entry, sizeof(cache_entry_t));
+}
+
+void file_cache_retain(cache_entry_t* entry) {
+    atomic_fetch_add(&entry->refs, 1);
+}
+
+void file_cache_release(cache_entry_t* entry) {
+    if (entry != NULL && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        entry_free(entry);
+    }
+}
+
+static void lru_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard_t* shard, cache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// unlink entry from shard (lock held) and drop the shard's reference;
+// responses still sending it keep it alive
+static void shard_remove(cache_shard_t* shard, cache_entry_t* entry) {
+    cache_entry_t** link = &shard->buckets[entry->path_hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->charge;
+    STATS_ADD(cache_bytes, -(long) entry->charge);
+    entry->cached = false;
+    file_cache_release(entry);
+}
+
+static cache_entry_t* shard_find(cache_shard_t* shard, const char* path, uint64_t path_hash) {
+    cache_entry_t* entry = shard->buckets[path_hash & (FILE_CACHE_BUCKETS - 1)];
+    while (entry != NULL && (entry->path_hash != path_hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+cache_entry_t* file_cache_lookup(const char* path, const struct stat* st) {
+    uint64_t path_hash = xxh3_64(path, strlen(path));
+    cache_shard_t* shard = local_shard();
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t* entry = shard_find(shard, path, path_hash);
+    if (entry != NULL && !entry_matches(entry, st)) {
+        shard_remove(shard, entry);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        STATS_INC(cache_hits);
+        HTTPD_PROBE1(cache_hit, path);
+        if (entry->weak) {
+            queue_hash(entry);  // asks again if the queue was full last time
+        }
+    }
+    return entry;
+}
+
+// read st_size bytes from fd into content (if non-NULL) and hash them
+static int read_and_hash(cache_entry_t* entry, int fd, char* content) {
+    xxh3_state_t xxh3;
+    sha256_ctx_t sha;
+    xxh3_init(&xxh3);
+    sha256_init(&sha);
+
+    // large files stream through one pooled buffer
+    pool_buf_t* chunk = content == NULL ? buffer_pool_get() : NULL;
+    if (content == NULL && chunk == NULL) {
+        return -1;
+    }
+
+    off_t offset = 0;
+    while (offset < entry->size) {
+        char* dest = content != NULL ? content + offset : chunk->data;
+        size_t want = content != NULL ? (size_t) (entry->size - offset) : POOL_BUF_SIZE;
+        if ((off_t) want > entry->size - offset) {
+            want = (size_t) (entry->size - offset);
+        }
+        ssize_t n = pread(fd, dest, want, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // the file shrank under us
+        }
+        xxh3_update(&xxh3, dest, (size_t) n);
+        if (with_digests) {
+            sha256_update(&sha, dest, (size_t) n);
+        }
+        offset += n;
+    }
+    buffer_pool_put(chunk);
+    if (offset != entry->size) {
+        return -1;
+    }
+
+    entry->hash = xxh3_digest(&xxh3);
+    if (with_digests) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_final(&sha, digest);
+        sha256_base64(digest, entry->repr_digest);
+        entry->has_digest = true;
+    }
+    return 0;
+}
+
+// an ETag that needs no read: the validators an entry is matched by
+static void weak_etag(cache_entry_t* entry) {
+    struct {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        struct timespec ctime;
+    } validators;
+    memset(&validators, 0, sizeof(validators));
+    validators.dev = entry->dev;
+    validators.ino = entry->ino;
+    validators.size = entry->size;
+    validators.mtime = entry->mtime;
+    validators.ctime = entry->ctime;
+    snprintf(entry->etag, sizeof(entry->etag), "W/\"%016llx\"",
+             (unsigned long long) xxh3_64(&validators, sizeof(validators)));
+    entry->weak = true;
+}
+
+// defer: leave a large file's hash to the background thread
+static cache_entry_t* fill(const char* path, int fd, const struct stat* st, int shard_index,
+                           bool defer) {
+    size_t path_len = strlen(path);
+    cache_entry_t* entry = arena_alloc(sizeof(cache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(cache_entry_t));
+    if ((entry->path = arena_alloc(path_len + 1)) == NULL) {
+        entry_free(entry);
+        return NULL;
+    }
+    memcpy(entry->path, path, path_len + 1);
+    entry->path_hash = xxh3_64(path, path_len);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->ctime = st->st_ctim;
+    atomic_init(&entry->refs, 1);
+    atomic_init(&entry->hash_queued, false);
+
+    if (st->st_size <= SENDFILE_THRESHOLD) {
+        entry->content = arena_alloc(st->st_size + 1);
+        if (entry->content == NULL) {
+            entry_free(entry);
+            return NULL;
+        }
+        entry->content[st->st_size] = '\0';
+    }
+    entry->charge = sizeof(cache_entry_t) + path_len + 1 +
+                    (entry->content != NULL ? (size_t) st->st_size + 1 : 0);
+    bool keep = entry->charge <= shard_max_bytes;
+
+    // a large file goes out with sendfile() right away, its first response
+    // should not wait for a read of all of it
+    if (entry->content == NULL && (defer || !keep)) {
+        weak_etag(entry);
+    } else if (read_and_hash(entry, fd, entry->content) < 0) {
+        entry_free(entry);
+        return NULL;
+    } else {
+        snprintf(entry->etag, sizeof(entry->etag), "\"%016llx\"", (unsigned long long) entry->hash);
+    }
+    if (!keep) {
+        return entry;  // private to this response, freed when it is released
+    }
+
+    cache_shard_t* shard = &shards[shard_index];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t* existing = shard_find(shard, path, entry->path_hash);
+    if (existing != NULL && entry_matches(existing, st) && (entry->weak || !existing->weak)) {
+        // another worker filled the same file first, share its entry
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        entry_free(entry);
+        return existing;
+    }
+    if (existing != NULL) {
+        shard_remove(shard, existing);
+    }
+
+    cache_entry_t** bucket = &shard->buckets[entry->path_hash & (FILE_CACHE_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    entry->cached = true;
+    entry->shard = shard_index;
+    atomic_fetch_add(&entry->refs, 1);
+    shard->bytes += entry->charge;
+    STATS_ADD(cache_bytes, (long) entry->charge);
+
+    while (shard->bytes > shard_max_bytes && shard->lru_tail != entry) {
+        shard_remove(shard, shard->lru_tail);
+        STATS_INC(cache_evictions);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry->weak) {
+        queue_hash(entry);
+    }
+    return entry;
+}
+
+cache_entry_t* file_cache_fill(const char* path, int fd, const struct stat* st) {
+    HTTPD_PROBE1(cache_miss, path);
+    STATS_INC(cache_misses);
+    return fill(path, fd, st, (int) (local_shard() - shards), true);
+}
+
+// read and hash queued weak entries, replacing each with a strong one in its shard
+static void* hash_thread(void* arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&hash_lock);
+        while (hash_count == 0) {
+            pthread_cond_wait(&hash_ready, &hash_lock);
+        }
+        cache_entry_t* entry = hash_queue[hash_head];
+        hash_head = (hash_head + 1) % FILE_CACHE_HASH_QUEUE;
+        hash_count--;
+        pthread_mutex_unlock(&hash_lock);
+
+        // a file that changed since gets a new weak entry on its next request
+        struct stat st;
+        int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && entry->cached && fstat(fd, &st) == 0 && entry_matches(entry, &st)) {
+            cache_entry_t* hashed = fill(entry->path, fd, &st, entry->shard, false);
+            if (hashed != NULL && !hashed->weak) {
+                STATS_INC(cache_background_hashes);
+            }
+            file_cache_release(hashed);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        file_cache_release(entry);
+    }
+    return NULL;
+}
+
+static void queue_hash(cache_entry_t* entry) {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&entry->hash_queued, &expected, true)) {
+        return;
+    }
+    pthread_mutex_lock(&hash_lock);
+    if (hasher_pid != getpid()) {
+        // entries queued before a fork are the parent's to hash
+        hash_head = hash_count = 0;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, hash_thread, NULL) != 0) {
+            pthread_mutex_unlock(&hash_lock);
+            atomic_store(&entry->hash_queued, false);
+            return;
+        }
+        pthread_detach(thread);
+        hasher_pid = getpid();
+    }
+    if (hash_count == FILE_CACHE_HASH_QUEUE) {
+        pthread_mutex_unlock(&hash_lock);
+        atomic_store(&entry->hash_queued, false);  // the next hit asks again
+        return;
+    }
+    file_cache_retain(entry);
+    hash_queue[(hash_head + hash_count) % FILE_CACHE_HASH_QUEUE] = entry;
+    hash_count++;
+    pthread_cond_signal(&hash_ready);
+    pthread_mutex_unlock(&hash_lock);
+}
+
+char* file_cache_hot_set(size_t* len) {
+    size_t used = 0;
+    size_t capacity = 4096;
+    char* list = malloc(capacity);
+    if (list == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        cache_shard_t* shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (cache_entry_t* entry = shard->lru_tail; entry != NULL; entry = entry->lru_prev) {
+            size_t path_len = strlen(entry->path);
+            if (used + path_len + 2 > capacity) {
+                while (used + path_len + 2 > capacity) {
+                    capacity *= 2;
+                }
+                char* grown = realloc(list, capacity);
+                if (grown == NULL) {
+                    pthread_mutex_unlock(&shard->lock);
+                    free(list);
+                    return NULL;
+                }
+                list = grown;
+            }
+            memcpy(list + used, entry->path, path_len);
+            list[used + path_len] = '\n';
+            used += path_len + 1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    list[used] = '\0';
+    *len = used;
+    return list;
+}
+
+int file_cache_warm(const char* list, size_t len) {
+    int warmed = 0;
+    const char* end = list + len;
+    char path[PATH_MAX];
+    while (list < end) {
+        const char* newline = memchr(list, '\n', end - list);
+        size_t path_len = (newline != NULL ? newline : end) - list;
+        const char* next = newline != NULL ? newline + 1 : end;
+        if (path_len == 0 || path_len >= sizeof(path)) {
+            list = next;
+            continue;
+        }
+        memcpy(path, list, path_len);
+        path[path_len] = '\0';
+        list = next;
+
+        // the same checks a request for the file would pass
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+            cache_entry_t* entry = file_cache_lookup(path, &st);
+            if (entry == NULL) {
+                entry = file_cache_fill(path, fd, &st);
+            }
+            if (entry != NULL) {
+                warmed += entry->cached;
+                file_cache_release(entry);
+            }
+        }
+        close(fd);
+    }
+    return warmed;
+}
+
+void file_cache_cleanup(void) {
+    for (int i = 0; i < MAX_NUMA_NODES; i++) {
+        cache_shard_t* shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_tail != NULL) {
+            shard_remove(shard, shard->lru_tail);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
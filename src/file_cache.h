@@ -0,0 +1,102 @@
+/* file_cache.h */
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include "content_hash.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/* Constants */
+#define FILE_CACHE_BUCKETS 4096                   // hash chains per shard, power of two
+#define FILE_CACHE_DEFAULT_SIZE (64 * 1024 * 1024) // bytes kept across all shards
+#define FILE_CACHE_HASH_QUEUE 64                  // large files waiting for a background hash
+#define ETAG_SIZE 21                              // "W/" "\"" 16 hex digits "\"" and a NUL
+
+/* One file as it was when it was last read: its identity, its content hash
+ * and, for small files, the content itself. Entries are immutable once
+ * filled, hash_queued aside; a changed file gets a new entry, and so does
+ * a large file once its background hash is done. */
+typedef struct cache_entry {
+    struct cache_entry* next;        // hash chain
+    struct cache_entry* lru_prev;
+    struct cache_entry* lru_next;
+    atomic_int refs;                 // one for the shard, one per response using it
+    bool cached;                     // linked into a shard (false: private to one response)
+    int shard;                       // index of the shard it is linked into
+
+    char* path;
+    uint64_t path_hash;
+    dev_t dev;                       // validators, all of them must still match
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    uint64_t hash;                   // XXH3 of the content
+    char etag[ETAG_SIZE];            // strong ETag derived from hash, quotes included, or weak
+    bool weak;                       // not hashed yet: etag is weak, made from the validators
+    atomic_bool hash_queued;         // a background hash of this weak entry is pending
+    bool has_digest;
+    char repr_digest[SHA256_BASE64_SIZE];  // base64 SHA-256, for Repr-Digest
+    char* content;                   // the whole file if size <= SENDFILE_THRESHOLD, else NULL
+    size_t charge;                   // bytes counted against the cache size
+} cache_entry_t;
+
+/**
+ * Size the cache and split it into one shard per NUMA node in use, so
+ * workers read content that was filled on their own node. max_bytes 0
+ * keeps nothing: every request hashes the file again. With digests,
+ * fills also compute a SHA-256 of the content.
+ */
+void file_cache_init(size_t max_bytes, int nodes, bool digests);
+
+/**
+ * Cached entry for path, if one exists and st still describes the file
+ * it was filled from. A hit takes a reference.
+ * Returns: the entry, or NULL on a miss
+ */
+cache_entry_t* file_cache_lookup(const char* path, const struct stat* st);
+
+/**
+ * Read and hash the file open at fd (st from fstat) and cache the result.
+ * A file over SENDFILE_THRESHOLD is not read here: its entry gets a weak
+ * ETag from the validators, and a background thread hashes the file and
+ * replaces the entry with a strong one. With the cache too small to keep
+ * the entry, it is never read at all. The caller gets a reference even if
+ * the entry is too big to keep.
+ * Returns: the entry, or NULL on a read error or out of memory
+ */
+cache_entry_t* file_cache_fill(const char* path, int fd, const struct stat* st);
+
+/**
+ * Take another reference on an entry the caller already holds one on
+ */
+void file_cache_retain(cache_entry_t* entry);
+
+/**
+ * Drop a reference taken by lookup, fill or retain
+ */
+void file_cache_release(cache_entry_t* entry);
+
+/**
+ * The paths of every cached file, one per line, coldest first, so that
+ * warming another cache from the list leaves the hottest files at the front
+ * of its LRU. The list is malloc'ed; the caller frees it.
+ * Returns: the list (len bytes, NUL terminated), or NULL when out of memory
+ */
+char* file_cache_hot_set(size_t* len);
+
+/**
+ * Fill the cache with the files named in list (as made by
+ * file_cache_hot_set), skipping any that are gone or not world-readable.
+ * Returns: number of files cached
+ */
+int file_cache_warm(const char* list, size_t len);
+
+/**
+ * Drop every cached entry that is not in use
+ */
+void file_cache_cleanup(void);
+
+#endif /* FILE_CACHE_H */
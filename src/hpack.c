@@ -0,0 +1,545 @@
+/* hpack.c */
+#include "hpack.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_MAX_INT 0x0fffffff      // larger integers are an attack, not a header
+#define HUFFMAN_EOS 256
+#define HUFFMAN_NODES 513             // 257 leaves and 256 inner nodes
+#define HUFFMAN_STATES 256            // inner nodes, the decoder's states
+
+/* Huffman decoder flags */
+#define HUFF_EMIT 1                   // the nibble completed a symbol
+#define HUFF_FAIL 2                   // it decoded EOS, which a string must not contain
+#define HUFF_ACCEPT 4                 // the bits since the last symbol are valid padding
+
+typedef struct static_entry {
+    const char* name;
+    const char* value;
+} static_entry_t;
+
+// RFC 7541 Appendix A, index 1 first
+static const static_entry_t static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""},
+    {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+
+// RFC 7541 Appendix B: code (right aligned) and length of each symbol, EOS last
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+typedef struct huffman_step {
+    uint8_t next;                 // state after the nibble
+    uint8_t sym;                  // symbol completed, with HUFF_EMIT
+    uint8_t flags;
+} huffman_step_t;
+
+// one step per state and nibble, built once from the code table
+static huffman_step_t huffman_fsm[HUFFMAN_STATES][16];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_fsm(void) {
+    // the code tree: children of inner nodes, symbol + 1 of leaves
+    static int16_t child[HUFFMAN_NODES][2];
+    static int16_t leaf[HUFFMAN_NODES];
+    static int16_t state_of[HUFFMAN_NODES];
+    static int16_t node_of[HUFFMAN_STATES];
+    static bool padding[HUFFMAN_NODES];  // reached from the root by up to 7 one bits
+    int nodes = 1;
+    for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        int node = 0;
+        for (int bit = huffman_bits[sym] - 1; bit >= 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (child[node][b] == 0) {
+                child[node][b] = (int16_t) nodes++;
+            }
+            node = child[node][b];
+        }
+        leaf[node] = (int16_t) (sym + 1);
+    }
+
+    int states = 0;
+    for (int node = 0; node < nodes; node++) {
+        if (leaf[node] == 0) {
+            node_of[states] = (int16_t) node;
+            state_of[node] = (int16_t) states++;
+        }
+    }
+    for (int node = 0, depth = 0; depth <= 7 && leaf[node] == 0; node = child[node][1], depth++) {
+        padding[node] = true;
+    }
+
+    for (int state = 0; state < HUFFMAN_STATES; state++) {
+        for (int nibble = 0; nibble < 16; nibble++) {
+            huffman_step_t* step = &huffman_fsm[state][nibble];
+            int node = node_of[state];
+            for (int bit = 3; bit >= 0; bit--) {
+                node = child[node][(nibble >> bit) & 1];
+                if (leaf[node] == 0) {
+                    continue;
+                }
+                // the shortest code is 5 bits, so a nibble completes at most one
+                if (leaf[node] - 1 == HUFFMAN_EOS) {
+                    step->flags |= HUFF_FAIL;
+                } else {
+                    step->flags |= HUFF_EMIT;
+                    step->sym = (uint8_t) (leaf[node] - 1);
+                }
+                node = 0;
+            }
+            step->next = (uint8_t) state_of[node];
+            if (padding[node]) {
+                step->flags |= HUFF_ACCEPT;
+            }
+        }
+    }
+}
+
+size_t hpack_huffman_length(const uint8_t* in, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += huffman_bits[in[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+size_t hpack_huffman_encode(const uint8_t* in, size_t len, uint8_t* out) {
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < len; i++) {
+        acc = (acc << huffman_bits[in[i]]) | huffman_codes[in[i]];
+        acc_bits += huffman_bits[in[i]];
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            out[used++] = (uint8_t) (acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) {
+        // pad with the most significant bits of EOS, all ones
+        out[used++] = (uint8_t) ((acc << (8 - acc_bits)) | (0xff >> acc_bits));
+    }
+    return used;
+}
+
+// Returns: decoded length, -1 if malformed, -2 if it does not fit cap
+static ssize_t huffman_decode(const uint8_t* in, size_t len, char* out, size_t cap) {
+    pthread_once(&huffman_once, build_huffman_fsm);
+    size_t used = 0;
+    uint8_t state = 0;
+    uint8_t flags = HUFF_ACCEPT;
+    for (size_t i = 0; i < len; i++) {
+        for (int shift = 4; shift >= 0; shift -= 4) {
+            const huffman_step_t* step = &huffman_fsm[state][(in[i] >> shift) & 0x0f];
+            if (step->flags & HUFF_FAIL) {
+                return -1;
+            }
+            if (step->flags & HUFF_EMIT) {
+                if (used == cap) {
+                    return -2;
+                }
+                out[used++] = (char) step->sym;
+            }
+            state = step->next;
+            flags = step->flags;
+        }
+    }
+    return flags & HUFF_ACCEPT ? (ssize_t) used : -1;
+}
+
+ssize_t hpack_huffman_decode(const uint8_t* in, size_t len, char* out, size_t cap) {
+    ssize_t n = huffman_decode(in, len, out, cap);
+    return n < 0 ? -1 : n;
+}
+
+// Returns: bytes written, 0 if cap is too small
+static size_t encode_int(uint8_t* out, size_t cap, uint8_t first, int prefix_bits, uint32_t value) {
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (cap == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[0] = first | (uint8_t) value;
+        return 1;
+    }
+    out[0] = first | (uint8_t) max;
+    value -= max;
+    size_t used = 1;
+    while (value >= 0x80) {
+        if (used == cap) {
+            return 0;
+        }
+        out[used++] = (uint8_t) (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (used == cap) {
+        return 0;
+    }
+    out[used++] = (uint8_t) value;
+    return used;
+}
+
+// Returns: 0, or -1 if the integer is truncated or absurdly large
+static int decode_int(const uint8_t* in, size_t len, size_t* pos, int prefix_bits,
+                      uint32_t* value) {
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t v = in[(*pos)++] & max;
+    if (v == max) {
+        int shift = 0;
+        uint8_t b;
+        do {
+            if (*pos == len || shift > 21) {
+                return -1;
+            }
+            b = in[(*pos)++];
+            v += (uint32_t) (b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        if (v > HPACK_MAX_INT) {
+            return -1;
+        }
+    }
+    *value = v;
+    return 0;
+}
+
+// a string literal into out; Returns: its length, or -1 if malformed
+static ssize_t decode_string(const uint8_t* in, size_t len, size_t* pos, char* out, size_t cap) {
+    if (*pos == len) {
+        return -1;
+    }
+    bool huffman = in[*pos] & 0x80;
+    uint32_t raw_len;
+    if (decode_int(in, len, pos, 7, &raw_len) < 0 || raw_len > len - *pos) {
+        return -1;
+    }
+    const uint8_t* raw = in + *pos;
+    *pos += raw_len;
+    if (huffman) {
+        return hpack_huffman_decode(raw, raw_len, out, cap);
+    }
+    if (raw_len > cap) {
+        return -1;
+    }
+    memcpy(out, raw, raw_len);
+    return raw_len;
+}
+
+static size_t encode_string(uint8_t* out, size_t cap, const char* str, size_t len) {
+    size_t huffman_len = hpack_huffman_length((const uint8_t*) str, len);
+    bool huffman = huffman_len < len;
+    size_t coded_len = huffman ? huffman_len : len;
+    size_t used = encode_int(out, cap, huffman ? 0x80 : 0x00, 7, (uint32_t) coded_len);
+    if (used == 0 || cap - used < coded_len) {
+        return 0;
+    }
+    if (huffman) {
+        hpack_huffman_encode((const uint8_t*) str, len, out + used);
+    } else {
+        memcpy(out + used, str, len);
+    }
+    return used + coded_len;
+}
+
+void hpack_table_init(hpack_table_t* table) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evict_to(hpack_table_t* table, size_t max_size) {
+    while (table->count > 0 && table->size > max_size) {
+        int oldest = (table->newest + table->count - 1) % HPACK_MAX_ENTRIES;
+        hpack_entry_t* entry = table->entries[oldest];
+        table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+        free(entry);
+        table->entries[oldest] = NULL;
+        table->count--;
+    }
+}
+
+void hpack_table_free(hpack_table_t* table) {
+    evict_to(table, 0);
+}
+
+void hpack_encoder_resize(hpack_table_t* table, size_t max_size) {
+    table->max_size = max_size < HPACK_TABLE_SIZE ? max_size : HPACK_TABLE_SIZE;
+    evict_to(table, table->max_size);
+    table->size_update_pending = true;
+}
+
+// name or value may point into an entry this evicts, so copy before evicting
+static void table_add(hpack_table_t* table, const char* name, size_t name_len, const char* value,
+                      size_t value_len) {
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (size > table->max_size) {
+        evict_to(table, 0);  // RFC 7541 4.4: an entry too large empties the table
+        return;
+    }
+    hpack_entry_t* entry = malloc(sizeof(hpack_entry_t) + name_len + value_len + 2);
+    if (entry == NULL) {
+        evict_to(table, 0);  // still consistent with the peer: as if it had been evicted
+        return;
+    }
+    entry->name_len = (uint32_t) name_len;
+    entry->value_len = (uint32_t) value_len;
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+    entry->value = entry->name + name_len + 1;
+    memcpy(entry->value, value, value_len);
+    entry->value[value_len] = '\0';
+
+    evict_to(table, table->max_size - size);
+    table->newest = (table->newest + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    table->entries[table->newest] = entry;
+    table->count++;
+    table->size += size;
+}
+
+// Returns: false if index is 0 or past the dynamic table
+static bool table_get(const hpack_table_t* table, uint32_t index, const char** name,
+                      size_t* name_len, const char** value, size_t* value_len) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (uint32_t) table->count) {
+        return false;
+    }
+    const hpack_entry_t* entry = table->entries[(table->newest + index) % HPACK_MAX_ENTRIES];
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return true;
+}
+
+int hpack_decode(hpack_table_t* table, const uint8_t* in, size_t len, char* out, size_t out_size,
+                 header_view_t* headers, int max_headers) {
+    // literals are decoded here first; none is longer than 8/5 of its coded form
+    size_t staging_size = len * 8 / 5 + 2;
+    char* staging = malloc(staging_size);
+    if (staging == NULL) {
+        return HPACK_ERROR;
+    }
+
+    int count = 0;
+    size_t used = 0;
+    bool too_large = false;
+    size_t pos = 0;
+    while (pos < len) {
+        uint8_t first = in[pos];
+        if ((first & 0xe0) == 0x20) {
+            // dynamic table size update, only before the first field
+            uint32_t size;
+            if (count > 0 || too_large || decode_int(in, len, &pos, 5, &size) < 0 ||
+                size > HPACK_TABLE_SIZE) {
+                free(staging);
+                return HPACK_ERROR;
+            }
+            table->max_size = size;
+            evict_to(table, size);
+            continue;
+        }
+
+        const char* name;
+        const char* value;
+        size_t name_len, value_len;
+        uint32_t index;
+        bool indexed = first & 0x80;
+        bool add = (first & 0xc0) == 0x40;
+        if (decode_int(in, len, &pos, indexed ? 7 : add ? 6 : 4, &index) < 0) {
+            free(staging);
+            return HPACK_ERROR;
+        }
+        if (indexed) {
+            if (!table_get(table, index, &name, &name_len, &value, &value_len)) {
+                free(staging);
+                return HPACK_ERROR;
+            }
+        } else {
+            size_t staged = 0;
+            if (index > 0) {
+                if (!table_get(table, index, &name, &name_len, &value, &value_len)) {
+                    free(staging);
+                    return HPACK_ERROR;
+                }
+            } else {
+                ssize_t n = decode_string(in, len, &pos, staging, staging_size);
+                if (n < 0) {
+                    free(staging);
+                    return HPACK_ERROR;
+                }
+                name = staging;
+                name_len = n;
+                staged = n;
+            }
+            ssize_t n = decode_string(in, len, &pos, staging + staged, staging_size - staged);
+            if (n < 0) {
+                free(staging);
+                return HPACK_ERROR;
+            }
+            value = staging + staged;
+            value_len = n;
+        }
+
+        if (count == max_headers || name_len > UINT16_MAX || value_len > UINT16_MAX ||
+            out_size - used < name_len + value_len + 2) {
+            too_large = true;
+        }
+        if (!too_large) {
+            header_view_t* header = &headers[count++];
+            memcpy(out + used, name, name_len);
+            out[used + name_len] = '\0';
+            header->name = out + used;
+            header->name_len = (uint16_t) name_len;
+            used += name_len + 1;
+            memcpy(out + used, value, value_len);
+            out[used + value_len] = '\0';
+            header->value = out + used;
+            header->value_len = (uint16_t) value_len;
+            used += value_len + 1;
+            header->id = (int16_t) header_lookup(header->name, name_len);
+        }
+        if (add) {
+            table_add(table, name, name_len, value, value_len);
+        }
+    }
+    free(staging);
+    return too_large ? HPACK_TOO_LARGE : count;
+}
+
+size_t hpack_encode(hpack_table_t* table, uint8_t* out, size_t cap, const char* name,
+                    const char* value, size_t value_len, bool index) {
+    size_t name_len = strlen(name);
+    // prefix integers, string lengths and a size update fit in 32 bytes
+    if (cap < name_len + value_len + 32) {
+        return 0;
+    }
+    size_t used = 0;
+    if (table->size_update_pending) {
+        used += encode_int(out, cap, 0x20, 5, (uint32_t) table->max_size);
+        table->size_update_pending = false;
+    }
+
+    uint32_t name_index = 0;
+    for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (strcmp(static_table[i].name, name) != 0) {
+            continue;
+        }
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+        if (strlen(static_table[i].value) == value_len &&
+            memcmp(static_table[i].value, value, value_len) == 0) {
+            return used + encode_int(out + used, cap - used, 0x80, 7, i + 1);
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        const hpack_entry_t* entry = table->entries[(table->newest + i) % HPACK_MAX_ENTRIES];
+        if (entry->name_len != name_len || memcmp(entry->name, name, name_len) != 0) {
+            continue;
+        }
+        uint32_t at = HPACK_STATIC_ENTRIES + 1 + i;
+        if (name_index == 0) {
+            name_index = at;
+        }
+        if (entry->value_len == value_len && memcmp(entry->value, value, value_len) == 0) {
+            return used + encode_int(out + used, cap - used, 0x80, 7, at);
+        }
+    }
+
+    bool add = index && name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size;
+    used += encode_int(out + used, cap - used, add ? 0x40 : 0x00, add ? 6 : 4, name_index);
+    if (name_index == 0) {
+        used += encode_string(out + used, cap - used, name, name_len);
+    }
+    used += encode_string(out + used, cap - used, value, value_len);
+    if (add) {
+        table_add(table, name, name_len, value, value_len);
+    }
+    return used;
+}
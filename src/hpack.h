@@ -0,0 +1,91 @@
+/* hpack.h */
+#ifndef HPACK_H
+#define HPACK_H
+
+#include "http_headers.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Constants */
+#define HPACK_TABLE_SIZE 4096          // dynamic table size we accept and use (the protocol default)
+#define HPACK_ENTRY_OVERHEAD 32        // counted per entry on top of name and value (RFC 7541 4.1)
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+
+/* hpack_decode() results besides the header count */
+#define HPACK_ERROR -1                 // malformed block: the connection is lost (COMPRESSION_ERROR)
+#define HPACK_TOO_LARGE -2             // valid, but more headers or bytes than the caller takes
+
+/* A dynamic table entry; name and value live in the same allocation */
+typedef struct hpack_entry {
+    uint32_t name_len;
+    uint32_t value_len;
+    char* value;
+    char name[];
+} hpack_entry_t;
+
+/* The dynamic table of one direction of a connection: a ring, newest first */
+typedef struct hpack_table {
+    hpack_entry_t* entries[HPACK_MAX_ENTRIES];
+    int newest;                   // ring index of index 62
+    int count;
+    size_t size;                  // entry sizes as the RFC counts them
+    size_t max_size;              // current limit, at most HPACK_TABLE_SIZE
+    bool size_update_pending;     // encoder: announce max_size in the next block
+} hpack_table_t;
+
+/**
+ * Start an empty table with the protocol default size
+ */
+void hpack_table_init(hpack_table_t* table);
+
+/**
+ * Free every entry of table
+ */
+void hpack_table_free(hpack_table_t* table);
+
+/**
+ * Apply the peer's SETTINGS_HEADER_TABLE_SIZE to an encoder's table (capped
+ * at HPACK_TABLE_SIZE). The next encoded header announces the new size.
+ */
+void hpack_encoder_resize(hpack_table_t* table, size_t max_size);
+
+/**
+ * Decode a complete header block. Names and values are copied into out,
+ * each NUL terminated, and described by views in headers (with their
+ * header_id_t). The table is updated even when the result is
+ * HPACK_TOO_LARGE, so the connection stays usable.
+ * Returns: the number of headers, HPACK_ERROR or HPACK_TOO_LARGE
+ */
+int hpack_decode(hpack_table_t* table, const uint8_t* in, size_t len, char* out, size_t out_size,
+                 header_view_t* headers, int max_headers);
+
+/**
+ * Append one header field (name in lower case) to a block. With index set
+ * the field is added to the dynamic table, so repeats cost a byte or two;
+ * values that change with every response should not be indexed.
+ * Returns: bytes written, 0 if cap is too small
+ */
+size_t hpack_encode(hpack_table_t* table, uint8_t* out, size_t cap, const char* name,
+                    const char* value, size_t value_len, bool index);
+
+/**
+ * Length of len bytes once Huffman coded
+ */
+size_t hpack_huffman_length(const uint8_t* in, size_t len);
+
+/**
+ * Huffman code len bytes into out, which holds hpack_huffman_length() bytes
+ * Returns: bytes written
+ */
+size_t hpack_huffman_encode(const uint8_t* in, size_t len, uint8_t* out);
+
+/**
+ * Decode a Huffman coded string
+ * Returns: decoded length, or -1 if it is malformed or does not fit cap
+ */
+ssize_t hpack_huffman_decode(const uint8_t* in, size_t len, char* out, size_t cap);
+
+#endif /* HPACK_H */
@@ -0,0 +1,995 @@
+/* http2.c */
+#define _GNU_SOURCE
+#include "http2.h"
+#include "hpack.h"
+#include "probes.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "server_config.h"
+#include "server_stats.h"
+#include "vhost.h"
+#include "zerocopy.h"
+#include <poll.h>
+
+#define H2_IN_BUF (2 * (H2_FRAME_HEADER + H2_MAX_FRAME))
+#define H2_HEADER_BLOCK 1024          // room a response's HEADERS frame needs at most
+#define H2_UPGRADE_SETTINGS_MAX 96    // HTTP2-Settings payload we take, 16 settings
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+typedef struct h2_stream {
+    uint32_t id;                  // 0 = free slot
+    uint32_t parent;              // stream it depends on, 0 = none
+    int weight;                   // 1..256, its share among streams of the same urgency
+    int urgency;                  // 0..7 from the priority header, lower goes first
+    uint64_t vtime;               // virtual time its next frame is due at
+    int64_t window;               // bytes we may still send on it
+    bool request_done;            // END_STREAM arrived, the response may go out
+    bool headers_sent;
+    bool head;                    // HEAD: no body after the headers
+    size_t body_sent;
+    http_response_t response;
+} h2_stream_t;
+
+typedef struct h2_conn {
+    int fd;
+    const char* docroot;
+    const http_task_t* task;
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    h2_stream_t streams[H2_MAX_STREAMS];
+    int active;                   // streams in use
+    uint32_t last_stream_id;      // highest stream the client opened
+    int64_t send_window;          // connection-level window
+    int64_t initial_window;       // the client's SETTINGS_INITIAL_WINDOW_SIZE
+    size_t max_frame;             // largest DATA payload we send
+    uint64_t vtime;               // virtual time of the last frame sent
+    size_t preface_left;          // bytes of the preface still to check
+    bool settings_seen;           // the client's first SETTINGS arrived
+    bool goaway_sent;
+    bool goaway_received;
+    int served;
+
+    // a header block, possibly spread over CONTINUATION frames
+    bool block_open;              // waiting for CONTINUATION
+    uint32_t block_stream;
+    uint8_t block_flags;          // of its HEADERS frame
+    bool block_priority;          // the HEADERS frame carried a priority
+    uint32_t block_parent;
+    bool block_exclusive;
+    int block_weight;
+    size_t block_len;
+    uint8_t block[MAX_REQUEST_SIZE];
+    char decoded[MAX_REQUEST_SIZE];
+
+    size_t in_len;
+    uint8_t in[H2_IN_BUF];
+    size_t out_len;
+    uint8_t out[H2_OUT_BUF];
+} h2_conn_t;
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void frame_header(uint8_t* p, size_t len, uint8_t type, uint8_t flags, uint32_t stream) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, stream & 0x7fffffff);
+}
+
+bool http2_is_preface(const char* raw_request) {
+    return strncmp(raw_request, H2_PREFACE, H2_PREFACE_LINE_LEN) == 0 &&
+           raw_request[H2_PREFACE_LINE_LEN] == '\0';
+}
+
+// HTTP2-Settings is a SETTINGS payload in base64url without padding
+static ssize_t decode_settings_header(const header_view_t* header, uint8_t* out, size_t cap) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < header->value_len; i++) {
+        char ch = header->value[i];
+        int v;
+        if (ch >= 'A' && ch <= 'Z') {
+            v = ch - 'A';
+        } else if (ch >= 'a' && ch <= 'z') {
+            v = ch - 'a' + 26;
+        } else if (ch >= '0' && ch <= '9') {
+            v = ch - '0' + 52;
+        } else if (ch == '-') {
+            v = 62;
+        } else if (ch == '_') {
+            v = 63;
+        } else {
+            return -1;
+        }
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (used == cap) {
+                return -1;
+            }
+            out[used++] = (uint8_t) (acc >> bits);
+        }
+    }
+    return used % 6 == 0 ? (ssize_t) used : -1;
+}
+
+bool http2_upgrade_requested(const http_request_t* request) {
+    const header_view_t* upgrade = get_header(request, HDR_UPGRADE);
+    const header_view_t* connection = get_header(request, HDR_CONNECTION);
+    const header_view_t* settings = get_header(request, HDR_HTTP2_SETTINGS);
+    uint8_t payload[H2_UPGRADE_SETTINGS_MAX];
+    return request->version_minor == 1 && upgrade != NULL && connection != NULL &&
+           settings != NULL && request->content_length == 0 && !request->chunked &&
+           header_has_token(upgrade->value, upgrade->value_len, "h2c") &&
+           header_has_token(connection->value, connection->value_len, "upgrade") &&
+           header_has_token(connection->value, connection->value_len, "http2-settings") &&
+           decode_settings_header(settings, payload, sizeof(payload)) >= 0;
+}
+
+// Write what the socket takes without blocking, or everything with wait.
+// Returns: 0, or -1 once the connection is broken
+static int flush_out(h2_conn_t* c, bool wait) {
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = c->fd, .events = POLLOUT};
+            if (wait && poll(&pfd, 1, TIMEOUT_SECS * 1000) > 0) {
+                continue;
+            }
+            if (!wait) {
+                break;
+            }
+        }
+        return -1;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    return 0;
+}
+
+// Returns: 0, or -1 if the socket is broken
+static int queue_frame(h2_conn_t* c, uint8_t type, uint8_t flags, uint32_t stream,
+                       const void* payload, size_t len) {
+    if (H2_OUT_BUF - c->out_len < H2_FRAME_HEADER + len && flush_out(c, true) < 0) {
+        return -1;
+    }
+    frame_header(c->out + c->out_len, len, type, flags, stream);
+    if (len > 0) {
+        memcpy(c->out + c->out_len + H2_FRAME_HEADER, payload, len);
+    }
+    c->out_len += H2_FRAME_HEADER + len;
+    return 0;
+}
+
+static int send_goaway(h2_conn_t* c, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, c->last_stream_id);
+    put32(payload + 4, code);
+    c->goaway_sent = true;
+    return queue_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+// Returns: always -1, the connection is done
+static int connection_error(h2_conn_t* c, uint32_t code) {
+    send_goaway(c, code);
+    return -1;
+}
+
+static int window_update(h2_conn_t* c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    return queue_frame(c, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static h2_stream_t* find_stream(h2_conn_t* c, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static h2_stream_t* open_stream(h2_conn_t* c, uint32_t id) {
+    h2_stream_t* s = find_stream(c, 0);
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->weight = H2_DEFAULT_WEIGHT;
+    s->urgency = H2_DEFAULT_URGENCY;
+    s->window = c->initial_window;
+    s->vtime = c->vtime;
+    c->active++;
+    STATS_INC(h2_streams);
+    return s;
+}
+
+static void close_stream(h2_conn_t* c, h2_stream_t* s) {
+    release_response_body(&s->response);
+    s->id = 0;
+    c->active--;
+}
+
+static int reset_stream(h2_conn_t* c, uint32_t id, uint32_t code) {
+    h2_stream_t* s = find_stream(c, id);
+    if (s != NULL) {
+        close_stream(c, s);
+    }
+    uint8_t payload[4];
+    put32(payload, code);
+    return queue_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+// RFC 7540 5.3.3: a stream that would depend on its own descendant first
+// moves that descendant up to its own place in the tree
+static void set_priority(h2_conn_t* c, h2_stream_t* s, uint32_t parent, bool exclusive,
+                         int weight) {
+    h2_stream_t* ancestor = find_stream(c, parent);
+    for (int depth = 0; ancestor != NULL && depth < H2_MAX_STREAMS; depth++) {
+        if (ancestor->parent == s->id) {
+            ancestor->parent = s->parent;
+            break;
+        }
+        ancestor = find_stream(c, ancestor->parent);
+    }
+    if (exclusive) {
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            if (c->streams[i].id != 0 && c->streams[i].id != s->id &&
+                c->streams[i].parent == parent) {
+                c->streams[i].parent = s->id;
+            }
+        }
+    }
+    s->parent = parent;
+    s->weight = weight;
+}
+
+// "u=N" of an RFC 9218 priority header, H2_DEFAULT_URGENCY if absent
+static int parse_urgency(const header_view_t* header) {
+    for (size_t i = 0; i + 2 < header->value_len; i++) {
+        if (header->value[i] == 'u' && header->value[i + 1] == '=' &&
+            (i == 0 || header->value[i - 1] == ' ' || header->value[i - 1] == ',') &&
+            header->value[i + 2] >= '0' && header->value[i + 2] <= '7') {
+            return header->value[i + 2] - '0';
+        }
+    }
+    return H2_DEFAULT_URGENCY;
+}
+
+static bool copy_pseudo(char* dest, size_t cap, const header_view_t* header) {
+    if (dest[0] != '\0' || header->value_len == 0 || header->value_len >= cap) {
+        return false;  // repeated, empty or too long
+    }
+    memcpy(dest, header->value, header->value_len);
+    return true;
+}
+
+// Turn the decoded header list in request->headers into a request: pseudo
+// headers into their fields, the rest kept as views.
+// Returns: 0, or -1 if the request is malformed (RFC 9113 8.1.1)
+static int build_request(http_request_t* request, int count, int* urgency) {
+    bool regular_seen = false;
+    bool scheme_seen = false;
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        header_view_t header = request->headers[i];
+        if (header.name[0] == ':') {
+            bool ok = !regular_seen;
+            if (strcmp(header.name, ":method") == 0) {
+                ok = ok && copy_pseudo(request->method, sizeof(request->method), &header);
+            } else if (strcmp(header.name, ":path") == 0) {
+                ok = ok && copy_pseudo(request->uri, sizeof(request->uri), &header);
+            } else if (strcmp(header.name, ":authority") == 0) {
+                ok = ok && copy_pseudo(request->host, sizeof(request->host), &header);
+            } else if (strcmp(header.name, ":scheme") == 0) {
+                ok = ok && !scheme_seen;
+                scheme_seen = true;
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                return -1;
+            }
+            continue;
+        }
+        regular_seen = true;
+        for (size_t j = 0; j < header.name_len; j++) {
+            if (header.name[j] >= 'A' && header.name[j] <= 'Z') {
+                return -1;
+            }
+        }
+        // connection-specific fields have no meaning here
+        if (header.id == HDR_CONNECTION || header.id == HDR_KEEP_ALIVE ||
+            header.id == HDR_TRANSFER_ENCODING || header.id == HDR_UPGRADE ||
+            (header.id == HDR_TE && !header_value_is(&header, "trailers"))) {
+            return -1;
+        }
+        if (header.id == HDR_HOST && request->host[0] == '\0' &&
+            header.value_len < sizeof(request->host)) {
+            memcpy(request->host, header.value, header.value_len);
+        }
+        if (header.name_len == 8 && strcmp(header.name, "priority") == 0) {
+            *urgency = parse_urgency(&header);
+        }
+        if (header.id != HDR_UNKNOWN && request->known[header.id] < 0) {
+            request->known[header.id] = (int16_t) kept;
+        }
+        request->headers[kept++] = header;
+    }
+    request->num_headers = kept;
+    if (request->method[0] == '\0' || request->uri[0] == '\0' || !scheme_seen) {
+        return -1;
+    }
+    strcpy(request->version, "HTTP/2.0");
+    return 0;
+}
+
+// The same handlers as an HTTP/1.1 request, except the ones that write
+// HTTP/1.1 to the socket themselves. Failures only set the status.
+static void make_response(h2_conn_t* c, h2_stream_t* s, const http_request_t* request) {
+    http_response_t* response = &s->response;
+    s->head = strcmp(request->method, "HEAD") == 0;
+    if (rate_limit_enabled() && !rate_limit_request(c->task->client_addr.sin_addr)) {
+        STATS_INC(rate_limited_requests);
+        response->status_code = 429;
+    } else if (server_config.status_path != NULL &&
+               strcmp(request->uri, server_config.status_path) == 0) {
+        generate_status_response(response);
+    } else if (strcmp(request->method, "PUT") == 0) {
+        response->status_code = server_config.allow_put ? 501 : 405;
+    } else if (proxy_match(request->uri) != NULL) {
+        response->status_code = 501;
+    } else {
+        generate_response(request, response, vhost_docroot(request->host, c->docroot));
+    }
+}
+
+static size_t body_left(const h2_stream_t* s) {
+    const http_response_t* response = &s->response;
+    if (s->head || response->status_code == 304 ||
+        (response->content == NULL && !response->use_sendfile)) {
+        return 0;
+    }
+    return response->content_length - s->body_sent;
+}
+
+static int send_headers(h2_conn_t* c, h2_stream_t* s, bool end_stream) {
+    const http_response_t* response = &s->response;
+    uint8_t block[H2_HEADER_BLOCK];
+    size_t used = 0;
+    char value[128];
+    int len = snprintf(value, sizeof(value), "%d", response->status_code);
+    used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, ":status", value, len,
+                         false);
+    used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "server", "TinyServer",
+                         10, true);
+    if (response->status_code == 200 && response->time_str[0] != '\0') {
+        used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "last-modified",
+                             response->time_str, strlen(response->time_str), false);
+    }
+    if (response->cache_entry != NULL) {
+        const cache_entry_t* entry = response->cache_entry;
+        used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "etag", entry->etag,
+                             strlen(entry->etag), false);
+        if (entry->has_digest && response->status_code == 200) {
+            len = snprintf(value, sizeof(value), "sha-256=:%s:", entry->repr_digest);
+            used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "repr-digest",
+                                 value, len, false);
+        }
+    }
+    if (response->status_code == 429) {
+        len = snprintf(value, sizeof(value), "%d", server_config.retry_after_secs);
+        used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "retry-after", value,
+                             len, true);
+    }
+    // a 304 describes the 200 it stands in for, so no length
+    if (response->status_code != 304) {
+        size_t length = response->content == NULL && !response->use_sendfile
+                        ? 0 : response->content_length;
+        len = snprintf(value, sizeof(value), "%zu", length);
+        used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "content-length",
+                             value, len, false);
+        if (response->content_type[0] != '\0') {
+            used += hpack_encode(&c->encoder, block + used, sizeof(block) - used, "content-type",
+                                 response->content_type, strlen(response->content_type), true);
+        }
+    }
+    uint8_t flags = H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0);
+    return queue_frame(c, H2_HEADERS, flags, s->id, block, used);
+}
+
+static void finish_stream(h2_conn_t* c, h2_stream_t* s) {
+    STATS_INC(requests_served);
+    c->served++;
+    close_stream(c, s);
+}
+
+static bool can_send(const h2_conn_t* c, const h2_stream_t* s) {
+    if (s->id == 0 || !s->request_done) {
+        return false;
+    }
+    if (!s->headers_sent) {
+        return true;
+    }
+    return body_left(s) > 0 && s->window > 0 && c->send_window > 0;
+}
+
+// a stream waits while a stream it depends on can make progress itself
+static bool blocked(h2_conn_t* c, const h2_stream_t* s) {
+    uint32_t parent = s->parent;
+    for (int depth = 0; parent != 0 && depth < H2_MAX_STREAMS; depth++) {
+        const h2_stream_t* p = find_stream(c, parent);
+        if (p == NULL) {
+            return false;
+        }
+        if (can_send(c, p)) {
+            return true;
+        }
+        parent = p->parent;
+    }
+    return false;
+}
+
+// the most urgent stream, and among equals the one furthest behind its
+// weighted share, so responses interleave frame by frame
+static h2_stream_t* next_stream(h2_conn_t* c) {
+    h2_stream_t* best = NULL;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        h2_stream_t* s = &c->streams[i];
+        if (!can_send(c, s) || blocked(c, s)) {
+            continue;
+        }
+        if (best == NULL || s->urgency < best->urgency ||
+            (s->urgency == best->urgency && s->vtime < best->vtime)) {
+            best = s;
+        }
+    }
+    return best;
+}
+
+// Frame responses into the output buffer as far as windows and room allow
+// Returns: 0, or -1 if the socket is broken
+static int fill_out(h2_conn_t* c) {
+    // after a 101 the client may not take frames until its own preface is
+    // out (curl keeps at most 32K of them), so stream 1 waits for it
+    if (!c->settings_seen) {
+        return 0;
+    }
+    while (true) {
+        h2_stream_t* s = next_stream(c);
+        if (s == NULL) {
+            return 0;
+        }
+        if (!s->headers_sent) {
+            if (H2_OUT_BUF - c->out_len < H2_FRAME_HEADER + H2_HEADER_BLOCK) {
+                return 0;
+            }
+            bool end = body_left(s) == 0;
+            if (send_headers(c, s, end) < 0) {
+                return -1;
+            }
+            s->headers_sent = true;
+            if (end) {
+                finish_stream(c, s);
+            }
+            continue;
+        }
+
+        size_t n = body_left(s);
+        n = n < c->max_frame ? n : c->max_frame;
+        n = (int64_t) n < s->window ? n : (size_t) s->window;
+        n = (int64_t) n < c->send_window ? n : (size_t) c->send_window;
+        if (H2_OUT_BUF - c->out_len < H2_FRAME_HEADER + n) {
+            return 0;
+        }
+        http_response_t* response = &s->response;
+        uint8_t* data = c->out + c->out_len + H2_FRAME_HEADER;
+        if (response->use_sendfile) {
+            // DATA frames need their headers between the chunks, so no sendfile() here
+            size_t got = 0;
+            while (got < n) {
+                ssize_t r = pread(response->file_fd, data + got, n - got, s->body_sent + got);
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    break;
+                }
+                got += r;
+            }
+            if (got < n) {
+                if (reset_stream(c, s->id, H2_INTERNAL_ERROR) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+        } else {
+            memcpy(data, response->content + s->body_sent, n);
+        }
+        bool end = n == body_left(s);
+        frame_header(c->out + c->out_len, n, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id);
+        c->out_len += H2_FRAME_HEADER + n;
+        s->body_sent += n;
+        s->window -= n;
+        c->send_window -= n;
+        c->vtime = s->vtime > c->vtime ? s->vtime : c->vtime;
+        s->vtime += (uint64_t) n * 256 / s->weight;
+        if (end) {
+            finish_stream(c, s);
+        }
+    }
+}
+
+// Returns: 0, or -1 after a connection error
+static int apply_settings(h2_conn_t* c, const uint8_t* payload, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (uint16_t) (payload[i] << 8 | payload[i + 1]);
+        uint32_t value = get32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_resize(&c->encoder, value);
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return connection_error(c, H2_PROTOCOL_ERROR);
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                return connection_error(c, H2_FLOW_CONTROL_ERROR);
+            }
+            // the change applies to the windows of open streams too
+            for (int j = 0; j < H2_MAX_STREAMS; j++) {
+                h2_stream_t* s = &c->streams[j];
+                if (s->id != 0) {
+                    s->window += (int64_t) value - c->initial_window;
+                    if (s->window > H2_MAX_WINDOW) {
+                        return connection_error(c, H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+            }
+            c->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME || value > 0xffffff) {
+                return connection_error(c, H2_PROTOCOL_ERROR);
+            }
+            break;  // we never send more than H2_MAX_FRAME anyway
+        default:
+            break;  // unknown settings are ignored
+        }
+    }
+    return 0;
+}
+
+static int end_headers(h2_conn_t* c) {
+    c->block_open = false;
+    uint32_t id = c->block_stream;
+    bool end_stream = c->block_flags & H2_FLAG_END_STREAM;
+
+    http_request_t request;
+    reset_request(&request);
+    int max_headers = MAX_HEADERS;
+    if (server_config.max_headers > 0 && server_config.max_headers < MAX_HEADERS) {
+        max_headers = server_config.max_headers;
+    }
+    size_t max_size = MAX_REQUEST_SIZE;
+    if (server_config.max_header_size > 0 && server_config.max_header_size < MAX_REQUEST_SIZE) {
+        max_size = server_config.max_header_size;
+    }
+    // decoded even for streams we refuse, the table has to stay in step
+    int count = hpack_decode(&c->decoder, c->block, c->block_len, c->decoded, max_size,
+                             request.headers, max_headers);
+    if (count == HPACK_ERROR) {
+        return connection_error(c, H2_COMPRESSION_ERROR);
+    }
+
+    h2_stream_t* s = find_stream(c, id);
+    if (s != NULL) {
+        // trailers, which must end the request; nothing in them is used
+        if (!end_stream || s->request_done) {
+            return reset_stream(c, id, H2_PROTOCOL_ERROR);
+        }
+        s->request_done = true;
+        return 0;
+    }
+    if (id <= c->last_stream_id) {
+        return connection_error(c, H2_STREAM_CLOSED);
+    }
+    c->last_stream_id = id;
+    if (c->goaway_sent) {
+        return 0;  // past the last stream our GOAWAY promised to answer
+    }
+    if (c->active == H2_MAX_STREAMS) {
+        return reset_stream(c, id, H2_REFUSED_STREAM);
+    }
+
+    s = open_stream(c, id);
+    if (c->block_priority) {
+        if (c->block_parent == id) {
+            return reset_stream(c, id, H2_PROTOCOL_ERROR);
+        }
+        set_priority(c, s, c->block_parent, c->block_exclusive, c->block_weight);
+    }
+    s->request_done = end_stream;
+    if (count == HPACK_TOO_LARGE) {
+        s->response.status_code = 431;
+        return 0;
+    }
+    if (build_request(&request, count, &s->urgency) < 0) {
+        return reset_stream(c, id, H2_PROTOCOL_ERROR);
+    }
+    HTTPD_PROBE4(parse_end, c->fd, 0, request.method, request.uri);
+    make_response(c, s, &request);
+    return 0;
+}
+
+static int append_block(h2_conn_t* c, const uint8_t* fragment, size_t len) {
+    if (len > sizeof(c->block) - c->block_len) {
+        // we cannot decode part of a block, and skipping it would desync the table
+        return connection_error(c, H2_ENHANCE_YOUR_CALM);
+    }
+    memcpy(c->block + c->block_len, fragment, len);
+    c->block_len += len;
+    return 0;
+}
+
+static int handle_headers(h2_conn_t* c, uint8_t flags, uint32_t stream, const uint8_t* payload,
+                          size_t len) {
+    if (stream == 0 || (stream & 1) == 0) {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+    }
+    size_t start = 0;
+    size_t padding = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        padding = payload[0];
+        start = 1;
+    }
+    c->block_priority = flags & H2_FLAG_PRIORITY;
+    if (c->block_priority) {
+        if (len < start + 5) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        c->block_exclusive = payload[start] & 0x80;
+        c->block_parent = get32(payload + start) & 0x7fffffff;
+        c->block_weight = payload[start + 4] + 1;
+        start += 5;
+    }
+    if (padding > len - start) {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+    }
+    c->block_stream = stream;
+    c->block_flags = flags;
+    c->block_len = 0;
+    if (append_block(c, payload + start, len - start - padding) < 0) {
+        return -1;
+    }
+    if (flags & H2_FLAG_END_HEADERS) {
+        return end_headers(c);
+    }
+    c->block_open = true;
+    return 0;
+}
+
+static int handle_data(h2_conn_t* c, uint8_t flags, uint32_t stream, const uint8_t* payload,
+                       size_t len) {
+    if (stream == 0) {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+    }
+    if ((flags & H2_FLAG_PADDED) && (len < 1 || payload[0] >= len)) {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+    }
+    // request bodies are not used over HTTP/2, so the window goes straight back
+    if (len > 0 && window_update(c, 0, (uint32_t) len) < 0) {
+        return -1;
+    }
+    h2_stream_t* s = find_stream(c, stream);
+    if (s == NULL || s->request_done) {
+        if (stream > c->last_stream_id) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        return reset_stream(c, stream, H2_STREAM_CLOSED);
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        s->request_done = true;
+        return 0;
+    }
+    return len > 0 ? window_update(c, stream, (uint32_t) len) : 0;
+}
+
+static int handle_window_update(h2_conn_t* c, uint32_t stream, const uint8_t* payload,
+                                size_t len) {
+    if (len != 4) {
+        return connection_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get32(payload) & 0x7fffffff;
+    if (stream == 0) {
+        if (increment == 0) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        c->send_window += increment;
+        return c->send_window > H2_MAX_WINDOW ? connection_error(c, H2_FLOW_CONTROL_ERROR) : 0;
+    }
+    h2_stream_t* s = find_stream(c, stream);
+    if (s == NULL) {
+        return stream > c->last_stream_id ? connection_error(c, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (increment == 0) {
+        return reset_stream(c, stream, H2_PROTOCOL_ERROR);
+    }
+    s->window += increment;
+    return s->window > H2_MAX_WINDOW ? reset_stream(c, stream, H2_FLOW_CONTROL_ERROR) : 0;
+}
+
+// Returns: 0, or -1 if the connection is done
+static int handle_frame(h2_conn_t* c, uint8_t type, uint8_t flags, uint32_t stream,
+                        const uint8_t* payload, size_t len) {
+    h2_stream_t* s;
+    switch (type) {
+    case H2_DATA:
+        return handle_data(c, flags, stream, payload, len);
+    case H2_HEADERS:
+        return handle_headers(c, flags, stream, payload, len);
+    case H2_CONTINUATION:
+        if (append_block(c, payload, len) < 0) {
+            return -1;
+        }
+        return flags & H2_FLAG_END_HEADERS ? end_headers(c) : 0;
+    case H2_PRIORITY:
+        if (stream == 0) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        if (len != 5) {
+            return reset_stream(c, stream, H2_FRAME_SIZE_ERROR);
+        }
+        if ((get32(payload) & 0x7fffffff) == stream) {
+            return reset_stream(c, stream, H2_PROTOCOL_ERROR);
+        }
+        if ((s = find_stream(c, stream)) != NULL) {
+            set_priority(c, s, get32(payload) & 0x7fffffff, payload[0] & 0x80, payload[4] + 1);
+        }
+        return 0;
+    case H2_RST_STREAM:
+        if (stream == 0 || stream > c->last_stream_id) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        if (len != 4) {
+            return connection_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        if ((s = find_stream(c, stream)) != NULL) {
+            close_stream(c, s);
+        }
+        return 0;
+    case H2_SETTINGS:
+        if (stream != 0) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        if ((flags & H2_FLAG_ACK) ? len != 0 : len % 6 != 0) {
+            return connection_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        if (flags & H2_FLAG_ACK) {
+            return 0;
+        }
+        if (apply_settings(c, payload, len) < 0) {
+            return -1;
+        }
+        c->settings_seen = true;
+        return queue_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    case H2_PING:
+        if (stream != 0) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        if (len != 8) {
+            return connection_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        return flags & H2_FLAG_ACK ? 0 : queue_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, len);
+    case H2_GOAWAY:
+        if (stream != 0) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        // finish what is open, take nothing new
+        c->goaway_received = true;
+        return 0;
+    case H2_WINDOW_UPDATE:
+        return handle_window_update(c, stream, payload, len);
+    case H2_PUSH_PROMISE:
+        return connection_error(c, H2_PROTOCOL_ERROR);  // clients do not push
+    default:
+        return 0;  // unknown frame types are ignored
+    }
+}
+
+// Returns: 0, or -1 if the connection is done
+static int process_input(h2_conn_t* c) {
+    size_t pos = 0;
+    if (c->preface_left > 0) {
+        size_t n = c->in_len < c->preface_left ? c->in_len : c->preface_left;
+        if (memcmp(c->in, H2_PREFACE + H2_PREFACE_LEN - c->preface_left, n) != 0) {
+            return -1;  // not HTTP/2 after all
+        }
+        pos = n;
+        c->preface_left -= n;
+    }
+    while (c->preface_left == 0 && c->in_len - pos >= H2_FRAME_HEADER) {
+        const uint8_t* header = c->in + pos;
+        size_t len = (size_t) header[0] << 16 | header[1] << 8 | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t stream = get32(header + 5) & 0x7fffffff;
+        if (len > H2_MAX_FRAME) {
+            return connection_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        if (c->in_len - pos < H2_FRAME_HEADER + len) {
+            break;
+        }
+        // the preface ends with SETTINGS, and nothing may come between CONTINUATIONs
+        if ((!c->settings_seen && type != H2_SETTINGS) ||
+            (c->block_open && (type != H2_CONTINUATION || stream != c->block_stream)) ||
+            (!c->block_open && type == H2_CONTINUATION)) {
+            return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        if (handle_frame(c, type, flags, stream, header + H2_FRAME_HEADER, len) < 0) {
+            return -1;
+        }
+        pos += H2_FRAME_HEADER + len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 0;
+}
+
+// the HTTP/1.1 request that asked for h2c becomes stream 1
+static int start_upgrade(h2_conn_t* c, const http_request_t* upgrade) {
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n";
+    if (rio_writen(c->fd, (char*) switching, sizeof(switching) - 1) !=
+        (ssize_t) sizeof(switching) - 1) {
+        return -1;
+    }
+    uint8_t payload[H2_UPGRADE_SETTINGS_MAX];
+    ssize_t len = decode_settings_header(get_header(upgrade, HDR_HTTP2_SETTINGS), payload,
+                                         sizeof(payload));
+    if (len < 0 || apply_settings(c, payload, len) < 0) {
+        return -1;
+    }
+    h2_stream_t* s = open_stream(c, 1);
+    c->last_stream_id = 1;
+    s->request_done = true;
+    make_response(c, s, upgrade);
+    return 0;
+}
+
+int http2_serve(int client_fd, rio_t* rio, const char* docroot, const http_task_t* task,
+                const http_request_t* upgrade) {
+    h2_conn_t* c = calloc(1, sizeof(h2_conn_t));
+    if (c == NULL) {
+        return 0;
+    }
+    c->fd = client_fd;
+    c->docroot = docroot;
+    c->task = task;
+    hpack_table_init(&c->decoder);
+    hpack_table_init(&c->encoder);
+    c->send_window = H2_DEFAULT_WINDOW;
+    c->initial_window = H2_DEFAULT_WINDOW;
+    c->max_frame = H2_MAX_FRAME;
+    c->preface_left = upgrade != NULL ? H2_PREFACE_LEN : H2_PREFACE_LEN - H2_PREFACE_LINE_LEN;
+    STATS_INC(h2_connections);
+
+    // whatever rio read past the request line is ours
+    memcpy(c->in, rio->rio_bufptr, rio->rio_cnt);
+    c->in_len = rio->rio_cnt;
+    rio->rio_cnt = 0;
+
+    uint8_t settings[18];
+    size_t max_header_size = server_config.max_header_size > 0 &&
+                             server_config.max_header_size < MAX_REQUEST_SIZE
+                             ? (size_t) server_config.max_header_size : MAX_REQUEST_SIZE;
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(settings + 8, (uint32_t) max_header_size);
+    settings[12] = 0;
+    settings[13] = H2_SETTINGS_ENABLE_PUSH;
+    put32(settings + 14, 0);
+
+    bool alive = (upgrade == NULL || start_upgrade(c, upgrade) == 0) &&
+                 queue_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings)) == 0 &&
+                 process_input(c) == 0;
+    uint64_t last_progress = monotonic_ms();
+    while (alive) {
+        if (!c->goaway_sent && server_draining()) {
+            // the client retries anything past last_stream_id on a new connection
+            send_goaway(c, H2_NO_ERROR);
+        }
+        if (fill_out(c) < 0) {
+            break;
+        }
+        if ((c->goaway_sent || c->goaway_received) && c->active == 0 && c->out_len == 0) {
+            break;
+        }
+
+        struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
+        if (c->out_len > 0) {
+            pfd.events |= POLLOUT;
+        }
+        int rc = poll(&pfd, 1, H2_TICK_MS);
+        if (rc < 0 && errno != EINTR) {
+            break;
+        }
+        uint64_t now = monotonic_ms();
+        if (rc <= 0) {
+            if (now - last_progress > TIMEOUT_SECS * 1000) {
+                // idle, or a client that stopped reading
+                if (!c->goaway_sent) {
+                    send_goaway(c, H2_NO_ERROR);
+                }
+                break;
+            }
+            continue;
+        }
+        // an HTTP/1.1 response before the upgrade may have been sent with MSG_ZEROCOPY
+        if ((pfd.revents & POLLERR) && zerocopy_reap(client_fd) > 0 &&
+            !(pfd.revents & (POLLIN | POLLOUT | POLLHUP))) {
+            continue;
+        }
+        if ((pfd.revents & POLLOUT) && flush_out(c, false) < 0) {
+            break;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(client_fd, c->in + c->in_len, H2_IN_BUF - c->in_len, MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                break;
+            }
+            if (n > 0) {
+                c->in_len += n;
+                alive = process_input(c) == 0;
+            }
+        }
+        last_progress = now;
+    }
+    // a GOAWAY queued on the way out is worth one more try
+    flush_out(c, false);
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id != 0) {
+            close_stream(c, &c->streams[i]);
+        }
+    }
+    int served = c->served;
+    hpack_table_free(&c->decoder);
+    hpack_table_free(&c->encoder);
+    free(c);
+    return served;
+}
@@ -0,0 +1,84 @@
+/* http2.h */
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "http_server.h"
+#include "network_utils.h"
+
+/* Constants */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PREFACE_LINE_LEN 18        // "PRI * HTTP/2.0\r\n\r\n", what read_request() takes for a request
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384            // largest frame we accept and send (the protocol default)
+#define H2_MAX_STREAMS 100            // SETTINGS_MAX_CONCURRENT_STREAMS we announce
+#define H2_DEFAULT_WINDOW 65535       // flow-control window before any SETTINGS or WINDOW_UPDATE
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_OUT_BUF (4 * (H2_FRAME_HEADER + H2_MAX_FRAME))  // frames waiting for the socket
+#define H2_DEFAULT_WEIGHT 16          // RFC 7540 5.3.5
+#define H2_DEFAULT_URGENCY 3          // RFC 9218 priority header, 0 goes first
+#define H2_TICK_MS 250                // idle connections look for a drain this often
+
+/* Frame types */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/* SETTINGS identifiers */
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+/* Error codes for RST_STREAM and GOAWAY */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+/**
+ * Whether raw_request, as read by read_request(), is the start of the
+ * HTTP/2 connection preface (prior knowledge)
+ */
+bool http2_is_preface(const char* raw_request);
+
+/**
+ * Whether request asks to switch to h2c: Upgrade: h2c with a valid
+ * HTTP2-Settings, and no body that would have to be read first
+ */
+bool http2_upgrade_requested(const http_request_t* request);
+
+/**
+ * Serve HTTP/2 on client_fd until the client goes away, a connection error,
+ * an idle timeout, or a drain. Bytes rio already holds are the start of the
+ * connection. With upgrade set, it is the HTTP/1.1 request that asked for
+ * h2c: it gets the 101 and is answered on stream 1, and the whole preface
+ * is expected next; otherwise read_request() already took its first line.
+ * The caller closes client_fd.
+ * Returns: the number of streams answered
+ */
+int http2_serve(int client_fd, rio_t* rio, const char* docroot, const http_task_t* task,
+                const http_request_t* upgrade);
+
+#endif /* HTTP2_H */
@@ -0,0 +1,148 @@
+/* http_headers.c */
+#include "http_headers.h"
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+
+#define HEADER_HASH_SIZE 128   // power of two, about 4x the known names
+
+static const char* header_names[HDR_COUNT] = {
+    [HDR_HOST] = "Host",
+    [HDR_CONNECTION] = "Connection",
+    [HDR_KEEP_ALIVE] = "Keep-Alive",
+    [HDR_CONTENT_LENGTH] = "Content-Length",
+    [HDR_CONTENT_TYPE] = "Content-Type",
+    [HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HDR_TE] = "TE",
+    [HDR_EXPECT] = "Expect",
+    [HDR_UPGRADE] = "Upgrade",
+    [HDR_HTTP2_SETTINGS] = "HTTP2-Settings",
+    [HDR_ACCEPT] = "Accept",
+    [HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HDR_ACCEPT_LANGUAGE] = "Accept-Language",
+    [HDR_IF_NONE_MATCH] = "If-None-Match",
+    [HDR_IF_MATCH] = "If-Match",
+    [HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [HDR_IF_UNMODIFIED_SINCE] = "If-Unmodified-Since",
+    [HDR_IF_RANGE] = "If-Range",
+    [HDR_RANGE] = "Range",
+    [HDR_CACHE_CONTROL] = "Cache-Control",
+    [HDR_PRAGMA] = "Pragma",
+    [HDR_AUTHORIZATION] = "Authorization",
+    [HDR_COOKIE] = "Cookie",
+    [HDR_ORIGIN] = "Origin",
+    [HDR_REFERER] = "Referer",
+    [HDR_USER_AGENT] = "User-Agent",
+    [HDR_X_FORWARDED_FOR] = "X-Forwarded-For",
+    [HDR_WANT_REPR_DIGEST] = "Want-Repr-Digest",
+};
+
+// slot -> header ID + 1, 0 = empty; filled once from header_names
+static uint8_t hash_table[HEADER_HASH_SIZE];
+static uint8_t name_lengths[HDR_COUNT];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+// FNV-1a over the lowercased name
+static inline uint32_t hash_name(const char* name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) (name[i] | 0x20);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void build_table(void) {
+    for (int id = 0; id < HDR_COUNT; id++) {
+        size_t len = strlen(header_names[id]);
+        name_lengths[id] = (uint8_t) len;
+        uint32_t slot = hash_name(header_names[id], len) & (HEADER_HASH_SIZE - 1);
+        while (hash_table[slot] != 0) {
+            slot = (slot + 1) & (HEADER_HASH_SIZE - 1);
+        }
+        hash_table[slot] = (uint8_t) (id + 1);
+    }
+}
+
+header_id_t header_lookup(const char* name, size_t len) {
+    pthread_once(&table_once, build_table);
+
+    uint32_t slot = hash_name(name, len) & (HEADER_HASH_SIZE - 1);
+    while (hash_table[slot] != 0) {
+        int id = hash_table[slot] - 1;
+        if (name_lengths[id] == len && strncasecmp(header_names[id], name, len) == 0) {
+            return (header_id_t) id;
+        }
+        slot = (slot + 1) & (HEADER_HASH_SIZE - 1);
+    }
+    return HDR_UNKNOWN;
+}
+
+const char* header_name(header_id_t id) {
+    return id >= 0 && id < HDR_COUNT ? header_names[id] : NULL;
+}
+
+bool header_has_token(const char* value, size_t len, const char* token) {
+    size_t token_len = strlen(token);
+    const char* end = value + len;
+    const char* p = value;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char* start = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char* stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) {
+            stop--;
+        }
+        if ((size_t) (stop - start) == token_len && strncasecmp(start, token, token_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool header_value_is(const header_view_t* header, const char* str) {
+    size_t len = strlen(str);
+    return header->value_len == len && strncasecmp(header->value, str, len) == 0;
+}
+
+bool header_etag_matches(const char* value, size_t len, const char* etag) {
+    // If-None-Match compares weakly: W/ is ignored on both sides
+    if (etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;
+    }
+    size_t etag_len = strlen(etag);
+    const char* end = value + len;
+    const char* p = value;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p < end && *p == '*') {
+            return true;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        // an entity tag is a quoted string, and commas may appear inside it
+        const char* start = p;
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end && *p != '"') {
+                p++;
+            }
+            p++;
+        }
+        if (p <= end && (size_t) (p - start) == etag_len && memcmp(start, etag, etag_len) == 0) {
+            return true;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,81 @@
+/* http_headers.h */
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Header names the server knows about. Lookups by ID are O(1) once a
+ * request is parsed; everything else is kept as an unknown view. */
+typedef enum header_id {
+    HDR_UNKNOWN = -1,
+    HDR_HOST = 0,
+    HDR_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_TE,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_HTTP2_SETTINGS,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_IF_RANGE,
+    HDR_RANGE,
+    HDR_CACHE_CONTROL,
+    HDR_PRAGMA,
+    HDR_AUTHORIZATION,
+    HDR_COOKIE,
+    HDR_ORIGIN,
+    HDR_REFERER,
+    HDR_USER_AGENT,
+    HDR_X_FORWARDED_FOR,
+    HDR_WANT_REPR_DIGEST,
+    HDR_COUNT
+} header_id_t;
+
+/* One header line, pointing into the raw request (not NUL-terminated) */
+typedef struct header_view {
+    const char* name;
+    const char* value;        // leading and trailing whitespace trimmed
+    uint16_t name_len;
+    uint16_t value_len;
+    int16_t id;               // header_id_t, HDR_UNKNOWN for the rest
+} header_view_t;
+
+/**
+ * Map a header name (any case) to its ID
+ * Returns: the ID, or HDR_UNKNOWN
+ */
+header_id_t header_lookup(const char* name, size_t len);
+
+/**
+ * Canonical spelling of a known header name
+ */
+const char* header_name(header_id_t id);
+
+/**
+ * Whether a comma-separated header value lists token (case-insensitive),
+ * e.g. header_has_token("keep-alive, Upgrade", 19, "upgrade")
+ */
+bool header_has_token(const char* value, size_t len, const char* token);
+
+/**
+ * Whether the view's value equals str, ignoring case
+ */
+bool header_value_is(const header_view_t* header, const char* str);
+
+/**
+ * Whether an If-None-Match value ("*" or a list of entity tags) matches
+ * etag, quotes included. Uses the weak comparison, so W/"x" matches "x".
+ */
+bool header_etag_matches(const char* value, size_t len, const char* etag);
+
+#endif /* HTTP_HEADERS_H */
@@ -1,18 +1,48 @@
 /* http_server.c */
+#define _GNU_SOURCE
 #include "http_server.h"
 #include "network_utils.h"
+#include "server_config.h"
+#include "server_stats.h"
+#include "proxy.h"
+#include "request_body.h"
+#include "tls.h"
+#include "cpu_affinity.h"
+#include "probes.h"
+#include "rate_limit.h"
+#include "file_cache.h"
+#include "prefork.h"
+#include "restart.h"
+#include "send_offload.h"
+#include "http2.h"
+#include "capture.h"
+#include "perf_counters.h"
+#include "dir_index.h"
+#include "slab_arena.h"
+#include "vhost.h"
+#include "zerocopy.h"
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sched.h>
 #include <signal.h>
+#include <time.h>
 
-bool read_request(rio_t* rp, char* dest, int client_fd);
+int read_request(rio_t* rp, char* dest, int client_fd);
 int init_server(char* port);
 int parse_request(const char *raw_request, http_request_t *request);
 int generate_response(const http_request_t *request, http_response_t *response, 
                      const char *docroot);
 int send_response(int client_fd, const http_response_t *response);
 int send_error_response(int client_fd, const http_response_t* response);
+int generate_status_response(http_response_t *response);
+int store_upload(const http_request_t *request, request_body_t *body,
+                 http_response_t *response, const char *docroot);
 void init_shared_buffer(void); 
 void init_thread(pthread_t* workers, int length);
-void add_to_buffer(http_task_t* new_task);
+int accept_connections(int server_fd, char* docroot);
+void get_task_from_buffer(int cpu, http_task_t* task);
 void *consumer_thread(void *arg);
 void cleanup_server(void);
 void reset_request(http_request_t *request);
@@ -22,9 +52,30 @@ void reset_request(http_request_t *request);
 sbuf_cond_t shared_buffer;
 volatile sig_atomic_t keep_running = 1;
 
+// 503 written straight from the accept path, rendered once at startup
+static char overload_response[256];
+static size_t overload_response_len;
+static char rate_limited_response[256];
+static size_t rate_limited_response_len;
+
+// set by SIGINT and SIGTERM, acted on by the accept loop
+static volatile sig_atomic_t stop_requested = 0;
+
+// Once set, workers answer with Connection: close and hang up on idle
+// keep-alive connections, so the in-flight count can reach zero
+static atomic_bool draining = false;
+
+// Per worker: the keep-alive connection it is waiting on for the next
+// request, -1 while it is busy, IDLE_CLAIMED while drain_connections() is
+// shutting that connection down
+#define IDLE_CLAIMED (-2)
+static atomic_int idle_fds[MAX_WORKERS] = {[0 ... MAX_WORKERS - 1] = -1};
+static _Atomic uint64_t idle_since_ms[MAX_WORKERS];
+
+// stop accepting, let in-flight requests finish
 void handle_sigint(int sig) {
     (void)sig;
-    exit(0);
+    stop_requested = 1;
 }
 
 int init_server(char* port) {
@@ -37,14 +88,14 @@ int init_server(char* port) {
     hints.ai_flags = AI_PASSIVE;
 
     int status;
-    if ((status = getaddrinfo(NULL, port, &hints, &res)) < 0) {
-        perror("getaddrinfo");
-        freeaddrinfo(res);
+    if ((status = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
         return -1;
     }
     
-    // Create socket file descriptor
-    if ((server_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0) {
+    // Create socket file descriptor; non-blocking so the accept loop can drain it
+    if ((server_fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            res->ai_protocol)) < 0) {
         perror("socket");
         freeaddrinfo(res);
         return -1;
@@ -54,13 +105,34 @@ int init_server(char* port) {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt failed");
         freeaddrinfo(res);
+        close(server_fd);
         return -1;
     }
+
+    // accepted sockets are clones of the listener, so options set here are
+    // inherited and cost nothing per connection
+    struct timeval timeout = {.tv_sec = TIMEOUT_SECS, .tv_usec = 0};
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // only hand over connections once the request has arrived
+    int defer_secs = server_config.defer_accept_secs;
+    if (defer_secs > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs, sizeof(defer_secs)) < 0) {
+        perror("TCP_DEFER_ACCEPT");
+    }
+
+    // let returning clients send the request in the SYN
+    int fastopen_qlen = server_config.fastopen_qlen;
+    if (fastopen_qlen > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_qlen, sizeof(fastopen_qlen)) < 0) {
+        perror("TCP_FASTOPEN");
+    }
     
     // Bind socket to address
     if (bind(server_fd, res->ai_addr, res->ai_addrlen) < 0) {
         perror("bind failed");
         freeaddrinfo(res);
+        close(server_fd);
         return -1;
     }
     
@@ -68,6 +140,7 @@ int init_server(char* port) {
     if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen failed");
         freeaddrinfo(res);
+        close(server_fd);
         return -1;
     }
     
@@ -75,40 +148,123 @@ int init_server(char* port) {
     return server_fd;
 }
 
-int parse_request(const char *raw_request, http_request_t *request) {
-    if (raw_request == NULL || request == NULL) {
-        return -1;
+int accept_connections(int server_fd, char* docroot) {
+    http_task_t batch[ACCEPT_BATCH];
+    int count = 0;
+    // across all processes in prefork mode, read once per wakeup
+    long in_flight = server_config.max_connections > 0 ? stats_in_flight() : 0;
+
+    while (count < ACCEPT_BATCH) {
+        http_task_t* task = &batch[count];
+        socklen_t client_len = sizeof(task->client_addr);
+        // accepted sockets stay blocking: workers use blocking I/O with timeouts
+        int client_fd = accept4(server_fd, (struct sockaddr*) &task->client_addr, &client_len,
+                                SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // EMFILE/ENFILE/ENOBUFS: the connection stays in the backlog, back off
+                // briefly instead of spinning on a listener that stays readable
+                STATS_INC(accept_errors);
+                perror("accept4");
+                usleep(ACCEPT_BACKOFF_US);
+            }
+            break;
+        }
+        STATS_INC(connections_accepted);
+        HTTPD_PROBE3(accept, client_fd, ntohl(task->client_addr.sin_addr.s_addr),
+                     ntohs(task->client_addr.sin_port));
+
+        // admission control: fail fast instead of letting the backlog grow
+        if (server_config.max_connections > 0 &&
+            in_flight + count >= server_config.max_connections) {
+            STATS_INC(shed_max_connections);
+            shed_connection(client_fd);
+            continue;
+        }
+
+        // a client over its connection rate never gets a queue slot
+        if (rate_limit_enabled() && !rate_limit_connection(task->client_addr.sin_addr)) {
+            STATS_INC(rate_limited_connections);
+            send_rate_limited(client_fd);
+            close(client_fd);
+            continue;
+        }
+
+        task->client_fd = client_fd;
+        task->docroot = docroot;
+        task->enqueued_ms = monotonic_ms();
+        task->capture_id = 0;
+        socklen_t cpu_len = sizeof(task->incoming_cpu);
+        if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &task->incoming_cpu,
+                       &cpu_len) < 0) {
+            task->incoming_cpu = -1;
+        }
+        count++;
     }
 
-    char* end_of_line = strstr(raw_request, "\r\n");
-    if (!end_of_line) {
-        return -1;
+    if (count == 0) {
+        return 0;
     }
 
-    size_t line_length = end_of_line - raw_request;
-    char first_line[MAXLINE];
+    int queued = add_tasks_to_buffer(batch, count);
+    for (int i = queued; i < count; i++) {
+        // every worker is busy and the queue is full
+        STATS_INC(shed_queue_full);
+        shed_connection(batch[i].client_fd);
+    }
+    return count;
+}
 
-    strncpy(first_line, raw_request, line_length);
-    first_line[line_length] = '\0';
+int parse_request(const char *raw_request, http_request_t *request) {
+    if (raw_request == NULL || request == NULL) {
+        return PARSE_BAD_REQUEST;
+    }
+    reset_request(request);
 
-    // now we have the first line as a proper string
-    char* method = strtok(first_line, " ");
-    char* uri = strtok(NULL, " "); 
-    char* version = strtok(NULL, "\r");  // now points to "HTTP/1.1"
+    const char* end_of_line = strstr(raw_request, "\r\n");
+    if (!end_of_line) {
+        return PARSE_BAD_REQUEST;
+    }
 
-    strncpy(request->method, method, sizeof(request->method) - 1);
-    strncpy(request->uri, uri, MAX_URI_LENGTH - 1);
-    strncpy(request->version, version, sizeof(request->version) - 1);
+    // request line: METHOD SP URI SP HTTP/1.x
+    const char* method = raw_request;
+    const char* uri_sep = memchr(method, ' ', end_of_line - method);
+    if (uri_sep == NULL) {
+        return PARSE_BAD_REQUEST;
+    }
+    const char* uri = uri_sep + 1;
+    const char* version_sep = memchr(uri, ' ', end_of_line - uri);
+    if (version_sep == NULL) {
+        return PARSE_BAD_REQUEST;
+    }
+    const char* version = version_sep + 1;
+
+    size_t method_len = uri_sep - method;
+    size_t uri_len = version_sep - uri;
+    size_t version_len = end_of_line - version;
+    if (method_len == 0 || method_len >= sizeof(request->method) || uri_len == 0 ||
+        uri_len >= MAX_URI_LENGTH || version_len != 8 || strncmp(version, "HTTP/1.", 7) != 0 ||
+        (version[7] != '0' && version[7] != '1')) {
+        return PARSE_BAD_REQUEST;
+    }
+    memcpy(request->method, method, method_len);
+    memcpy(request->uri, uri, uri_len);
+    memcpy(request->version, version, version_len);
+    request->version_minor = version[7] - '0';
+
+    int max_headers = MAX_HEADERS;
+    if (server_config.max_headers > 0 && server_config.max_headers < MAX_HEADERS) {
+        max_headers = server_config.max_headers;
+    }
 
-    char* line_start = end_of_line + 2;
-    char curr_line[MAXLINE];
-    int content_length = 0;
+    const char* line_start = end_of_line + 2;
     while (true) {
         end_of_line = strstr(line_start, "\r\n");
-        line_length = end_of_line - line_start;
-
         if (!end_of_line) {
-            return -1;
+            return PARSE_BAD_REQUEST;
         }
 
         if (line_start == end_of_line) {
@@ -117,50 +273,177 @@ int parse_request(const char *raw_request, http_request_t *request) {
             break;
         }
 
-        // extract the string
-        strncpy(curr_line, line_start, line_length);
-        curr_line[line_length] = '\0';
+        // "name: value", no whitespace before the colon and no obsolete line folding
+        const char* colon = memchr(line_start, ':', end_of_line - line_start);
+        if (colon == NULL || colon == line_start || colon[-1] == ' ' || colon[-1] == '\t' ||
+            *line_start == ' ' || *line_start == '\t') {
+            return PARSE_BAD_REQUEST;
+        }
+        if (request->num_headers == max_headers) {
+            return PARSE_HEADERS_TOO_LARGE;
+        }
 
-        char* key = strtok(curr_line, ":");
+        const char* value = colon + 1;
+        const char* value_end = end_of_line;
+        // strip dangling spaces
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
 
-        if (key) {
-            char* value = key + strlen(key) + 1;
-            // strip dangling spaces
-            while (*value == ' ') {
-                value++;
+        header_view_t* header = &request->headers[request->num_headers];
+        header->name = line_start;
+        header->name_len = (uint16_t) (colon - line_start);
+        header->value = value;
+        header->value_len = (uint16_t) (value_end - value);
+        header->id = (int16_t) header_lookup(header->name, header->name_len);
+
+        if (header->id != HDR_UNKNOWN) {
+            int16_t first = request->known[header->id];
+            if (first < 0) {
+                request->known[header->id] = (int16_t) request->num_headers;
+            } else if (header->id == HDR_TRANSFER_ENCODING) {
+                // only the first would be read here, the next hop may combine them
+                return PARSE_BAD_REQUEST;
+            } else if (header->id == HDR_HOST || header->id == HDR_CONTENT_LENGTH) {
+                // two different answers to "where" or "how long" is a smuggling attempt
+                const header_view_t* other = &request->headers[first];
+                if (other->value_len != header->value_len ||
+                    memcmp(other->value, header->value, header->value_len) != 0) {
+                    return PARSE_BAD_REQUEST;
+                }
             }
+        }
+        request->num_headers++;
+        line_start = end_of_line + 2;
+    }
+
+    // if we arrive here it means that we're already in the body
+    request->body = line_start;
+
+    const header_view_t* header;
+    if ((header = get_header(request, HDR_HOST)) != NULL) {
+        if (header->value_len == 0 || header->value_len >= sizeof(request->host)) {
+            return PARSE_BAD_REQUEST;
+        }
+        memcpy(request->host, header->value, header->value_len);
+    } else if (request->version_minor == 1) {
+        // HTTP/1.1 requires Host
+        return PARSE_BAD_REQUEST;
+    }
 
-            if (strcasecmp(key, "Host") == 0) {
-                // get the host
-                strcpy(request->host, value);
-            } else if (strcasecmp(key, "Content-Length") == 0) {
-                content_length = atoi(value);
-            } else if (strcasecmp(key, "Connection") == 0) {
-                if (strcmp(value, "close") == 0) {
-                    request->connection_close = true;
-                } 
+    if ((header = get_header(request, HDR_CONTENT_LENGTH)) != NULL) {
+        size_t length = 0;
+        if (header->value_len == 0 || header->value_len > 18) {
+            return PARSE_BAD_REQUEST;
+        }
+        for (size_t i = 0; i < header->value_len; i++) {
+            if (header->value[i] < '0' || header->value[i] > '9') {
+                return PARSE_BAD_REQUEST;
             }
+            length = length * 10 + (header->value[i] - '0');
         }
+        request->content_length = length;
+    }
 
-        line_start = end_of_line + 2;
+    if ((header = get_header(request, HDR_TRANSFER_ENCODING)) != NULL) {
+        // anything but chunked is something we can't frame, and a length next
+        // to it may be what the next hop believes instead (RFC 9112 6.3)
+        if (!header_value_is(header, "chunked") ||
+            get_header(request, HDR_CONTENT_LENGTH) != NULL) {
+            return PARSE_BAD_REQUEST;
+        }
+        request->chunked = true;
     }
 
-    if (!request->host[0]) {
-        return -1;
+    if ((header = get_header(request, HDR_EXPECT)) != NULL &&
+        header_value_is(header, "100-continue")) {
+        request->expect_continue = true;
     }
 
-    // if we arrive here it means that we're already in the body
-    if ((size_t) content_length > sizeof(request->body)) {
-        content_length = sizeof(request->body) - 1;
+    // HTTP/1.1 connections persist unless the client says close, HTTP/1.0
+    // ones close unless it asks for keep-alive
+    header = get_header(request, HDR_CONNECTION);
+    if (request->version_minor == 0) {
+        request->connection_close =
+            header == NULL || !header_has_token(header->value, header->value_len, "keep-alive");
+    } else {
+        request->connection_close =
+            header != NULL && header_has_token(header->value, header->value_len, "close");
+    }
 
-        printf("Body too large!");
+    return 0;
+}
+
+const header_view_t* get_header(const http_request_t* request, header_id_t id) {
+    int index = request->known[id];
+    return index < 0 ? NULL : &request->headers[index];
+}
+
+const header_view_t* find_header(const http_request_t* request, const char* name) {
+    header_id_t id = header_lookup(name, strlen(name));
+    if (id != HDR_UNKNOWN) {
+        return get_header(request, id);
+    }
+    size_t len = strlen(name);
+    for (int i = 0; i < request->num_headers; i++) {
+        const header_view_t* header = &request->headers[i];
+        if (header->name_len == len && strncasecmp(header->name, name, len) == 0) {
+            return header;
+        }
     }
+    return NULL;
+}
 
-    memcpy(request->body, line_start, content_length);
-    
+static void set_file_error(http_response_t* response, int err) {
+    if (err == ENOENT || err == ENOTDIR) {
+        // File does not exist
+        response->status_code = 404;
+        strcpy(response->status_text, "Not Found");
+    } else if (err == EACCES) {
+        // File exists but permission is denied
+        response->status_code = 403;
+        strcpy(response->status_text, "Forbidden");
+    } else {
+        // Other error conditions
+        response->status_code = 500;
+        strcpy(response->status_text, "Internal Server Error");
+    }
+}
+
+int decode_uri_path(const char* uri, char* path, size_t len) {
+    size_t n = 0;
+    for (const char* p = uri; *p != '\0' && *p != '?'; p++) {
+        char c = *p;
+        if (c == '%') {
+            char hex[3] = {p[1], p[1] != '\0' ? p[2] : '\0', '\0'};
+            char* end;
+            c = (char) strtol(hex, &end, 16);
+            if (end != hex + 2 || !isxdigit((unsigned char) hex[0]) || c == '\0') {
+                return -1;
+            }
+            p += 2;
+        }
+        if (n + 1 >= len) {
+            return -1;
+        }
+        path[n++] = c;
+    }
+    path[n] = '\0';
     return 0;
 }
 
+bool inside_docroot(const char* real_path, const char* docroot) {
+    size_t len = strlen(docroot);
+    while (len > 1 && docroot[len - 1] == '/') {
+        len--;
+    }
+    return strncmp(real_path, docroot, len) == 0 &&
+           (real_path[len] == '/' || real_path[len] == '\0' || len == 1);
+}
+
 // TODO: Implement generate_response()
 int generate_response(const http_request_t *request, http_response_t *response, 
                      const char *docroot) {
@@ -168,7 +451,12 @@ int generate_response(const http_request_t *request, http_response_t *response,
     // based on the request and document root
     // TODO: Implement this function
     char new_filename[MAX_URI_LENGTH];
-    const char* filename = request->uri;
+    if (decode_uri_path(request->uri, new_filename, sizeof(new_filename)) < 0) {
+        response->status_code = 400;
+        strcpy(response->status_text, "Bad Request");
+        return -1;
+    }
+    const char* filename = new_filename;
     if (strcmp(filename, "/") == 0) {
         snprintf(new_filename, MAX_URI_LENGTH, "/index.html");
         filename = new_filename;
@@ -188,40 +476,27 @@ int generate_response(const http_request_t *request, http_response_t *response,
         return -1;
     }
 
-    if (strncmp(real_path, docroot, strlen(docroot)) != 0) {
+    if (!inside_docroot(real_path, docroot)) {
         response->status_code = 404;
         strcpy(response->status_text, "Not Found");
         free(real_path);
         return -1;
     }
 
-    FILE* fp = fopen(real_path, "r"); // open file
-
-    if (fp == NULL) {
-        if (errno == ENOENT) {
-            // File does not exist
-            response->status_code = 404;
-            strcpy(response->status_text, "Not Found");
-        } else if (errno == EACCES) {
-            // File exists but permission is denied
-            response->status_code = 403;
-            strcpy(response->status_text, "Forbidden");
-        } else {
-            // Other error conditions
-            response->status_code = 500;
-            strcpy(response->status_text, "Internal Server Error");
-        }
-        return -1;
-    }
-
     // get file stat to get its last modified + size
-
     struct stat file_stat;
     if (stat(real_path, &file_stat) == -1) {
-        fclose(fp);
+        set_file_error(response, errno);
+        free(real_path);
         return -1;
     }
 
+    if (!S_ISREG(file_stat.st_mode)) {
+        response->status_code = 404;
+        strcpy(response->status_text, "Not Found");
+        free(real_path);
+        return -1;
+    }
     if (!(file_stat.st_mode & S_IROTH)) {
         response->status_code = 403;
         strcpy(response->status_text, "Forbidden");
@@ -229,9 +504,41 @@ int generate_response(const http_request_t *request, http_response_t *response,
         return -1;
     }
 
+    // small files are served from the cache without opening them again;
+    // large ones only take their ETag from it and go out with sendfile()
+    cache_entry_t* entry = file_cache_lookup(real_path, &file_stat);
+    int fd = -1;
+    if (entry == NULL || entry->content == NULL) {
+        fd = open(real_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            set_file_error(response, errno);
+            file_cache_release(entry);
+            free(real_path);
+            return -1;
+        }
+        // on a miss, fill from exactly the file we are about to send
+        if (entry == NULL && (fstat(fd, &file_stat) < 0 ||
+                              (entry = file_cache_fill(real_path, fd, &file_stat)) == NULL)) {
+            response->status_code = 500;
+            strcpy(response->status_text, "Internal Server Error");
+            close(fd);
+            free(real_path);
+            return -1;
+        }
+        HTTPD_PROBE2(file_open, real_path, file_stat.st_size);
+        if (entry->content != NULL) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    free(real_path);
+
+    response->cache_entry = entry;
+    response->content = NULL;
+    response->use_sendfile = false;
     response->content_length = file_stat.st_size;
     strftime(response->time_str, 100, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&file_stat.st_mtime));
-    
+
     // get content type
     char* ext = strrchr(filename, '.');
     if (ext != NULL) {
@@ -248,41 +555,141 @@ int generate_response(const http_request_t *request, http_response_t *response,
         strcpy(response->content_type, "application/octet-stream");
     }
 
-    // read content
-    response->content = malloc(file_stat.st_size + 1);
-    if (response->content == NULL) {
-        response->status_code = 500;  // Internal Server Error
-        strcpy(response->status_text, "Internal Server Error");
-        free(real_path);
-        fclose(fp);
-        return -1;
+    // check connection close
+    if (request->connection_close) {
+        response->connection_close = true;
     }
 
-    if (fread(response->content, 1, file_stat.st_size, fp) != file_stat.st_size) {
-        free(response->content);
-        free(real_path);
-        fclose(fp);
-        return -1;
+    // the ETag is the content hash, so it survives deploys that only touch mtimes
+    const header_view_t* if_none_match = get_header(request, HDR_IF_NONE_MATCH);
+    if (if_none_match != NULL &&
+        (strcmp(request->method, "GET") == 0 || strcmp(request->method, "HEAD") == 0) &&
+        header_etag_matches(if_none_match->value, if_none_match->value_len, entry->etag)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        response->content_length = 0;
+        response->status_code = 304;
+        strcpy(response->status_text, "Not Modified");
+        return 0;
     }
-    response->content[file_stat.st_size] = '\0';
 
-    // check connection close
-    if (request->connection_close) {
-        response->connection_close = true;
+    // large files go out with sendfile() and never pass through user space
+    if (entry->content == NULL) {
+        response->file_fd = fd;
+        response->use_sendfile = true;
+    } else {
+        response->content = entry->content;  // owned by the entry
     }
 
     response->status_code = 200;
     strcpy(response->status_text, "OK");
+    return 0;
+}
 
-    free(real_path);
-    fclose(fp);
+int store_upload(const http_request_t *request, request_body_t *body,
+                 http_response_t *response, const char *docroot) {
+    if (!server_config.allow_put) {
+        response->status_code = 405;
+        strcpy(response->status_text, "Method Not Allowed");
+        return -1;
+    }
+
+    // the same name a GET for this URI would look up
+    char uri[MAX_URI_LENGTH];
+    if (decode_uri_path(request->uri, uri, sizeof(uri)) < 0) {
+        response->status_code = 400;
+        strcpy(response->status_text, "Bad Request");
+        return -1;
+    }
+    size_t uri_len = strlen(uri);
+    if (uri[0] != '/' || uri[uri_len - 1] == '/' || strstr(uri, "/..") != NULL) {
+        response->status_code = 400;
+        strcpy(response->status_text, "Bad Request");
+        return -1;
+    }
+
+    // the parent directory must already exist inside the docroot
+    char combined_path[MAX_URI_LENGTH];
+    snprintf(combined_path, MAX_URI_LENGTH, "%s%s", docroot, uri);
+    char* slash = strrchr(combined_path, '/');
+    *slash = '\0';
+    const char* filename = slash + 1;
+
+    char* real_dir = realpath(combined_path, NULL);
+    if (real_dir == NULL || !inside_docroot(real_dir, docroot)) {
+        response->status_code = 404;
+        strcpy(response->status_text, "Not Found");
+        free(real_dir);
+        return -1;
+    }
+
+    char final_path[MAX_URI_LENGTH];
+    char temp_path[MAX_URI_LENGTH];
+    snprintf(final_path, MAX_URI_LENGTH, "%s/%s", real_dir, filename);
+    snprintf(temp_path, MAX_URI_LENGTH, "%s/.%s.upload.XXXXXX", real_dir, filename);
+    free(real_dir);
+
+    struct stat file_stat;
+    bool existed = stat(final_path, &file_stat) == 0;
+    if (existed && !S_ISREG(file_stat.st_mode)) {
+        response->status_code = 409;
+        strcpy(response->status_text, "Conflict");
+        return -1;
+    }
+
+    // write to a temporary file and rename, readers never see half an upload
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        response->status_code = errno == EACCES ? 403 : 500;
+        strcpy(response->status_text, errno == EACCES ? "Forbidden" : "Internal Server Error");
+        return -1;
+    }
+    fchmod(fd, 0644);
+
+    if (body_write_to_fd(body, fd) < 0) {
+        bool too_large = errno == EFBIG;
+        close(fd);
+        unlink(temp_path);
+        response->status_code = too_large ? 413 : 400;
+        strcpy(response->status_text, too_large ? "Payload Too Large" : "Bad Request");
+        response->connection_close = true;  // the rest of the body is still on the wire
+        return -1;
+    }
+
+    if (close(fd) < 0 || rename(temp_path, final_path) < 0) {
+        unlink(temp_path);
+        response->status_code = 500;
+        strcpy(response->status_text, "Internal Server Error");
+        return -1;
+    }
+
+    response->status_code = existed ? 204 : 201;
+    strcpy(response->status_text, existed ? "No Content" : "Created");
     return 0;
 }
 
+// the body is the response's own buffer, a cache entry's content or a file
+void release_response_body(const http_response_t* response) {
+    if (response->use_sendfile) {
+        close(response->file_fd);
+    }
+    if (response->cache_entry != NULL) {
+        file_cache_release(response->cache_entry);
+    } else {
+        free(response->content);
+    }
+}
+
+bool server_draining(void) {
+    return atomic_load(&draining);
+}
+
 // TODO: Implement send_response()
 int send_response(int client_fd, const http_response_t *response) {
     // This is where you send the response back to the client
     // TODO: Implement this function
+    HTTPD_PROBE3(send_start, client_fd, response->status_code, response->content_length);
     int n_bytes = 0;
     char buf[MAXBUF];
     size_t remaining = MAXBUF;
@@ -299,19 +706,37 @@ int send_response(int client_fd, const http_response_t *response) {
         write_byte = snprintf(buf + n_bytes, remaining, "Connection: close\r\n");
         n_bytes += write_byte;
         remaining -= write_byte;
+    } else if (response->keep_alive_header) {
+        write_byte = snprintf(buf + n_bytes, remaining, "Connection: keep-alive\r\n");
+        n_bytes += write_byte;
+        remaining -= write_byte;
     }
     if (response->status_code == 200) {
         write_byte = snprintf(buf + n_bytes, remaining, "Last-Modified: %s\r\n", response->time_str);
         n_bytes += write_byte;
         remaining -= write_byte;
     }
+    if (response->cache_entry != NULL) {
+        write_byte = snprintf(buf + n_bytes, remaining, "ETag: %s\r\n", response->cache_entry->etag);
+        n_bytes += write_byte;
+        remaining -= write_byte;
+        if (response->cache_entry->has_digest && response->status_code == 200) {
+            write_byte = snprintf(buf + n_bytes, remaining, "Repr-Digest: sha-256=:%s:\r\n",
+                                  response->cache_entry->repr_digest);
+            n_bytes += write_byte;
+            remaining -= write_byte;
+        }
+    }
    
-    write_byte = snprintf(buf + n_bytes, remaining, "Content-length: %lu\r\n", response->content_length);
-    n_bytes += write_byte;
-    remaining -= write_byte;
-    write_byte = snprintf(buf + n_bytes, remaining, "Content-type: %s\r\n", response->content_type);
-    n_bytes += write_byte;
-    remaining -= write_byte;
+    // a 304 has no body and describes the 200 it stands in for, so no length
+    if (response->status_code != 304) {
+        write_byte = snprintf(buf + n_bytes, remaining, "Content-length: %lu\r\n", response->content_length);
+        n_bytes += write_byte;
+        remaining -= write_byte;
+        write_byte = snprintf(buf + n_bytes, remaining, "Content-type: %s\r\n", response->content_type);
+        n_bytes += write_byte;
+        remaining -= write_byte;
+    }
     write_byte = snprintf(buf + n_bytes, remaining, "\r\n");
     n_bytes += write_byte;
     remaining -= write_byte;
@@ -321,19 +746,78 @@ int send_response(int client_fd, const http_response_t *response) {
         return -1;
     }
 
-    if (rio_writen(client_fd, buf, strlen(buf)) != n_bytes) {
+    // a large cached body is lent to the kernel instead of copied; the
+    // headers live on our stack, so they are copied and wait for it (MSG_MORE)
+    size_t head_sent = 0;
+    size_t body_sent = 0;
+    if (zerocopy_eligible(response)) {
+        ssize_t n = send(client_fd, buf, n_bytes, MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            release_response_body(response);
+            return -1;
+        }
+        head_sent = n > 0 ? (size_t) n : 0;
+        if (head_sent == (size_t) n_bytes) {
+            n = zerocopy_send(client_fd, response->content, response->content_length,
+                              response->cache_entry);
+            if (n < 0) {
+                release_response_body(response);
+                return -1;
+            }
+            body_sent = n;
+        }
+    }
+
+    if (response->park_task != NULL) {
+        // headers and body in one go; a slow client's rest is parked, not waited for
+        struct iovec iov[2] = {{buf + head_sent, n_bytes - head_sent}, {response->content, 0}};
+        int iovcnt = 1;
+        if (!response->use_sendfile && response->content != NULL) {
+            iov[1].iov_base = response->content + body_sent;
+            iov[1].iov_len = response->content_length - body_sent;
+            iovcnt = 2;
+        }
+        int rc = send_offload_write(client_fd, iov, iovcnt,
+                                    response->use_sendfile ? response->file_fd : -1,
+                                    response->use_sendfile ? response->content_length : 0,
+                                    response->park_task, response->connection_close);
+        release_response_body(response);
+        HTTPD_PROBE4(send_end, client_fd, response->status_code,
+                     n_bytes + (rc < 0 ? 0 : response->content_length), rc);
+        return rc;
+    }
+
+    size_t head_left = n_bytes - head_sent;
+    if (rio_writen(client_fd, buf + head_sent, head_left) != (ssize_t) head_left) {
         printf("Wrong header length being sent");
+        release_response_body(response);
         return -1;
     }
     printf("Response headers:\n");
     printf("%s", buf);
 
-    if (rio_writen(client_fd, response->content, response->content_length) != response->content_length) {
+    if (response->use_sendfile) {
+        int rc = rio_sendfilen(client_fd, response->file_fd, response->content_length);
+        release_response_body(response);
+        if (rc < 0) {
+            printf("Wrong body length being sent");
+        }
+        HTTPD_PROBE4(send_end, client_fd, response->status_code,
+                     n_bytes + (rc < 0 ? 0 : response->content_length), rc);
+        return rc;
+    }
+
+    if (rio_writen(client_fd, response->content + body_sent, response->content_length - body_sent) !=
+        response->content_length - body_sent) {
         printf("Wrong body length being sent");
+        release_response_body(response);
+        HTTPD_PROBE4(send_end, client_fd, response->status_code, n_bytes, -1);
         return -1;
     }
-    free(response->content);
+    release_response_body(response);
 
+    HTTPD_PROBE4(send_end, client_fd, response->status_code,
+                 n_bytes + response->content_length, 0);
     return 0;
 }
 
@@ -344,9 +828,12 @@ int send_error_response(int client_fd, const http_response_t* response) {
     n_bytes += snprintf(buf, MAXBUF, 
     "HTTP/1.1 %d %s\r\n"
     "Content-Length: 0\r\n"
+    "%s"
     "\r\n", 
     response->status_code, 
-    response->status_text);
+    response->status_text,
+    response->connection_close ? "Connection: close\r\n" :
+    response->keep_alive_header ? "Connection: keep-alive\r\n" : "");
     if (rio_writen(client_fd, buf, strlen(buf)) != n_bytes) {
         printf("Wrong header length being sent");
         return -1;
@@ -356,67 +843,344 @@ int send_error_response(int client_fd, const http_response_t* response) {
     return 0;
 }
 
+int generate_status_response(http_response_t *response) {
+    size_t cap = 4096 + (size_t) num_workers * 256 + (size_t) server_config.processes * 64 +
+                 PERF_RENDER_MAX;
+    response->content = malloc(cap);
+    if (response->content == NULL) {
+        response->status_code = 500;
+        strcpy(response->status_text, "Internal Server Error");
+        return -1;
+    }
+
+    response->content_length = stats_render(response->content, cap);
+    response->content_length += affinity_render(response->content + response->content_length,
+                                                cap - response->content_length);
+    response->content_length += prefork_render(response->content + response->content_length,
+                                               cap - response->content_length);
+    response->content_length += perf_counters_render(response->content + response->content_length,
+                                                     cap - response->content_length);
+    response->status_code = 200;
+    strcpy(response->status_text, "OK");
+    strcpy(response->content_type, "text/plain");
+
+    time_t now = time(NULL);
+    strftime(response->time_str, sizeof(response->time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+    return 0;
+}
+
+void init_overload_response(int retry_after_secs) {
+    int n = snprintf(overload_response, sizeof(overload_response),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Server: TinyServer\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        retry_after_secs);
+    overload_response_len = (size_t) n;
+
+    n = snprintf(rate_limited_response, sizeof(rate_limited_response),
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Server: TinyServer\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        retry_after_secs);
+    rate_limited_response_len = (size_t) n;
+}
+
+void shed_connection(int client_fd) {
+    // the socket buffer of a fresh connection always has room for this, and
+    // if it somehow doesn't we'd rather drop the 503 than stall accepting
+    send(client_fd, overload_response, overload_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+void send_rate_limited(int client_fd) {
+    send(client_fd, rate_limited_response, rate_limited_response_len,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
 #ifndef TESTING
+// The listener, shared by every worker process in prefork mode
+static int listen_fd = -1;
+
+// signals the accept loop waits for; blocked everywhere else, so they
+// cannot land in a worker thread or between a flag check and epoll_pwait()
+static sigset_t serve_signals;
+static sigset_t serve_mask;
+
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t hot_set_requested = 0;
+static volatile sig_atomic_t perf_dump_requested = 0;
+
+// start the binary again on the same listener, then stop like SIGINT
+static void handle_restart(int sig) {
+    (void) sig;
+    restart_requested = 1;
+}
+
+// prefork workers: the master wants our hot set for the next process
+static void handle_hot_set(int sig) {
+    (void) sig;
+    hot_set_requested = 1;
+}
+
+// print the per-stage counters from the accept loop
+static void handle_perf_dump(int sig) {
+    (void) sig;
+    perf_dump_requested = 1;
+}
+
+// A parked response is out (or failed): the connection goes back to the
+// workers for its next request, or is closed
+static void resume_connection(http_task_t* task, int how) {
+    if (how == SEND_FINISHED && !atomic_load(&draining)) {
+        task->resumed = true;
+        task->enqueued_ms = monotonic_ms();
+        if (add_to_buffer(task)) {
+            STATS_DEC(connections_in_flight);  // add_to_buffer() counted it again
+            return;
+        }
+        STATS_INC(shed_queue_full);
+    }
+    if (how != SEND_FAILED && tls_enabled()) {
+        tls_close_notify(task->client_fd);
+    }
+    zerocopy_close(task->client_fd);
+    HTTPD_PROBE2(close, task->client_fd, 0);
+    STATS_DEC(connections_in_flight);
+}
+
+// start the worker threads of this process
+static void start_workers(void) {
+    int nodes = 1;
+    for (int i = 0; i < num_workers; i++) {
+        if (worker_info[i].node + 1 > nodes) {
+            nodes = worker_info[i].node + 1;
+        }
+    }
+    arena_init(server_config.huge_pages);
+    file_cache_init(server_config.file_cache_size, nodes, server_config.repr_digest);
+    // kTLS encrypts from the pages it is given, so it cannot lend them
+    zerocopy_init(tls_enabled() ? 0 : server_config.zerocopy_threshold);
+    // the queue must exist before a worker can wait on it
+    init_shared_buffer();
+    sigemptyset(&serve_signals);
+    sigaddset(&serve_signals, SIGINT);
+    sigaddset(&serve_signals, SIGTERM);
+    sigaddset(&serve_signals, SIGHUP);
+    sigaddset(&serve_signals, SIGUSR2);
+    sigaddset(&serve_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &serve_signals, &serve_mask);
+    static pthread_t workers[MAX_WORKERS];
+    init_thread(workers, num_workers);
+    if (send_offload_start(server_config.send_buffer_cap, server_config.min_send_rate,
+                           resume_connection) < 0) {
+        fprintf(stderr, "Failed to start the send offload thread, writing in place\n");
+    }
+
+    // a restart: load what the previous process had cached before taking connections
+    size_t len;
+    char* hot_set = restart_hot_set(&len);
+    if (hot_set != NULL) {
+        uint64_t start = monotonic_ms();
+        int warmed = file_cache_warm(hot_set, len);
+        printf("Warmed the file cache with %d files in %llu ms\n", warmed,
+               (unsigned long long) (monotonic_ms() - start));
+        free(hot_set);
+    }
+}
+
+// accept loop of one process, until a signal asks it to stop or restart
+static int serve(int server_fd, char* docroot) {
+    // with several processes on one listener, EPOLLEXCLUSIVE wakes one of
+    // them per new connection instead of all of them
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+        perror("epoll");
+        return PREFORK_STOP;
+    }
+    restart_ready();
+    while (!stop_requested && !restart_requested) {
+        // At this point we're already creating the socket, binding the socket, and listening for 
+        // connections; wait until some are ready, then take all of them
+        int ready = epoll_pwait(epoll_fd, &event, 1, -1, &serve_mask);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_pwait");
+            break;
+        }
+        if (hot_set_requested) {
+            hot_set_requested = 0;
+            restart_save_hot_set();
+        }
+        if (perf_dump_requested) {
+            perf_dump_requested = 0;
+            perf_counters_dump();
+        }
+        if (ready > 0) {
+            accept_connections(server_fd, docroot);
+        }
+    }
+    close(epoll_fd);
+    if (restart_requested && !stop_requested) {
+        restart_requested = 0;
+        return PREFORK_RESTART;
+    }
+    return PREFORK_STOP;
+}
+
+// After the listener is closed: wait for in-flight connections, closing
+// keep-alive connections as soon as they are between requests
+static void drain_connections(void) {
+    atomic_store(&draining, true);
+    uint64_t deadline = monotonic_ms() + (uint64_t) server_config.drain_timeout_secs * 1000;
+    while (STATS_GET(connections_in_flight) > 0 && monotonic_ms() < deadline) {
+        for (int i = 0; i < num_workers; i++) {
+            // a client that is still sending requests gets Connection: close on the next
+            // response; hanging up under it could lose a request already on the wire
+            int fd = atomic_load(&idle_fds[i]);
+            if (fd >= 0 && monotonic_ms() - atomic_load(&idle_since_ms[i]) >= DRAIN_IDLE_GRACE_MS &&
+                atomic_compare_exchange_strong(&idle_fds[i], &fd, IDLE_CLAIMED)) {
+                // wakes the worker's read with EOF; it cannot close fd before we store -1
+                shutdown(fd, SHUT_RD);
+                atomic_store(&idle_fds[i], -1);
+            }
+        }
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+    long left = STATS_GET(connections_in_flight);
+    if (left > 0) {
+        fprintf(stderr, "drain timeout: closing with %ld connections in flight\n", left);
+    }
+}
+
+// handlers of a process that serves connections
+static void install_serve_handlers(bool prefork_worker) {
+    struct sigaction action = {.sa_handler = handle_sigint};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // a prefork worker is restarted by its master, which may ask it for its hot set
+    action.sa_handler = prefork_worker ? SIG_IGN : handle_restart;
+    sigaction(SIGHUP, &action, NULL);
+    action.sa_handler = prefork_worker ? handle_hot_set : handle_restart;
+    sigaction(SIGUSR2, &action, NULL);
+    // in prefork mode the master sums every worker's counters
+    action.sa_handler = prefork_worker ? SIG_IGN : handle_perf_dump;
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+// body of a forked worker process, slot 1..server_config.processes
+static void worker_process(int slot) {
+    install_serve_handlers(true);
+    affinity_keep_share(slot - 1, server_config.processes);
+    start_workers();
+    serve(listen_fd, server_config.docroot);
+    close(listen_fd);
+    drain_connections();
+    capture_flush();
+    exit(0);
+}
+
 int main(int argc, char *argv[]) {
-    signal(SIGINT, handle_sigint);
     signal(SIGPIPE, SIG_IGN);
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <docroot>\n", argv[0]);
+    if (parse_config(argc, argv, &server_config) < 0) {
+        return 1;
+    }
+    if (server_config.capture_path != NULL && capture_open(server_config.capture_path) < 0) {
+        perror(server_config.capture_path);
         return 1;
     }
+    perf_counters_init(server_config.perf_counters);
+    dir_index_init(server_config.autoindex);
+    install_serve_handlers(false);
+    restart_init(argv, server_config.processes > 0 ? server_config.processes : 1);
     
-    int port = atoi(argv[1]);
-    char* port_str = argv[1];
-    char *docroot = argv[2];
+    int port = atoi(server_config.port);
+    char* port_str = server_config.port;
+    char *docroot = server_config.docroot;
     
-    // Initialize server
-    int server_fd = init_server(port_str);
-    pthread_t workers[5];
-    init_thread(workers, 5);
-    init_shared_buffer();
+    // Initialize server, or carry on with the listener of the process we replace
+    int server_fd = restart_listener();
+    if (server_fd < 0) {
+        server_fd = init_server(port_str);
+    }
+    if (affinity_plan(server_config.cpu_affinity, server_config.exclude_irq_cpus) < 0) {
+        fprintf(stderr, "Invalid --cpu-affinity: %s\n", server_config.cpu_affinity);
+        return 1;
+    }
+    init_overload_response(server_config.retry_after_secs);
+    if (server_config.tls_cert != NULL &&
+        tls_init(server_config.tls_cert, server_config.tls_key) < 0) {
+        fprintf(stderr, "Failed to set up TLS\n");
+        return 1;
+    }
     if (server_fd < 0) {
         fprintf(stderr, "Failed to initialize server\n");
         return 1;
     }
     
     printf("Server listening on port %d...\n", port);
-    
-    // Main server loop
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        
-        // Accept client connection
-        // At this point we're already creating the socket, binding the socket, and listening for 
-        // connections
-        int client_fd = accept(server_fd, (struct sockaddr*) &client_addr, &client_len);
 
-        // should def break here and create a worker thread
-        http_task_t* new_request = malloc(sizeof(http_task_t));
-        new_request->client_fd = client_fd;
-        new_request->client_addr = client_addr;
-        new_request->docroot = docroot;
-        add_to_buffer(new_request);
+    if (server_config.processes > 0) {
+        // the master only supervises; threads are started after the fork, in each worker
+        listen_fd = server_fd;
+        if (prefork_start(server_config.processes, worker_process) < 0) {
+            return 1;
+        }
+        // the workers hold the ready pipe now, each reports itself
+        restart_detach();
+        while (prefork_supervise() == PREFORK_RESTART) {
+            pid_t hot_set_owner = server_config.warm_handover ? prefork_pid(1) : -1;
+            if (restart_exec(server_fd, hot_set_owner > 0 ? hot_set_owner : -1) == 0) {
+                break;
+            }
+        }
+        close(server_fd);
+        prefork_stop();
+        return 0;
+    }
 
-        // TODO: Free any allocated memory
+    start_workers();
+    while (serve(server_fd, docroot) == PREFORK_RESTART) {
+        if (restart_exec(server_fd, server_config.warm_handover ? 0 : -1) == 0) {
+            break;
+        }
     }
+    // the kernel keeps queued connections for the new process, if there is one
+    close(server_fd);
+    drain_connections();
+    capture_flush();
     
     cleanup_server();
-    close(server_fd);
     return 0;
 }
 #endif
 
-bool read_request(rio_t* rp, char* dest, int client_fd) {
+// Returns 1 with the header block in dest, 0 on EOF/timeout, -1 when the
+// block is larger than the configured limit (the rest is left unread)
+int read_request(rio_t* rp, char* dest, int client_fd) {
     ssize_t curr_size;
     size_t total = 0;
     char line[MAXLINE];
+    size_t limit = MAX_REQUEST_SIZE;
+    if (server_config.max_header_size > 0 && server_config.max_header_size < MAX_REQUEST_SIZE) {
+        limit = server_config.max_header_size;
+    }
 
     while ((curr_size = rio_readlineb(rp, line, MAXLINE)) > 0) {
-        if (curr_size + total >= MAX_REQUEST_SIZE) {
-            fprintf(stderr, "File too large!");
-            return false;
+        if (curr_size + total >= limit) {
+            return -1;
         }
 
         memcpy(dest + total, line, curr_size);
@@ -431,60 +1195,81 @@ bool read_request(rio_t* rp, char* dest, int client_fd) {
         }
     }
 
-    if (curr_size == 0) {
-        return false;
-    }
-
-    // If we're here, it means that we're already at the body
-    char* content_length_str = strstr(dest, "Content-Length: ");
-    int content_length = 0;
-    if (content_length_str) {
-        content_length = atoi(content_length_str + strlen("Content-Length: "));
-    }
-
-    // get the body
-    if (rio_readnb(rp, dest, content_length) != content_length) {
-        return false;
+    if (curr_size <= 0) {
+        return 0;
     }
 
-    total += content_length;
-    return true;
+    // the body stays in rp, it is streamed by request_body_t
+    dest[total] = '\0';
+    return 1;
 }
 
 /*
 HTTP Thread Section
 */
 
-void add_to_buffer(http_task_t* new_task) {
+int add_tasks_to_buffer(const http_task_t* tasks, int count) {
     pthread_mutex_lock(&shared_buffer.lock);
 
-    while (shared_buffer.count == MAX_TASK) {
-        pthread_cond_wait(&shared_buffer.not_full, &shared_buffer.lock);
+    // never block the accept thread, the caller sheds what doesn't fit
+    int queued = 0;
+    while (queued < count && shared_buffer.count < MAX_TASK) {
+        shared_buffer.tasks[shared_buffer.rear] = tasks[queued++];
+        shared_buffer.rear = (shared_buffer.rear + 1) % MAX_TASK;
+        shared_buffer.count++;
+        HTTPD_PROBE2(enqueue, tasks[queued - 1].client_fd, shared_buffer.count);
     }
+    STATS_ADD(connections_in_flight, queued);
 
-    shared_buffer.tasks[shared_buffer.rear] = new_task;
-    shared_buffer.rear = (shared_buffer.rear + 1) % MAX_TASK;
-    shared_buffer.count++;
-
-    pthread_cond_signal(&shared_buffer.not_empty);
+    if (queued == 1) {
+        pthread_cond_signal(&shared_buffer.not_empty);
+    } else if (queued > 1) {
+        pthread_cond_broadcast(&shared_buffer.not_empty);
+    }
     pthread_mutex_unlock(&shared_buffer.lock);
-} 
+    return queued;
+}
+
+bool add_to_buffer(const http_task_t* new_task) {
+    return add_tasks_to_buffer(new_task, 1) == 1;
+}
 
-http_task_t* get_task_from_buffer(void) {
+// cpu is the caller's pinned CPU (-1 if unpinned). A pinned worker prefers a
+// connection whose packets the kernel already processed on its CPU, so the
+// socket's cache lines are still warm there.
+void get_task_from_buffer(int cpu, http_task_t* task) {
     pthread_mutex_lock(&shared_buffer.lock);
-    while (shared_buffer.count == 0) {
+    while (shared_buffer.count == 0 && keep_running) {
         pthread_cond_wait(&shared_buffer.not_empty, &shared_buffer.lock);
     }
+    if (shared_buffer.count == 0) {
+        // cleanup_server(): nothing left to serve
+        task->client_fd = -1;
+        pthread_mutex_unlock(&shared_buffer.lock);
+        return;
+    }
+
+    if (cpu >= 0 && shared_buffer.tasks[shared_buffer.front].incoming_cpu != cpu) {
+        int depth = shared_buffer.count < AFFINITY_SCAN_DEPTH ? shared_buffer.count
+                                                              : AFFINITY_SCAN_DEPTH;
+        for (int i = 1; i < depth; i++) {
+            int slot = (shared_buffer.front + i) % MAX_TASK;
+            if (shared_buffer.tasks[slot].incoming_cpu == cpu) {
+                // the skipped head takes the local task's place
+                http_task_t local = shared_buffer.tasks[slot];
+                shared_buffer.tasks[slot] = shared_buffer.tasks[shared_buffer.front];
+                shared_buffer.tasks[shared_buffer.front] = local;
+                break;
+            }
+        }
+    }
 
-    http_task_t* returned_task = shared_buffer.tasks[shared_buffer.front];
+    *task = shared_buffer.tasks[shared_buffer.front];
     shared_buffer.front = (shared_buffer.front + 1) % MAX_TASK;
     shared_buffer.count--;
+    HTTPD_PROBE3(dequeue, task->client_fd, shared_buffer.count, cpu);
 
-
-    pthread_cond_signal(&shared_buffer.not_full);
     pthread_mutex_unlock(&shared_buffer.lock);
-
-    return returned_task;
 }
 
 void init_shared_buffer() {
@@ -492,74 +1277,268 @@ void init_shared_buffer() {
   shared_buffer.front = 0;
   shared_buffer.rear = 0;
   pthread_cond_init(&shared_buffer.not_empty, NULL);
-  pthread_cond_init(&shared_buffer.not_full, NULL);
   pthread_mutex_init(&shared_buffer.lock, NULL);
 }
 
+// the idle state of a worker's connection, see idle_fds
+static void leave_idle(int worker, int client_fd) {
+    int expected = client_fd;
+    if (!atomic_compare_exchange_strong(&idle_fds[worker], &expected, -1)) {
+        // drain_connections() is calling shutdown() on client_fd, keep it open until it is done
+        while (atomic_load(&idle_fds[worker]) != -1) {
+            sched_yield();
+        }
+    }
+}
+
+static bool enter_idle(int worker, int client_fd) {
+    atomic_store(&idle_since_ms[worker], monotonic_ms());
+    atomic_store(&idle_fds[worker], client_fd);
+    // checked after the store: either we see draining or the drainer sees us
+    if (atomic_load(&draining)) {
+        leave_idle(worker, client_fd);
+        return false;
+    }
+    return true;
+}
+
+// generate_response() as a counted stage
+static int generate_stage(const http_request_t* request, http_response_t* response,
+                          const char* docroot) {
+    perf_sample_t sample;
+    perf_stage_begin(&sample);
+    int rc = generate_response(request, response, docroot);
+    perf_stage_end(PERF_STAGE_GENERATE, &sample);
+    return rc;
+}
+
 void *consumer_thread(void *arg) {
     pthread_detach(pthread_self());
+    worker_info_t* worker = arg;
+    affinity_enter_worker(worker);
+
     int client_fd;
-    rio_t rio;
+    // the read buffer lives in the slab arena, on huge pages next to the
+    // other workers' and the cached content; the stack only if that fails
+    rio_t stack_rio;
+    rio_t* rio = arena_alloc(sizeof(rio_t));
+    if (rio == NULL) {
+        rio = &stack_rio;
+    }
     char* docroot;
+    char client_ip[INET_ADDRSTRLEN];
+    proxy_route_t* route;
 
     while (true && keep_running == 1) {
-        http_task_t* task = get_task_from_buffer();
-        docroot = task->docroot;
-        client_fd = task->client_fd;
+        http_task_t task;
+        get_task_from_buffer(worker->cpu, &task);
+        if (task.client_fd < 0) {
+            break;
+        }
+        docroot = task.docroot;
+        client_fd = task.client_fd;
+        inet_ntop(AF_INET, &task.client_addr.sin_addr, client_ip, sizeof(client_ip));
         
         printf("Accepted client\n");
-        if (client_fd < 0) {
-            perror("accept failed");
+
+        if (!task.resumed && server_config.max_queue_wait_ms > 0 &&
+            monotonic_ms() - task.enqueued_ms > (uint64_t) server_config.max_queue_wait_ms) {
+            // the client has likely given up already, don't spend a worker on it
+            STATS_INC(shed_queue_wait);
+            STATS_DEC(connections_in_flight);
+            shed_connection(client_fd);
+            continue;
+        }
+
+        // SO_RCVTIMEO comes from the listener
+        if (!task.resumed) {
+            affinity_note_connection(worker, task.incoming_cpu);
+        }
+
+        // after the handshake the kernel does the crypto, everything below is unchanged
+        if (!task.resumed && tls_enabled() && tls_accept(client_fd) < 0) {
+            close(client_fd);
+            STATS_DEC(connections_in_flight);
             continue;
         }
-        
-        struct timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
         bool connection_alive = true;
-        rio_readinitb(&rio, client_fd);
+        bool parked = false;
+        int requests = 0;
+        rio_readinitb(rio, client_fd);
 
         while (connection_alive) {
             char raw_request[MAX_REQUEST_SIZE];
-            bool read_header_status = read_request(&rio, raw_request, client_fd);
-            if (!read_header_status) {
-                // this is when the request size is too large
+            // between requests a draining process may hang up on us
+            bool between_requests = requests > 0 || task.resumed;
+            if (between_requests && !enter_idle(worker->id, client_fd)) {
+                break;
+            }
+            perf_sample_t sample;
+            perf_stage_begin(&sample);
+            int read_header_status = read_request(rio, raw_request, client_fd);
+            perf_stage_end(PERF_STAGE_READ, &sample);
+            if (between_requests) {
+                leave_idle(worker->id, client_fd);
+            }
+            if (read_header_status == 0) {
+                break;
+            }
+            if (read_header_status < 0) {
+                http_response_t too_large = {.status_code = 431, .connection_close = true,
+                                             .status_text = "Request Header Fields Too Large"};
+                send_error_response(client_fd, &too_large);
+                break;
+            }
+
+            // prior knowledge h2c: the preface's first line reads like a request
+            if (requests == 0 && !task.resumed && server_config.h2c && !tls_enabled() &&
+                http2_is_preface(raw_request)) {
+                requests += http2_serve(client_fd, rio, docroot, &task, NULL);
                 break;
             }
 
             // Parse request
             http_request_t request;
             reset_request(&request);
-            if (parse_request(raw_request, &request) < 0) {
-                // TODO: Send 400 Bad Request
-                continue;
+            HTTPD_PROBE1(parse_start, client_fd);
+            perf_stage_begin(&sample);
+            int parse_rc = parse_request(raw_request, &request);
+            perf_stage_end(PERF_STAGE_PARSE, &sample);
+            HTTPD_PROBE4(parse_end, client_fd, parse_rc, request.method, request.uri);
+            if (parse_rc < 0) {
+                // we can't trust where this request ends, so answer and hang up
+                http_response_t bad = {.status_code = 400, .status_text = "Bad Request",
+                                       .connection_close = true};
+                if (parse_rc == PARSE_HEADERS_TOO_LARGE) {
+                    bad.status_code = 431;
+                    strcpy(bad.status_text, "Request Header Fields Too Large");
+                }
+                send_error_response(client_fd, &bad);
+                break;
             }
             printf("URI: %s\n", request.uri);
+            if (capture_enabled()) {
+                if (task.capture_id == 0) {
+                    task.capture_id = capture_connection_id();
+                }
+                capture_request(task.capture_id, raw_request, &request);
+            }
 
+            // tell the client this is the last one, so it reconnects to the new process
+            if (atomic_load(&draining)) {
+                request.connection_close = true;
+            }
             if (request.connection_close) {
                 connection_alive = false;
             }
+
+            // the rest of the connection is HTTP/2, this request becomes its stream 1
+            if (server_config.h2c && !tls_enabled() && connection_alive &&
+                http2_upgrade_requested(&request)) {
+                requests += http2_serve(client_fd, rio, docroot, &task, &request);
+                break;
+            }
+
+            if (rate_limit_enabled() && !rate_limit_request(task.client_addr.sin_addr)) {
+                // the 429 says Connection: close, unread body and all
+                STATS_INC(rate_limited_requests);
+                send_rate_limited(client_fd);
+                break;
+            }
             
             // Generate response
             http_response_t response;
             memset(&response, 0, sizeof(http_response_t));
-            if (generate_response(&request, &response, docroot) < 0) {
+            response.connection_close = request.connection_close;
+            response.keep_alive_header = request.version_minor == 0 && !request.connection_close;
+
+            request_body_t body;
+            if (body_init(&body, rio, &request, server_config.max_body_size) < 0) {
+                // refuse before reading any of it; the unread body means we must hang up
+                response.status_code = 413;
+                strcpy(response.status_text, "Payload Too Large");
+                response.connection_close = true;
                 send_error_response(client_fd, &response);
-                continue;
+                break;
             }
-            
-            // Send response
-            if (send_response(client_fd, &response) < 0) {
+
+            // nothing more to read for this request: a slow client need not hold the worker
+            if (request.content_length == 0 && !request.chunked && rio->rio_cnt == 0) {
+                response.park_task = &task;
+            }
+
+            int sent = 0;
+            int listed;
+            if (server_config.status_path != NULL &&
+                strcmp(request.uri, server_config.status_path) == 0) {
+                if (generate_status_response(&response) < 0) {
+                    send_error_response(client_fd, &response);
+                } else {
+                    response.connection_close = request.connection_close;
+                    sent = send_response(client_fd, &response);
+                }
+            } else if ((route = proxy_match(request.uri)) != NULL) {
+                // the proxy streams its own reply, including errors
+                if (proxy_request(route, client_fd, raw_request, &request, &body, client_ip) < 0) {
+                    break;
+                }
+            } else if (strcmp(request.method, "PUT") == 0) {
+                store_upload(&request, &body, &response, vhost_docroot(request.host, docroot));
+                send_error_response(client_fd, &response);
+                if (response.connection_close) {
+                    break;
+                }
+            } else if (dir_index_enabled() &&
+                       (listed = dir_index_serve(client_fd, &request,
+                                                 vhost_docroot(request.host, docroot))) !=
+                           DIR_INDEX_PASS) {
+                // a listing is written as it is streamed
+                if (listed < 0) {
+                    break;
+                }
+            } else if (generate_stage(&request, &response, vhost_docroot(request.host, docroot)) < 0) {
+                send_error_response(client_fd, &response);
+            } else {
+                // Send response
+                perf_stage_begin(&sample);
+                sent = send_response(client_fd, &response);
+                perf_stage_end(PERF_STAGE_SEND, &sample);
+            }
+            if (sent < 0) {
+                break;
+            }
+            if (sent == SEND_PARKED) {
+                // the offload thread owns the connection until the response is out
+                parked = true;
+                STATS_INC(requests_served);
+                requests++;
                 break;
             }
+
+            // whatever the handler left unread has to go before the next request
+            if (body_discard(&body) < 0) {
+                break;
+            }
+            STATS_INC(requests_served);
+            requests++;
         }
         
-        close(client_fd);
-        free(task);
+        if (parked) {
+            continue;
+        }
+        if (tls_enabled()) {
+            tls_close_notify(client_fd);
+        }
+        zerocopy_close(client_fd);
+        HTTPD_PROBE2(close, client_fd, requests);
+        STATS_DEC(connections_in_flight);
     }
 
+    if (rio != &stack_rio) {
+        arena_free(rio, sizeof(rio_t));
+    }
+    perf_counters_thread_exit();
     return NULL;
 }
 
@@ -568,14 +1547,20 @@ void reset_request(http_request_t *request) {
     memset(request->uri, 0, sizeof(request->uri));
     memset(request->version, 0, sizeof(request->version));
     memset(request->host, 0, sizeof(request->host));
+    request->version_minor = 1;
     request->connection_close = false;  
-    memset(request->body, 0, sizeof(request->body));
+    request->content_length = 0;
+    request->chunked = false;
+    request->expect_continue = false;
+    request->body = NULL;
+    request->num_headers = 0;
+    memset(request->known, 0xff, sizeof(request->known));  // all -1
 }
 
 
 void init_thread(pthread_t* workers, int length) {
     for (int i = 0; i < length; i++) {
-        pthread_create(&workers[i], NULL, consumer_thread, NULL);
+        pthread_create(&workers[i], NULL, consumer_thread, &worker_info[i]);
     }
 }
 
@@ -585,13 +1570,14 @@ void cleanup_server() {
     // wake up thread;
     pthread_mutex_lock(&shared_buffer.lock);
     pthread_cond_broadcast(&shared_buffer.not_empty);
-    pthread_cond_broadcast(&shared_buffer.not_full);
     pthread_mutex_unlock(&shared_buffer.lock);
 
     sleep(1);
 
     pthread_mutex_destroy(&shared_buffer.lock);
     pthread_cond_destroy(&shared_buffer.not_empty);
-    pthread_cond_destroy(&shared_buffer.not_full);
+    tls_cleanup();
+    file_cache_cleanup();
+    dir_index_cleanup();
     return;
 }
\ No newline at end of file
@@ -11,14 +11,31 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "http_headers.h"
+#include "file_cache.h"
 
 /* Constants */
-#define MAX_REQUEST_SIZE 8192
+#define MAX_REQUEST_SIZE 32768  // hard cap on a request header block
+#define MAX_HEADERS 128         // hard cap on header lines per request
 #define MAX_URI_LENGTH 2048
 #define TIMEOUT_SECS 5
 #define MAX_TASK 100
+#define ACCEPT_BATCH 64         // connections taken off the listener per wakeup
+#define ACCEPT_BACKOFF_US 10000 // pause after EMFILE and friends
+#define DRAIN_POLL_MS 20        // how often a draining process checks for finished connections
+#define DRAIN_IDLE_GRACE_MS 1000 // a draining process hangs up on keep-alive connections idle this long
+#define AFFINITY_SCAN_DEPTH 8  // queued tasks a pinned worker looks at for a local one
+#define SENDFILE_THRESHOLD (64 * 1024)  // larger files are sent with sendfile()
 #define SERVER_NAME "TritonHTTP/1.0"
 
+/* parse_request() results */
+#define PARSE_BAD_REQUEST -1         // answer 400
+#define PARSE_HEADERS_TOO_LARGE -2   // answer 431
+
+/* send_response() results besides 0 and -1 */
+#define SEND_PARKED 1                // the offload thread finishes the response
+
 
 /* HTTP Request Structure */
 typedef struct {
@@ -26,9 +43,18 @@ typedef struct {
     char uri[MAX_URI_LENGTH];     // /path/to/file
     char version[16];     // HTTP/1.1
     char host[256];       // Required header
-    bool connection_close; // Connection: close header present?
-    char body[4096]; //max 4 KB
-    // TODO: Add more headers as needed
+    int version_minor;     // 0 for HTTP/1.0, 1 for HTTP/1.1
+    bool connection_close; // close after this request (Connection header and version)
+    size_t content_length; // Content-Length of the body
+    bool chunked;          // Transfer-Encoding: chunked
+    bool expect_continue;  // Expect: 100-continue
+    const char* body;      // body bytes that came with raw_request, if any; the
+                           // server streams bodies through request_body_t instead
+
+    // every header line as a view into raw_request, which must outlive them
+    header_view_t headers[MAX_HEADERS];
+    int num_headers;
+    int16_t known[HDR_COUNT];  // index into headers of each known header, -1 = absent
 } http_request_t;
 
 /* HTTP Response Structure */
@@ -38,8 +64,15 @@ typedef struct {
     char content_type[128];   // text/html, image/jpeg, etc.
     size_t content_length;    // Length of the body
     bool connection_close;     // Whether to close connection
+    bool keep_alive_header;    // say "Connection: keep-alive" (HTTP/1.0 clients)
     char time_str[100];          // Last Modified
     char* content;
+    bool use_sendfile;        // body is file_fd instead of content
+    int file_fd;
+    cache_entry_t* cache_entry; // ETag source and owner of content, released once sent
+    // connection to hand to the send offload thread if the client is too slow
+    // to take the whole response at once, NULL = always finish in place
+    const struct http_task* park_task;
     // TODO: Add more headers as needed
 } http_response_t;
 
@@ -48,13 +81,17 @@ typedef struct http_task {
     int client_fd;
     struct sockaddr_in client_addr;
     char* docroot;
+    uint64_t enqueued_ms;     // monotonic time the accept loop queued it
+    int incoming_cpu;         // CPU that processed its packets (SO_INCOMING_CPU), -1 = unknown
+    bool resumed;             // back from the send offload thread: TLS is set up, wait for a request
+    uint64_t capture_id;      // connection number in the capture file, 0 = none yet
 } http_task_t;
 
 typedef struct shared_buffer {
     pthread_mutex_t lock;
-    pthread_cond_t not_full, not_empty;
+    pthread_cond_t not_empty;
     int count;
-    http_task_t* tasks[MAX_TASK];
+    http_task_t tasks[MAX_TASK];    // stored by value, nothing is allocated per connection
     int front;
     int rear;
 } sbuf_cond_t;
@@ -68,12 +105,37 @@ typedef struct shared_buffer {
 int init_server(char* port);
 
 /**
- * Parse raw HTTP request into http_request_t structure
- * Returns: 0 on success, -1 on error
- * TODO: Implement this function
+ * Parse raw HTTP request into http_request_t structure. Header values are
+ * views into raw_request. Header count is limited by server_config.max_headers.
+ * Returns: 0 on success, PARSE_BAD_REQUEST or PARSE_HEADERS_TOO_LARGE
  */
 int parse_request(const char *raw_request, http_request_t *request);
 
+/**
+ * Header id of request, if it was sent
+ * Returns: the first such header line, or NULL
+ */
+const header_view_t* get_header(const http_request_t* request, header_id_t id);
+
+/**
+ * Header of request by name (any case), for headers without an ID
+ * Returns: the first such header line, or NULL
+ */
+const header_view_t* find_header(const http_request_t* request, const char* name);
+
+/**
+ * The path part of a request URI with %XX escapes decoded into path (len
+ * bytes); the query, if any, is left out
+ * Returns: 0, or -1 on a bad escape, an escaped NUL or a path that does not fit
+ */
+int decode_uri_path(const char* uri, char* path, size_t len);
+
+/**
+ * Whether real_path is docroot itself or below it; a sibling that merely
+ * shares the prefix (/srv/site2 next to /srv/site) is not
+ */
+bool inside_docroot(const char* real_path, const char* docroot);
+
 /**
  * Generate HTTP response based on request
  * Returns: 0 on success, -1 on error
@@ -83,10 +145,82 @@ int generate_response(const http_request_t *request, http_response_t *response,
                      const char *docroot);
 
 /**
- * Send HTTP response to client
- * Returns: 0 on success, -1 on error
+ * Fill response with the stats page
+ * Returns: 0 on success, -1 (status 500) if out of memory
+ */
+int generate_status_response(http_response_t* response);
+
+/**
+ * Put request back into its empty state, before parse_request()
+ */
+void reset_request(http_request_t* request);
+
+/**
+ * Free what holds a generated response's body: its buffer, its cache
+ * entry reference or its file descriptor
+ */
+void release_response_body(const http_response_t* response);
+
+/**
+ * Whether the process is draining: connections should finish what they
+ * are doing and close
+ */
+bool server_draining(void);
+
+/**
+ * Send HTTP response to client. With response->park_task set, whatever the
+ * socket does not take right away is left to the send offload thread.
+ * Returns: 0 on success, SEND_PARKED if the connection now belongs to the
+ * offload thread, -1 on error
  * TODO: Implement this function
  */
 int send_response(int client_fd, const http_response_t *response);
 
+/**
+ * Send a header-only response with the status of response
+ * Returns: 0 on success, -1 on error
+ */
+int send_error_response(int client_fd, const http_response_t* response);
+
+/**
+ * Queue an accepted connection for the workers without blocking
+ * Returns: true if queued, false if shared_buffer is full
+ */
+bool add_to_buffer(const http_task_t* new_task);
+
+/**
+ * Queue a batch of accepted connections under one lock, counting them as in flight
+ * Returns: how many were queued; the tail that didn't fit is left to the caller
+ */
+int add_tasks_to_buffer(const http_task_t* tasks, int count);
+
+/**
+ * Accept every connection pending on the non-blocking listener (up to
+ * ACCEPT_BATCH) with accept4() and queue them, shedding what doesn't fit
+ * Returns: number of connections queued or shed in this call
+ */
+int accept_connections(int server_fd, char* docroot);
+
+/**
+ * Pre-render the 503 written to connections shed by admission control and
+ * the 429 written to rate limited clients
+ */
+void init_overload_response(int retry_after_secs);
+
+/**
+ * Write the pre-rendered 503 (best effort, never blocks) and close client_fd
+ */
+void shed_connection(int client_fd);
+
+/**
+ * Write the pre-rendered 429 with Retry-After (best effort, never blocks).
+ * The caller closes client_fd.
+ */
+void send_rate_limited(int client_fd);
+
+/**
+ * Milliseconds from CLOCK_MONOTONIC
+ */
+uint64_t monotonic_ms(void);
+
 #endif /* HTTP_SERVER_H */
\ No newline at end of file
@@ -1,8 +1,40 @@
+#define _GNU_SOURCE
 #include "network_utils.h"
 
-void gai_error(int code, char *msg) { /* getaddrinfo-style error */
-  fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
-  exit(0);
+/*
+ * connect_timeout - connect() that gives up after timeout_ms milliseconds
+ *     (timeout_ms <= 0 blocks like plain connect). Leaves the socket in
+ *     blocking mode. Returns 0 on success, -1 with errno set on failure.
+ */
+static int connect_timeout(int fd, const struct sockaddr *addr, socklen_t len,
+                           int timeout_ms) {
+  if (timeout_ms <= 0)
+    return connect(fd, addr, len);
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  int rc = connect(fd, addr, len);
+  if (rc < 0 && errno == EINPROGRESS) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if ((rc = poll(&pfd, 1, timeout_ms)) == 0) {
+      errno = ETIMEDOUT;
+      rc = -1;
+    } else if (rc > 0) {
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+      if (err != 0) {
+        errno = err;
+        rc = -1;
+      } else
+        rc = 0;
+    }
+  }
+
+  fcntl(fd, F_SETFL, flags);
+  return rc;
 }
 
 /*
@@ -13,6 +45,15 @@ void gai_error(int code, char *msg) { /* getaddrinfo-style error */
  *     On error, returns -1 and sets errno.
  */
 int open_clientfd(char *hostname, char *port) {
+  return open_clientfd_timeout(hostname, port, 0);
+}
+
+/*
+ * open_clientfd_timeout - open_clientfd() with a per-address connect
+ *     timeout. Lookup failures are reported as -1 like connect failures,
+ *     a server can't exit because DNS had a bad day.
+ */
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms) {
   int clientfd, rc;
   struct addrinfo hints, *listp, *p;
 
@@ -21,17 +62,21 @@ int open_clientfd(char *hostname, char *port) {
   hints.ai_socktype = SOCK_STREAM; /* Open a connection */
   hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
   hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
-  if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0)
-    gai_error(rc, "getaddrinfo error");
+  if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rc));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
 
   /* Walk the list for one that we can successfully connect to */
   for (p = listp; p; p = p->ai_next) {
     /* Create a socket descriptor */
-    if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+    if ((clientfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                           p->ai_protocol)) < 0)
       continue; /* Socket failed, try the next */
 
     /* Connect to the server */
-    if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+    if (connect_timeout(clientfd, p->ai_addr, p->ai_addrlen, timeout_ms) != -1)
       break;         /* Success */
     close(clientfd); /* Connect failed, try another */
   }
@@ -58,8 +103,10 @@ int open_listenfd(char *port) {
   hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
   hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
   hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
-  if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0)
-    gai_error(rc, "getaddrinfo error");
+  if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rc));
+    return -1;
+  }
 
   /* Walk the list for one that we can bind to */
   for (p = listp; p; p = p->ai_next) {
@@ -219,3 +266,127 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
   *bufp = 0;
   return n - 1;
 }
+
+/*
+ * rio_sendfilen - Robustly send n bytes of in_fd from its start with
+ *    sendfile(). Returns 0 on success, -1 on error or a short file.
+ */
+int rio_sendfilen(int out_fd, int in_fd, size_t n) {
+  off_t offset = 0;
+
+  while (n > 0) {
+    ssize_t sent = sendfile(out_fd, in_fd, &offset, n);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return -1;
+    n -= (size_t)sent;
+  }
+  return 0;
+}
+
+/* One pipe per thread for splice(), created on first use */
+static __thread int relay_pipe[2] = {-1, -1};
+
+/*
+ * copy_fd - read/write fallback for descriptors splice() can't handle
+ */
+static int copy_fd(int in_fd, int out_fd, size_t n, int until_eof) {
+  char buf[MAXBUF];
+
+  while (until_eof || n > 0) {
+    size_t want = (!until_eof && n < sizeof(buf)) ? n : sizeof(buf);
+    ssize_t got = read(in_fd, buf, want);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return (got == 0 && until_eof) ? 0 : -1;
+    if (rio_writen(out_fd, buf, (size_t)got) != got)
+      return -1;
+    if (!until_eof)
+      n -= (size_t)got;
+  }
+  return 0;
+}
+
+/*
+ * splice_fd - Move n bytes (or everything until EOF) from in_fd to out_fd
+ *    through the per-thread pipe without copying them into user space.
+ *    Returns 0 on success, -1 on error or early EOF.
+ */
+int splice_fd(int in_fd, int out_fd, size_t n, int until_eof) {
+  if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0)
+    return copy_fd(in_fd, out_fd, n, until_eof);
+
+  while (until_eof || n > 0) {
+    size_t want = (!until_eof && n < 65536) ? n : 65536;
+    ssize_t in = splice(in_fd, NULL, relay_pipe[1], NULL, want,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in < 0 && errno == EINTR)
+      continue;
+    if (in < 0 && errno == EINVAL) /* Not spliceable, copy instead */
+      return copy_fd(in_fd, out_fd, n, until_eof);
+    if (in <= 0)
+      return (in == 0 && until_eof) ? 0 : -1;
+
+    /* Drain the pipe completely so it is empty for the next call */
+    ssize_t left = in;
+    while (left > 0) {
+      ssize_t out = splice(relay_pipe[0], NULL, out_fd, NULL, (size_t)left,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out < 0 && errno == EINTR)
+        continue;
+      if (out <= 0) {
+        /* The pipe may hold stale bytes now, start over with a new one */
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+        relay_pipe[0] = relay_pipe[1] = -1;
+        return -1;
+      }
+      left -= out;
+    }
+    if (!until_eof)
+      n -= (size_t)in;
+  }
+  return 0;
+}
+
+/*
+ * rio_relay_buffered - Write up to n bytes still sitting in the rio
+ *    buffer to out_fd. Returns the number of bytes written, -1 on error.
+ */
+static ssize_t rio_relay_buffered(rio_t *rp, int out_fd, size_t n) {
+  size_t cnt = rp->rio_cnt > 0 ? (size_t)rp->rio_cnt : 0;
+
+  if (cnt > n)
+    cnt = n;
+  if (cnt == 0)
+    return 0;
+  if (rio_writen(out_fd, rp->rio_bufptr, cnt) != (ssize_t)cnt)
+    return -1;
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return (ssize_t)cnt;
+}
+
+/*
+ * rio_relayn - Move exactly n bytes from a buffered reader to out_fd:
+ *    whatever is already buffered first, the rest with splice().
+ */
+int rio_relayn(rio_t *rp, int out_fd, size_t n) {
+  ssize_t buffered = rio_relay_buffered(rp, out_fd, n);
+
+  if (buffered < 0)
+    return -1;
+  n -= (size_t)buffered;
+  return n > 0 ? splice_fd(rp->rio_fd, out_fd, n, 0) : 0;
+}
+
+/*
+ * rio_relay_eof - Move everything up to EOF from a buffered reader to out_fd
+ */
+int rio_relay_eof(rio_t *rp, int out_fd) {
+  if (rio_relay_buffered(rp, out_fd, (size_t)-1) < 0)
+    return -1;
+  return splice_fd(rp->rio_fd, out_fd, 0, 1);
+}
@@ -1,12 +1,18 @@
+/* network_utils.h */
+#ifndef NETWORK_UTILS_H
+#define NETWORK_UTILS_H
+
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -22,8 +28,8 @@ extern char **environ; /* Defined by libc */
 typedef struct sockaddr SA;
 
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
 int open_listenfd(char *port);
-void gai_error(int code, char *msg);
 
 #define RIO_BUFSIZE 8192
 typedef struct {
@@ -38,3 +44,9 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 ssize_t rio_writen(int fd, char *usrbuf, size_t n);
 
+int rio_sendfilen(int out_fd, int in_fd, size_t n);
+int splice_fd(int in_fd, int out_fd, size_t n, int until_eof);
+int rio_relayn(rio_t *rp, int out_fd, size_t n);
+int rio_relay_eof(rio_t *rp, int out_fd);
+
+#endif /* NETWORK_UTILS_H */
@@ -0,0 +1,254 @@
+/* perf_counters.c */
+#include "perf_counters.h"
+#include "server_stats.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+} events[PERF_EVENTS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses"},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+    [PERF_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+                               "context_switches"},
+};
+
+static const char* const stage_names[PERF_STAGES] = {"read", "parse", "generate", "send"};
+
+static bool perf_enabled;
+
+/* One group per thread: the first event that opens leads, one read()
+ * returns them all. Events the CPU or the kernel lacks are left out. */
+typedef struct perf_thread {
+    bool tried;
+    bool user_only;             // perf_event_paranoid kept the kernel's share out
+    int leader;                 // -1: nothing could be opened
+    int fds[PERF_EVENTS];
+    int position[PERF_EVENTS];  // index in the group read, -1 when not open
+    int open;
+} perf_thread_t;
+
+static __thread perf_thread_t thread = {.leader = -1};
+
+void perf_counters_init(bool enabled) {
+    perf_enabled = enabled;
+}
+
+bool perf_counters_enabled(void) {
+    return perf_enabled;
+}
+
+static void close_group(void) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (thread.position[i] >= 0) {
+            close(thread.fds[i]);
+            thread.position[i] = -1;
+        }
+    }
+    thread.leader = -1;
+    thread.open = 0;
+}
+
+// Returns: -1 with errno EACCES if kernel counting was refused
+static int open_group(bool user_only) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        thread.position[i] = -1;
+    }
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr = {
+            .type = events[i].type,
+            .size = sizeof(attr),
+            .config = events[i].config,
+            .exclude_kernel = user_only,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, thread.leader,
+                               PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && errno == EACCES && !user_only) {
+            close_group();
+            errno = EACCES;
+            return -1;
+        }
+        if (fd < 0) {
+            continue;  // no such event here, or no room for it in the group
+        }
+        if (thread.leader < 0) {
+            thread.leader = fd;
+        }
+        thread.fds[i] = fd;
+        thread.position[i] = thread.open++;
+    }
+    thread.user_only = user_only;
+    return 0;
+}
+
+static void open_thread(void) {
+    thread.tried = true;
+    if (open_group(false) < 0) {
+        open_group(true);
+    }
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (thread.position[i] >= 0) {
+            STATS_INC(perf_threads[i]);
+        }
+    }
+    if (thread.user_only && thread.open > 0) {
+        STATS_INC(perf_threads_user_only);
+    }
+}
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void take(perf_sample_t* sample) {
+    sample->counted = false;
+    if (!thread.tried) {
+        open_thread();
+    }
+    if (thread.leader >= 0) {
+        uint64_t data[3 + PERF_EVENTS];
+        ssize_t n = read(thread.leader, data, sizeof(data));
+        if (n >= (ssize_t) (3 * sizeof(uint64_t)) && data[0] == (uint64_t) thread.open) {
+            sample->enabled_ns = data[1];
+            sample->running_ns = data[2];
+            for (int i = 0; i < PERF_EVENTS; i++) {
+                sample->values[i] = thread.position[i] >= 0 ? data[3 + thread.position[i]] : 0;
+            }
+            sample->counted = true;
+        }
+    }
+    sample->wall_ns = wall_ns();
+}
+
+void perf_stage_begin(perf_sample_t* start) {
+    if (!perf_enabled) {
+        return;
+    }
+    take(start);
+}
+
+void perf_stage_end(perf_stage_t stage, const perf_sample_t* start) {
+    if (!perf_enabled) {
+        return;
+    }
+    perf_sample_t end;
+    take(&end);
+    STATS_INC(perf_stages[stage][PERF_SAMPLES]);
+    STATS_ADD(perf_stages[stage][PERF_NANOSECONDS], end.wall_ns - start->wall_ns);
+    if (!start->counted || !end.counted) {
+        return;
+    }
+    uint64_t enabled = end.enabled_ns - start->enabled_ns;
+    uint64_t running = end.running_ns - start->running_ns;
+    if (running == 0) {
+        return;  // multiplexed out the whole time, nothing to scale from
+    }
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        uint64_t delta = end.values[i] - start->values[i];
+        if (running < enabled) {
+            delta = (uint64_t) ((double) delta * enabled / running);
+        }
+        STATS_ADD(perf_stages[stage][i], delta);
+    }
+}
+
+void perf_counters_thread_exit(void) {
+    if (!thread.tried) {
+        return;
+    }
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (thread.position[i] >= 0) {
+            STATS_DEC(perf_threads[i]);
+        }
+    }
+    if (thread.user_only && thread.open > 0) {
+        STATS_DEC(perf_threads_user_only);
+    }
+    close_group();
+    thread.tried = false;
+}
+
+// num / den * scale with two decimals, or n/a when den is zero
+static const char* ratio(char* out, size_t len, double num, double den, double scale) {
+    if (den == 0) {
+        return "n/a";
+    }
+    snprintf(out, len, "%.2f", num / den * scale);
+    return out;
+}
+
+#define WORD(stage, word) \
+    ((double) atomic_load_explicit(&total.perf_stages[stage][word], memory_order_relaxed))
+
+size_t perf_counters_render(char* buf, size_t len) {
+    if (!perf_enabled || len == 0) {
+        return 0;
+    }
+    server_stats_t total;
+    stats_sum(&total);
+
+    size_t used = 0;
+    int n = 0;
+    for (int i = 0; i < PERF_EVENTS && n >= 0 && used + n < len; i++) {
+        used += n;
+        n = snprintf(buf + used, len - used, "perf_threads_%s: %ld\n", events[i].name,
+                     atomic_load_explicit(&total.perf_threads[i], memory_order_relaxed));
+    }
+    if (n >= 0 && used + n < len) {
+        used += n;
+        n = snprintf(buf + used, len - used, "perf_threads_user_only: %ld\n",
+                     atomic_load_explicit(&total.perf_threads_user_only, memory_order_relaxed));
+    }
+    for (int s = 0; s < PERF_STAGES && n >= 0 && used + n < len; s++) {
+        used += n;
+        char usecs[32], cycles[32], ipc[32], llc[32], branch[32];
+        double samples = WORD(s, PERF_SAMPLES);
+        const char* name = stage_names[s];
+        n = snprintf(buf + used, len - used,
+            "perf_%s_samples: %.0f\n"
+            "perf_%s_usecs_avg: %s\n"
+            "perf_%s_cycles_avg: %s\n"
+            "perf_%s_ipc: %s\n"
+            "perf_%s_llc_misses_per_kinstr: %s\n"
+            "perf_%s_branch_misses_per_kinstr: %s\n"
+            "perf_%s_context_switches: %.0f\n",
+            name, samples,
+            name, ratio(usecs, sizeof(usecs), WORD(s, PERF_NANOSECONDS), samples, 1e-3),
+            name, ratio(cycles, sizeof(cycles), WORD(s, PERF_CYCLES),
+                        WORD(s, PERF_CYCLES) > 0 ? samples : 0, 1),
+            name, ratio(ipc, sizeof(ipc), WORD(s, PERF_INSTRUCTIONS), WORD(s, PERF_CYCLES), 1),
+            name, ratio(llc, sizeof(llc), WORD(s, PERF_LLC_MISSES),
+                        WORD(s, PERF_INSTRUCTIONS), 1000),
+            name, ratio(branch, sizeof(branch), WORD(s, PERF_BRANCH_MISSES),
+                        WORD(s, PERF_INSTRUCTIONS), 1000),
+            name, WORD(s, PERF_CONTEXT_SWITCHES));
+    }
+    if (n >= 0 && used + n < len) {
+        used += n;
+    }
+    return used;
+}
+
+void perf_counters_dump(void) {
+    char buf[PERF_RENDER_MAX];
+    size_t len = perf_counters_render(buf, sizeof(buf));
+    if (len == 0) {
+        fprintf(stderr, "perf counters are off, start the server with -E\n");
+        return;
+    }
+    fwrite(buf, 1, len, stderr);
+}
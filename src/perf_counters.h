@@ -0,0 +1,84 @@
+/* perf_counters.h */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Request stages measured, in the order a request goes through them */
+typedef enum perf_stage {
+    PERF_STAGE_READ,            // read_request(): includes waiting for the client
+    PERF_STAGE_PARSE,           // parse_request()
+    PERF_STAGE_GENERATE,        // generate_response()
+    PERF_STAGE_SEND,            // send_response()
+    PERF_STAGES
+} perf_stage_t;
+
+/* Counters in each thread's group. Per stage, server_stats_t keeps one
+ * word per event and then PERF_SAMPLES and PERF_NANOSECONDS. */
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,            // the kernel's generic cache-misses event, last level on most CPUs
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_EVENTS,
+    PERF_SAMPLES = PERF_EVENTS, // times the stage ran
+    PERF_NANOSECONDS,           // wall time spent in it
+    PERF_STAGE_WORDS
+};
+
+#define PERF_RENDER_MAX 2048    // bytes perf_counters_render() needs at most
+
+/* Counter values at the start of a stage */
+typedef struct perf_sample {
+    uint64_t values[PERF_EVENTS];
+    uint64_t enabled_ns;        // how long the group has existed
+    uint64_t running_ns;        // how much of that it was on the PMU (less when multiplexed)
+    uint64_t wall_ns;
+    bool counted;               // the thread has a group and it was read
+} perf_sample_t;
+
+/**
+ * Turn stage sampling on or off for the process. When on, each thread
+ * opens its counter group the first time it samples. Call before the
+ * workers start.
+ */
+void perf_counters_init(bool enabled);
+
+/**
+ * Whether stages are being sampled
+ */
+bool perf_counters_enabled(void);
+
+/**
+ * Read the calling thread's counters into start. A branch and nothing
+ * more when sampling is off.
+ */
+void perf_stage_begin(perf_sample_t* start);
+
+/**
+ * Add what the counters advanced since start to stage's totals, scaled
+ * up if the group was multiplexed off the PMU for part of the time
+ */
+void perf_stage_end(perf_stage_t stage, const perf_sample_t* start);
+
+/**
+ * Close the calling thread's counters. Call before a sampling thread exits.
+ */
+void perf_counters_thread_exit(void);
+
+/**
+ * Render per-stage IPC, miss rates and averages, summed over all
+ * processes, as "name: value" lines into buf
+ * Returns: number of bytes written (excluding the NUL), 0 when sampling is off
+ */
+size_t perf_counters_render(char* buf, size_t len);
+
+/**
+ * Write the rendered counters to stderr, for SIGUSR1
+ */
+void perf_counters_dump(void);
+
+#endif /* PERF_COUNTERS_H */
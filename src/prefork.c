@@ -0,0 +1,193 @@
+/* prefork.c */
+#include "prefork.h"
+#include "http_server.h"
+#include "perf_counters.h"
+#include "server_stats.h"
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+/* The process table lives in shared memory too, so any worker can put it
+ * on the status page */
+typedef struct process_slot {
+    atomic_int pid;               // 0 while the slot has no running process
+    atomic_ulong restarts;
+} process_slot_t;
+
+static process_slot_t* slots;
+static int slot_count;
+static uint64_t started_ms[MAX_PROCESSES + 1];
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t restarting = 0;
+static volatile sig_atomic_t dumping = 0;
+static void (*worker_entry)(int slot);
+
+static void handle_stop(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+static void handle_restart(int sig) {
+    (void) sig;
+    restarting = 1;
+}
+
+static void handle_dump(int sig) {
+    (void) sig;
+    dumping = 1;
+}
+
+static pid_t spawn(int slot) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // worker_main installs its own handlers
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGUSR2, SIG_DFL);
+        signal(SIGUSR1, SIG_IGN);
+        // never outlive the master, even if it is killed without a chance to stop us
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master) {
+            _exit(0);
+        }
+        stats_use_slot(slot);
+        worker_entry(slot);
+        _exit(1);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    atomic_store(&slots[slot].pid, pid);
+    started_ms[slot] = monotonic_ms();
+    return pid;
+}
+
+// fork into slot until it works or we are told to stop
+static void respawn(int slot) {
+    while (!stopping && spawn(slot) < 0) {
+        usleep(RESPAWN_BACKOFF_MS * 1000);
+    }
+}
+
+int prefork_start(int processes, void (*worker_main)(int slot)) {
+    if (processes > MAX_PROCESSES) {
+        processes = MAX_PROCESSES;
+    }
+    if (stats_share(processes + 1) < 0) {
+        return -1;
+    }
+    slots = mmap(NULL, sizeof(process_slot_t) * (processes + 1), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        slots = NULL;
+        return -1;
+    }
+    slot_count = processes + 1;
+    worker_entry = worker_main;
+
+    // no SA_RESTART, a signal has to interrupt waitpid()
+    struct sigaction action = {.sa_handler = handle_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = handle_restart;
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    // the counters are in shared memory, the master can add them up itself
+    action.sa_handler = handle_dump;
+    sigaction(SIGUSR1, &action, NULL);
+
+    for (int slot = 1; slot < slot_count; slot++) {
+        respawn(slot);
+    }
+    return 0;
+}
+
+int prefork_supervise(void) {
+    while (!stopping && !restarting) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (dumping) {
+            dumping = 0;
+            perf_counters_dump();
+        }
+        if (pid < 0) {
+            continue;  // EINTR from a signal
+        }
+
+        int slot = 1;
+        while (slot < slot_count && atomic_load(&slots[slot].pid) != pid) {
+            slot++;
+        }
+        if (slot == slot_count) {
+            continue;  // a replacement master that failed to start
+        }
+        atomic_store(&slots[slot].pid, 0);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", slot, pid, WTERMSIG(status));
+        } else {
+            fprintf(stderr, "worker %d (pid %d) exited with status %d\n", slot, pid,
+                    WEXITSTATUS(status));
+        }
+
+        // a worker that crashes right away would otherwise be forked in a tight loop
+        if (monotonic_ms() - started_ms[slot] < RESPAWN_BACKOFF_MS) {
+            usleep(RESPAWN_BACKOFF_MS * 1000);
+        }
+        if (stopping) {
+            break;
+        }
+        atomic_fetch_add(&slots[slot].restarts, 1);
+        STATS_INC(worker_restarts);
+        respawn(slot);
+    }
+    if (stopping) {
+        return PREFORK_STOP;
+    }
+    restarting = 0;
+    return PREFORK_RESTART;
+}
+
+void prefork_stop(void) {
+    for (int slot = 1; slot < slot_count; slot++) {
+        pid_t pid = atomic_load(&slots[slot].pid);
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+        }
+    }
+    // only our workers: a replacement master is our child too and outlives us
+    for (int slot = 1; slot < slot_count; slot++) {
+        pid_t pid = atomic_load(&slots[slot].pid);
+        while (pid > 0 && waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        atomic_store(&slots[slot].pid, 0);
+    }
+}
+
+pid_t prefork_pid(int slot) {
+    return slot > 0 && slot < slot_count ? atomic_load(&slots[slot].pid) : 0;
+}
+
+size_t prefork_render(char* buf, size_t len) {
+    size_t used = 0;
+    for (int slot = 1; slot < slot_count && used + 1 < len; slot++) {
+        int n = snprintf(buf + used, len - used,
+            "process%d_pid: %d\n"
+            "process%d_restarts: %lu\n",
+            slot, atomic_load(&slots[slot].pid),
+            slot, atomic_load(&slots[slot].restarts));
+        if (n < 0) {
+            break;
+        }
+        used += (size_t) n < len - used ? (size_t) n : len - used - 1;
+    }
+    if (len > 0) {
+        buf[used] = '\0';
+    }
+    return used;
+}
@@ -0,0 +1,49 @@
+/* prefork.h */
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Constants */
+#define MAX_PROCESSES 64
+#define RESPAWN_BACKOFF_MS 1000   // a worker that dies sooner than this is restarted this much later
+
+/* Why prefork_supervise() returned */
+#define PREFORK_STOP 0       // SIGINT or SIGTERM
+#define PREFORK_RESTART 1    // SIGHUP or SIGUSR2
+
+/**
+ * Become the master of processes worker processes. Each is forked with its
+ * own counters slot (1..processes, slot 0 is the master) and runs
+ * worker_main(slot), which must not return. SIGINT and SIGTERM to the
+ * master stop it, SIGHUP and SIGUSR2 ask for a restart.
+ * Returns: 0 once the workers are forked, -1 if the shared memory could
+ * not be set up
+ */
+int prefork_start(int processes, void (*worker_main)(int slot));
+
+/**
+ * Fork workers that die into the same slot again, until a signal arrives
+ * Returns: PREFORK_STOP or PREFORK_RESTART; the workers are still running
+ */
+int prefork_supervise(void);
+
+/**
+ * SIGTERM every worker and wait until each has drained and exited
+ */
+void prefork_stop(void);
+
+/**
+ * Returns: pid of the worker in slot, 0 if it has none right now
+ */
+pid_t prefork_pid(int slot);
+
+/**
+ * Render the process table (pid, restarts) as "name: value" lines into buf,
+ * nothing outside prefork mode
+ * Returns: number of bytes written (excluding the NUL)
+ */
+size_t prefork_render(char* buf, size_t len);
+
+#endif /* PREFORK_H */
@@ -0,0 +1,47 @@
+/* probes.h */
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT (user-level statically defined tracing) probes, provider "httpd".
+ *
+ * With <sys/sdt.h> available (systemtap-sdt-dev) each probe compiles to a
+ * single nop plus an ELF note; bpftrace/perf patch it only while attached.
+ * Without the header, or with -DNO_USDT, the probes compile to nothing.
+ *
+ *   accept        (fd, client_ip, client_port)     connection accepted
+ *   enqueue       (fd, queue_depth)                task queued for the workers
+ *   dequeue       (fd, queue_depth, worker_cpu)    task taken by a worker
+ *   parse_start   (fd)                             request header block read
+ *   parse_end     (fd, rc, method, uri)            rc < 0 on a malformed request
+ *   cache_hit     (path)                           file served from the file cache
+ *   cache_miss    (path)                           file read and hashed into the cache
+ *   file_open     (path, size)                     file opened for a response
+ *   send_start    (fd, status, content_length)
+ *   send_end      (fd, status, bytes, rc)          rc 1: the rest was parked
+ *   send_parked   (fd, buffered, file_bytes)       unsent rest handed to the offload thread
+ *   send_resumed  (fd, how)                        offload done: 0 keep-alive, 1 close, 2 failed
+ *   close         (fd, requests)                   connection closed after requests
+ *
+ * Strings are passed as pointers, read them with str(argN) in bpftrace.
+ */
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define HTTPD_PROBE1(name, a) DTRACE_PROBE1(httpd, name, a)
+#define HTTPD_PROBE2(name, a, b) DTRACE_PROBE2(httpd, name, a, b)
+#define HTTPD_PROBE3(name, a, b, c) DTRACE_PROBE3(httpd, name, a, b, c)
+#define HTTPD_PROBE4(name, a, b, c, d) DTRACE_PROBE4(httpd, name, a, b, c, d)
+#else
+#define HTTPD_PROBE1(name, a) ((void) (a))
+#define HTTPD_PROBE2(name, a, b) ((void) (a), (void) (b))
+#define HTTPD_PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#define HTTPD_PROBE4(name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,738 @@
+/* proxy.c */
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "network_utils.h"
+#include "server_stats.h"
+#include "buffer_pool.h"
+#include "response_stream.h"
+#include <netinet/tcp.h>
+#include <strings.h>
+
+static upstream_t upstreams[MAX_UPSTREAMS];
+static int num_upstreams = 0;
+static proxy_route_t routes[MAX_PROXY_ROUTES];
+static int num_routes = 0;
+
+// request/response headers that only make sense for a single hop
+static const char* hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+    "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+    NULL
+};
+
+static bool is_hop_by_hop(const char* name, size_t len) {
+    for (int i = 0; hop_by_hop[i] != NULL; i++) {
+        if (strlen(hop_by_hop[i]) == len && strncasecmp(name, hop_by_hop[i], len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Configuration
+*/
+
+static int parse_option(upstream_t* u, char* opt) {
+    char* eq = strchr(opt, '=');
+    if (eq == NULL) {
+        return -1;
+    }
+    *eq = '\0';
+    int value = atoi(eq + 1);
+    if (value <= 0) {
+        return -1;
+    }
+
+    if (strcmp(opt, "timeout") == 0) {
+        u->timeout_ms = value;
+    } else if (strcmp(opt, "max_idle") == 0) {
+        u->max_idle = value > PROXY_MAX_IDLE ? PROXY_MAX_IDLE : value;
+    } else if (strcmp(opt, "max_fails") == 0) {
+        u->max_fails = value;
+    } else if (strcmp(opt, "eject") == 0) {
+        u->eject_ms = value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int proxy_add_route(const char* spec) {
+    char buf[512];
+    if (strlen(spec) >= sizeof(buf) || num_upstreams == MAX_UPSTREAMS) {
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    char* eq = strchr(buf, '=');
+    if (eq == NULL || buf[0] != '/' || (size_t) (eq - buf) >= MAX_PROXY_PREFIX) {
+        return -1;
+    }
+    *eq = '\0';
+    char* prefix = buf;
+    char* target = eq + 1;
+
+    upstream_t* u = &upstreams[num_upstreams];
+    memset(u, 0, sizeof(*u));
+    u->timeout_ms = PROXY_DEFAULT_TIMEOUT_MS;
+    u->max_idle = PROXY_DEFAULT_MAX_IDLE;
+    u->max_fails = PROXY_DEFAULT_MAX_FAILS;
+    u->eject_ms = PROXY_DEFAULT_EJECT_MS;
+
+    char* opts = strchr(target, ',');
+    if (opts != NULL) {
+        *opts++ = '\0';
+    }
+    char* colon = strrchr(target, ':');
+    if (colon == NULL || colon == target || strlen(colon + 1) == 0 ||
+        strlen(colon + 1) >= sizeof(u->port) || (size_t) (colon - target) >= sizeof(u->host)) {
+        return -1;
+    }
+    *colon = '\0';
+    strcpy(u->host, target);
+    strcpy(u->port, colon + 1);
+
+    char* saveptr;
+    for (char* opt = opts ? strtok_r(opts, ",", &saveptr) : NULL; opt != NULL;
+         opt = strtok_r(NULL, ",", &saveptr)) {
+        if (parse_option(u, opt) < 0) {
+            return -1;
+        }
+    }
+
+    // find or create the route for this prefix
+    proxy_route_t* route = NULL;
+    for (int i = 0; i < num_routes; i++) {
+        if (strcmp(routes[i].prefix, prefix) == 0) {
+            route = &routes[i];
+        }
+    }
+    if (route == NULL) {
+        if (num_routes == MAX_PROXY_ROUTES) {
+            return -1;
+        }
+        route = &routes[num_routes++];
+        memset(route, 0, sizeof(*route));
+        strcpy(route->prefix, prefix);
+        route->prefix_len = strlen(prefix);
+    }
+    if (route->num_upstreams == MAX_UPSTREAMS) {
+        return -1;
+    }
+
+    pthread_mutex_init(&u->lock, NULL);
+    route->upstreams[route->num_upstreams++] = num_upstreams++;
+    return 0;
+}
+
+proxy_route_t* proxy_match(const char* uri) {
+    proxy_route_t* best = NULL;
+    for (int i = 0; i < num_routes; i++) {
+        proxy_route_t* route = &routes[i];
+        if (strncmp(uri, route->prefix, route->prefix_len) != 0) {
+            continue;
+        }
+        // "/api" matches "/api" and "/api/x" but not "/apix"
+        char next = uri[route->prefix_len];
+        if (route->prefix[route->prefix_len - 1] != '/' && next != '\0' && next != '/' && next != '?') {
+            continue;
+        }
+        if (best == NULL || route->prefix_len > best->prefix_len) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+void proxy_cleanup(void) {
+    for (int i = 0; i < num_upstreams; i++) {
+        upstream_t* u = &upstreams[i];
+        pthread_mutex_lock(&u->lock);
+        while (u->idle_count > 0) {
+            close(u->idle_fds[--u->idle_count]);
+        }
+        pthread_mutex_unlock(&u->lock);
+        pthread_mutex_destroy(&u->lock);
+    }
+    num_upstreams = 0;
+    num_routes = 0;
+}
+
+/*
+Upstream health and connection pool
+*/
+
+// round robin over the upstreams that are not ejected
+static upstream_t* pick_upstream(proxy_route_t* route) {
+    uint64_t now = monotonic_ms();
+    unsigned start = atomic_fetch_add_explicit(&route->next, 1, memory_order_relaxed);
+
+    for (int i = 0; i < route->num_upstreams; i++) {
+        upstream_t* u = &upstreams[route->upstreams[(start + i) % route->num_upstreams]];
+        pthread_mutex_lock(&u->lock);
+        bool healthy = u->ejected_until_ms <= now;
+        pthread_mutex_unlock(&u->lock);
+        if (healthy) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+static void upstream_succeeded(upstream_t* u) {
+    pthread_mutex_lock(&u->lock);
+    u->consecutive_failures = 0;
+    pthread_mutex_unlock(&u->lock);
+}
+
+static void upstream_failed(upstream_t* u) {
+    STATS_INC(proxy_failures);
+    pthread_mutex_lock(&u->lock);
+    // once ejected, a single failed probe after the timeout ejects it again
+    if (++u->consecutive_failures >= u->max_fails) {
+        u->ejected_until_ms = monotonic_ms() + (uint64_t) u->eject_ms;
+        STATS_INC(upstream_ejections);
+        fprintf(stderr, "proxy: ejecting upstream %s:%s for %d ms\n", u->host, u->port, u->eject_ms);
+
+        // pooled connections to a sick upstream are suspect too
+        while (u->idle_count > 0) {
+            close(u->idle_fds[--u->idle_count]);
+        }
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+// a pooled connection is usable if the upstream hasn't closed it or sent junk
+static bool connection_is_idle(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+static int upstream_acquire(upstream_t* u, bool* reused) {
+    pthread_mutex_lock(&u->lock);
+    while (u->idle_count > 0) {
+        int fd = u->idle_fds[--u->idle_count];
+        pthread_mutex_unlock(&u->lock);
+        if (connection_is_idle(fd)) {
+            *reused = true;
+            return fd;
+        }
+        close(fd);
+        pthread_mutex_lock(&u->lock);
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    *reused = false;
+    int fd = open_clientfd_timeout(u->host, u->port, u->timeout_ms);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = u->timeout_ms / 1000;
+    timeout.tv_usec = (u->timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void upstream_release(upstream_t* u, int fd, bool reusable) {
+    if (reusable) {
+        pthread_mutex_lock(&u->lock);
+        if (u->idle_count < u->max_idle) {
+            u->idle_fds[u->idle_count++] = fd;
+            fd = -1;
+        }
+        pthread_mutex_unlock(&u->lock);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+Body relaying
+*/
+
+// pass a chunked body through unchanged, splicing the chunk payloads
+static int relay_chunked(rio_t* rp, int out_fd) {
+    char line[MAXLINE];
+    ssize_t len;
+
+    while (true) {
+        if ((len = rio_readlineb(rp, line, sizeof(line))) <= 0) {
+            return -1;
+        }
+        if (rio_writen(out_fd, line, (size_t) len) != len) {
+            return -1;
+        }
+
+        char* end;
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        // payload plus its trailing CRLF
+        if (rio_relayn(rp, out_fd, size + 2) < 0) {
+            return -1;
+        }
+    }
+
+    // trailers, terminated by an empty line
+    do {
+        if ((len = rio_readlineb(rp, line, sizeof(line))) <= 0) {
+            return -1;
+        }
+        if (rio_writen(out_fd, line, (size_t) len) != len) {
+            return -1;
+        }
+    } while (!(len == 2 && line[0] == '\r'));
+
+    return 0;
+}
+
+/*
+Request forwarding
+*/
+
+static void send_status(int client_fd, int status_code, const char* status_text) {
+    http_response_t response;
+    memset(&response, 0, sizeof(response));
+    response.status_code = status_code;
+    strcpy(response.status_text, status_text);
+    send_error_response(client_fd, &response);
+}
+
+// rebuild the client's header block for the upstream hop
+static int build_upstream_request(char* buf, size_t cap, const char* raw_request,
+                                  const http_request_t* request, const char* client_ip) {
+    size_t n = 0;
+    int w = snprintf(buf, cap, "%s %s HTTP/1.1\r\n", request->method, request->uri);
+    if (w < 0 || (size_t) w >= cap) {
+        return -1;
+    }
+    n = (size_t) w;
+
+    const char* forwarded_for = NULL;
+    size_t forwarded_for_len = 0;
+
+    const char* line = strstr(raw_request, "\r\n");
+    while (line != NULL) {
+        line += 2;
+        const char* eol = strstr(line, "\r\n");
+        if (eol == NULL || eol == line) {
+            break;
+        }
+
+        const char* colon = memchr(line, ':', (size_t) (eol - line));
+        if (colon != NULL) {
+            size_t name_len = (size_t) (colon - line);
+            if (name_len == 6 && strncasecmp(line, "Expect", 6) == 0) {
+                // 100-continue is answered by us, the upstream sees the body right away
+            } else if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0 &&
+                       request->chunked) {
+                // the body goes up chunked, a length next to it must not
+            } else if (name_len == 15 && strncasecmp(line, "X-Forwarded-For", 15) == 0) {
+                forwarded_for = colon + 1;
+                while (*forwarded_for == ' ') {
+                    forwarded_for++;
+                }
+                forwarded_for_len = (size_t) (eol - forwarded_for);
+            } else if (!is_hop_by_hop(line, name_len)) {
+                size_t line_len = (size_t) (eol - line) + 2;
+                if (n + line_len >= cap) {
+                    return -1;
+                }
+                memcpy(buf + n, line, line_len);
+                n += line_len;
+            }
+        }
+        line = eol;
+    }
+
+    if (forwarded_for != NULL) {
+        w = snprintf(buf + n, cap - n, "X-Forwarded-For: %.*s, %s\r\n",
+                     (int) forwarded_for_len, forwarded_for, client_ip);
+    } else {
+        w = snprintf(buf + n, cap - n, "X-Forwarded-For: %s\r\n", client_ip);
+    }
+    if (w < 0 || (size_t) w >= cap - n) {
+        return -1;
+    }
+    n += (size_t) w;
+
+    w = snprintf(buf + n, cap - n, "%sConnection: keep-alive\r\n\r\n",
+                 request->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+    if (w < 0 || (size_t) w >= cap - n) {
+        return -1;
+    }
+    return (int) (n + (size_t) w);
+}
+
+typedef struct upstream_reply {
+    int status_code;
+    bool chunked;
+    bool has_length;
+    size_t content_length;
+    bool upstream_close;      // upstream won't take another request on this connection
+    char head[MAXBUF];        // status line and end-to-end headers for the client
+    size_t head_len;
+} upstream_reply_t;
+
+static bool has_token(const char* value, const char* token) {
+    size_t len = strlen(token);
+    for (const char* p = value; (p = strcasestr(p, token)) != NULL; p += len) {
+        bool start = p == value || p[-1] == ' ' || p[-1] == ',';
+        bool end = p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\r';
+        if (start && end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Read the status line and headers from the upstream.
+ * Returns 0 on success, 1 if the connection was closed before any byte
+ * arrived (a stale pooled connection), -1 on error.
+ */
+static int read_upstream_reply(rio_t* rp, upstream_reply_t* reply) {
+    char line[MAXLINE];
+    ssize_t len = rio_readlineb(rp, line, sizeof(line));
+    if (len == 0) {
+        return 1;
+    }
+    if (len < 0) {
+        return -1;
+    }
+
+    int minor;
+    char* reason = NULL;
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &reply->status_code) != 2 ||
+        (reason = strchr(line + 9, ' ')) == NULL) {
+        return -1;
+    }
+    reply->upstream_close = minor == 0;
+    reply->head_len = (size_t) snprintf(reply->head, sizeof(reply->head), "HTTP/1.1 %d %s",
+                                        reply->status_code, reason + 1);
+
+    while (true) {
+        if ((len = rio_readlineb(rp, line, sizeof(line))) <= 0) {
+            return -1;
+        }
+        if (len == 2 && line[0] == '\r' && line[1] == '\n') {
+            break;
+        }
+
+        char* colon = strchr(line, ':');
+        if (colon == NULL) {
+            return -1;
+        }
+        size_t name_len = (size_t) (colon - line);
+        char* value = colon + 1;
+        while (*value == ' ') {
+            value++;
+        }
+
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            reply->has_length = true;
+            reply->content_length = strtoul(value, NULL, 10);
+        } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            reply->chunked = has_token(value, "chunked");
+        } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+            if (has_token(value, "close")) {
+                reply->upstream_close = true;
+            } else if (has_token(value, "keep-alive")) {
+                reply->upstream_close = false;
+            }
+        }
+
+        // chunked framing is the client hop's business: proxy_request() adds it back
+        if (is_hop_by_hop(line, name_len)) {
+            continue;
+        }
+        if (reply->head_len + (size_t) len >= sizeof(reply->head) - 64) {
+            return -1;
+        }
+        memcpy(reply->head + reply->head_len, line, (size_t) len);
+        reply->head_len += (size_t) len;
+    }
+    // framed both ways is as ambiguous coming back as it is going up
+    if (reply->chunked && reply->has_length) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read replies until the final one. Interim 1xx replies are relayed to
+ * HTTP/1.1 clients, except 100 Continue, which we answered ourselves.
+ * Returns as read_upstream_reply(); 101 is an error, we never ask to upgrade.
+ */
+static int read_final_reply(rio_t* rp, upstream_reply_t* reply, int client_fd,
+                            const http_request_t* request) {
+    for (bool interim = false;; interim = true) {
+        memset(reply, 0, sizeof(*reply));
+        int status = read_upstream_reply(rp, reply);
+        if (status != 0) {
+            // after an interim reply the connection was not stale, just broken
+            return interim ? -1 : status;
+        }
+        if (reply->status_code / 100 != 1) {
+            return 0;
+        }
+        if (reply->status_code == 101) {
+            return -1;
+        }
+        if (reply->status_code != 100 && request->version_minor >= 1) {
+            // a client that went away fails on the final reply
+            memcpy(reply->head + reply->head_len, "\r\n", 2);
+            rio_writen(client_fd, reply->head, reply->head_len + 2);
+        }
+    }
+}
+
+/*
+ * Decode a chunked body for an HTTP/1.0 client through a response_stream,
+ * which sends it raw and closes the connection after it. Trailers are
+ * dropped, there is nowhere to put them.
+ * Returns 0 when the whole body was relayed, -1 otherwise.
+ */
+static int relay_dechunked(rio_t* rp, int client_fd, const http_request_t* request,
+                           upstream_reply_t* reply) {
+    response_stream_t stream;
+    if (stream_begin(&stream, client_fd, request, reply->head, reply->head_len) < 0) {
+        return -1;
+    }
+
+    char line[MAXLINE];
+    ssize_t len;
+    while (true) {
+        char* end;
+        if (rio_readlineb(rp, line, sizeof(line)) <= 0) {
+            break;
+        }
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line) {
+            break;
+        }
+        if (size == 0) {
+            do {
+                len = rio_readlineb(rp, line, sizeof(line));
+            } while (len > 0 && !(len == 2 && line[0] == '\r'));
+            if (len > 0 && stream_end(&stream) == 0) {
+                return 0;
+            }
+            break;
+        }
+        while (size > 0) {
+            char data[MAXBUF];
+            ssize_t n = rio_readnb(rp, data, size < sizeof(data) ? size : sizeof(data));
+            if (n <= 0 || stream_write(&stream, data, (size_t) n) < 0) {
+                break;
+            }
+            size -= (size_t) n;
+        }
+        // the payload's CRLF
+        if (size > 0 || rio_readlineb(rp, line, sizeof(line)) != 2) {
+            break;
+        }
+    }
+    stream_abort(&stream);
+    return -1;
+}
+
+/*
+ * Stream a body the upstream delimits by closing through a response_stream,
+ * which chunks it for HTTP/1.1 clients.
+ * Returns 0 if the client connection can be kept, -1 otherwise.
+ */
+static int relay_rechunked(rio_t* rp, int client_fd, const http_request_t* request,
+                           upstream_reply_t* reply) {
+    response_stream_t stream;
+    if (stream_begin(&stream, client_fd, request, reply->head, reply->head_len) < 0) {
+        return -1;
+    }
+
+    // whatever rio read past the headers goes first
+    if (rp->rio_cnt > 0 && stream_write(&stream, rp->rio_bufptr, (size_t) rp->rio_cnt) < 0) {
+        stream_abort(&stream);
+        return -1;
+    }
+    rp->rio_cnt = 0;
+
+    ssize_t n;
+    while ((n = stream_read_fd(&stream, rp->rio_fd)) > 0) {
+    }
+    if (n < 0 || stream_end(&stream) < 0) {
+        stream_abort(&stream);
+        return -1;
+    }
+    return stream.connection_close ? -1 : 0;
+}
+
+// stream the client's body to the upstream, re-chunking chunked bodies
+static int forward_body(request_body_t* body, int upstream_fd) {
+    if (!body->chunked) {
+        return body_write_to_fd(body, upstream_fd);
+    }
+
+    pool_buf_t* buf = buffer_pool_get();
+    if (buf == NULL) {
+        return -1;
+    }
+
+    ssize_t got;
+    while ((got = body_read(body, buf->data, sizeof(buf->data))) > 0) {
+        char size_line[32];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t) got);
+        if (rio_writen(upstream_fd, size_line, (size_t) n) != n ||
+            rio_writen(upstream_fd, buf->data, (size_t) got) != got ||
+            rio_writen(upstream_fd, "\r\n", 2) != 2) {
+            got = -1;
+            break;
+        }
+    }
+    buffer_pool_put(buf);
+
+    if (got < 0 || rio_writen(upstream_fd, "0\r\n\r\n", 5) != 5) {
+        return -1;
+    }
+    return 0;
+}
+
+int proxy_request(proxy_route_t* route, int client_fd, const char* raw_request,
+                  const http_request_t* request, request_body_t* body, const char* client_ip) {
+    STATS_INC(proxy_requests);
+
+    upstream_t* u = pick_upstream(route);
+    if (u == NULL) {
+        send_status(client_fd, 503, "Service Unavailable");
+        return 0;
+    }
+
+    char head[MAX_REQUEST_SIZE + 512];
+    int head_len = build_upstream_request(head, sizeof(head), raw_request, request, client_ip);
+    if (head_len < 0) {
+        send_status(client_fd, 431, "Request Header Fields Too Large");
+        return -1;
+    }
+
+    rio_t rio;
+    upstream_reply_t reply;
+    int fd = -1;
+    bool reused = false;
+
+    // a pooled connection may have been closed under us; retry those once on a
+    // fresh one, unless the client's body has already been streamed into it
+    bool has_body = !body->done;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((fd = upstream_acquire(u, &reused)) < 0) {
+            upstream_failed(u);
+            send_status(client_fd, 502, "Bad Gateway");
+            return 0;
+        }
+
+        int status = -1;
+        errno = 0;
+        if (rio_writen(fd, head, (size_t) head_len) == head_len) {
+            if (forward_body(body, fd) < 0) {
+                // the client side broke (or went over the body limit), not the upstream
+                bool too_large = errno == EFBIG;
+                close(fd);
+                if (too_large) {
+                    send_status(client_fd, 413, "Payload Too Large");
+                }
+                return -1;
+            }
+            rio_readinitb(&rio, fd);
+            status = read_final_reply(&rio, &reply, client_fd, request);
+        }
+
+        if (status == 0) {
+            break;
+        }
+        bool timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+        close(fd);
+        fd = -1;
+        if (reused && !has_body && !timed_out) {
+            continue;
+        }
+
+        upstream_failed(u);
+        if (timed_out) {
+            send_status(client_fd, 504, "Gateway Timeout");
+        } else {
+            send_status(client_fd, 502, "Bad Gateway");
+        }
+        return 0;
+    }
+    if (fd < 0) {
+        upstream_failed(u);
+        send_status(client_fd, 502, "Bad Gateway");
+        return 0;
+    }
+
+    bool no_body = strcmp(request->method, "HEAD") == 0 || reply.status_code == 204 ||
+                   reply.status_code == 304;
+    bool delimited_by_close = !no_body && !reply.chunked && !reply.has_length;
+    if (delimited_by_close) {
+        // re-frame as chunked so the client connection survives the upstream closing
+        int rc = relay_rechunked(&rio, client_fd, request, &reply);
+        close(fd);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                upstream_failed(u);
+            }
+            return -1;
+        }
+        upstream_succeeded(u);
+        return rc;
+    }
+
+    // chunks pass through as-is to HTTP/1.1 clients and are decoded for HTTP/1.0 ones
+    bool pass_chunked = reply.chunked && request->version_minor >= 1;
+    bool dechunk = reply.chunked && !pass_chunked && !no_body;
+    bool client_close = request->connection_close || dechunk;
+    if (!dechunk) {
+        reply.head_len += (size_t) snprintf(reply.head + reply.head_len,
+                                            sizeof(reply.head) - reply.head_len, "%s%s\r\n",
+                                            pass_chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                                            client_close ? "Connection: close\r\n" : "");
+        if (rio_writen(client_fd, reply.head, reply.head_len) != (ssize_t) reply.head_len) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    int rc = 0;
+    if (no_body) {
+        rc = 0;
+    } else if (dechunk) {
+        rc = relay_dechunked(&rio, client_fd, request, &reply);
+    } else if (reply.chunked) {
+        rc = relay_chunked(&rio, client_fd);
+    } else {
+        rc = rio_relayn(&rio, client_fd, reply.content_length);
+    }
+
+    if (rc < 0) {
+        // we can't tell which side broke; only blame the upstream on a read timeout
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            upstream_failed(u);
+        }
+        close(fd);
+        return -1;
+    }
+
+    upstream_succeeded(u);
+    // leftover bytes mean the upstream sent more than it framed, don't reuse it
+    upstream_release(u, fd, !reply.upstream_close && rio.rio_cnt == 0);
+    return client_close ? -1 : 0;
+}
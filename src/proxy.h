@@ -0,0 +1,72 @@
+/* proxy.h */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "http_server.h"
+#include "request_body.h"
+#include <stdatomic.h>
+
+/* Constants */
+#define MAX_UPSTREAMS 16
+#define MAX_PROXY_ROUTES 16
+#define MAX_PROXY_PREFIX 256
+#define PROXY_MAX_IDLE 64
+#define PROXY_DEFAULT_TIMEOUT_MS 5000
+#define PROXY_DEFAULT_MAX_IDLE 8
+#define PROXY_DEFAULT_MAX_FAILS 3
+#define PROXY_DEFAULT_EJECT_MS 10000
+
+/* One upstream HTTP server and its pool of idle keep-alive connections */
+typedef struct upstream {
+    char host[256];
+    char port[16];
+    int timeout_ms;           // connect, read and write timeout
+    int max_idle;             // pooled connections kept open
+    int max_fails;            // consecutive failures before ejection
+    int eject_ms;             // how long an ejected upstream sits out
+
+    pthread_mutex_t lock;     // guards everything below
+    int idle_fds[PROXY_MAX_IDLE];
+    int idle_count;
+    int consecutive_failures;
+    uint64_t ejected_until_ms;
+} upstream_t;
+
+/* A path prefix served by one or more upstreams (round robin) */
+typedef struct proxy_route {
+    char prefix[MAX_PROXY_PREFIX];
+    size_t prefix_len;
+    int upstreams[MAX_UPSTREAMS]; // indices into the upstream table
+    int num_upstreams;
+    atomic_uint next;
+} proxy_route_t;
+
+/**
+ * Add a route from a command line spec:
+ *   PREFIX=HOST:PORT[,timeout=MS][,max_idle=N][,max_fails=N][,eject=MS]
+ * Repeating a prefix adds another upstream to the same route.
+ * Returns: 0 on success, -1 on a malformed spec or full table
+ */
+int proxy_add_route(const char* spec);
+
+/**
+ * Find the route with the longest prefix matching uri
+ * Returns: the route, or NULL when the uri is served from the docroot
+ */
+proxy_route_t* proxy_match(const char* uri);
+
+/**
+ * Forward request to an upstream of route and stream the reply to client_fd.
+ * raw_request holds the header block exactly as read from the client, the
+ * body is streamed from body. Error replies (502/503/504) are sent here.
+ * Returns: 0 if the client connection can be kept, -1 if it must be closed
+ */
+int proxy_request(proxy_route_t* route, int client_fd, const char* raw_request,
+                  const http_request_t* request, request_body_t* body, const char* client_ip);
+
+/**
+ * Close pooled connections and forget every route
+ */
+void proxy_cleanup(void);
+
+#endif /* PROXY_H */
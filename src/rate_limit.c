@@ -0,0 +1,205 @@
+/* rate_limit.c */
+#include "rate_limit.h"
+#include "http_server.h"
+#include "server_stats.h"
+#include <arpa/inet.h>
+
+#define STATE_TIME_SHIFT 24
+#define STATE_TOKEN_MASK ((1u << STATE_TIME_SHIFT) - 1)
+#define MAX_BURST (STATE_TOKEN_MASK >> RATE_TOKEN_SHIFT)
+#define ONE_TOKEN (1u << RATE_TOKEN_SHIFT)
+
+rate_limit_t rate_limits[RATE_KINDS];
+
+static rate_slot_t rate_table[RATE_TABLE_SIZE];
+static bool limits_enabled = false;
+
+static const char* kind_names[RATE_KINDS] = {"conn", "conn24", "req", "req24"};
+
+static inline uint32_t slot_index(uint64_t key) {
+    // Fibonacci hashing, the top bits are the best mixed
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> (64 - RATE_TABLE_BITS));
+}
+
+// a bucket idle long enough to have refilled completely holds no information
+static bool slot_expired(uint64_t key, uint64_t state, uint64_t now_ms) {
+    if (state == 0) {
+        return false;  // just claimed, not used yet
+    }
+    const rate_limit_t* limit = &rate_limits[(key >> 32) - 1];
+    uint64_t last_ms = (state >> STATE_TIME_SHIFT) - 1;
+    uint64_t refill_ms = limit->rate ? (uint64_t) limit->burst * 1000 / limit->rate : 0;
+    return now_ms > last_ms + refill_ms;
+}
+
+// Returns: the first slot in key's probe window that holds it, or NULL
+static rate_slot_t* lookup_slot(uint64_t key) {
+    uint32_t index = slot_index(key);
+    for (int probe = 0; probe < RATE_MAX_PROBE; probe++) {
+        rate_slot_t* slot = &rate_table[(index + probe) & (RATE_TABLE_SIZE - 1)];
+        if (atomic_load_explicit(&slot->key, memory_order_acquire) == key) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static rate_slot_t* find_slot(uint64_t key, uint64_t now_ms) {
+    uint32_t index = slot_index(key);
+    for (;;) {
+        // the whole window is searched for key before anything is claimed: its
+        // bucket may sit past an empty or expired slot
+        rate_slot_t* claim = NULL;
+        uint64_t owner = 0;
+        for (int probe = 0; probe < RATE_MAX_PROBE; probe++) {
+            rate_slot_t* slot = &rate_table[(index + probe) & (RATE_TABLE_SIZE - 1)];
+            uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+            if (current == key) {
+                return slot;
+            }
+            // lazy expiry: take over a stale bucket instead of ever sweeping the table
+            if (claim == NULL &&
+                (current == 0 || slot_expired(current, atomic_load(&slot->state), now_ms))) {
+                claim = slot;
+                owner = current;
+            }
+        }
+        if (claim == NULL) {
+            return NULL;
+        }
+
+        uint64_t expected = owner;
+        if (!atomic_compare_exchange_strong(&claim->key, &expected, key)) {
+            continue;  // someone else took it, look again
+        }
+        // A thread still updating the old owner's state can leave a few tokens
+        // behind for the new one, which only errs on the side of allowing.
+        if (owner != 0) {
+            atomic_store_explicit(&claim->state, 0, memory_order_release);
+        }
+        // another thread may have claimed a different slot for key meanwhile:
+        // the first one in the window is the bucket, a later duplicate is freed
+        rate_slot_t* first = lookup_slot(key);
+        if (first == claim) {
+            return claim;
+        }
+        atomic_store_explicit(&claim->state, 0, memory_order_relaxed);
+        expected = key;
+        atomic_compare_exchange_strong(&claim->key, &expected, 0);
+        if (first != NULL) {
+            return first;
+        }
+    }
+}
+
+bool rate_limit_take(rate_kind_t kind, uint32_t addr, uint64_t now_ms) {
+    const rate_limit_t* limit = &rate_limits[kind];
+    if (limit->rate == 0) {
+        return true;
+    }
+
+    uint64_t key = ((uint64_t) kind + 1) << 32 | addr;
+    rate_slot_t* slot = find_slot(key, now_ms);
+    if (slot == NULL) {
+        // a full neighbourhood fails open, limiting innocent clients would be worse
+        STATS_INC(rate_limit_table_full);
+        return true;
+    }
+
+    uint64_t capacity = (uint64_t) limit->burst << RATE_TOKEN_SHIFT;
+    uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+    for (;;) {
+        uint64_t tokens = capacity;
+        if (state != 0) {
+            uint64_t last_ms = (state >> STATE_TIME_SHIFT) - 1;
+            uint64_t elapsed = now_ms > last_ms ? now_ms - last_ms : 0;
+            tokens = (state & STATE_TOKEN_MASK) +
+                     (elapsed * limit->rate << RATE_TOKEN_SHIFT) / 1000;
+            if (tokens > capacity) {
+                tokens = capacity;
+            }
+        }
+        if (tokens < ONE_TOKEN) {
+            return false;
+        }
+        uint64_t next = (now_ms + 1) << STATE_TIME_SHIFT | (tokens - ONE_TOKEN);
+        if (atomic_compare_exchange_weak_explicit(&slot->state, &state, next,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+bool rate_limit_connection(struct in_addr addr) {
+    uint32_t ip = ntohl(addr.s_addr);
+    uint64_t now = monotonic_ms();
+    return rate_limit_take(RATE_CONN_IP, ip, now) &&
+           rate_limit_take(RATE_CONN_NET24, ip & 0xFFFFFF00u, now);
+}
+
+bool rate_limit_request(struct in_addr addr) {
+    uint32_t ip = ntohl(addr.s_addr);
+    uint64_t now = monotonic_ms();
+    return rate_limit_take(RATE_REQ_IP, ip, now) &&
+           rate_limit_take(RATE_REQ_NET24, ip & 0xFFFFFF00u, now);
+}
+
+bool rate_limit_enabled(void) {
+    return limits_enabled;
+}
+
+int rate_limit_configure(const char* spec) {
+    char copy[256];
+    if (strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    char* saveptr;
+    for (char* item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char* value = strchr(item, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+
+        int kind;
+        for (kind = 0; kind < RATE_KINDS; kind++) {
+            if (strcmp(item, kind_names[kind]) == 0) {
+                break;
+            }
+        }
+        if (kind == RATE_KINDS) {
+            return -1;
+        }
+
+        char* end;
+        unsigned long rate = strtoul(value, &end, 10);
+        unsigned long burst = rate;
+        if (*end == '/') {
+            char* burst_str = end + 1;
+            burst = strtoul(burst_str, &end, 10);
+            if (end == burst_str) {
+                return -1;
+            }
+        }
+        if (end == value || *end != '\0' || rate == 0 || burst == 0 || burst > MAX_BURST ||
+            rate > 1000000) {
+            return -1;
+        }
+        rate_limits[kind].rate = (uint32_t) rate;
+        rate_limits[kind].burst = (uint32_t) burst;
+        limits_enabled = true;
+    }
+    return 0;
+}
+
+void rate_limit_reset(void) {
+    memset(rate_limits, 0, sizeof(rate_limits));
+    for (uint32_t i = 0; i < RATE_TABLE_SIZE; i++) {
+        atomic_store(&rate_table[i].key, 0);
+        atomic_store(&rate_table[i].state, 0);
+    }
+    limits_enabled = false;
+}
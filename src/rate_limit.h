@@ -0,0 +1,77 @@
+/* rate_limit.h */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Constants */
+#define RATE_TABLE_BITS 16
+#define RATE_TABLE_SIZE (1u << RATE_TABLE_BITS)  // buckets shared by every limit
+#define RATE_MAX_PROBE 16                        // slots tried before failing open
+#define RATE_TOKEN_SHIFT 8                       // tokens are kept in 1/256 units
+
+/* Which limit a bucket belongs to */
+typedef enum {
+    RATE_CONN_IP,       // new connections per client address
+    RATE_CONN_NET24,    // new connections per /24
+    RATE_REQ_IP,        // requests per client address
+    RATE_REQ_NET24,     // requests per /24
+    RATE_KINDS
+} rate_kind_t;
+
+/* A token bucket: rate tokens per second, at most burst saved up */
+typedef struct rate_limit {
+    uint32_t rate;      // 0 = unlimited
+    uint32_t burst;
+} rate_limit_t;
+
+/* One slot of the open-addressing table. key is (kind + 1) << 32 | address,
+ * 0 when free. state packs the last refill time (ms, upper 40 bits) and the
+ * tokens left (lower 24 bits); 0 is a full bucket. */
+typedef struct rate_slot {
+    _Atomic uint64_t key;
+    _Atomic uint64_t state;
+} rate_slot_t;
+
+extern rate_limit_t rate_limits[RATE_KINDS];
+
+/**
+ * Parse a --rate-limit spec and enable those limits:
+ *   conn=RATE[/BURST],conn24=RATE[/BURST],req=RATE[/BURST],req24=RATE[/BURST]
+ * Any subset may be given; BURST defaults to RATE.
+ * Returns: 0 on success, -1 on a malformed spec
+ */
+int rate_limit_configure(const char* spec);
+
+/**
+ * Whether any limit is configured
+ */
+bool rate_limit_enabled(void);
+
+/**
+ * Take a token from the connection buckets of addr (per address and per /24)
+ * Returns: true if the connection may proceed
+ */
+bool rate_limit_connection(struct in_addr addr);
+
+/**
+ * Take a token from the request buckets of addr (per address and per /24)
+ * Returns: true if the request may proceed
+ */
+bool rate_limit_request(struct in_addr addr);
+
+/**
+ * Take a token from one bucket at time now_ms (exposed for tests/benchmarks)
+ * Returns: true if a token was available
+ */
+bool rate_limit_take(rate_kind_t kind, uint32_t addr, uint64_t now_ms);
+
+/**
+ * Forget every bucket and limit
+ */
+void rate_limit_reset(void);
+
+#endif /* RATE_LIMIT_H */
@@ -0,0 +1,186 @@
+/* request_body.c */
+#include "request_body.h"
+#include "buffer_pool.h"
+
+int body_init(request_body_t* body, rio_t* rp, const http_request_t* request, size_t limit) {
+    memset(body, 0, sizeof(*body));
+    body->rp = rp;
+    body->limit = limit;
+    body->chunked = request->chunked;
+    body->expect_continue = request->expect_continue;
+
+    if (!body->chunked) {
+        body->remaining = request->content_length;
+        body->done = body->remaining == 0;
+        if (limit > 0 && request->content_length > limit) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_continue(request_body_t* body) {
+    if (!body->expect_continue || body->continue_sent) {
+        return 0;
+    }
+    body->continue_sent = true;
+
+    char msg[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (rio_writen(body->rp->rio_fd, msg, sizeof(msg) - 1) != sizeof(msg) - 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// read the next chunk-size line, or the trailers after the last chunk
+static int next_chunk(request_body_t* body) {
+    char line[MAXLINE];
+
+    if (body->chunk_crlf_pending) {
+        if (rio_readlineb(body->rp, line, sizeof(line)) != 2 || line[0] != '\r') {
+            errno = EPROTO;
+            return -1;
+        }
+        body->chunk_crlf_pending = false;
+    }
+
+    if (rio_readlineb(body->rp, line, sizeof(line)) <= 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    // chunk extensions after ';' are ignored
+    char* end;
+    errno = 0;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (end == line || errno == ERANGE || (*end != '\r' && *end != ';' && *end != ' ')) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (size == 0) {
+        // trailers are dropped, they end with an empty line
+        ssize_t len;
+        do {
+            if ((len = rio_readlineb(body->rp, line, sizeof(line))) <= 0) {
+                errno = EPROTO;
+                return -1;
+            }
+        } while (!(len == 2 && line[0] == '\r'));
+
+        body->done = true;
+        return 0;
+    }
+
+    body->remaining = (size_t) size;
+    body->chunk_crlf_pending = true;
+    return 0;
+}
+
+ssize_t body_read(request_body_t* body, char* buf, size_t n) {
+    if (body->done) {
+        return 0;
+    }
+    if (send_continue(body) < 0) {
+        return -1;
+    }
+
+    if (body->chunked && body->remaining == 0) {
+        if (next_chunk(body) < 0) {
+            return -1;
+        }
+        if (body->done) {
+            return 0;
+        }
+    }
+
+    if (n > body->remaining) {
+        n = body->remaining;
+    }
+    if (body->limit > 0 && body->received + n > body->limit) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    ssize_t got = rio_readnb(body->rp, buf, n);
+    if (got <= 0) {
+        // the client went away halfway through the body
+        if (got == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+
+    body->remaining -= (size_t) got;
+    body->received += (size_t) got;
+    if (!body->chunked && body->remaining == 0) {
+        body->done = true;
+    }
+    return got;
+}
+
+int body_write_to_fd(request_body_t* body, int fd) {
+    if (body->done) {
+        return 0;
+    }
+    if (send_continue(body) < 0) {
+        return -1;
+    }
+
+    if (!body->chunked) {
+        if (rio_relayn(body->rp, fd, body->remaining) < 0) {
+            return -1;
+        }
+        body->received += body->remaining;
+        body->remaining = 0;
+        body->done = true;
+        return 0;
+    }
+
+    // chunked framing has to be decoded, so this goes through a pooled buffer
+    pool_buf_t* buf = buffer_pool_get();
+    if (buf == NULL) {
+        return -1;
+    }
+
+    ssize_t got;
+    while ((got = body_read(body, buf->data, sizeof(buf->data))) > 0) {
+        if (rio_writen(fd, buf->data, (size_t) got) != got) {
+            got = -1;
+            break;
+        }
+    }
+    buffer_pool_put(buf);
+    return got < 0 ? -1 : 0;
+}
+
+int body_discard(request_body_t* body) {
+    if (body->done) {
+        return 0;
+    }
+
+    // the client is still waiting for permission to send; just hang up
+    if (body->expect_continue && !body->continue_sent) {
+        return -1;
+    }
+    if (!body->chunked && body->remaining > MAX_DISCARD_SIZE) {
+        return -1;
+    }
+
+    pool_buf_t* buf = buffer_pool_get();
+    if (buf == NULL) {
+        return -1;
+    }
+
+    size_t discarded = 0;
+    ssize_t got;
+    while ((got = body_read(body, buf->data, sizeof(buf->data))) > 0) {
+        discarded += (size_t) got;
+        if (discarded > MAX_DISCARD_SIZE) {
+            got = -1;
+            break;
+        }
+    }
+    buffer_pool_put(buf);
+    return got < 0 ? -1 : 0;
+}
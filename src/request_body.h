@@ -0,0 +1,53 @@
+/* request_body.h */
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include "http_server.h"
+#include "network_utils.h"
+
+/* Constants */
+#define DEFAULT_MAX_BODY_SIZE (1 << 20)
+#define MAX_DISCARD_SIZE 65536   // larger unread bodies close the connection instead
+
+/* Streaming reader for one request body. Bodies are never buffered whole:
+ * callers pull them through a fixed-size buffer or straight into a file. */
+typedef struct request_body {
+    rio_t* rp;                // the connection's reader, positioned after the headers
+    bool chunked;             // Transfer-Encoding: chunked
+    bool expect_continue;     // client waits for "100 Continue" before sending
+    bool continue_sent;
+    bool done;                // body and any trailers fully consumed
+    bool chunk_crlf_pending;  // CRLF after the last chunk's data not read yet
+    size_t remaining;         // bytes left in the body (or the current chunk)
+    size_t received;          // decoded bytes consumed so far
+    size_t limit;             // max decoded body size, 0 = unlimited
+} request_body_t;
+
+/**
+ * Prepare to read the body of request from rp
+ * Returns: 0 on success, -1 if the declared Content-Length exceeds limit
+ */
+int body_init(request_body_t* body, rio_t* rp, const http_request_t* request, size_t limit);
+
+/**
+ * Read up to n decoded body bytes into buf, sending 100 Continue first if
+ * the client asked for it
+ * Returns: bytes read, 0 at the end of the body, -1 on error
+ *          (errno is EFBIG when the body grows past the limit)
+ */
+ssize_t body_read(request_body_t* body, char* buf, size_t n);
+
+/**
+ * Write the whole remaining body to fd. Length-delimited bodies are
+ * spliced from the socket without passing through user space.
+ * Returns: 0 on success, -1 on error
+ */
+int body_write_to_fd(request_body_t* body, int fd);
+
+/**
+ * Consume whatever the handler left unread so the next request can be parsed
+ * Returns: 0 on success, -1 if the connection should be closed instead
+ */
+int body_discard(request_body_t* body);
+
+#endif /* REQUEST_BODY_H */
@@ -0,0 +1,232 @@
+/* response_stream.c */
+#include "response_stream.h"
+#include "network_utils.h"
+#include <stdarg.h>
+#include <sys/uio.h>
+
+// writev() until every iovec is out, advancing past partial writes
+static int writev_all(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= (ssize_t) iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+    return 0;
+}
+
+int stream_begin(response_stream_t* stream, int client_fd, const http_request_t* request,
+                 const char* head, size_t head_len) {
+    memset(stream, 0, sizeof(*stream));
+    stream->client_fd = client_fd;
+    stream->head_only = strcmp(request->method, "HEAD") == 0;
+    stream->chunked = strcmp(request->version, "HTTP/1.0") != 0;
+    stream->connection_close = request->connection_close || !stream->chunked;
+
+    const char* framing = stream->chunked ? "Transfer-Encoding: chunked\r\n" : "";
+    const char* connection = stream->connection_close ? "Connection: close\r\n" : "";
+    int n = snprintf(stream->head, sizeof(stream->head), "%.*s%s%s\r\n",
+                     (int) head_len, head, framing, connection);
+    if (n < 0 || (size_t) n >= sizeof(stream->head)) {
+        return -1;
+    }
+    stream->head_len = (size_t) n;
+    return 0;
+}
+
+int stream_begin_response(response_stream_t* stream, int client_fd, const http_request_t* request,
+                          int status_code, const char* status_text, const char* content_type) {
+    char head[512];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\n"
+        "Server: TinyServer\r\n"
+        "Content-type: %s\r\n",
+        status_code, status_text, content_type);
+    if (n < 0 || (size_t) n >= sizeof(head)) {
+        return -1;
+    }
+    return stream_begin(stream, client_fd, request, head, (size_t) n);
+}
+
+static void release_buffers(response_stream_t* stream) {
+    while (stream->first != NULL) {
+        pool_buf_t* next = stream->first->next;
+        buffer_pool_put(stream->first);
+        stream->first = next;
+    }
+    stream->last = NULL;
+    stream->queued = 0;
+}
+
+// write the pending head and every queued buffer (plus the last chunk if final)
+static int flush_batch(response_stream_t* stream, bool final) {
+    if (stream->failed) {
+        return -1;
+    }
+
+    struct iovec iov[1 + 3 * (STREAM_FLUSH_BUFFERS + 1) + 1];
+    char size_lines[STREAM_FLUSH_BUFFERS + 1][20];
+    int iovcnt = 0;
+    size_t body = 0;
+
+    if (stream->head_len > 0) {
+        iov[iovcnt].iov_base = stream->head;
+        iov[iovcnt++].iov_len = stream->head_len;
+    }
+
+    int i = 0;
+    for (pool_buf_t* buf = stream->first; buf != NULL && !stream->head_only; buf = buf->next, i++) {
+        if (buf->len == 0) {
+            continue;
+        }
+        if (stream->chunked) {
+            int n = snprintf(size_lines[i], sizeof(size_lines[i]), "%zx\r\n", buf->len);
+            iov[iovcnt].iov_base = size_lines[i];
+            iov[iovcnt++].iov_len = (size_t) n;
+        }
+        iov[iovcnt].iov_base = buf->data;
+        iov[iovcnt++].iov_len = buf->len;
+        if (stream->chunked) {
+            iov[iovcnt].iov_base = "\r\n";
+            iov[iovcnt++].iov_len = 2;
+        }
+        body += buf->len;
+    }
+
+    if (final && stream->chunked && !stream->head_only) {
+        iov[iovcnt].iov_base = "0\r\n\r\n";
+        iov[iovcnt++].iov_len = 5;
+    }
+
+    if (iovcnt == 0) {
+        release_buffers(stream);
+        return 0;
+    }
+
+    // the iov points into the queued buffers: they go back to the pool only once written
+    int rc = writev_all(stream->client_fd, iov, iovcnt);
+    release_buffers(stream);
+    if (rc < 0) {
+        stream->failed = true;
+        return -1;
+    }
+    stream->head_len = 0;
+    stream->body_bytes += body;
+    return 0;
+}
+
+// the buffer currently being filled, a new one if it is full
+static pool_buf_t* writable_buffer(response_stream_t* stream) {
+    if (stream->last != NULL && stream->last->len < sizeof(stream->last->data)) {
+        return stream->last;
+    }
+    if (stream->queued == STREAM_FLUSH_BUFFERS && flush_batch(stream, false) < 0) {
+        return NULL;
+    }
+
+    pool_buf_t* buf = buffer_pool_get();
+    if (buf == NULL) {
+        stream->failed = true;
+        return NULL;
+    }
+    if (stream->last != NULL) {
+        stream->last->next = buf;
+    } else {
+        stream->first = buf;
+    }
+    stream->last = buf;
+    stream->queued++;
+    return buf;
+}
+
+int stream_write(response_stream_t* stream, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        if (stream->failed) {
+            return -1;
+        }
+        pool_buf_t* buf = writable_buffer(stream);
+        if (buf == NULL) {
+            return -1;
+        }
+        size_t room = sizeof(buf->data) - buf->len;
+        size_t n = len < room ? len : room;
+        memcpy(buf->data + buf->len, p, n);
+        buf->len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int stream_printf(response_stream_t* stream, const char* fmt, ...) {
+    char line[MAXLINE];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return -1;
+    }
+
+    if ((size_t) n < sizeof(line)) {
+        return stream_write(stream, line, (size_t) n);
+    }
+
+    // too long for the line buffer, format it again on the heap
+    char* big = malloc((size_t) n + 1);
+    if (big == NULL) {
+        return -1;
+    }
+    va_start(args, fmt);
+    vsnprintf(big, (size_t) n + 1, fmt, args);
+    va_end(args);
+    int rc = stream_write(stream, big, (size_t) n);
+    free(big);
+    return rc;
+}
+
+ssize_t stream_read_fd(response_stream_t* stream, int fd) {
+    if (stream->failed) {
+        return -1;
+    }
+    pool_buf_t* buf = writable_buffer(stream);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = read(fd, buf->data + buf->len, sizeof(buf->data) - buf->len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        buf->len += (size_t) n;
+    }
+    return n;
+}
+
+int stream_flush(response_stream_t* stream) {
+    return flush_batch(stream, false);
+}
+
+int stream_end(response_stream_t* stream) {
+    return flush_batch(stream, true);
+}
+
+void stream_abort(response_stream_t* stream) {
+    release_buffers(stream);
+    stream->failed = true;
+}
@@ -0,0 +1,81 @@
+/* response_stream.h */
+#ifndef RESPONSE_STREAM_H
+#define RESPONSE_STREAM_H
+
+#include "http_server.h"
+#include "buffer_pool.h"
+
+/* Constants */
+#define STREAM_FLUSH_BUFFERS 4    // full buffers batched into one writev()
+#define STREAM_MAX_HEAD 4096
+
+/* A response whose body is produced incrementally. Data is collected in
+ * pooled buffers, each buffer goes out as one chunk of a
+ * "Transfer-Encoding: chunked" body, and full buffers are flushed in batches.
+ * HTTP/1.0 clients get the raw body delimited by closing the connection. */
+typedef struct response_stream {
+    int client_fd;
+    bool chunked;             // false: body ends when the connection closes
+    bool head_only;           // HEAD request, headers but no body
+    bool connection_close;    // caller must close the connection after stream_end
+    bool failed;              // a write failed, later calls are no-ops
+    char head[STREAM_MAX_HEAD];  // headers not written yet, sent with the first batch
+    size_t head_len;
+    pool_buf_t* first;        // queued buffers, the last one is still being filled
+    pool_buf_t* last;
+    int queued;
+    size_t body_bytes;        // body bytes handed to the kernel so far
+} response_stream_t;
+
+/**
+ * Start a streamed response. head holds the status line and headers
+ * (each ending in CRLF, without the blank line); the framing headers are
+ * added here. Nothing is written until the first flush.
+ * Returns: 0 on success, -1 if head does not fit
+ */
+int stream_begin(response_stream_t* stream, int client_fd, const http_request_t* request,
+                 const char* head, size_t head_len);
+
+/**
+ * stream_begin() with a head rendered from a status and content type
+ */
+int stream_begin_response(response_stream_t* stream, int client_fd, const http_request_t* request,
+                          int status_code, const char* status_text, const char* content_type);
+
+/**
+ * Append body bytes, flushing a batch whenever STREAM_FLUSH_BUFFERS fill up
+ * Returns: 0 on success, -1 on error
+ */
+int stream_write(response_stream_t* stream, const void* data, size_t len);
+
+/**
+ * printf() into the body
+ * Returns: 0 on success, -1 on error
+ */
+int stream_printf(response_stream_t* stream, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Read once from fd straight into the stream's buffer
+ * Returns: bytes read, 0 at EOF, -1 on error
+ */
+ssize_t stream_read_fd(response_stream_t* stream, int fd);
+
+/**
+ * Send everything queued so far, even if the buffers are not full
+ * Returns: 0 on success, -1 on error
+ */
+int stream_flush(response_stream_t* stream);
+
+/**
+ * Flush and terminate the body, then release the buffers
+ * Returns: 0 on success, -1 on error
+ */
+int stream_end(response_stream_t* stream);
+
+/**
+ * Release the buffers without sending anything more (after an error)
+ */
+void stream_abort(response_stream_t* stream);
+
+#endif /* RESPONSE_STREAM_H */
@@ -0,0 +1,277 @@
+/* restart.c */
+#define _GNU_SOURCE
+#include "restart.h"
+#include "file_cache.h"
+#include "http_server.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+/* Shared with the workers of a prefork master, which are forked after
+ * restart_init() */
+typedef struct handover_state {
+    atomic_int ready;            // processes that called restart_ready()
+    atomic_int hot_set_saved;    // a worker wrote its hot set on request
+} handover_state_t;
+
+static char** saved_argv;
+static int ready_needed = 1;
+static handover_state_t* state;
+static int inherited_listener = -1;
+static int inherited_hot_set = -1;
+static int ready_fd = -1;        // write end, ours until restart_ready()
+static int hot_set_fd = -1;      // memfd the next process reads our hot set from
+
+// take a descriptor named by an environment variable, and the variable with it
+static int take_fd(const char* name) {
+    const char* value = getenv(name);
+    if (value == NULL) {
+        return -1;
+    }
+    char* end;
+    long fd = strtol(value, &end, 10);
+    bool valid = *value != '\0' && *end == '\0' && fd > STDERR_FILENO && fd < INT32_MAX;
+    unsetenv(name);
+    if (!valid || fcntl((int) fd, F_SETFD, FD_CLOEXEC) < 0) {
+        return -1;
+    }
+    return (int) fd;
+}
+
+void restart_init(char* argv[], int ready_count) {
+    saved_argv = argv;
+    ready_needed = ready_count < 1 ? 1 : ready_count;
+
+    inherited_listener = take_fd(LISTEN_FD_ENV);
+    int accepting = 0;
+    socklen_t len = sizeof(accepting);
+    if (inherited_listener >= 0 &&
+        (getsockopt(inherited_listener, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 ||
+         !accepting)) {
+        fprintf(stderr, "%s is not a listening socket, ignored\n", LISTEN_FD_ENV);
+        close(inherited_listener);
+        inherited_listener = -1;
+    }
+    ready_fd = take_fd(READY_FD_ENV);
+    inherited_hot_set = take_fd(HOT_SET_FD_ENV);
+
+    state = mmap(NULL, sizeof(handover_state_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        state = NULL;
+    }
+    hot_set_fd = memfd_create("httpd-hot-set", MFD_CLOEXEC);
+}
+
+int restart_listener(void) {
+    return inherited_listener;
+}
+
+char* restart_hot_set(size_t* len) {
+    struct stat st;
+    if (inherited_hot_set < 0 || fstat(inherited_hot_set, &st) < 0 || st.st_size == 0) {
+        return NULL;
+    }
+    char* list = malloc(st.st_size + 1);
+    if (list == NULL) {
+        return NULL;
+    }
+    // pread(): prefork workers share the file offset
+    size_t used = 0;
+    while (used < (size_t) st.st_size) {
+        ssize_t n = pread(inherited_hot_set, list + used, st.st_size - used, used);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+    }
+    list[used] = '\0';
+    *len = used;
+    return list;
+}
+
+void restart_ready(void) {
+    if (ready_fd < 0) {
+        return;
+    }
+    if (state == NULL || atomic_fetch_add(&state->ready, 1) + 1 == ready_needed) {
+        ssize_t rc;
+        do {
+            rc = write(ready_fd, "R", 1);
+        } while (rc < 0 && errno == EINTR);
+    }
+    restart_detach();
+}
+
+void restart_detach(void) {
+    if (ready_fd >= 0) {
+        close(ready_fd);
+        ready_fd = -1;
+    }
+}
+
+void restart_save_hot_set(void) {
+    size_t len = 0;
+    char* list = file_cache_hot_set(&len);
+    if (hot_set_fd >= 0 && list != NULL && ftruncate(hot_set_fd, 0) == 0) {
+        size_t used = 0;
+        while (used < len) {
+            ssize_t n = pwrite(hot_set_fd, list + used, len - used, used);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            used += n;
+        }
+    }
+    free(list);
+    if (state != NULL) {
+        atomic_store(&state->hot_set_saved, 1);
+    }
+}
+
+static int collect_hot_set(pid_t owner) {
+    if (owner == 0) {
+        restart_save_hot_set();
+        return 0;
+    }
+    if (state == NULL) {
+        return -1;
+    }
+    atomic_store(&state->hot_set_saved, 0);
+    if (kill(owner, SIGUSR2) < 0) {
+        return -1;
+    }
+    for (int waited = 0; waited < HOT_SET_TIMEOUT_MS; waited += 10) {
+        if (atomic_load(&state->hot_set_saved)) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "restart: worker %d did not write its hot set\n", owner);
+    return -1;
+}
+
+// true once the new process wrote its byte, false on EOF (it died) or timeout
+static bool wait_ready(int fd, int timeout_ms) {
+    uint64_t deadline = monotonic_ms() + timeout_ms;
+    while (1) {
+        uint64_t now = monotonic_ms();
+        if (now >= deadline) {
+            return false;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int rc = poll(&pfd, 1, (int) (deadline - now));
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return false;
+        }
+        char byte;
+        ssize_t n = read(fd, &byte, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n == 1;
+    }
+}
+
+static bool is_handover_var(const char* entry) {
+    static const char* const names[] = {LISTEN_FD_ENV, READY_FD_ENV, HOT_SET_FD_ENV};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(entry, names[i], len) == 0 && entry[len] == '=') {
+            return true;
+        }
+    }
+    return false;
+}
+
+int restart_exec(int listen_fd, pid_t hot_set_owner) {
+    int hot_fd = -1;
+    if (hot_set_owner >= 0 && hot_set_fd >= 0 && collect_hot_set(hot_set_owner) == 0) {
+        hot_fd = hot_set_fd;
+    }
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    // the environment is built before fork(): setenv() is not safe in the child
+    char listen_env[48], ready_env[48], hot_set_env[48];
+    snprintf(listen_env, sizeof(listen_env), "%s=%d", LISTEN_FD_ENV, listen_fd);
+    snprintf(ready_env, sizeof(ready_env), "%s=%d", READY_FD_ENV, ready[1]);
+    snprintf(hot_set_env, sizeof(hot_set_env), "%s=%d", HOT_SET_FD_ENV, hot_fd);
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char** envp = malloc((count + 4) * sizeof(char*));
+    if (envp == NULL) {
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!is_handover_var(environ[i])) {
+            envp[used++] = environ[i];
+        }
+    }
+    envp[used++] = listen_env;
+    envp[used++] = ready_env;
+    if (hot_fd >= 0) {
+        envp[used++] = hot_set_env;
+    }
+    envp[used] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // these are the only descriptors that survive the exec
+        fcntl(listen_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        if (hot_fd >= 0) {
+            fcntl(hot_fd, F_SETFD, 0);
+        }
+        // the signal mask survives exec too, and the accept loop blocks its signals
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execvpe(saved_argv[0], saved_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(ready[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        return -1;
+    }
+
+    fprintf(stderr, "restart: started %s as pid %d\n", saved_argv[0], pid);
+    bool serving = wait_ready(ready[0], RESTART_READY_TIMEOUT_MS);
+    close(ready[0]);
+    if (serving) {
+        fprintf(stderr, "restart: pid %d is serving, draining\n", pid);
+        return 0;
+    }
+
+    fprintf(stderr, "restart: pid %d did not come up, still serving\n", pid);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
@@ -0,0 +1,65 @@
+/* restart.h */
+#ifndef RESTART_H
+#define RESTART_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Constants */
+#define LISTEN_FD_ENV "HTTPD_LISTEN_FD"       // listener inherited from the previous process
+#define READY_FD_ENV "HTTPD_READY_FD"         // pipe to write one byte to once we serve
+#define HOT_SET_FD_ENV "HTTPD_HOT_SET_FD"     // memfd with the previous process's cached paths
+#define RESTART_READY_TIMEOUT_MS 30000        // give up on a new process that is not serving by then
+#define HOT_SET_TIMEOUT_MS 1000               // wait this long for a worker to write the hot set
+
+/**
+ * Remember how to start this binary again and pick up (and remove from the
+ * environment) whatever a previous process handed over. ready_count is the
+ * number of processes that must call restart_ready() before the previous
+ * process is told to stop accepting: 1, or the worker count in prefork mode.
+ * Call once, before any fork.
+ */
+void restart_init(char* argv[], int ready_count);
+
+/**
+ * Returns: the listening socket handed over by the previous process, or -1
+ * when we were started normally
+ */
+int restart_listener(void);
+
+/**
+ * The hot set the previous process wrote, as made by file_cache_hot_set().
+ * Returns: the malloc'ed list (len bytes, NUL terminated), or NULL if none
+ */
+char* restart_hot_set(size_t* len);
+
+/**
+ * Called by a process once it accepts connections. The last of the
+ * ready_count processes tells the previous process to stop accepting and
+ * drain. Later calls (a respawned worker) do nothing.
+ */
+void restart_ready(void);
+
+/**
+ * Close this process's end of the ready pipe without signalling, so the
+ * previous process sees the failure if every worker that inherited it dies
+ * before restart_ready()
+ */
+void restart_detach(void);
+
+/**
+ * Write this process's hot set where the next process will look for it
+ */
+void restart_save_hot_set(void);
+
+/**
+ * Re-exec the binary (argv[0], searched in PATH) with listen_fd inherited
+ * and wait until the new process is serving. hot_set_owner selects the
+ * file set to hand over: 0 for this process's cache, a pid to ask that
+ * process with SIGUSR2, -1 for none.
+ * Returns: 0 once the new process is serving and we should drain, -1 if it
+ * failed to start in time (it is stopped and we keep serving)
+ */
+int restart_exec(int listen_fd, pid_t hot_set_owner);
+
+#endif /* RESTART_H */
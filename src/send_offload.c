@@ -0,0 +1,472 @@
+/* send_offload.c */
+#define _GNU_SOURCE
+#include "send_offload.h"
+#include "buffer_pool.h"
+#include "network_utils.h"
+#include "probes.h"
+#include "server_stats.h"
+#include "zerocopy.h"
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+/* The unsent rest of one response: pooled buffers first, then a file range */
+typedef struct parked {
+    struct parked* prev;
+    struct parked* next;
+    http_task_t task;
+    bool close_after;
+    pool_buf_t* first;
+    pool_buf_t* last;
+    size_t first_sent;            // bytes of first already written
+    size_t buffered;              // unsent bytes in the buffers
+    int file_fd;                  // our dup(), -1 when there is no file range
+    off_t file_offset;
+    size_t file_left;
+    bool draining;                // all written, the kernel still holds queued bytes
+    size_t queued;                // what it held at the last look
+    uint64_t window_start_ms;     // throughput is measured per window
+    size_t window_bytes;
+} parked_t;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static int start_rc = -1;
+static size_t start_cap;          // arguments of the first send_offload_start()
+static unsigned long start_rate;
+static void (*start_finish)(http_task_t* task, int how);
+static size_t park_cap;
+static unsigned long min_send_rate;
+static void (*finish_parked)(http_task_t* task, int how);
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+// handed over by workers, picked up by the thread when wake_fd fires
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static parked_t* pending;
+// owned by the thread
+static parked_t* active;
+
+static void set_nonblocking(int fd, bool on) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    }
+}
+
+// Returns: 1 once the buffers are all out, 0 when the socket is full, -1 on error
+static int write_buffers(parked_t* p, size_t* written) {
+    while (p->first != NULL) {
+        struct iovec iov[SEND_MAX_IOV];
+        int count = 0;
+        size_t skip = p->first_sent;
+        for (pool_buf_t* buf = p->first; buf != NULL && count < SEND_MAX_IOV; buf = buf->next) {
+            iov[count].iov_base = buf->data + skip;
+            iov[count].iov_len = buf->len - skip;
+            skip = 0;
+            count++;
+        }
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+        ssize_t n = sendmsg(p->task.client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        *written += n;
+        p->buffered -= n;
+        size_t left = n;
+        while (left > 0) {
+            size_t avail = p->first->len - p->first_sent;
+            if (left < avail) {
+                p->first_sent += left;
+                break;
+            }
+            left -= avail;
+            pool_buf_t* done = p->first;
+            p->first = done->next;
+            p->first_sent = 0;
+            buffer_pool_put(done);
+        }
+    }
+    p->last = NULL;
+    return 1;
+}
+
+static int write_file(parked_t* p, size_t* written) {
+    while (p->file_left > 0) {
+        size_t want = p->file_left < SEND_FILE_CHUNK ? p->file_left : SEND_FILE_CHUNK;
+        ssize_t n = sendfile(p->task.client_fd, p->file_fd, &p->file_offset, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;  // error, or the file shrank
+        }
+        p->file_left -= n;
+        *written += n;
+    }
+    return 1;
+}
+
+static int write_parked(parked_t* p) {
+    size_t written = 0;
+    size_t buffered = p->buffered;
+    int rc = write_buffers(p, &written);
+    if (rc == 1) {
+        rc = write_file(p, &written);
+    }
+    p->window_bytes += written;
+    STATS_ADD(send_parked_bytes, -(long) (buffered - p->buffered));
+    return rc;
+}
+
+static void free_buffers(parked_t* p) {
+    while (p->first != NULL) {
+        pool_buf_t* buf = p->first;
+        p->first = buf->next;
+        buffer_pool_put(buf);
+    }
+    p->last = NULL;
+}
+
+// copy len bytes to the end of p's buffers
+static int append(parked_t* p, const char* data, size_t len) {
+    while (len > 0) {
+        if (p->last == NULL || p->last->len == POOL_BUF_SIZE) {
+            pool_buf_t* buf = buffer_pool_get();
+            if (buf == NULL) {
+                return -1;
+            }
+            buf->next = NULL;
+            buf->len = 0;
+            if (p->last != NULL) {
+                p->last->next = buf;
+            } else {
+                p->first = buf;
+            }
+            p->last = buf;
+        }
+        size_t room = POOL_BUF_SIZE - p->last->len;
+        size_t take = room < len ? room : len;
+        memcpy(p->last->data + p->last->len, data, take);
+        p->last->len += take;
+        p->buffered += take;
+        data += take;
+        len -= take;
+    }
+    return 0;
+}
+
+static void finish(parked_t* p, int how) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->task.client_fd, NULL);
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else if (active == p) {
+        active = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+    free_buffers(p);
+    STATS_ADD(send_parked_bytes, -(long) p->buffered);
+    if (p->file_fd >= 0) {
+        close(p->file_fd);
+    }
+    set_nonblocking(p->task.client_fd, false);
+    HTTPD_PROBE2(send_resumed, p->task.client_fd, how);
+
+    http_task_t task = p->task;
+    free(p);
+    finish_parked(&task, how);
+}
+
+// bytes the client has not acknowledged yet, 0 if the kernel cannot tell
+static size_t queued_bytes(int fd) {
+    int queued = 0;
+    return ioctl(fd, SIOCOUTQ, &queued) == 0 && queued > 0 ? (size_t) queued : 0;
+}
+
+// Everything is written. A connection that stays open is handed back only
+// once the client has taken the bytes still queued in the kernel (or sends
+// its next request), so the worker's read timeout does not start while a
+// slow client is still busy with this response.
+static void written(parked_t* p) {
+    if (p->close_after) {
+        finish(p, SEND_FINISHED_CLOSE);
+        return;
+    }
+    p->queued = queued_bytes(p->task.client_fd);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = p};
+    if (p->queued == 0 || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->task.client_fd, &event) < 0) {
+        finish(p, SEND_FINISHED);
+        return;
+    }
+    p->draining = true;
+}
+
+static void take_pending(void) {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+    pthread_mutex_lock(&pending_lock);
+    parked_t* list = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&pending_lock);
+
+    while (list != NULL) {
+        parked_t* p = list;
+        list = p->next;
+        p->prev = NULL;
+        p->next = active;
+        if (active != NULL) {
+            active->prev = p;
+        }
+        active = p;
+        // level-triggered: fires right away if the client drained meanwhile
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = p};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->task.client_fd, &event) < 0) {
+            finish(p, SEND_FAILED);
+        }
+    }
+}
+
+// drop clients that took less than the minimum rate over a full window
+static void check_rates(uint64_t now) {
+    parked_t* next;
+    for (parked_t* p = active; p != NULL; p = next) {
+        next = p->next;
+        if (p->draining) {
+            size_t queued = queued_bytes(p->task.client_fd);
+            p->window_bytes += queued < p->queued ? p->queued - queued : 0;
+            p->queued = queued;
+            if (queued == 0) {
+                finish(p, SEND_FINISHED);
+                continue;
+            }
+        }
+        uint64_t elapsed = now - p->window_start_ms;
+        if (elapsed < SEND_RATE_WINDOW_MS) {
+            continue;
+        }
+        if (p->window_bytes == 0 || p->window_bytes * 1000 < min_send_rate * elapsed) {
+            STATS_INC(send_timeouts);
+            finish(p, SEND_FAILED);
+            continue;
+        }
+        p->window_start_ms = now;
+        p->window_bytes = 0;
+    }
+}
+
+static void* offload_thread(void* arg) {
+    (void) arg;
+    struct epoll_event events[64];
+    uint64_t last_check = monotonic_ms();
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, 64, SEND_CHECK_MS);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            parked_t* p = events[i].data.ptr;
+            if (p == NULL) {
+                take_pending();
+                continue;
+            }
+            // completions of zero-copy sends; only they, with nothing else to report
+            if ((events[i].events & EPOLLERR) && zerocopy_reap(p->task.client_fd) > 0 &&
+                !(events[i].events & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP))) {
+                continue;
+            }
+            if (p->draining) {
+                finish(p, SEND_FINISHED);  // the next request, or a hangup the worker will see
+                continue;
+            }
+            int rc = write_parked(p);
+            if (rc < 0) {
+                finish(p, SEND_FAILED);
+            } else if (rc > 0) {
+                written(p);
+            }
+        }
+        uint64_t now = monotonic_ms();
+        if (now - last_check >= SEND_CHECK_MS) {
+            check_rates(now);
+            last_check = now;
+        }
+    }
+    return NULL;
+}
+
+static void start(void) {
+    if (start_cap == 0) {
+        start_rc = 0;
+        return;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+        perror("send offload");
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, offload_thread, NULL) != 0) {
+        return;
+    }
+    pthread_detach(thread);
+    min_send_rate = start_rate;
+    finish_parked = start_finish;
+    park_cap = start_cap;  // last: workers only park once everything above is set
+    start_rc = 0;
+}
+
+int send_offload_start(size_t cap, unsigned long min_rate,
+                       void (*finish)(http_task_t* task, int how)) {
+    start_cap = cap;
+    start_rate = min_rate;
+    start_finish = finish;
+    pthread_once(&start_once, start);
+    return start_rc;
+}
+
+// everything in place with blocking writes, the way it was before parking
+static int write_in_place(int fd, const struct iovec* iov, int iovcnt, int file_fd,
+                          size_t file_len) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0 &&
+            rio_writen(fd, iov[i].iov_base, iov[i].iov_len) != (ssize_t) iov[i].iov_len) {
+            return -1;
+        }
+    }
+    return file_len > 0 ? rio_sendfilen(fd, file_fd, file_len) : 0;
+}
+
+// pooled memory needed to hold len bytes
+static size_t pooled_size(size_t len) {
+    return (len + POOL_BUF_SIZE - 1) / POOL_BUF_SIZE * POOL_BUF_SIZE;
+}
+
+int send_offload_write(int fd, const struct iovec* iov, int iovcnt, int file_fd, size_t file_len,
+                       const http_task_t* task, bool close_after) {
+    if (task == NULL || park_cap == 0 || iovcnt > SEND_MAX_IOV) {
+        return write_in_place(fd, iov, iovcnt, file_fd, file_len);
+    }
+
+    // most responses fit in the socket buffer, try that first
+    struct iovec rest[SEND_MAX_IOV];
+    memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+    struct iovec* next = rest;
+    int left = iovcnt;
+    size_t unsent = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        unsent += iov[i].iov_len;
+    }
+    while (unsent > 0) {
+        struct msghdr msg = {.msg_iov = next, .msg_iovlen = left};
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (n < 0) {
+            // the socket is full; keep at it here only while the rest would not fit the cap
+            if (pooled_size(unsent) <= park_cap) {
+                break;
+            }
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if (poll(&pfd, 1, SEND_RATE_WINDOW_MS) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        unsent -= n;
+        while (left > 0 && (size_t) n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (char*) next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+
+    off_t offset = 0;
+    if (unsent == 0 && file_len > 0) {
+        set_nonblocking(fd, true);
+        while ((size_t) offset < file_len) {
+            size_t want = file_len - offset < SEND_FILE_CHUNK ? file_len - offset : SEND_FILE_CHUNK;
+            ssize_t n = sendfile(fd, file_fd, &offset, want);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                set_nonblocking(fd, false);
+                return -1;
+            }
+        }
+        if ((size_t) offset == file_len) {
+            set_nonblocking(fd, false);
+            return 0;
+        }
+    } else if (unsent == 0) {
+        return 0;
+    }
+
+    // park the rest: memory is copied into pooled buffers, the file stays a range
+    parked_t* p = calloc(1, sizeof(parked_t));
+    if (p == NULL) {
+        set_nonblocking(fd, false);
+        return -1;
+    }
+    p->task = *task;
+    p->close_after = close_after;
+    p->file_fd = -1;
+    bool copied = true;
+    for (int i = 0; i < left && copied; i++) {
+        copied = append(p, next[i].iov_base, next[i].iov_len) == 0;
+    }
+    if (copied && (size_t) offset < file_len) {
+        // a dup() of our own: the caller closes file_fd as soon as we return
+        p->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+        p->file_offset = offset;
+        p->file_left = file_len - offset;
+    }
+    if (!copied || ((size_t) offset < file_len && p->file_fd < 0)) {
+        free_buffers(p);
+        free(p);
+        set_nonblocking(fd, false);
+        return -1;
+    }
+    set_nonblocking(fd, true);
+    p->window_start_ms = monotonic_ms();
+    STATS_INC(sends_parked);
+    STATS_ADD(send_parked_bytes, (long) p->buffered);
+    HTTPD_PROBE3(send_parked, fd, p->buffered, p->file_left);
+
+    pthread_mutex_lock(&pending_lock);
+    p->next = pending;
+    pending = p;
+    pthread_mutex_unlock(&pending_lock);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+    }
+    return SEND_PARKED;
+}
@@ -0,0 +1,46 @@
+/* send_offload.h */
+#ifndef SEND_OFFLOAD_H
+#define SEND_OFFLOAD_H
+
+#include "http_server.h"
+#include <sys/uio.h>
+
+/* Constants */
+#define SEND_PARK_DEFAULT_CAP (256 * 1024)  // pooled memory one parked response may hold
+#define SEND_DEFAULT_MIN_RATE 1024          // bytes/s a parked client must take
+#define SEND_RATE_WINDOW_MS 5000            // the rate is judged over windows this long
+#define SEND_CHECK_MS 500                   // how often the offload thread looks at the windows
+#define SEND_MAX_IOV 16                     // buffers per sendmsg()
+#define SEND_FILE_CHUNK (1 << 20)           // bytes per sendfile() call
+
+/* How a parked response ended, passed to the finish callback */
+#define SEND_FINISHED 0          // all sent, the connection takes another request
+#define SEND_FINISHED_CLOSE 1    // all sent, close the connection
+#define SEND_FAILED 2            // write error, or the client was slower than the minimum rate
+
+/**
+ * Start the offload thread of this process. cap is the pooled memory a
+ * parked response may hold (0 disables parking: every response is sent
+ * in place, as before); min_rate is the throughput in bytes/s below which
+ * a parked client is dropped (0 = only one that takes nothing for a whole
+ * window). finish gets every parked connection back, with the socket
+ * blocking again; it owns the fd from then on. Later calls do nothing.
+ * Returns: 0 on success, -1 if the thread could not be started
+ */
+int send_offload_start(size_t cap, unsigned long min_rate,
+                       void (*finish)(http_task_t* task, int how));
+
+/**
+ * Write iov, then file_len bytes of file_fd from offset 0, without
+ * blocking on a slow client. Whatever the socket does not take is copied
+ * into pooled buffers (file ranges are kept as ranges, on a dup() of
+ * file_fd) and the connection is parked with the offload thread, which
+ * resumes it on EPOLLOUT and hands task to the finish callback when done.
+ * Without a task, or with parking disabled, everything is written in place.
+ * The caller keeps ownership of file_fd and of the iov memory either way.
+ * Returns: 0 if everything was sent, SEND_PARKED, or -1 on error
+ */
+int send_offload_write(int fd, const struct iovec* iov, int iovcnt, int file_fd, size_t file_len,
+                       const http_task_t* task, bool close_after);
+
+#endif /* SEND_OFFLOAD_H */
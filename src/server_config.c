@@ -0,0 +1,295 @@
+/* server_config.c */
+#include "server_config.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "file_cache.h"
+#include "prefork.h"
+#include "request_body.h"
+#include "send_offload.h"
+#include "vhost.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+server_config_t server_config;
+
+static const struct option long_options[] = {
+    {"max-connections", required_argument, NULL, 'c'},
+    {"max-queue-wait",  required_argument, NULL, 'q'},
+    {"retry-after",     required_argument, NULL, 'r'},
+    {"status-path",     required_argument, NULL, 's'},
+    {"defer-accept",    required_argument, NULL, 'D'},
+    {"tcp-fastopen",    required_argument, NULL, 'F'},
+    {"rate-limit",      required_argument, NULL, 'L'},
+    {"proxy",           required_argument, NULL, 'P'},
+    {"max-headers",     required_argument, NULL, 'm'},
+    {"max-header-size", required_argument, NULL, 'M'},
+    {"max-body-size",   required_argument, NULL, 'b'},
+    {"send-buffer-cap", required_argument, NULL, 'B'},
+    {"min-send-rate",   required_argument, NULL, 'S'},
+    {"zerocopy",        required_argument, NULL, 'Z'},
+    {"no-h2c",          no_argument,       NULL, 'H'},
+    {"allow-put",       no_argument,       NULL, 'u'},
+    {"vhosts",          required_argument, NULL, 'V'},
+    {"cache-size",      required_argument, NULL, 'k'},
+    {"repr-digest",     no_argument,       NULL, 'd'},
+    {"no-huge-pages",   no_argument,       NULL, 'G'},
+    {"processes",       required_argument, NULL, 'w'},
+    {"drain-timeout",   required_argument, NULL, 'T'},
+    {"warm-handover",   no_argument,       NULL, 'W'},
+    {"cpu-affinity",    required_argument, NULL, 'a'},
+    {"exclude-irq-cpus", no_argument,      NULL, 'I'},
+    {"record",          required_argument, NULL, 'R'},
+    {"perf-counters",   no_argument,       NULL, 'E'},
+    {"autoindex",       no_argument,       NULL, 'A'},
+    {"tls-cert",        required_argument, NULL, 'C'},
+    {"tls-key",         required_argument, NULL, 'K'},
+    {"help",            no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+void print_usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] <port> <docroot>\n"
+        "  -c, --max-connections N   shed new connections once N are in flight\n"
+        "  -q, --max-queue-wait MS   shed connections that waited MS for a worker\n"
+        "  -r, --retry-after SECS    Retry-After sent with 503 (default %d)\n"
+        "  -s, --status-path URI     serve server statistics at URI\n"
+        "  -D, --defer-accept SECS   wake workers only once request bytes arrive (default %d, 0 = off)\n"
+        "  -F, --tcp-fastopen QLEN   accept TCP Fast Open with up to QLEN pending SYNs (default off)\n"
+        "  -L, --rate-limit conn=RATE[/BURST],conn24=..,req=..,req24=..\n"
+        "                            per client IP and per /24 token buckets, answered with 429\n"
+        "  -P, --proxy PREFIX=HOST:PORT[,timeout=MS][,max_idle=N][,max_fails=N][,eject=MS]\n"
+        "                            forward PREFIX to an upstream (repeat to load balance)\n"
+        "  -m, --max-headers N       answer 431 to requests with more header lines (default %d)\n"
+        "  -M, --max-header-size BYTES  answer 431 to larger header blocks (default %d, max %d)\n"
+        "  -b, --max-body-size BYTES reject larger request bodies with 413 (default %d, 0 = no limit)\n"
+        "  -B, --send-buffer-cap BYTES  memory a response to a slow client may park, so the worker\n"
+        "                            can move on (default %d, 0 = write in place)\n"
+        "  -S, --min-send-rate BPS   drop parked clients slower than BPS bytes/s (default %d)\n"
+        "  -Z, --zerocopy BYTES      send cached bodies of at least BYTES with MSG_ZEROCOPY (default off)\n"
+        "  -H, --no-h2c              answer HTTP/1.x only: no HTTP/2 preface, ignore Upgrade: h2c\n"
+        "  -u, --allow-put           let PUT store files under the docroot\n"
+        "  -V, --vhosts FILE         serve the hosts named in FILE from their own docroots; other\n"
+        "                            hosts get <docroot>\n"
+        "  -k, --cache-size BYTES    file cache size (default %d, 0 = hash files on every request)\n"
+        "  -d, --repr-digest         send a SHA-256 Repr-Digest header with files\n"
+        "  -G, --no-huge-pages       back cached files and connection buffers with 4 KiB pages only\n"
+        "  -w, --processes N         prefork N worker processes under a master (default 0 = one process)\n"
+        "  -T, --drain-timeout SECS  on stop or SIGHUP restart, let connections finish for SECS (default %d)\n"
+        "  -W, --warm-handover       on restart, load the cached files into the new process first\n"
+        "  -a, --cpu-affinity SPEC   pin one worker per CPU: cpus, cores (one per physical core)\n"
+        "                            or a CPU list such as 0-3,8\n"
+        "  -I, --exclude-irq-cpus    with -a, skip CPUs that handle NIC interrupts\n"
+        "  -R, --record FILE         append every request's headers and timing to FILE for replay\n"
+        "  -E, --perf-counters       count cycles, instructions and misses per request stage\n"
+        "                            (on the status page and on SIGUSR1)\n"
+        "  -A, --autoindex           list directories as HTML, or JSON with ?format=json\n"
+        "  -C, --tls-cert FILE       serve HTTPS with this PEM certificate chain (needs -K)\n"
+        "  -K, --tls-key FILE        PEM private key for -C\n",
+        prog, DEFAULT_RETRY_AFTER_SECS, DEFAULT_DEFER_ACCEPT_SECS, DEFAULT_MAX_HEADERS,
+        DEFAULT_MAX_HEADER_SIZE, MAX_REQUEST_SIZE, DEFAULT_MAX_BODY_SIZE,
+        SEND_PARK_DEFAULT_CAP, SEND_DEFAULT_MIN_RATE,
+        FILE_CACHE_DEFAULT_SIZE, DEFAULT_DRAIN_TIMEOUT_SECS);
+}
+
+// parse a non-negative integer option, -1 on garbage
+static int parse_count(const char* arg) {
+    char* end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value < 0 || value > 1000000000) {
+        return -1;
+    }
+    return (int) value;
+}
+
+int parse_config(int argc, char* argv[], server_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    config->retry_after_secs = DEFAULT_RETRY_AFTER_SECS;
+    config->max_body_size = DEFAULT_MAX_BODY_SIZE;
+    config->defer_accept_secs = DEFAULT_DEFER_ACCEPT_SECS;
+    config->max_headers = DEFAULT_MAX_HEADERS;
+    config->max_header_size = DEFAULT_MAX_HEADER_SIZE;
+    config->file_cache_size = FILE_CACHE_DEFAULT_SIZE;
+    config->drain_timeout_secs = DEFAULT_DRAIN_TIMEOUT_SECS;
+    config->send_buffer_cap = SEND_PARK_DEFAULT_CAP;
+    config->min_send_rate = SEND_DEFAULT_MIN_RATE;
+    config->h2c = true;
+    config->huge_pages = true;
+
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "c:q:r:s:D:F:L:P:m:M:b:B:S:Z:HuV:k:dGw:T:Wa:IR:EAC:K:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            config->max_connections = parse_count(optarg);
+            break;
+        case 'q':
+            config->max_queue_wait_ms = parse_count(optarg);
+            break;
+        case 'r':
+            config->retry_after_secs = parse_count(optarg);
+            break;
+        case 's':
+            if (optarg[0] != '/') {
+                fprintf(stderr, "status path must start with '/'\n");
+                return -1;
+            }
+            config->status_path = optarg;
+            break;
+        case 'D':
+            config->defer_accept_secs = parse_count(optarg);
+            break;
+        case 'F':
+            config->fastopen_qlen = parse_count(optarg);
+            break;
+        case 'm':
+            config->max_headers = parse_count(optarg);
+            if (config->max_headers < 1 || config->max_headers > MAX_HEADERS) {
+                fprintf(stderr, "-m must be between 1 and %d\n", MAX_HEADERS);
+                return -1;
+            }
+            break;
+        case 'M':
+            config->max_header_size = parse_count(optarg);
+            if (config->max_header_size < 64 || config->max_header_size > MAX_REQUEST_SIZE) {
+                fprintf(stderr, "-M must be between 64 and %d\n", MAX_REQUEST_SIZE);
+                return -1;
+            }
+            break;
+        case 'b': {
+            char* end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size < 0) {
+                fprintf(stderr, "invalid value for -b: %s\n", optarg);
+                return -1;
+            }
+            config->max_body_size = (size_t) size;
+            break;
+        }
+        case 'B': {
+            char* end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size < 0) {
+                fprintf(stderr, "invalid value for -B: %s\n", optarg);
+                return -1;
+            }
+            config->send_buffer_cap = (size_t) size;
+            break;
+        }
+        case 'S':
+            config->min_send_rate = parse_count(optarg);
+            break;
+        case 'Z': {
+            char* end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size < 0) {
+                fprintf(stderr, "invalid value for -Z: %s\n", optarg);
+                return -1;
+            }
+            config->zerocopy_threshold = (size_t) size;
+            break;
+        }
+        case 'H':
+            config->h2c = false;
+            break;
+        case 'u':
+            config->allow_put = true;
+            break;
+        case 'k': {
+            char* end;
+            long long size = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size < 0) {
+                fprintf(stderr, "invalid value for -k: %s\n", optarg);
+                return -1;
+            }
+            config->file_cache_size = (size_t) size;
+            break;
+        }
+        case 'd':
+            config->repr_digest = true;
+            break;
+        case 'G':
+            config->huge_pages = false;
+            break;
+        case 'w':
+            config->processes = parse_count(optarg);
+            if (config->processes < 0 || config->processes > MAX_PROCESSES) {
+                fprintf(stderr, "-w must be between 0 and %d\n", MAX_PROCESSES);
+                return -1;
+            }
+            break;
+        case 'T':
+            config->drain_timeout_secs = parse_count(optarg);
+            break;
+        case 'W':
+            config->warm_handover = true;
+            break;
+        case 'a':
+            config->cpu_affinity = optarg;
+            break;
+        case 'I':
+            config->exclude_irq_cpus = true;
+            break;
+        case 'C':
+            config->tls_cert = optarg;
+            break;
+        case 'K':
+            config->tls_key = optarg;
+            break;
+        case 'R':
+            config->capture_path = optarg;
+            break;
+        case 'E':
+            config->perf_counters = true;
+            break;
+        case 'A':
+            config->autoindex = true;
+            break;
+        case 'L':
+            if (rate_limit_configure(optarg) < 0) {
+                fprintf(stderr, "invalid rate limit: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'V':
+            // vhost_load() says what is wrong with the file
+            if (vhost_load(optarg) < 0) {
+                return -1;
+            }
+            break;
+        case 'P':
+            if (proxy_add_route(optarg) < 0) {
+                fprintf(stderr, "invalid proxy route: %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+
+        if (config->max_connections < 0 || config->max_queue_wait_ms < 0 ||
+            config->retry_after_secs < 0 || config->defer_accept_secs < 0 ||
+            config->fastopen_qlen < 0 || config->drain_timeout_secs < 0 ||
+            config->min_send_rate < 0) {
+            fprintf(stderr, "invalid value for -%c: %s\n", opt, optarg);
+            return -1;
+        }
+    }
+
+    if ((config->tls_cert == NULL) != (config->tls_key == NULL)) {
+        fprintf(stderr, "--tls-cert and --tls-key must be given together\n");
+        return -1;
+    }
+
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    config->port = argv[optind];
+    config->docroot = argv[optind + 1];
+    return 0;
+}
@@ -0,0 +1,85 @@
+/* server_config.h */
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Defaults */
+#define DEFAULT_RETRY_AFTER_SECS 1
+#define DEFAULT_DEFER_ACCEPT_SECS 5
+#define DEFAULT_MAX_HEADERS 100
+#define DEFAULT_MAX_HEADER_SIZE 8192
+#define DEFAULT_DRAIN_TIMEOUT_SECS 30
+
+/* Runtime configuration, filled in from the command line */
+typedef struct server_config {
+    char* port;
+    char* docroot;
+
+    // Admission control
+    int max_connections;      // max in-flight connections, 0 = bounded by the queue only
+    int max_queue_wait_ms;    // max time a connection may wait for a worker, 0 = no limit
+    int retry_after_secs;     // value of the Retry-After header on 503s
+
+    const char* status_path;  // URI that serves the stats page, NULL = disabled
+
+    // Listener
+    int defer_accept_secs;    // TCP_DEFER_ACCEPT: wake on request bytes, 0 = off
+    int fastopen_qlen;        // TCP_FASTOPEN pending SYN queue, 0 = off
+
+    // Request headers, over either limit is answered with 431
+    int max_headers;          // header lines, capped at MAX_HEADERS
+    int max_header_size;      // bytes in the request line plus headers, capped at MAX_REQUEST_SIZE
+
+    // Responses to slow clients
+    size_t send_buffer_cap;   // pooled memory per parked response, 0 = always send in place
+    int min_send_rate;        // bytes/s a parked client must take, 0 = any progress
+    size_t zerocopy_threshold; // cached bodies this large go out with MSG_ZEROCOPY, 0 = never
+
+    // HTTP/2 over cleartext TCP, by prior knowledge or Upgrade: h2c
+    bool h2c;
+
+    // Request bodies
+    size_t max_body_size;     // larger bodies get 413, 0 = unlimited
+    bool allow_put;           // PUT stores the body under the docroot
+
+    // File cache
+    size_t file_cache_size;   // bytes of file content and hashes kept, 0 = none
+    bool repr_digest;         // send Repr-Digest: sha-256 with cached files
+    bool huge_pages;          // back the slab arena with huge pages when the kernel has them
+
+    // Process model
+    int processes;            // prefork worker processes under a master, 0 = one process
+    int drain_timeout_secs;   // on stop or restart, wait this long for connections to finish
+    bool warm_handover;       // on restart, pass the cached file set to the new process
+
+    // Traffic capture
+    const char* capture_path; // append request metadata to this file for replay, NULL = off
+
+    // Directory listings
+    bool autoindex;           // list directories that have no index.html
+
+    // Instrumentation
+    bool perf_counters;       // sample hardware counters around each request stage
+
+    // Worker placement
+    const char* cpu_affinity; // "cpus", "cores" or a CPU list, NULL = unpinned
+    bool exclude_irq_cpus;    // keep workers off CPUs that service NIC interrupts
+
+    // HTTPS (kTLS), both set or neither
+    const char* tls_cert;     // PEM certificate chain
+    const char* tls_key;      // PEM private key
+} server_config_t;
+
+extern server_config_t server_config;
+
+/**
+ * Fill config with defaults, then apply options and positional arguments
+ * Returns: 0 on success, -1 on bad usage (usage is printed to stderr)
+ */
+int parse_config(int argc, char* argv[], server_config_t* config);
+
+void print_usage(const char* prog);
+
+#endif /* SERVER_CONFIG_H */
@@ -0,0 +1,175 @@
+/* server_stats.c */
+#include "server_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define STAT_WORDS (sizeof(server_stats_t) / sizeof(atomic_ulong))
+_Static_assert(sizeof(server_stats_t) % sizeof(atomic_ulong) == 0, "stats must be whole words");
+
+static server_stats_t local_stats;
+server_stats_t* server_stats = &local_stats;
+
+static server_stats_t* shared_slots;
+static int shared_count;
+
+int stats_share(int slots) {
+    server_stats_t* segment = mmap(NULL, sizeof(server_stats_t) * slots, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(&segment[0], server_stats, sizeof(server_stats_t));
+    shared_slots = segment;
+    shared_count = slots;
+    server_stats = &segment[0];
+    return 0;
+}
+
+void stats_use_slot(int slot) {
+    server_stats = &shared_slots[slot];
+    atomic_store(&server_stats->connections_in_flight, 0);
+    atomic_store(&server_stats->cache_bytes, 0);
+    atomic_store(&server_stats->send_parked_bytes, 0);
+    atomic_store(&server_stats->arena_mapped_bytes, 0);
+    atomic_store(&server_stats->arena_huge_bytes, 0);
+    atomic_store(&server_stats->arena_used_bytes, 0);
+    atomic_store(&server_stats->arena_requested_bytes, 0);
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        atomic_store(&server_stats->perf_threads[i], 0);
+    }
+    atomic_store(&server_stats->perf_threads_user_only, 0);
+}
+
+void stats_sum(server_stats_t* total) {
+    memset(total, 0, sizeof(*total));
+    server_stats_t* first = shared_slots != NULL ? shared_slots : server_stats;
+    int count = shared_slots != NULL ? shared_count : 1;
+
+    atomic_ulong* sum = (atomic_ulong*) total;
+    for (int slot = 0; slot < count; slot++) {
+        atomic_ulong* words = (atomic_ulong*) &first[slot];
+        for (size_t i = 0; i < STAT_WORDS; i++) {
+            // gauges are signed, but two's complement sums come out right
+            sum[i] += atomic_load_explicit(&words[i], memory_order_relaxed);
+        }
+    }
+}
+
+long stats_in_flight(void) {
+    if (shared_slots == NULL) {
+        return STATS_GET(connections_in_flight);
+    }
+    long total = 0;
+    for (int slot = 0; slot < shared_count; slot++) {
+        total += atomic_load_explicit(&shared_slots[slot].connections_in_flight,
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+#define TOTAL(field) atomic_load_explicit(&total.field, memory_order_relaxed)
+
+size_t stats_render(char* buf, size_t len) {
+    server_stats_t total;
+    stats_sum(&total);
+    unsigned long shed = TOTAL(shed_max_connections) + TOTAL(shed_queue_full) +
+                         TOTAL(shed_queue_wait);
+
+    int n = snprintf(buf, len,
+        "connections_accepted: %lu\n"
+        "accept_errors: %lu\n"
+        "connections_in_flight: %ld\n"
+        "connections_shed: %lu\n"
+        "shed_max_connections: %lu\n"
+        "shed_queue_full: %lu\n"
+        "shed_queue_wait: %lu\n"
+        "requests_served: %lu\n"
+        "rate_limited_connections: %lu\n"
+        "rate_limited_requests: %lu\n"
+        "rate_limit_table_full: %lu\n"
+        "cache_hits: %lu\n"
+        "cache_misses: %lu\n"
+        "cache_evictions: %lu\n"
+        "cache_background_hashes: %lu\n"
+        "cache_bytes: %ld\n"
+        "proxy_requests: %lu\n"
+        "proxy_failures: %lu\n"
+        "upstream_ejections: %lu\n"
+        "tls_handshakes: %lu\n"
+        "tls_sessions_resumed: %lu\n"
+        "tls_handshake_failures: %lu\n"
+        "tls_ktls_failures: %lu\n"
+        "worker_restarts: %lu\n"
+        "sends_parked: %lu\n"
+        "send_timeouts: %lu\n"
+        "send_parked_bytes: %ld\n"
+        "h2_connections: %lu\n"
+        "h2_streams: %lu\n"
+        "zerocopy_sends: %lu\n"
+        "zerocopy_bytes: %lu\n"
+        "zerocopy_copied: %lu\n"
+        "zerocopy_lingering: %ld\n"
+        "arena_mapped_bytes: %ld\n"
+        "arena_huge_bytes: %ld\n"
+        "arena_used_bytes: %ld\n"
+        "arena_requested_bytes: %ld\n"
+        "arena_class_waste: %ld\n"
+        "arena_free_bytes: %ld\n"
+        "arena_oversized: %lu\n"
+        "vhost_unmatched: %lu\n"
+        "dir_index_hits: %lu\n"
+        "dir_index_renders: %lu\n"
+        "dir_index_scans: %lu\n"
+        "dir_index_updates: %lu\n",
+        TOTAL(connections_accepted),
+        TOTAL(accept_errors),
+        TOTAL(connections_in_flight),
+        shed,
+        TOTAL(shed_max_connections),
+        TOTAL(shed_queue_full),
+        TOTAL(shed_queue_wait),
+        TOTAL(requests_served),
+        TOTAL(rate_limited_connections),
+        TOTAL(rate_limited_requests),
+        TOTAL(rate_limit_table_full),
+        TOTAL(cache_hits),
+        TOTAL(cache_misses),
+        TOTAL(cache_evictions),
+        TOTAL(cache_background_hashes),
+        TOTAL(cache_bytes),
+        TOTAL(proxy_requests),
+        TOTAL(proxy_failures),
+        TOTAL(upstream_ejections),
+        TOTAL(tls_handshakes),
+        TOTAL(tls_sessions_resumed),
+        TOTAL(tls_handshake_failures),
+        TOTAL(tls_ktls_failures),
+        TOTAL(worker_restarts),
+        TOTAL(sends_parked),
+        TOTAL(send_timeouts),
+        TOTAL(send_parked_bytes),
+        TOTAL(h2_connections),
+        TOTAL(h2_streams),
+        TOTAL(zerocopy_sends),
+        TOTAL(zerocopy_bytes),
+        TOTAL(zerocopy_copied),
+        TOTAL(zerocopy_lingering),
+        TOTAL(arena_mapped_bytes),
+        TOTAL(arena_huge_bytes),
+        TOTAL(arena_used_bytes),
+        TOTAL(arena_requested_bytes),
+        TOTAL(arena_used_bytes) - TOTAL(arena_requested_bytes),
+        TOTAL(arena_mapped_bytes) - TOTAL(arena_used_bytes),
+        TOTAL(arena_oversized),
+        TOTAL(vhost_unmatched),
+        TOTAL(dir_index_hits),
+        TOTAL(dir_index_renders),
+        TOTAL(dir_index_scans),
+        TOTAL(dir_index_updates));
+
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t) n < len ? (size_t) n : len - 1;
+}
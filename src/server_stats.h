@@ -0,0 +1,103 @@
+/* server_stats.h */
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "perf_counters.h"
+
+/* Process-wide counters. Updated with relaxed atomics from the accept
+ * thread and the workers. Every field is one 64-bit word, so slots can be
+ * summed word by word. */
+typedef struct server_stats {
+    atomic_ulong connections_accepted;
+    atomic_ulong accept_errors;          // accept4() failures other than EAGAIN
+    atomic_long connections_in_flight;   // accepted and not yet closed
+    atomic_ulong shed_max_connections;   // 503: too many connections in flight
+    atomic_ulong shed_queue_full;        // 503: no room in shared_buffer
+    atomic_ulong shed_queue_wait;        // 503: waited too long for a worker
+    atomic_ulong requests_served;
+    atomic_ulong rate_limited_connections; // 429 from the accept path
+    atomic_ulong rate_limited_requests;    // 429 from a worker
+    atomic_ulong rate_limit_table_full;    // checks let through for lack of a bucket
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;           // files read and hashed
+    atomic_ulong cache_evictions;
+    atomic_ulong cache_background_hashes; // large files hashed after their first response
+    atomic_long cache_bytes;             // held by the file cache
+    atomic_ulong proxy_requests;
+    atomic_ulong proxy_failures;         // connect errors, timeouts, bad replies
+    atomic_ulong upstream_ejections;
+    atomic_ulong tls_handshakes;
+    atomic_ulong tls_sessions_resumed;
+    atomic_ulong tls_handshake_failures;
+    atomic_ulong tls_ktls_failures;       // handshake done but the kernel refused the keys
+    atomic_ulong worker_restarts;         // prefork: worker processes that died and were replaced
+    atomic_ulong sends_parked;            // responses finished by the send offload thread
+    atomic_ulong send_timeouts;           // parked clients dropped for taking too little
+    atomic_long send_parked_bytes;        // pooled memory holding parked response data
+    atomic_ulong h2_connections;          // connections that switched to HTTP/2
+    atomic_ulong h2_streams;              // requests they carried
+    atomic_ulong zerocopy_sends;          // MSG_ZEROCOPY send() calls
+    atomic_ulong zerocopy_bytes;
+    atomic_ulong zerocopy_copied;         // completions where the kernel copied anyway
+    atomic_long zerocopy_lingering;       // closed connections kept open until their sends complete
+    atomic_long arena_mapped_bytes;       // slab arena regions mapped
+    atomic_long arena_huge_bytes;         // of those, on huge pages (reserved or transparent)
+    atomic_long arena_used_bytes;         // chunks handed out, rounded up to their size class
+    atomic_long arena_requested_bytes;    // bytes asked for in those chunks
+    atomic_ulong arena_oversized;         // allocations too big for a size class, left to malloc
+    atomic_ulong vhost_unmatched;         // requests for a host not in the table, served from the default docroot
+    atomic_ulong dir_index_hits;          // listings sent as already rendered
+    atomic_ulong dir_index_renders;       // listings rendered after a change
+    atomic_ulong dir_index_scans;         // directories read in full
+    atomic_ulong dir_index_updates;       // entries updated from inotify events
+    atomic_long perf_threads[PERF_EVENTS];  // threads counting each event
+    atomic_long perf_threads_user_only;     // of those, threads kept to user space
+    atomic_ulong perf_stages[PERF_STAGES][PERF_STAGE_WORDS];  // event totals, samples, nanoseconds
+} server_stats_t;
+
+/* This process's counters. A static block normally; in prefork mode a slot
+ * in a shared mapping, so the master and every worker see all of them. */
+extern server_stats_t* server_stats;
+
+#define STATS_INC(field) \
+    atomic_fetch_add_explicit(&server_stats->field, 1, memory_order_relaxed)
+#define STATS_ADD(field, n) \
+    atomic_fetch_add_explicit(&server_stats->field, (n), memory_order_relaxed)
+#define STATS_DEC(field) \
+    atomic_fetch_sub_explicit(&server_stats->field, 1, memory_order_relaxed)
+#define STATS_GET(field) \
+    atomic_load_explicit(&server_stats->field, memory_order_relaxed)
+
+/**
+ * Move the counters into a MAP_SHARED anonymous mapping with one slot per
+ * process, and use slot 0. Call before forking; children pick their slot
+ * with stats_use_slot().
+ * Returns: 0 on success, -1 if the mapping failed
+ */
+int stats_share(int slots);
+
+/**
+ * Count into slot from now on. Gauges left by a previous owner of the slot
+ * (a worker that died) are cleared, totals are kept.
+ */
+void stats_use_slot(int slot);
+
+/**
+ * Sum of every slot (just this process when not shared) into total
+ */
+void stats_sum(server_stats_t* total);
+
+/**
+ * Connections in flight across all processes
+ */
+long stats_in_flight(void);
+
+/**
+ * Render the counters, summed over all processes, as "name: value" lines into buf
+ * Returns: number of bytes written (excluding the NUL)
+ */
+size_t stats_render(char* buf, size_t len);
+
+#endif /* SERVER_STATS_H */
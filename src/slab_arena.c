@@ -0,0 +1,290 @@
+/* slab_arena.c */
+#define _GNU_SOURCE
+#include "slab_arena.h"
+#include "cpu_affinity.h"
+#include "server_stats.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+struct arena;
+
+/* ARENA_SLAB_SIZE bytes of a region, cut into chunks of one size class */
+typedef struct slab {
+    struct slab* prev;            // in its class's list of slabs with a free chunk
+    struct slab* next;
+    bool listed;
+    int cls;                      // -1 while the slab belongs to no class
+    int used;                     // chunks handed out
+    void* free_chunks;            // chunks given back, linked through their first word
+    char* fresh;                  // chunks never handed out start here
+    char* end;
+} slab_t;
+
+/* Header at the start of every region, ahead of the first slab's chunks */
+typedef struct region {
+    struct region* prev;
+    struct region* next;
+    struct arena* arena;
+    int kind;                     // ARENA_PAGES_*
+    int free_slabs;               // slabs without a class
+    slab_t slabs[ARENA_REGION_SLABS];
+} region_t;
+
+#define REGION_HEADER ((sizeof(region_t) + 63) & ~(size_t) 63)
+
+/* One arena per NUMA node, like the file cache shards, so the pages
+ * behind a worker's allocations are first touched on its own node.
+ * Locks are taken class first, then region. */
+typedef struct arena {
+    pthread_mutex_t class_locks[ARENA_CLASSES];
+    slab_t* partial[ARENA_CLASSES];   // slabs of the class that have a free chunk
+    pthread_mutex_t region_lock;
+    region_t* regions;
+} arena_t;
+
+static arena_t arenas[MAX_NUMA_NODES] = {
+    [0 ... MAX_NUMA_NODES - 1] = {
+        .class_locks = {[0 ... ARENA_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER},
+        .region_lock = PTHREAD_MUTEX_INITIALIZER,
+    }
+};
+static bool use_huge_pages = true;
+
+void arena_init(bool huge_pages) {
+    use_huge_pages = huge_pages;
+}
+
+// size in (2^p, 2^(p+1)] falls into one of four steps of 2^(p-2)
+static int class_of(size_t size) {
+    if (size <= ARENA_MIN_CLASS) {
+        return 0;
+    }
+    int p = 63 - __builtin_clzl(size - 1);
+    size_t step = (size_t) 1 << (p - 2);
+    return (p - 6) * 4 + (int) ((size - ((size_t) 1 << p) + step - 1) / step);
+}
+
+static size_t class_size(int cls) {
+    if (cls == 0) {
+        return ARENA_MIN_CLASS;
+    }
+    int p = 6 + (cls - 1) / 4;
+    return ((size_t) 1 << p) + (size_t) ((cls - 1) % 4 + 1) * ((size_t) 1 << (p - 2));
+}
+
+size_t arena_class_size(size_t size) {
+    return size > ARENA_MAX_CLASS ? size : class_size(class_of(size));
+}
+
+static region_t* region_of(const void* ptr) {
+    return (region_t*) ((uintptr_t) ptr & ~(uintptr_t) (ARENA_REGION_SIZE - 1));
+}
+
+static void slab_reset(region_t* region, int index) {
+    char* start = (char*) region + (size_t) index * ARENA_SLAB_SIZE;
+    region->slabs[index] = (slab_t) {
+        .cls = -1,
+        .fresh = index == 0 ? start + REGION_HEADER : start,
+        .end = start + ARENA_SLAB_SIZE,
+    };
+}
+
+// map a region (region lock held): a reserved huge page, else an aligned
+// range the kernel may back with a transparent one, else normal pages
+static region_t* region_map(arena_t* arena) {
+    int kind = ARENA_PAGES_HUGETLB;
+    char* base = MAP_FAILED;
+    if (use_huge_pages) {
+        base = mmap(NULL, ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        // twice the size, so an aligned region fits; THP only backs aligned ranges
+        char* raw = mmap(NULL, 2 * ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        base = (char*) (((uintptr_t) raw + ARENA_REGION_SIZE - 1) &
+                        ~(uintptr_t) (ARENA_REGION_SIZE - 1));
+        if (base > raw) {
+            munmap(raw, base - raw);
+        }
+        munmap(base + ARENA_REGION_SIZE, raw + ARENA_REGION_SIZE - base);
+        kind = use_huge_pages && madvise(base, ARENA_REGION_SIZE, MADV_HUGEPAGE) == 0
+                   ? ARENA_PAGES_THP : ARENA_PAGES_SMALL;
+    }
+
+    region_t* region = (region_t*) base;
+    region->arena = arena;
+    region->kind = kind;
+    region->free_slabs = ARENA_REGION_SLABS;
+    for (int i = 0; i < ARENA_REGION_SLABS; i++) {
+        slab_reset(region, i);
+    }
+    region->prev = NULL;
+    region->next = arena->regions;
+    if (arena->regions != NULL) {
+        arena->regions->prev = region;
+    }
+    arena->regions = region;
+    STATS_ADD(arena_mapped_bytes, ARENA_REGION_SIZE);
+    if (kind != ARENA_PAGES_SMALL) {
+        STATS_ADD(arena_huge_bytes, ARENA_REGION_SIZE);
+    }
+    return region;
+}
+
+static void region_unmap(arena_t* arena, region_t* region) {
+    if (region->prev != NULL) {
+        region->prev->next = region->next;
+    } else {
+        arena->regions = region->next;
+    }
+    if (region->next != NULL) {
+        region->next->prev = region->prev;
+    }
+    STATS_ADD(arena_mapped_bytes, -(long) ARENA_REGION_SIZE);
+    if (region->kind != ARENA_PAGES_SMALL) {
+        STATS_ADD(arena_huge_bytes, -(long) ARENA_REGION_SIZE);
+    }
+    munmap(region, ARENA_REGION_SIZE);
+}
+
+// a slab without a class, from any region with one left or a new region
+static slab_t* slab_take(arena_t* arena, int cls) {
+    pthread_mutex_lock(&arena->region_lock);
+    region_t* region = arena->regions;
+    while (region != NULL && region->free_slabs == 0) {
+        region = region->next;
+    }
+    if (region == NULL) {
+        region = region_map(arena);
+    }
+    slab_t* slab = NULL;
+    if (region != NULL) {
+        for (int i = 0; slab == NULL; i++) {
+            if (region->slabs[i].cls < 0) {
+                slab = &region->slabs[i];
+            }
+        }
+        slab->cls = cls;
+        region->free_slabs--;
+    }
+    pthread_mutex_unlock(&arena->region_lock);
+    return slab;
+}
+
+// hand an empty slab back to its region; the last slab out of a region
+// unmaps it, unless it is the arena's only one
+static void slab_give_back(arena_t* arena, slab_t* slab) {
+    region_t* region = region_of(slab);
+    pthread_mutex_lock(&arena->region_lock);
+    slab_reset(region, (int) (slab - region->slabs));
+    if (++region->free_slabs == ARENA_REGION_SLABS &&
+        (region->prev != NULL || region->next != NULL)) {
+        region_unmap(arena, region);
+    }
+    pthread_mutex_unlock(&arena->region_lock);
+}
+
+static void list_push(arena_t* arena, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = arena->partial[slab->cls];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->partial[slab->cls] = slab;
+    slab->listed = true;
+}
+
+static void list_remove(arena_t* arena, slab_t* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->partial[slab->cls] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+    slab->listed = false;
+}
+
+void* arena_alloc(size_t size) {
+    if (size > ARENA_MAX_CLASS) {
+        STATS_INC(arena_oversized);
+        return malloc(size);
+    }
+    int cls = class_of(size);
+    size_t chunk = class_size(cls);
+    arena_t* arena = &arenas[affinity_current_node()];
+
+    pthread_mutex_lock(&arena->class_locks[cls]);
+    slab_t* slab = arena->partial[cls];
+    if (slab == NULL && (slab = slab_take(arena, cls)) != NULL) {
+        list_push(arena, slab);
+    }
+    void* ptr = NULL;
+    if (slab != NULL) {
+        if (slab->free_chunks != NULL) {
+            ptr = slab->free_chunks;
+            slab->free_chunks = *(void**) ptr;
+        } else {
+            ptr = slab->fresh;
+            slab->fresh += chunk;
+        }
+        slab->used++;
+        if (slab->free_chunks == NULL && slab->fresh + chunk > slab->end) {
+            list_remove(arena, slab);
+        }
+    }
+    pthread_mutex_unlock(&arena->class_locks[cls]);
+
+    if (ptr != NULL) {
+        STATS_ADD(arena_used_bytes, chunk);
+        STATS_ADD(arena_requested_bytes, size);
+    }
+    return ptr;
+}
+
+void arena_free(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > ARENA_MAX_CLASS) {
+        free(ptr);
+        return;
+    }
+    int cls = class_of(size);
+    region_t* region = region_of(ptr);
+    slab_t* slab = &region->slabs[((char*) ptr - (char*) region) / ARENA_SLAB_SIZE];
+    arena_t* arena = region->arena;
+
+    pthread_mutex_lock(&arena->class_locks[cls]);
+    *(void**) ptr = slab->free_chunks;
+    slab->free_chunks = ptr;
+    slab->used--;
+    if (!slab->listed) {
+        list_push(arena, slab);
+    }
+    // an empty slab is kept while it is the class's only one with room,
+    // so a class that allocates and frees one chunk at a time stays put
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        list_remove(arena, slab);
+        slab_give_back(arena, slab);
+    }
+    pthread_mutex_unlock(&arena->class_locks[cls]);
+
+    STATS_ADD(arena_used_bytes, -(long) class_size(cls));
+    STATS_ADD(arena_requested_bytes, -(long) size);
+}
+
+int arena_page_kind(const void* ptr, size_t size) {
+    if (ptr == NULL || size > ARENA_MAX_CLASS) {
+        return -1;
+    }
+    return region_of(ptr)->kind;
+}
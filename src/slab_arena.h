@@ -0,0 +1,55 @@
+/* slab_arena.h */
+#ifndef SLAB_ARENA_H
+#define SLAB_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Constants */
+#define ARENA_REGION_SIZE (2 * 1024 * 1024)  // one huge page, the unit mapped from the kernel
+#define ARENA_SLAB_SIZE (256 * 1024)         // regions are cut into slabs of one size class each
+#define ARENA_REGION_SLABS (ARENA_REGION_SIZE / ARENA_SLAB_SIZE)
+#define ARENA_MIN_CLASS 64                   // smallest chunk
+#define ARENA_MAX_CLASS (80 * 1024)          // largest chunk: a SENDFILE_THRESHOLD file and its NUL
+#define ARENA_CLASSES 42                     // 64, then four classes per doubling up to 80 KiB
+
+/* How a region's pages are backed */
+#define ARENA_PAGES_HUGETLB 0    // MAP_HUGETLB, from the reserved huge page pool
+#define ARENA_PAGES_THP 1        // normal mapping advised with MADV_HUGEPAGE
+#define ARENA_PAGES_SMALL 2      // 4 KiB pages: huge pages are off or unavailable
+
+/**
+ * Back the arena with huge pages (MAP_HUGETLB, else MADV_HUGEPAGE) or, with
+ * huge_pages false, with normal pages only. Call before the workers start;
+ * without a call huge pages are tried.
+ */
+void arena_init(bool huge_pages);
+
+/**
+ * Round size up to its size class. Classes step by a quarter of the power
+ * of two below them, so no chunk wastes more than a fifth of itself.
+ * Returns: the chunk size, or size itself above ARENA_MAX_CLASS
+ */
+size_t arena_class_size(size_t size);
+
+/**
+ * Allocate size bytes from the calling thread's NUMA node's arena, 16-byte
+ * aligned and uninitialized. Sizes above ARENA_MAX_CLASS go to malloc().
+ * Returns: the memory, or NULL if no region could be mapped
+ */
+void* arena_alloc(size_t size);
+
+/**
+ * Give back memory from arena_alloc(); size must be the size it was
+ * allocated with. Any thread may free. Slabs left empty go back to their
+ * region for other size classes, and regions left empty are unmapped.
+ */
+void arena_free(void* ptr, size_t size);
+
+/**
+ * How the region holding ptr is backed (one of ARENA_PAGES_*)
+ * Returns: the backing, or -1 if ptr was not allocated from a region
+ */
+int arena_page_kind(const void* ptr, size_t size);
+
+#endif /* SLAB_ARENA_H */
@@ -0,0 +1,185 @@
+/* tls.c */
+#include "tls.h"
+#include <stdio.h>
+
+#ifdef WITH_TLS
+
+#include "server_stats.h"
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+static SSL_CTX* tls_ctx = NULL;
+
+// ciphers the kernel can take over after the handshake
+static const char* ktls_ciphers =
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+    "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+static const char* ktls_ciphersuites =
+    "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                       const unsigned char* in, unsigned int inlen, void* arg) {
+    (void) ssl;
+    (void) arg;
+    static const unsigned char http11[] = "\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char**) out, outlen, http11, sizeof(http11) - 1,
+                              in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// the "tls" ULP is loaded on demand, so this is only worth a warning
+static void check_ktls_available(void) {
+    char ulps[256] = "";
+    FILE* fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (fp != NULL) {
+        if (fgets(ulps, sizeof(ulps), fp) == NULL) {
+            ulps[0] = '\0';
+        }
+        fclose(fp);
+    }
+    if (strstr(ulps, "tls") == NULL) {
+        fprintf(stderr, "tls: kernel TLS module not loaded (modprobe tls), "
+                        "connections will fail unless it can be autoloaded\n");
+    }
+}
+
+int tls_init(const char* cert_file, const char* key_file) {
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    // receive offload for TLS 1.3 only arrived in OpenSSL 3.2
+    SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+#endif
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                 SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_cipher_list(tls_ctx, ktls_ciphers);
+    SSL_CTX_set_ciphersuites(tls_ctx, ktls_ciphersuites);
+    SSL_CTX_set_alpn_select_cb(tls_ctx, select_alpn, NULL);
+
+    // resumption: a server-side session cache plus stateless tickets
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT_SECS);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char*) "httpd", 5);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+
+    check_ktls_available();
+    return 0;
+}
+
+bool tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+int tls_accept(int client_fd) {
+    SSL* ssl = SSL_new(tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, client_fd) != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    if (SSL_accept(ssl) != 1) {
+        STATS_INC(tls_handshake_failures);
+        SSL_free(ssl);
+        return -1;
+    }
+    STATS_INC(tls_handshakes);
+    if (SSL_session_reused(ssl)) {
+        STATS_INC(tls_sessions_resumed);
+    }
+
+    // OpenSSL installs the keys in the kernel as soon as the handshake is done
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            fprintf(stderr, "tls: kTLS could not be enabled for %s, closing connections\n",
+                    SSL_get_cipher_name(ssl));
+        }
+        STATS_INC(tls_ktls_failures);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    // mark it cleanly shut down so freeing it keeps the session resumable
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+    return 0;
+}
+
+void tls_close_notify(int client_fd) {
+    // a warning-level close_notify alert, sent as a TLS alert record
+    unsigned char alert[2] = {1, 0};
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = {.iov_base = alert, .iov_len = sizeof(alert)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = 21;  // alert
+
+    sendmsg(client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void tls_cleanup(void) {
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+#else /* !WITH_TLS */
+
+int tls_init(const char* cert_file, const char* key_file) {
+    (void) cert_file;
+    (void) key_file;
+    fprintf(stderr, "tls: built without TLS support, rebuild with \"make TLS=1\"\n");
+    return -1;
+}
+
+bool tls_enabled(void) {
+    return false;
+}
+
+int tls_accept(int client_fd) {
+    (void) client_fd;
+    return -1;
+}
+
+void tls_close_notify(int client_fd) {
+    (void) client_fd;
+}
+
+void tls_cleanup(void) {
+}
+
+#endif /* WITH_TLS */
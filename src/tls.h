@@ -0,0 +1,42 @@
+/* tls.h */
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+
+/* Constants */
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT_SECS 300
+
+/**
+ * Load the certificate chain and private key and set up the server context.
+ * Only available when built with "make TLS=1".
+ * Returns: 0 on success, -1 on error
+ */
+int tls_init(const char* cert_file, const char* key_file);
+
+/**
+ * Whether accepted connections speak TLS
+ */
+bool tls_enabled(void);
+
+/**
+ * Run the handshake on a freshly accepted socket, then hand the session
+ * keys to the kernel (kTLS) for both directions. On success client_fd
+ * carries plaintext for read/write/sendfile/splice as before and the
+ * OpenSSL state is already gone.
+ * Returns: 0 on success, -1 if the handshake failed or kTLS is unavailable
+ */
+int tls_accept(int client_fd);
+
+/**
+ * Send a close_notify alert through kTLS before the socket is closed
+ */
+void tls_close_notify(int client_fd);
+
+/**
+ * Free the server context
+ */
+void tls_cleanup(void);
+
+#endif /* TLS_H */
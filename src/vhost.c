@@ -0,0 +1,208 @@
+/* vhost.c */
+#include "vhost.h"
+#include "content_hash.h"
+#include "server_stats.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define LINE_MAX_BYTES 4096
+
+/* Open-addressed table, at most half full, built once before the workers
+ * start and only read after that, so lookups take no lock */
+typedef struct vhost_slot {
+    uint64_t hash;
+    const vhost_t* host;        // NULL: empty
+} vhost_slot_t;
+
+static vhost_t hosts[VHOST_MAX];
+static int host_count;
+static vhost_slot_t* slots;
+static size_t slot_mask;
+
+// lowercase host into name without port or trailing dot
+// Returns: length, 0 if it is empty or too long
+static size_t normalize(const char* host, char* name) {
+    size_t len = 0;
+    bool bracketed = host[0] == '[';   // an IPv6 literal, its colons are not a port
+    for (const char* p = host; *p != '\0'; p++) {
+        if (*p == ':' && !bracketed) {
+            break;
+        }
+        if (len == VHOST_NAME_MAX - 1) {
+            return 0;
+        }
+        name[len++] = (char) tolower((unsigned char) *p);
+        if (*p == ']') {
+            bracketed = false;
+        }
+    }
+    while (len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+    name[len] = '\0';
+    return len;
+}
+
+static const vhost_t* probe(const char* key, size_t len) {
+    uint64_t hash = xxh3_64(key, len);
+    for (size_t i = hash & slot_mask; slots[i].host != NULL; i = (i + 1) & slot_mask) {
+        if (slots[i].hash == hash && strcmp(slots[i].host->name, key) == 0) {
+            return slots[i].host;
+        }
+    }
+    return NULL;
+}
+
+const vhost_t* vhost_find(const char* host) {
+    char name[VHOST_NAME_MAX];
+    size_t len;
+    if (slots == NULL || host == NULL || (len = normalize(host, name)) == 0 || name[0] == '.') {
+        return NULL;
+    }
+    const vhost_t* found = probe(name, len);
+    for (char* dot = strchr(name, '.'); found == NULL && dot != NULL; dot = strchr(dot + 1, '.')) {
+        found = probe(dot, len - (size_t) (dot - name));
+    }
+    return found;
+}
+
+const char* vhost_docroot(const char* host, const char* fallback) {
+    if (slots == NULL) {
+        return fallback;
+    }
+    const vhost_t* found = vhost_find(host);
+    if (found == NULL) {
+        STATS_INC(vhost_unmatched);
+        return fallback;
+    }
+    return found->docroot;
+}
+
+void vhost_cleanup(void) {
+    for (int i = 0; i < host_count; i++) {
+        free(hosts[i].name);
+        // names from one line share their docroot, the first of them owns it
+        if (i == 0 || hosts[i].docroot != hosts[i - 1].docroot) {
+            free(hosts[i].docroot);
+        }
+    }
+    host_count = 0;
+    free(slots);
+    slots = NULL;
+    slot_mask = 0;
+}
+
+// a name as written in the file: "*." and a suffix, or a plain host name
+// Returns: 0, or -1 if it is not a name we could ever match
+static int add_name(const char* token, char* docroot) {
+    char name[VHOST_NAME_MAX];
+    bool wildcard = strncmp(token, "*.", 2) == 0;
+    const char* rest = wildcard ? token + 1 : token;
+    if (strchr(rest, '*') != NULL || strchr(rest, '/') != NULL || strchr(rest, ':') != NULL ||
+        strlen(rest) >= VHOST_NAME_MAX || normalize(rest, name) == 0 ||
+        (!wildcard && name[0] == '.') || (wildcard && name[1] == '\0') ||
+        host_count == VHOST_MAX) {
+        return -1;
+    }
+    hosts[host_count].name = strdup(name);
+    hosts[host_count].docroot = docroot;
+    if (hosts[host_count].name == NULL) {
+        return -1;
+    }
+    host_count++;
+    return 0;
+}
+
+static int build_table(void) {
+    size_t size = 16;
+    while (size < (size_t) host_count * 2) {
+        size *= 2;
+    }
+    if ((slots = calloc(size, sizeof(vhost_slot_t))) == NULL) {
+        return -1;
+    }
+    slot_mask = size - 1;
+    for (int i = 0; i < host_count; i++) {
+        size_t len = strlen(hosts[i].name);
+        if (probe(hosts[i].name, len) != NULL) {
+            fprintf(stderr, "vhosts: %s is given twice\n", hosts[i].name);
+            return -1;
+        }
+        uint64_t hash = xxh3_64(hosts[i].name, len);
+        size_t slot = hash & slot_mask;
+        while (slots[slot].host != NULL) {
+            slot = (slot + 1) & slot_mask;
+        }
+        slots[slot] = (vhost_slot_t) {hash, &hosts[i]};
+    }
+    return 0;
+}
+
+int vhost_load(const char* path) {
+    vhost_cleanup();
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[LINE_MAX_BYTES];
+    int line_no = 0;
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        char* tokens[64];
+        int count = 0;
+        char* saveptr;
+        for (char* token = strtok_r(line, " \t\r\n", &saveptr); token != NULL && token[0] != '#';
+             token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+            if (count == (int) (sizeof(tokens) / sizeof(tokens[0]))) {
+                count = -1;
+                break;
+            }
+            tokens[count++] = token;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        struct stat st;
+        char* docroot = count >= 2 ? realpath(tokens[count - 1], NULL) : NULL;
+        if (docroot == NULL || stat(docroot, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "vhosts: %s:%d: expected host names and an existing docroot\n",
+                    path, line_no);
+            free(docroot);
+            status = -1;
+            break;
+        }
+        int first = host_count;
+        for (int i = 0; i < count - 1 && status == 0; i++) {
+            if (add_name(tokens[i], docroot) < 0) {
+                fprintf(stderr, "vhosts: %s:%d: bad host name %s\n", path, line_no, tokens[i]);
+                status = -1;
+            }
+        }
+        if (host_count == first) {
+            free(docroot);  // no name took ownership
+        }
+    }
+    fclose(fp);
+
+    if (status == 0 && host_count == 0) {
+        fprintf(stderr, "vhosts: %s: no hosts\n", path);
+        status = -1;
+    }
+    if (status == 0 && build_table() < 0) {
+        status = -1;
+    }
+    if (status < 0) {
+        vhost_cleanup();
+        return -1;
+    }
+    return host_count;
+}
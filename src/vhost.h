@@ -0,0 +1,50 @@
+/* vhost.h */
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <stddef.h>
+
+/* Constants */
+#define VHOST_MAX 4096          // names across the whole table
+#define VHOST_NAME_MAX 256      // bytes in a host name, as in http_request_t.host
+
+/* One name of a virtual host. Wildcards ("*.example.com") are kept with the
+ * star dropped (".example.com"), which no exact name can start with. */
+typedef struct vhost {
+    char* name;                 // lowercase, no port, no trailing dot
+    char* docroot;              // canonical, from realpath()
+} vhost_t;
+
+/**
+ * Load virtual hosts from path, replacing any loaded before. Each line is
+ * one or more host names followed by the docroot they share; blank lines
+ * and lines starting with # are skipped:
+ *   example.com www.example.com  /srv/example
+ *   *.example.org                /srv/example-org
+ * A wildcard matches any name ending in its suffix (a.example.org,
+ * a.b.example.org) but not the bare domain. Call before the workers start.
+ * Returns: number of names loaded, -1 on an unreadable file, a bad line,
+ * a docroot that is not a directory or a name given twice
+ */
+int vhost_load(const char* path);
+
+/**
+ * Virtual host for the value of a Host header or :authority: a hash probe
+ * for the exact name, then one per dot for the wildcards, longest suffix
+ * first. Case and any :port are ignored.
+ * Returns: the host, or NULL if no name matches
+ */
+const vhost_t* vhost_find(const char* host);
+
+/**
+ * Docroot to serve host from: its virtual host's, or fallback when no
+ * table is loaded or no name matches
+ */
+const char* vhost_docroot(const char* host, const char* fallback);
+
+/**
+ * Forget every virtual host
+ */
+void vhost_cleanup(void);
+
+#endif /* VHOST_H */
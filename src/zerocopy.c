@@ -0,0 +1,249 @@
+/* zerocopy.c */
+#define _GNU_SOURCE
+#include "zerocopy.h"
+#include "server_stats.h"
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/* One send waiting for the kernel to be done with its pages */
+typedef struct zc_pending {
+    uint32_t seq;                 // the socket's count of zero-copy sends when it was made
+    cache_entry_t* owner;         // NULL once completed
+} zc_pending_t;
+
+/* Zero-copy state of one socket, by fd; only the thread that owns the
+ * connection at the moment touches it */
+typedef struct zc_socket {
+    bool enabled;                 // SO_ZEROCOPY is set
+    bool refused;                 // the socket does not do zero-copy, always copy
+    uint32_t next_seq;
+    int head;                     // oldest pending send
+    int count;
+    zc_pending_t pending[ZEROCOPY_MAX_PENDING];
+} zc_socket_t;
+
+/* A connection that ended before its sends completed: shut down for
+ * writing but kept open, so the reaper can still read its completions */
+typedef struct zc_linger {
+    struct zc_linger* next;
+    int fd;
+} zc_linger_t;
+
+static size_t threshold;
+static zc_socket_t** sockets;     // indexed by fd
+static int max_fds;
+
+static pthread_mutex_t linger_lock = PTHREAD_MUTEX_INITIALIZER;
+static zc_linger_t* lingering;    // their zc_socket_t belongs to the reaper
+static int reaper_epoll = -1;
+static pid_t reaper_pid;          // a forked worker starts its own reaper
+
+void zerocopy_init(size_t bytes) {
+    struct rlimit limit;
+    max_fds = ZEROCOPY_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) max_fds) {
+        max_fds = (int) limit.rlim_cur;
+    }
+    if (bytes > 0 && sockets == NULL) {
+        sockets = calloc(max_fds, sizeof(zc_socket_t*));
+    }
+    threshold = sockets != NULL ? bytes : 0;
+}
+
+bool zerocopy_eligible(const http_response_t* response) {
+    return threshold > 0 && !response->use_sendfile && response->cache_entry != NULL &&
+           response->content != NULL && response->content == response->cache_entry->content &&
+           response->content_length >= threshold;
+}
+
+static zc_socket_t* socket_state(int fd, bool create) {
+    if (sockets == NULL || fd < 0 || fd >= max_fds) {
+        return NULL;
+    }
+    if (sockets[fd] == NULL && create) {
+        sockets[fd] = calloc(1, sizeof(zc_socket_t));
+    }
+    return sockets[fd];
+}
+
+// sends lo..hi (inclusive, wrapping) are done with their pages
+static void complete(zc_socket_t* s, uint32_t lo, uint32_t hi) {
+    for (int i = 0; i < s->count; i++) {
+        zc_pending_t* p = &s->pending[(s->head + i) % ZEROCOPY_MAX_PENDING];
+        if (p->owner != NULL && p->seq - lo <= hi - lo) {
+            file_cache_release(p->owner);
+            p->owner = NULL;
+        }
+    }
+    while (s->count > 0 && s->pending[s->head].owner == NULL) {
+        s->head = (s->head + 1) % ZEROCOPY_MAX_PENDING;
+        s->count--;
+    }
+}
+
+int zerocopy_reap(int fd) {
+    zc_socket_t* s = socket_state(fd, false);
+    if (s == NULL || s->count == 0) {
+        return 0;
+    }
+    int reaped = 0;
+    while (s->count > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* err = (struct sock_extended_err*) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // the kernel had to copy after all, e.g. over loopback
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                STATS_INC(zerocopy_copied);
+            }
+            complete(s, err->ee_info, err->ee_data);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+ssize_t zerocopy_send(int fd, const char* buf, size_t len, cache_entry_t* owner) {
+    zc_socket_t* s = socket_state(fd, true);
+    if (s == NULL || s->refused) {
+        return 0;
+    }
+    if (!s->enabled) {
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            s->refused = true;
+            return 0;
+        }
+        s->enabled = true;
+    }
+    zerocopy_reap(fd);
+
+    size_t sent = 0;
+    while (sent < len && s->count < ZEROCOPY_MAX_PENDING) {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+            break;  // full, or out of option memory for notifications
+        }
+        if (n < 0) {
+            return -1;
+        }
+        file_cache_retain(owner);
+        s->pending[(s->head + s->count) % ZEROCOPY_MAX_PENDING] =
+            (zc_pending_t) {.seq = s->next_seq++, .owner = owner};
+        s->count++;
+        sent += n;
+        STATS_INC(zerocopy_sends);
+    }
+    STATS_ADD(zerocopy_bytes, sent);
+    return (ssize_t) sent;
+}
+
+// reap every lingering socket, close the ones the kernel is done with
+static void reap_lingering(void) {
+    pthread_mutex_lock(&linger_lock);
+    zc_linger_t** link = &lingering;
+    while (*link != NULL) {
+        zc_linger_t* linger = *link;
+        zc_socket_t* s = socket_state(linger->fd, false);
+        zerocopy_reap(linger->fd);
+        // an aborted connection keeps reporting its error until it is read
+        int err;
+        socklen_t err_len = sizeof(err);
+        getsockopt(linger->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (s->count > 0) {
+            link = &linger->next;
+            continue;
+        }
+        *link = linger->next;
+        memset(s, 0, sizeof(*s));
+        close(linger->fd);
+        free(linger);
+        STATS_DEC(zerocopy_lingering);
+    }
+    pthread_mutex_unlock(&linger_lock);
+}
+
+static void* reaper_thread(void* arg) {
+    (void) arg;
+    struct epoll_event events[64];
+    for (;;) {
+        // completions wake it; the timeout catches anything an edge missed
+        epoll_wait(reaper_epoll, events, 64, ZEROCOPY_SWEEP_MS);
+        reap_lingering();
+    }
+    return NULL;
+}
+
+// Returns: 0 once this process has a reaper, -1 if it cannot have one
+static int start_reaper(void) {
+    if (reaper_pid == getpid()) {
+        return 0;
+    }
+    if (reaper_epoll >= 0) {
+        close(reaper_epoll);  // the parent's, inherited over fork
+    }
+    reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+    pthread_t thread;
+    if (reaper_epoll < 0 || pthread_create(&thread, NULL, reaper_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    reaper_pid = getpid();
+    return 0;
+}
+
+void zerocopy_close(int fd) {
+    zc_socket_t* s = socket_state(fd, false);
+    if (s != NULL) {
+        zerocopy_reap(fd);
+    }
+    if (s == NULL || s->count == 0) {
+        if (s != NULL) {
+            memset(s, 0, sizeof(*s));  // the fd number is reused by the next connection
+        }
+        close(fd);
+        return;
+    }
+
+    // the kernel still reads pages of these sends; closing now would lose the
+    // completions that say when it stops, so the socket stays open until then.
+    // A peer that acknowledges nothing gets the connection aborted, which
+    // frees the queued data and reports it complete.
+    shutdown(fd, SHUT_WR);
+    unsigned int timeout = ZEROCOPY_LINGER_MS;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&linger_lock);
+    zc_linger_t* linger = start_reaper() == 0 ? malloc(sizeof(zc_linger_t)) : NULL;
+    if (linger != NULL) {
+        linger->fd = fd;
+        linger->next = lingering;
+        lingering = linger;
+        STATS_INC(zerocopy_lingering);
+        struct epoll_event event = {.events = EPOLLET, .data.fd = fd};
+        epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+    pthread_mutex_unlock(&linger_lock);
+    if (linger == NULL) {
+        // nobody could read the completions: better leaked references than
+        // pages freed under the kernel
+        memset(s, 0, sizeof(*s));
+        close(fd);
+    }
+}
@@ -0,0 +1,53 @@
+/* zerocopy.h */
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "http_server.h"
+
+/* Constants */
+#define ZEROCOPY_MAX_PENDING 64         // sends per socket waiting for their completion
+#define ZEROCOPY_LINGER_MS 30000        // TCP_USER_TIMEOUT of a closed connection with sends in flight
+#define ZEROCOPY_SWEEP_MS 1000          // the reaper looks at every lingering socket this often
+#define ZEROCOPY_MAX_FDS (1 << 20)      // sockets with a higher fd always copy
+
+/**
+ * Send cached bodies of at least threshold bytes with MSG_ZEROCOPY
+ * (0 = never). Call once before the workers start.
+ */
+void zerocopy_init(size_t threshold);
+
+/**
+ * Whether response's body should be lent to the kernel rather than copied:
+ * zero-copy is on, and the body is a cache entry's content of at least
+ * the threshold
+ */
+bool zerocopy_eligible(const http_response_t* response);
+
+/**
+ * Send up to len bytes of buf with MSG_ZEROCOPY, without blocking. The
+ * kernel reads the pages after send() returns, so every send takes a
+ * reference on owner, dropped once the socket's error queue reports that
+ * send complete (zerocopy_reap()). Sockets that refuse SO_ZEROCOPY, a full
+ * socket buffer and exhausted option memory all end the call early.
+ * Returns: bytes sent (the caller copies the rest), -1 on a socket error
+ */
+ssize_t zerocopy_send(int fd, const char* buf, size_t len, cache_entry_t* owner);
+
+/**
+ * Read the completions queued on fd and drop the references of the sends
+ * they cover. Call when poll() reports POLLERR on a socket that may have
+ * sent with zerocopy_send().
+ * Returns: number of completion notifications read
+ */
+int zerocopy_reap(int fd);
+
+/**
+ * Close a connection's socket. One with sends still in flight is shut down
+ * for writing instead and handed to a reaper thread, which closes it and
+ * drops their references once the kernel has reported them all complete.
+ * If the peer acknowledges nothing for ZEROCOPY_LINGER_MS the kernel aborts
+ * the connection, which completes them too.
+ */
+void zerocopy_close(int fd);
+
+#endif /* ZEROCOPY_H */
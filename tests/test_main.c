@@ -4,6 +4,30 @@
 #include <sys/stat.h>
 #include "../src/network_utils.h"
 #include "../src/http_server.h"
+#include "../src/server_config.h"
+#include "../src/proxy.h"
+#include "../src/request_body.h"
+#include "../src/response_stream.h"
+#include "../src/cpu_affinity.h"
+#include "../src/rate_limit.h"
+#include "../src/content_hash.h"
+#include "../src/file_cache.h"
+#include "../src/server_stats.h"
+#include "../src/restart.h"
+#include "../src/send_offload.h"
+#include "../src/hpack.h"
+#include "../src/http2.h"
+#include "../src/zerocopy.h"
+#include "../src/slab_arena.h"
+#include "../src/vhost.h"
+#include "../src/capture.h"
+#include "../src/perf_counters.h"
+#include "../src/dir_index.h"
+#include "../src/tls.h"
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #define CHECK_OR_DIE(expr, msg) \
    do { \
@@ -16,8 +40,35 @@
 // Forward declarations for test functions
 void test_parse_request(void);
 void test_generate_response(void);
+void test_admission_control(void);
+void test_proxy(void);
+void test_request_body(void);
+void test_response_stream(void);
+void test_cpu_affinity(void);
+void test_accept_path(void);
+void test_rate_limit(void);
+void test_file_cache(void);
+void test_prefork(void);
+void test_restart(void);
+void test_send_offload(void);
+void test_hpack(void);
+void test_http2(void);
+void test_zerocopy(void);
+void test_slab_arena(void);
+void test_vhost(void);
+void test_capture(void);
+void test_perf_counters(void);
+void test_dir_index(void);
+void test_tls(void);
 void cleanup(void);
 
+extern sbuf_cond_t shared_buffer;
+void init_shared_buffer(void);
+void get_task_from_buffer(int cpu, http_task_t* task);
+int init_server(char* port);
+int store_upload(const http_request_t *request, request_body_t *body,
+                 http_response_t *response, const char *docroot);
+
 static char* HOST = "localhost";
 static char* PORT = "1025";
 
@@ -56,6 +107,26 @@ int main(void) {
 
     test_parse_request();
     test_generate_response();
+    test_admission_control();
+    test_proxy();
+    test_request_body();
+    test_response_stream();
+    test_cpu_affinity();
+    test_accept_path();
+    test_rate_limit();
+    test_file_cache();
+    test_prefork();
+    test_restart();
+    test_send_offload();
+    test_hpack();
+    test_http2();
+    test_zerocopy();
+    test_slab_arena();
+    test_vhost();
+    test_capture();
+    test_perf_counters();
+    test_dir_index();
+    test_tls();
     
     // Final cleanup (in case all tests pass)
     // cleanup();
@@ -104,6 +175,70 @@ void test_parse_request(void) {
         "hello world";
     TEST_ASSERT(parse_request(post_request, &request) == 0);
     TEST_ASSERT(strncmp(request.body, "hello world", 11) == 0);
+    TEST_ASSERT(request.content_length == 11);
+
+    // Test 4: every known header name maps back to its ID, in any case
+    for (int id = 0; id < HDR_COUNT; id++) {
+        TEST_ASSERT(header_lookup(header_name(id), strlen(header_name(id))) == id);
+    }
+    TEST_ASSERT(header_lookup("if-NONE-match", 13) == HDR_IF_NONE_MATCH);
+    TEST_ASSERT(header_lookup("X-Custom", 8) == HDR_UNKNOWN);
+    TEST_ASSERT(header_has_token("keep-alive, Upgrade", 19, "upgrade"));
+    TEST_ASSERT(!header_has_token("keep-alive-ish", 14, "keep-alive"));
+
+    // Test 5: known headers by ID, unknown ones by name, values trimmed
+    char conditional[] =
+        "GET /a.png HTTP/1.1\r\n"
+        "host: example.com\r\n"
+        "If-None-Match:  \"abc\"  \r\n"
+        "Range: bytes=0-99\r\n"
+        "Accept-Encoding: gzip\r\n"
+        "X-Custom: yes\r\n"
+        "Connection: Keep-Alive, CLOSE\r\n"
+        "\r\n";
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(request.num_headers == 6);
+    const header_view_t* header = get_header(&request, HDR_IF_NONE_MATCH);
+    TEST_ASSERT(header != NULL && header->value_len == 5 && strncmp(header->value, "\"abc\"", 5) == 0);
+    TEST_ASSERT(get_header(&request, HDR_RANGE) != NULL);
+    TEST_ASSERT(get_header(&request, HDR_COOKIE) == NULL);
+    header = find_header(&request, "x-custom");
+    TEST_ASSERT(header != NULL && header_value_is(header, "YES"));
+    TEST_ASSERT(strcmp(request.host, "example.com") == 0);
+    TEST_ASSERT(request.connection_close);
+
+    // Test 6: HTTP/1.0 closes unless asked not to, and needs no Host
+    char http10[] = "GET / HTTP/1.0\r\n\r\n";
+    TEST_ASSERT(parse_request(http10, &request) == 0);
+    TEST_ASSERT(request.version_minor == 0 && request.connection_close);
+    char http10_keep_alive[] = "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+    TEST_ASSERT(parse_request(http10_keep_alive, &request) == 0);
+    TEST_ASSERT(!request.connection_close);
+
+    // Test 7: malformed requests
+    char no_version[] = "GET /\r\nHost: a\r\n\r\n";
+    TEST_ASSERT(parse_request(no_version, &request) == PARSE_BAD_REQUEST);
+    char bad_version[] = "GET / HTTP/2.0\r\nHost: a\r\n\r\n";
+    TEST_ASSERT(parse_request(bad_version, &request) == PARSE_BAD_REQUEST);
+    char space_before_colon[] = "GET / HTTP/1.1\r\nHost : a\r\n\r\n";
+    TEST_ASSERT(parse_request(space_before_colon, &request) == PARSE_BAD_REQUEST);
+    char two_lengths[] = "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 1\r\n"
+                         "Content-Length: 2\r\n\r\n";
+    TEST_ASSERT(parse_request(two_lengths, &request) == PARSE_BAD_REQUEST);
+    char same_lengths[] = "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 2\r\n"
+                          "Content-Length: 2\r\n\r\n";
+    TEST_ASSERT(parse_request(same_lengths, &request) == 0);
+    char two_codings[] = "POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n"
+                         "Transfer-Encoding: gzip\r\n\r\n";
+    TEST_ASSERT(parse_request(two_codings, &request) == PARSE_BAD_REQUEST);
+    char signed_length[] = "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: +2\r\n\r\n";
+    TEST_ASSERT(parse_request(signed_length, &request) == PARSE_BAD_REQUEST);
+
+    // Test 8: more header lines than allowed
+    server_config.max_headers = 2;
+    char many[] = "GET / HTTP/1.1\r\nHost: a\r\nA: 1\r\nB: 2\r\n\r\n";
+    TEST_ASSERT(parse_request(many, &request) == PARSE_HEADERS_TOO_LARGE);
+    server_config.max_headers = 0;
 }
 
 void test_generate_response(void) {
@@ -215,4 +350,1733 @@ void test_generate_response(void) {
     cleanup();
 }
 
+void test_admission_control(void) {
+    // Test 1: options before the positional arguments
+    server_config_t config;
+    char* argv[] = {"httpd", "-c", "64", "--max-queue-wait", "250", "-r", "3",
+                    "-s", "/server-status", "8080", "/var/www", NULL};
+    TEST_ASSERT(parse_config(11, argv, &config) == 0);
+    TEST_ASSERT(config.max_connections == 64);
+    TEST_ASSERT(config.max_queue_wait_ms == 250);
+    TEST_ASSERT(config.retry_after_secs == 3);
+    TEST_ASSERT(strcmp(config.status_path, "/server-status") == 0);
+    TEST_ASSERT(strcmp(config.port, "8080") == 0);
+    TEST_ASSERT(strcmp(config.docroot, "/var/www") == 0);
+
+    // Test 2: plain "<port> <docroot>" still works with defaults
+    char* plain_argv[] = {"httpd", "1025", ".", NULL};
+    TEST_ASSERT(parse_config(3, plain_argv, &config) == 0);
+    TEST_ASSERT(config.max_connections == 0);
+    TEST_ASSERT(config.retry_after_secs == DEFAULT_RETRY_AFTER_SECS);
+    TEST_ASSERT(config.status_path == NULL);
+    TEST_ASSERT(config.tls_cert == NULL && config.tls_key == NULL);
+
+    // a certificate without its key is a usage error
+    char* tls_argv[] = {"httpd", "-C", "cert.pem", "1025", ".", NULL};
+    TEST_ASSERT(parse_config(5, tls_argv, &config) < 0);
+
+    // Test 3: a full queue rejects instead of blocking the caller
+    init_shared_buffer();
+    static http_task_t tasks[MAX_TASK + 1];
+    for (int i = 0; i < MAX_TASK; i++) {
+        TEST_ASSERT(add_to_buffer(&tasks[i]));
+    }
+    TEST_ASSERT(!add_to_buffer(&tasks[MAX_TASK]));
+    TEST_ASSERT(shared_buffer.count == MAX_TASK);
+    init_shared_buffer();
+}
+
+// stand-in upstream: answers every request on a connection with "hello", chunked
+// and after an Early Hints reply for /api/hints
+static int upstream_accepts = 0;
+
+static void* fake_upstream(void* arg) {
+    int listen_fd = *(int*) arg;
+    int conn_fd;
+    while ((conn_fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        upstream_accepts++;
+        char buf[MAXBUF];
+        ssize_t n;
+        while ((n = read(conn_fd, buf, sizeof(buf) - 1)) > 0) {
+            const char* reply = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+            if (strncmp(buf, "GET /api/hints ", 15) == 0) {
+                reply = "HTTP/1.1 103 Early Hints\r\nLink: </a.css>; rel=preload\r\n\r\n"
+                        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                        "5\r\nhello\r\n0\r\n\r\n";
+            }
+            write(conn_fd, reply, strlen(reply));
+        }
+        close(conn_fd);
+    }
+    return NULL;
+}
+
+static void read_reply(int fd, char* buf, size_t len) {
+    // the proxy has already written everything by the time it returns
+    ssize_t n = recv(fd, buf, len - 1, MSG_DONTWAIT);
+    buf[n > 0 ? n : 0] = '\0';
+}
+
+void test_proxy(void) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    CHECK_OR_DIE(bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0, "bind");
+    CHECK_OR_DIE(listen(listen_fd, 8) == 0, "listen");
+    getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len);
+
+    pthread_t upstream_thread;
+    pthread_create(&upstream_thread, NULL, fake_upstream, &listen_fd);
+
+    char spec[64];
+    snprintf(spec, sizeof(spec), "/api=127.0.0.1:%d,timeout=1000", ntohs(addr.sin_port));
+    TEST_ASSERT(proxy_add_route(spec) == 0);
+    TEST_ASSERT(proxy_add_route("/down=127.0.0.1:1,max_fails=1,eject=60000") == 0);
+    TEST_ASSERT(proxy_add_route("no-slash=127.0.0.1:80") == -1);
+    TEST_ASSERT(proxy_add_route("/bad=127.0.0.1") == -1);
+
+    // Test 1: prefix matching stops at path segments
+    TEST_ASSERT(proxy_match("/api") != NULL);
+    TEST_ASSERT(proxy_match("/api/users?id=1") != NULL);
+    TEST_ASSERT(proxy_match("/apix") == NULL);
+    TEST_ASSERT(proxy_match("/index.html") == NULL);
+
+    int client[2];
+    CHECK_OR_DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, client) == 0, "socketpair");
+    char raw_request[] =
+        "GET /api/users HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    http_request_t request;
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(raw_request, &request) == 0);
+
+    rio_t rio;
+    request_body_t body;
+    rio_readinitb(&rio, client[0]);
+    TEST_ASSERT(body_init(&body, &rio, &request, 0) == 0);
+
+    // Test 2: two requests are relayed over one pooled upstream connection
+    char reply[1024];
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT(proxy_request(proxy_match(request.uri), client[0], raw_request, &request, &body, "10.0.0.1") == 0);
+        read_reply(client[1], reply, sizeof(reply));
+        TEST_ASSERT(strncmp(reply, "HTTP/1.1 200 OK\r\n", 17) == 0);
+        TEST_ASSERT(strstr(reply, "\r\n\r\nhello") != NULL);
+    }
+    TEST_ASSERT(upstream_accepts == 1);
+
+    // Test 3: a dead upstream gives 502, then gets ejected and answers 503 right away
+    TEST_ASSERT(proxy_request(proxy_match("/down"), client[0], raw_request, &request, &body, "10.0.0.1") == 0);
+    read_reply(client[1], reply, sizeof(reply));
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 502", 12) == 0);
+    TEST_ASSERT(proxy_request(proxy_match("/down"), client[0], raw_request, &request, &body, "10.0.0.1") == 0);
+    read_reply(client[1], reply, sizeof(reply));
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 503", 12) == 0);
+
+    // Test 4: Early Hints go to an HTTP/1.1 client ahead of the final reply, whose
+    // chunks pass through, and the pooled connection stays in step
+    char hints_request[] = "GET /api/hints HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    http_request_t hints;
+    TEST_ASSERT(parse_request(hints_request, &hints) == 0);
+    TEST_ASSERT(proxy_request(proxy_match(hints.uri), client[0], hints_request, &hints, &body, "10.0.0.1") == 0);
+    read_reply(client[1], reply, sizeof(reply));
+    char* final = strstr(reply, "\r\n\r\nHTTP/1.1 200 OK\r\n");
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 103 Early Hints\r\nLink: ", 32) == 0 && final != NULL);
+    TEST_ASSERT(strstr(final, "Transfer-Encoding: chunked\r\n") != NULL);
+    TEST_ASSERT(strstr(final, "\r\n\r\n5\r\nhello\r\n0\r\n\r\n") != NULL);
+    TEST_ASSERT(proxy_request(proxy_match(request.uri), client[0], raw_request, &request, &body, "10.0.0.1") == 0);
+    read_reply(client[1], reply, sizeof(reply));
+    TEST_ASSERT(strstr(reply, "\r\n\r\nhello") != NULL && strstr(reply, "103") == NULL);
+    TEST_ASSERT(upstream_accepts == 1);
+
+    // Test 5: an HTTP/1.0 client gets neither the hints nor the chunks
+    char hints10_request[] = "GET /api/hints HTTP/1.0\r\n\r\n";
+    TEST_ASSERT(parse_request(hints10_request, &hints) == 0);
+    TEST_ASSERT(proxy_request(proxy_match(hints.uri), client[0], hints10_request, &hints, &body, "10.0.0.1") == -1);
+    read_reply(client[1], reply, sizeof(reply));
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    TEST_ASSERT(strstr(reply, "Transfer-Encoding") == NULL && strstr(reply, "Connection: close\r\n"));
+    final = strstr(reply, "\r\n\r\n");
+    TEST_ASSERT(final != NULL && strcmp(final, "\r\n\r\nhello") == 0);
+
+    close(client[0]);
+    close(client[1]);
+    proxy_cleanup();
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    pthread_join(upstream_thread, NULL);
+}
+
+void test_request_body(void) {
+    int sv[2];
+    CHECK_OR_DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    rio_t rio;
+    rio_readinitb(&rio, sv[0]);
+
+    // Test 1: chunked body is decoded and trailers are skipped
+    char chunked_request[] =
+        "PUT /upload.txt HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n";
+    http_request_t request;
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(chunked_request, &request) == 0);
+    TEST_ASSERT(request.chunked);
+
+    const char* wire = "5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\nNEXT";
+    TEST_ASSERT(write(sv[1], wire, strlen(wire)) == (ssize_t) strlen(wire));
+
+    request_body_t body;
+    TEST_ASSERT(body_init(&body, &rio, &request, 0) == 0);
+    char buf[64];
+    size_t total = 0;
+    ssize_t n;
+    while ((n = body_read(&body, buf + total, sizeof(buf) - total)) > 0) {
+        total += (size_t) n;
+    }
+    TEST_ASSERT(n == 0 && body.done);
+    TEST_ASSERT(total == 11 && strncmp(buf, "hello world", 11) == 0);
+    // the next request is still in the reader, untouched
+    TEST_ASSERT(rio_readnb(&rio, buf, 4) == 4 && strncmp(buf, "NEXT", 4) == 0);
+
+    // Test 2: a chunked body that grows past the limit is refused
+    wire = "8\r\n12345678\r\n0\r\n\r\n";
+    TEST_ASSERT(write(sv[1], wire, strlen(wire)) == (ssize_t) strlen(wire));
+    TEST_ASSERT(body_init(&body, &rio, &request, 4) == 0);
+    TEST_ASSERT(body_read(&body, buf, sizeof(buf)) == -1 && errno == EFBIG);
+    rio_readinitb(&rio, sv[0]);
+    while (recv(sv[0], buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+
+    // Test 3: a declared Content-Length over the limit is refused up front
+    char length_request[] =
+        "PUT /upload.txt HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Length: 10\r\n"
+        "\r\n";
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(length_request, &request) == 0);
+    TEST_ASSERT(body_init(&body, &rio, &request, 9) == -1);
+
+    // Test 4: a length-delimited body goes straight into a file
+    TEST_ASSERT(body_init(&body, &rio, &request, 10) == 0);
+    TEST_ASSERT(write(sv[1], "0123456789", 10) == 10);
+    FILE* fp = tmpfile();
+    TEST_ASSERT(fp != NULL);
+    TEST_ASSERT(body_write_to_fd(&body, fileno(fp)) == 0);
+    TEST_ASSERT(body.done && body.received == 10);
+    rewind(fp);
+    TEST_ASSERT(fread(buf, 1, sizeof(buf), fp) == 10 && strncmp(buf, "0123456789", 10) == 0);
+    fclose(fp);
+
+    // Test 5: negative or garbage Content-Length is a bad request
+    char bad_length[] =
+        "POST /x HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Length: -1\r\n"
+        "\r\n";
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(bad_length, &request) == -1);
+
+    // Test 6: a length next to chunked framing is a smuggling attempt, not a tie to break
+    char length_and_chunked[] =
+        "POST /x HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Length: 5\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n";
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(length_and_chunked, &request) == -1);
+
+    // Test 7: PUT decodes its path like GET does, the query is not part of the name
+    mkdir(docroot, 0755);
+    server_config.allow_put = true;
+    char put_request[] =
+        "PUT /put%20me.txt?x=1 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Length: 6\r\n"
+        "\r\n";
+    memset(&request, 0, sizeof(request));
+    TEST_ASSERT(parse_request(put_request, &request) == 0);
+    TEST_ASSERT(body_init(&body, &rio, &request, 0) == 0);
+    TEST_ASSERT(write(sv[1], "stored", 6) == 6);
+    http_response_t response;
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(store_upload(&request, &body, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 201);
+
+    char get_request[] = "GET /put%20me.txt HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    memset(&request, 0, sizeof(request));
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(get_request, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.content_length == 6 && memcmp(response.content, "stored", 6) == 0);
+    release_response_body(&response);
+
+    // an escaped traversal or NUL is refused after decoding
+    char traversal[] = "PUT /%2e%2e/escape.txt HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    char nul[] = "PUT /a%00b HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    char* refused[] = {traversal, nul};
+    for (int i = 0; i < 2; i++) {
+        memset(&request, 0, sizeof(request));
+        memset(&response, 0, sizeof(response));
+        TEST_ASSERT(parse_request(refused[i], &request) == 0);
+        TEST_ASSERT(store_upload(&request, &body, &response, docroot) == -1);
+        TEST_ASSERT(response.status_code == 400);
+    }
+
+    // a body cut short says the connection is ending, what is left of it cannot be skipped
+    memset(&request, 0, sizeof(request));
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(put_request, &request) == 0);
+    TEST_ASSERT(body_init(&body, &rio, &request, 0) == 0);
+    TEST_ASSERT(write(sv[1], "sto", 3) == 3);
+    shutdown(sv[1], SHUT_WR);
+    TEST_ASSERT(store_upload(&request, &body, &response, docroot) == -1);
+    TEST_ASSERT(response.status_code == 400 && response.connection_close);
+    server_config.allow_put = false;
+    char stored_path[300];
+    snprintf(stored_path, sizeof(stored_path), "%s/put me.txt", docroot);
+    TEST_ASSERT(unlink(stored_path) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// decode a chunked body in place, returns its length or -1 on bad framing
+static long dechunk(char* body) {
+    char* in = body;
+    char* out = body;
+    while (true) {
+        char* end;
+        long size = strtol(in, &end, 16);
+        if (end == in || strncmp(end, "\r\n", 2) != 0) {
+            return -1;
+        }
+        in = end + 2;
+        if (size == 0) {
+            return strncmp(in, "\r\n", 2) == 0 ? out - body : -1;
+        }
+        memmove(out, in, (size_t) size);
+        out += size;
+        in += size;
+        if (strncmp(in, "\r\n", 2) != 0) {
+            return -1;
+        }
+        in += 2;
+    }
+}
+
+void test_response_stream(void) {
+    int sv[2];
+    CHECK_OR_DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    // enough room for the whole test response without a reader
+    int sndbuf = 1 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &sndbuf, sizeof(sndbuf));
+
+    http_request_t request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.method, "GET");
+    strcpy(request.version, "HTTP/1.1");
+
+    // Test 1: nothing is written until there is a batch or an explicit flush
+    response_stream_t stream;
+    TEST_ASSERT(stream_begin_response(&stream, sv[0], &request, 200, "OK", "text/plain") == 0);
+    TEST_ASSERT(stream_printf(&stream, "line %d\n", 1) == 0);
+    char probe[16];
+    TEST_ASSERT(recv(sv[1], probe, sizeof(probe), MSG_DONTWAIT) == -1);
+
+    // Test 2: a body spanning several pooled buffers arrives intact and chunked
+    size_t total = 7;
+    char pattern[1000];
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = 'a' + (char) (i % 26);
+    }
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT(stream_write(&stream, pattern, sizeof(pattern)) == 0);
+        total += sizeof(pattern);
+    }
+    TEST_ASSERT(stream_end(&stream) == 0);
+    TEST_ASSERT(stream.body_bytes == total);
+    TEST_ASSERT(!stream.connection_close);
+
+    static char wire[256 * 1024];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = recv(sv[1], wire + got, sizeof(wire) - 1 - got, MSG_DONTWAIT)) > 0) {
+        got += (size_t) n;
+    }
+    wire[got] = '\0';
+    TEST_ASSERT(strstr(wire, "Transfer-Encoding: chunked\r\n") != NULL);
+    char* body = strstr(wire, "\r\n\r\n") + 4;
+    TEST_ASSERT(dechunk(body) == (long) total);
+    TEST_ASSERT(strncmp(body, "line 1\n", 7) == 0);
+    for (size_t i = 0; i < total - 7; i++) {
+        TEST_ASSERT(body[7 + i] == pattern[i % sizeof(pattern)]);
+    }
+
+    // Test 3: HTTP/1.0 clients get a raw body and the connection closes after it
+    strcpy(request.version, "HTTP/1.0");
+    TEST_ASSERT(stream_begin_response(&stream, sv[0], &request, 200, "OK", "text/plain") == 0);
+    TEST_ASSERT(stream_write(&stream, "raw", 3) == 0);
+    TEST_ASSERT(stream_end(&stream) == 0);
+    TEST_ASSERT(stream.connection_close);
+    got = (size_t) recv(sv[1], wire, sizeof(wire) - 1, MSG_DONTWAIT);
+    wire[got] = '\0';
+    TEST_ASSERT(strstr(wire, "Transfer-Encoding") == NULL);
+    TEST_ASSERT(strcmp(strstr(wire, "\r\n\r\n") + 4, "raw") == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void test_cpu_affinity(void) {
+    // Test 1: CPU lists
+    bool cpus[MAX_CPUS] = {false};
+    TEST_ASSERT(parse_cpu_list("0-2,5\n", cpus) == 0);
+    TEST_ASSERT(cpus[0] && cpus[1] && cpus[2] && !cpus[3] && cpus[5]);
+    TEST_ASSERT(parse_cpu_list("3-1", cpus) < 0);
+    TEST_ASSERT(parse_cpu_list("1,x", cpus) < 0);
+
+    // Test 2: worker layouts
+    TEST_ASSERT(affinity_plan(NULL, false) == DEFAULT_WORKERS);
+    TEST_ASSERT(worker_info[0].cpu == -1);
+    TEST_ASSERT(affinity_plan("cores", false) >= 1);
+    TEST_ASSERT(worker_info[0].cpu >= 0);
+    TEST_ASSERT(affinity_plan("cpus", true) >= 1);
+    TEST_ASSERT(affinity_plan("bogus", false) < 0);
+    TEST_ASSERT(affinity_plan(NULL, false) == DEFAULT_WORKERS);
+
+    // Test 3: a pinned worker takes a queued connection that arrived on its CPU first
+    init_shared_buffer();
+    http_task_t tasks[3], task;
+    for (int i = 0; i < 3; i++) {
+        tasks[i].client_fd = 100 + i;
+    }
+    tasks[0].incoming_cpu = 1;
+    tasks[1].incoming_cpu = 2;
+    tasks[2].incoming_cpu = 0;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT(add_to_buffer(&tasks[i]));
+    }
+    get_task_from_buffer(0, &task);
+    TEST_ASSERT(task.client_fd == 102);
+    get_task_from_buffer(-1, &task);
+    TEST_ASSERT(task.client_fd == 101);
+    get_task_from_buffer(7, &task);
+    TEST_ASSERT(task.client_fd == 100);
+    TEST_ASSERT(shared_buffer.count == 0);
+
+    // Test 4: counters render per worker
+    char buf[1024];
+    affinity_note_connection(&worker_info[0], -1);
+    TEST_ASSERT(affinity_render(buf, sizeof(buf)) > 0);
+    TEST_ASSERT(strstr(buf, "worker0_connections: 1\n") != NULL);
+    TEST_ASSERT(strstr(buf, "worker4_cpu: -1\n") != NULL);
+}
+
+void test_accept_path(void) {
+    // Test 1: one call drains every pending connection without blocking
+    int listen_fd = init_server("0");
+    TEST_ASSERT(listen_fd >= 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    TEST_ASSERT(getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) == 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int clients[3];
+    for (int i = 0; i < 3; i++) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        TEST_ASSERT(connect(clients[i], (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    }
+
+    init_shared_buffer();
+    TEST_ASSERT(accept_connections(listen_fd, docroot) == 3);
+    TEST_ASSERT(shared_buffer.count == 3);
+    TEST_ASSERT(accept_connections(listen_fd, docroot) == 0);
+
+    // Test 2: accepted sockets inherit the listener's options and stay blocking
+    for (int i = 0; i < 3; i++) {
+        http_task_t task;
+        get_task_from_buffer(-1, &task);
+        TEST_ASSERT(task.docroot == docroot);
+        struct timeval timeout;
+        socklen_t len = sizeof(timeout);
+        TEST_ASSERT(getsockopt(task.client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &len) == 0);
+        TEST_ASSERT(timeout.tv_sec == TIMEOUT_SECS);
+        TEST_ASSERT(fcntl(task.client_fd, F_GETFD) & FD_CLOEXEC);
+        TEST_ASSERT(!(fcntl(task.client_fd, F_GETFL) & O_NONBLOCK));
+        close(task.client_fd);
+        close(clients[i]);
+    }
+    close(listen_fd);
+    init_shared_buffer();
+}
+
+// every thread races for the same bucket at the same instant
+static void* drain_bucket(void* arg) {
+    int* allowed = arg;
+    for (int i = 0; i < 1000; i++) {
+        if (rate_limit_take(RATE_REQ_IP, 0x0A000001, 5000)) {
+            (*allowed)++;
+        }
+    }
+    return NULL;
+}
+
+void test_rate_limit(void) {
+    // Test 1: specs
+    rate_limit_reset();
+    TEST_ASSERT(!rate_limit_enabled());
+    TEST_ASSERT(rate_limit_configure("conn=2/3,conn24=5,req=1000") == 0);
+    TEST_ASSERT(rate_limit_enabled());
+    TEST_ASSERT(rate_limits[RATE_CONN_IP].rate == 2 && rate_limits[RATE_CONN_IP].burst == 3);
+    TEST_ASSERT(rate_limits[RATE_CONN_NET24].burst == 5);
+    TEST_ASSERT(rate_limit_configure("conn=0") < 0);
+    TEST_ASSERT(rate_limit_configure("bogus=1") < 0);
+    TEST_ASSERT(rate_limit_configure("req=5/") < 0);
+
+    // Test 2: burst, then refill at the configured rate
+    uint32_t ip = 0xC0A80107;  // 192.168.1.7
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT(rate_limit_take(RATE_CONN_IP, ip, 1000));
+    }
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_IP, ip, 1000));
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_IP, ip, 1400));
+    TEST_ASSERT(rate_limit_take(RATE_CONN_IP, ip, 1500));
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_IP, ip, 1500));
+    TEST_ASSERT(rate_limit_take(RATE_CONN_IP, 0xC0A80108, 1500));  // its own bucket
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT(rate_limit_take(RATE_CONN_IP, ip, 60000));    // full again after idling
+    }
+
+    // Test 3: a /24 is limited as a whole
+    for (uint32_t host = 1; host <= 5; host++) {
+        TEST_ASSERT(rate_limit_take(RATE_CONN_NET24, 0x0A010200, 1000));
+    }
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_NET24, 0x0A010200, 1000));
+    TEST_ASSERT(rate_limit_take(RATE_CONN_NET24, 0x0A010300, 1000));
+
+    struct in_addr addr;
+    inet_pton(AF_INET, "172.16.0.1", &addr);
+    TEST_ASSERT(rate_limit_connection(addr));
+
+    // Test 4: a bucket past an expired neighbour in the probe window is found, not
+    // replaced by a fresh one in the neighbour's slot
+    rate_limit_reset();
+    TEST_ASSERT(rate_limit_configure("conn=1/1,req=1000/1") == 0);
+    uint32_t fast = 0x0A000001, slow = 0;
+    uint64_t fast_slot = (((uint64_t) RATE_REQ_IP + 1) << 32 | fast) * 0x9E3779B97F4A7C15ull >> 48;
+    while ((((uint64_t) RATE_CONN_IP + 1) << 32 | slow) * 0x9E3779B97F4A7C15ull >> 48 != fast_slot) {
+        slow++;
+    }
+    TEST_ASSERT(rate_limit_take(RATE_REQ_IP, fast, 1000));   // takes the home slot
+    TEST_ASSERT(rate_limit_take(RATE_CONN_IP, slow, 1000));  // lands one further
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_IP, slow, 1000));
+    // the fast bucket has long refilled and expired, the slow one has not
+    TEST_ASSERT(!rate_limit_take(RATE_CONN_IP, slow, 1500));
+    TEST_ASSERT(rate_limit_take(RATE_CONN_IP, slow, 2000));
+
+    // Test 5: concurrent takes never hand out more than the burst
+    rate_limit_reset();
+    TEST_ASSERT(rate_limit_configure("req=1000/1000") == 0);
+    pthread_t threads[4];
+    int allowed[4] = {0};
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, drain_bucket, &allowed[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT(allowed[0] + allowed[1] + allowed[2] + allowed[3] == 1000);
+    rate_limit_reset();
+}
+
+void test_file_cache(void) {
+    // Test 1: XXH3 matches the reference implementation, one-shot and streamed
+    char data[5000];
+    for (int i = 0; i < 5000; i++) {
+        data[i] = (char) i;
+    }
+    TEST_ASSERT(xxh3_64("", 0) == 0x2d06800538d394c2ULL);
+    TEST_ASSERT(xxh3_64("hello", 5) == 0x9555e8555c62dcfdULL);
+    TEST_ASSERT(xxh3_64(data, 5000) == 0x1b74bda2c82a8c7aULL);
+    xxh3_state_t state;
+    xxh3_init(&state);
+    for (int off = 0; off < 5000; off += 333) {
+        xxh3_update(&state, data + off, off + 333 > 5000 ? 5000 - off : 333);
+    }
+    TEST_ASSERT(xxh3_digest(&state) == 0x1b74bda2c82a8c7aULL);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char encoded[SHA256_BASE64_SIZE];
+    sha256("abc", 3, digest);
+    sha256_base64(digest, encoded);
+    TEST_ASSERT(strcmp(encoded, "ungWv48Bz+pBQUDeXa4iI7ADYaOWF3qctBD/YfIAFa0=") == 0);
+
+    // Test 2: If-None-Match lists
+    TEST_ASSERT(header_etag_matches("\"a\", W/\"b\"", 13, "\"b\""));
+    TEST_ASSERT(header_etag_matches("*", 1, "\"b\""));
+    TEST_ASSERT(!header_etag_matches("\"ab\"", 4, "\"b\""));
+    TEST_ASSERT(!header_etag_matches("\"a,\"b\"\"", 8, "\"b\""));
+
+    // Test 3: the ETag follows the content, not the mtime
+    mkdir(docroot, 0755);
+    char path[300];
+    snprintf(path, sizeof(path), "%s/etag.txt", docroot);
+    FILE* fp = fopen(path, "w");
+    TEST_ASSERT(fp != NULL);
+    fputs("version one", fp);
+    fclose(fp);
+
+    char get[] = "GET /etag.txt HTTP/1.1\r\nHost: a\r\n\r\n";
+    http_request_t request;
+    http_response_t response;
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(get, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 200 && response.cache_entry != NULL);
+    TEST_ASSERT(strcmp(response.content, "version one") == 0);
+    char etag[ETAG_SIZE];
+    strcpy(etag, response.cache_entry->etag);
+    file_cache_release(response.cache_entry);
+
+    unsigned long hits = STATS_GET(cache_hits);
+    struct timespec times[2] = {{0, UTIME_NOW}, {1000000000, 0}};
+    TEST_ASSERT(utimensat(AT_FDCWD, path, times, 0) == 0);
+    char conditional[128];
+    snprintf(conditional, sizeof(conditional),
+             "GET /etag.txt HTTP/1.1\r\nHost: a\r\nIf-None-Match: %s\r\n\r\n", etag);
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 304);
+    TEST_ASSERT(strcmp(response.cache_entry->etag, etag) == 0);
+    file_cache_release(response.cache_entry);
+    TEST_ASSERT(STATS_GET(cache_hits) == hits);  // refilled, the file looks different
+
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 304);
+    file_cache_release(response.cache_entry);
+    TEST_ASSERT(STATS_GET(cache_hits) == hits + 1);
+
+    fp = fopen(path, "w");
+    fputs("version two", fp);
+    fclose(fp);
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 200);
+    TEST_ASSERT(strcmp(response.cache_entry->etag, etag) != 0);
+    TEST_ASSERT(strcmp(response.content, "version two") == 0);
+    file_cache_release(response.cache_entry);
+    remove(path);
+
+    // Test 4: a large file goes out on a weak ETag at once and is hashed in the background
+    size_t big_len = SENDFILE_THRESHOLD * 4;
+    char* big = malloc(big_len);
+    TEST_ASSERT(big != NULL);
+    for (size_t i = 0; i < big_len; i++) {
+        big[i] = (char) (i * 7);
+    }
+    snprintf(path, sizeof(path), "%s/big.bin", docroot);
+    fp = fopen(path, "w");
+    TEST_ASSERT(fp != NULL && fwrite(big, 1, big_len, fp) == big_len);
+    fclose(fp);
+    char strong[ETAG_SIZE];
+    snprintf(strong, sizeof(strong), "\"%016llx\"", (unsigned long long) xxh3_64(big, big_len));
+    free(big);
+
+    char get_big[] = "GET /big.bin HTTP/1.1\r\nHost: a\r\n\r\n";
+    unsigned long hashed = STATS_GET(cache_background_hashes);
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(get_big, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.use_sendfile && response.cache_entry->weak);
+    TEST_ASSERT(strncmp(response.cache_entry->etag, "W/\"", 3) == 0);
+    snprintf(conditional, sizeof(conditional),
+             "GET /big.bin HTTP/1.1\r\nHost: a\r\nIf-None-Match: %s\r\n\r\n",
+             response.cache_entry->etag);
+    release_response_body(&response);
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.status_code == 304);
+    release_response_body(&response);
+
+    bool is_strong = false;
+    for (int waited = 0; waited < 5000 && !is_strong; waited += 10) {
+        usleep(10 * 1000);
+        memset(&response, 0, sizeof(response));
+        TEST_ASSERT(parse_request(get_big, &request) == 0);
+        TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+        is_strong = strcmp(response.cache_entry->etag, strong) == 0;
+        release_response_body(&response);
+    }
+    TEST_ASSERT(is_strong && STATS_GET(cache_background_hashes) == hashed + 1);
+
+    // with no room to keep it, a large file is never read at all
+    file_cache_cleanup();
+    file_cache_init(0, 1, false);
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(parse_request(get_big, &request) == 0);
+    TEST_ASSERT(generate_response(&request, &response, docroot) == 0);
+    TEST_ASSERT(response.cache_entry->weak && !response.cache_entry->cached);
+    release_response_body(&response);
+    usleep(50 * 1000);
+    TEST_ASSERT(STATS_GET(cache_background_hashes) == hashed + 1);
+    file_cache_init(FILE_CACHE_DEFAULT_SIZE, 1, false);
+
+    remove(path);
+    rmdir(docroot);
+    file_cache_cleanup();
+}
+
+void test_prefork(void) {
+    // Test 1: a pinned plan is split into disjoint shares, an unpinned one is not
+    TEST_ASSERT(affinity_plan(NULL, false) == DEFAULT_WORKERS);
+    affinity_keep_share(1, 4);
+    TEST_ASSERT(num_workers == DEFAULT_WORKERS);
+
+    memset(worker_info, 0, sizeof(worker_info));
+    for (int i = 0; i < 5; i++) {
+        worker_info[i].id = i;
+        worker_info[i].cpu = 10 + i;
+    }
+    num_workers = 5;
+    affinity_keep_share(1, 2);
+    TEST_ASSERT(num_workers == 2);
+    TEST_ASSERT(worker_info[0].cpu == 11 && worker_info[1].cpu == 13 && worker_info[1].id == 1);
+
+    num_workers = 2;
+    affinity_keep_share(3, 4);  // more processes than CPUs
+    TEST_ASSERT(num_workers == 1 && worker_info[0].cpu == 13);
+
+    // Test 2: counters of forked processes add up in the shared segment
+    unsigned long served = STATS_GET(requests_served);
+    TEST_ASSERT(stats_share(3) == 0);
+    TEST_ASSERT(STATS_GET(requests_served) == served);  // carried over into slot 0
+    for (int slot = 1; slot <= 2; slot++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            stats_use_slot(slot);
+            STATS_ADD(requests_served, 10 * slot);
+            STATS_INC(connections_in_flight);
+            _exit(0);
+        }
+        TEST_ASSERT(pid > 0);
+        waitpid(pid, NULL, 0);
+    }
+    server_stats_t total;
+    stats_sum(&total);
+    TEST_ASSERT(atomic_load(&total.requests_served) == served + 30);
+    TEST_ASSERT(STATS_GET(requests_served) == served);
+    TEST_ASSERT(stats_in_flight() == STATS_GET(connections_in_flight) + 2);
+
+    char buf[4096];
+    char expected[64];
+    stats_render(buf, sizeof(buf));
+    snprintf(expected, sizeof(expected), "requests_served: %lu\n", served + 30);
+    TEST_ASSERT(strstr(buf, expected) != NULL);
+
+    // a replacement worker starts with no connections of its own
+    stats_use_slot(2);
+    TEST_ASSERT(STATS_GET(connections_in_flight) == 0 && STATS_GET(requests_served) == 20);
+    stats_use_slot(0);
+}
+
+void test_restart(void) {
+    // Test 1: the hot set lists cached files coldest first and warms a new cache
+    mkdir(docroot, 0755);
+    char paths[3][300];
+    for (int i = 0; i < 3; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/hot%d.txt", docroot, i);
+        FILE* fp = fopen(paths[i], "w");
+        TEST_ASSERT(fp != NULL);
+        fprintf(fp, "file %d", i);
+        fclose(fp);
+        chmod(paths[i], 0644);
+    }
+    chmod(paths[2], 0600);  // not servable, must not be loaded
+    file_cache_init(FILE_CACHE_DEFAULT_SIZE, 1, false);
+    for (int i = 0; i < 2; i++) {
+        int fd = open(paths[i], O_RDONLY);
+        struct stat st;
+        TEST_ASSERT(fd >= 0 && fstat(fd, &st) == 0);
+        file_cache_release(file_cache_fill(paths[i], fd, &st));
+        close(fd);
+    }
+    size_t len;
+    char* hot_set = file_cache_hot_set(&len);
+    char expected[3 * sizeof(paths[0]) + 16];
+    snprintf(expected, sizeof(expected), "%s\n%s\n", paths[0], paths[1]);
+    TEST_ASSERT(hot_set != NULL && len == strlen(expected) && strcmp(hot_set, expected) == 0);
+    free(hot_set);
+
+    file_cache_cleanup();
+    snprintf(expected, sizeof(expected), "%s\n/nonexistent\n%s\n\n%s", paths[2], paths[0], paths[1]);
+    TEST_ASSERT(file_cache_warm(expected, strlen(expected)) == 2);
+    unsigned long hits = STATS_GET(cache_hits);
+    for (int i = 0; i < 2; i++) {
+        struct stat st;
+        TEST_ASSERT(stat(paths[i], &st) == 0);
+        cache_entry_t* entry = file_cache_lookup(paths[i], &st);
+        TEST_ASSERT(entry != NULL && strcmp(entry->content, i == 0 ? "file 0" : "file 1") == 0);
+        file_cache_release(entry);
+    }
+    TEST_ASSERT(STATS_GET(cache_hits) == hits + 2);
+
+    // Test 2: what the previous process hands over through the environment
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int not_listening = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    TEST_ASSERT(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(listener, 4) == 0);
+    int ready[2];
+    TEST_ASSERT(pipe(ready) == 0);
+    FILE* hot_file = tmpfile();
+    TEST_ASSERT(hot_file != NULL);
+    fprintf(hot_file, "%s\n", paths[0]);
+    fflush(hot_file);
+
+    char value[16];
+    snprintf(value, sizeof(value), "%d", listener);
+    setenv(LISTEN_FD_ENV, value, 1);
+    snprintf(value, sizeof(value), "%d", ready[1]);
+    setenv(READY_FD_ENV, value, 1);
+    snprintf(value, sizeof(value), "%d", fileno(hot_file));
+    setenv(HOT_SET_FD_ENV, value, 1);
+    char* argv[] = {"httpd", NULL};
+    restart_init(argv, 1);
+    TEST_ASSERT(restart_listener() == listener);
+    TEST_ASSERT(getenv(LISTEN_FD_ENV) == NULL && getenv(READY_FD_ENV) == NULL &&
+                getenv(HOT_SET_FD_ENV) == NULL);
+    TEST_ASSERT(fcntl(listener, F_GETFD) & FD_CLOEXEC);
+    hot_set = restart_hot_set(&len);
+    snprintf(expected, sizeof(expected), "%s\n", paths[0]);
+    TEST_ASSERT(hot_set != NULL && strcmp(hot_set, expected) == 0);
+    free(hot_set);
+
+    restart_ready();
+    char byte = 0;
+    TEST_ASSERT(read(ready[0], &byte, 1) == 1 && byte == 'R');
+    TEST_ASSERT(read(ready[0], &byte, 1) == 0);  // our end is closed, once
+    restart_ready();
+
+    // a socket that is not listening is refused, and started normally nothing is inherited
+    snprintf(value, sizeof(value), "%d", not_listening);
+    setenv(LISTEN_FD_ENV, value, 1);
+    restart_init(argv, 1);
+    TEST_ASSERT(restart_listener() == -1);
+    restart_init(argv, 1);
+    TEST_ASSERT(restart_listener() == -1 && restart_hot_set(&len) == NULL);
+
+    close(listener);
+    close(ready[0]);
+    fclose(hot_file);
+    for (int i = 0; i < 3; i++) {
+        remove(paths[i]);
+    }
+    rmdir(docroot);
+    file_cache_cleanup();
+}
+
+static atomic_int offload_finished = -1;
+static int offload_finished_fd = -1;
+
+static void record_finish(http_task_t* task, int how) {
+    offload_finished_fd = task->client_fd;
+    atomic_store(&offload_finished, how);
+}
+
+void test_send_offload(void) {
+    // a loopback connection with small buffers, so a response does not fit
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    TEST_ASSERT(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(listener, 4) == 0);
+    TEST_ASSERT(getsockname(listener, (struct sockaddr*) &addr, &addr_len) == 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    int small = 4096;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    TEST_ASSERT(connect(client, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    int server = accept(listener, NULL, NULL);
+    TEST_ASSERT(server >= 0);
+    setsockopt(server, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+
+    // Test 1: without a task everything is written in place
+    TEST_ASSERT(send_offload_start(SEND_PARK_DEFAULT_CAP, 0, record_finish) == 0);
+    struct iovec header = {"HEAD", 4};
+    TEST_ASSERT(send_offload_write(server, &header, 1, -1, 0, NULL, false) == 0);
+    char got[4];
+    TEST_ASSERT(recv(client, got, 4, MSG_WAITALL) == 4 && memcmp(got, "HEAD", 4) == 0);
+
+    // Test 2: memory and a file range the client is too slow for are parked
+    size_t mem_len = 100 * 1024, file_len = 300 * 1024, total = 4 + mem_len + file_len;
+    char* body = malloc(mem_len);
+    char* file_data = malloc(file_len);
+    TEST_ASSERT(body != NULL && file_data != NULL);
+    for (size_t i = 0; i < mem_len; i++) {
+        body[i] = (char) (i * 7);
+    }
+    for (size_t i = 0; i < file_len; i++) {
+        file_data[i] = (char) (i * 13);
+    }
+    FILE* file = tmpfile();
+    TEST_ASSERT(file != NULL && fwrite(file_data, 1, file_len, file) == file_len);
+    fflush(file);
+    struct iovec iov[2] = {{"HEAD", 4}, {body, mem_len}};
+    http_task_t task = {.client_fd = server};
+    unsigned long parked = STATS_GET(sends_parked);
+    TEST_ASSERT(send_offload_write(server, iov, 2, fileno(file), file_len, &task, false) ==
+                SEND_PARKED);
+    TEST_ASSERT(STATS_GET(sends_parked) == parked + 1);
+    // the caller's copies may go away right after
+    memset(body, 0, mem_len);
+    fclose(file);
+
+    char* received = malloc(total);
+    TEST_ASSERT(received != NULL);
+    TEST_ASSERT(recv(client, received, total, MSG_WAITALL) == (ssize_t) total);
+    TEST_ASSERT(memcmp(received, "HEAD", 4) == 0);
+    for (size_t i = 0; i < mem_len; i++) {
+        TEST_ASSERT(received[4 + i] == (char) (i * 7));
+    }
+    TEST_ASSERT(memcmp(received + 4 + mem_len, file_data, file_len) == 0);
+
+    // handed back once the client took it all, blocking again
+    for (int waited = 0; waited < 3000 && atomic_load(&offload_finished) < 0; waited += 10) {
+        usleep(10000);
+    }
+    TEST_ASSERT(atomic_load(&offload_finished) == SEND_FINISHED && offload_finished_fd == server);
+    TEST_ASSERT((fcntl(server, F_GETFL) & O_NONBLOCK) == 0);
+    TEST_ASSERT(STATS_GET(send_parked_bytes) == 0);
+
+    // Test 3: a response that is the last one on its connection finishes with a close
+    atomic_store(&offload_finished, -1);
+    TEST_ASSERT(send_offload_write(server, iov, 2, -1, 0, &task, true) == SEND_PARKED);
+    TEST_ASSERT(recv(client, received, 4 + mem_len, MSG_WAITALL) == (ssize_t) (4 + mem_len));
+    for (int waited = 0; waited < 3000 && atomic_load(&offload_finished) < 0; waited += 10) {
+        usleep(10000);
+    }
+    TEST_ASSERT(atomic_load(&offload_finished) == SEND_FINISHED_CLOSE);
+
+    free(body);
+    free(file_data);
+    free(received);
+    close(client);
+    close(server);
+    close(listener);
+}
+
+static bool header_is(const header_view_t* header, const char* name, const char* value) {
+    return strcmp(header->name, name) == 0 && strcmp(header->value, value) == 0;
+}
+
+void test_hpack(void) {
+    hpack_table_t table;
+    hpack_table_init(&table);
+    header_view_t headers[8];
+    char out[512];
+
+    // Test 1: RFC 7541 C.4, three requests with Huffman coding sharing one table
+    static const uint8_t c41[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2,
+                                  0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff};
+    static const uint8_t c42[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64,
+                                  0x9c, 0xbf};
+    static const uint8_t c43[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9,
+                                  0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b,
+                                  0xb8, 0xe8, 0xb4, 0xbf};
+    TEST_ASSERT(hpack_decode(&table, c41, sizeof(c41), out, sizeof(out), headers, 8) == 4);
+    TEST_ASSERT(header_is(&headers[0], ":method", "GET"));
+    TEST_ASSERT(header_is(&headers[3], ":authority", "www.example.com"));
+    TEST_ASSERT(hpack_decode(&table, c42, sizeof(c42), out, sizeof(out), headers, 8) == 5);
+    TEST_ASSERT(header_is(&headers[3], ":authority", "www.example.com"));
+    TEST_ASSERT(header_is(&headers[4], "cache-control", "no-cache"));
+    TEST_ASSERT(headers[4].id == HDR_CACHE_CONTROL);
+    TEST_ASSERT(hpack_decode(&table, c43, sizeof(c43), out, sizeof(out), headers, 8) == 5);
+    TEST_ASSERT(header_is(&headers[2], ":path", "/index.html"));
+    TEST_ASSERT(header_is(&headers[4], "custom-key", "custom-value"));
+    TEST_ASSERT(table.count == 3 && table.size == 164);
+    hpack_table_free(&table);
+
+    // Test 2: too many headers still updates the table; garbage is an error
+    hpack_table_init(&table);
+    TEST_ASSERT(hpack_decode(&table, c41, sizeof(c41), out, sizeof(out), headers, 2) ==
+                HPACK_TOO_LARGE);
+    TEST_ASSERT(table.count == 1);
+    static const uint8_t bad_index[] = {0x80};
+    static const uint8_t past_table[] = {0xff, 0x10};
+    TEST_ASSERT(hpack_decode(&table, bad_index, 1, out, sizeof(out), headers, 8) == HPACK_ERROR);
+    TEST_ASSERT(hpack_decode(&table, past_table, 2, out, sizeof(out), headers, 8) == HPACK_ERROR);
+    hpack_table_free(&table);
+
+    // Test 3: Huffman round trip of every byte value
+    uint8_t all[256], coded[1024];
+    char decoded[256];
+    for (int i = 0; i < 256; i++) {
+        all[i] = (uint8_t) i;
+    }
+    size_t coded_len = hpack_huffman_encode(all, sizeof(all), coded);
+    TEST_ASSERT(coded_len == hpack_huffman_length(all, sizeof(all)));
+    TEST_ASSERT(hpack_huffman_decode(coded, coded_len, decoded, sizeof(decoded)) == 256);
+    TEST_ASSERT(memcmp(all, decoded, sizeof(all)) == 0);
+    TEST_ASSERT(hpack_huffman_decode(coded, coded_len, decoded, 255) == -1);
+
+    // Test 4: an indexed field costs one byte the second time
+    hpack_table_t encoder, decoder;
+    hpack_table_init(&encoder);
+    hpack_table_init(&decoder);
+    uint8_t block[256];
+    size_t first = hpack_encode(&encoder, block, sizeof(block), "content-type", "text/html", 9,
+                                true);
+    first += hpack_encode(&encoder, block + first, sizeof(block) - first, ":status", "200", 3,
+                          false);
+    TEST_ASSERT(hpack_decode(&decoder, block, first, out, sizeof(out), headers, 8) == 2);
+    TEST_ASSERT(header_is(&headers[0], "content-type", "text/html"));
+    TEST_ASSERT(header_is(&headers[1], ":status", "200"));
+    size_t again = hpack_encode(&encoder, block, sizeof(block), "content-type", "text/html", 9,
+                                true);
+    TEST_ASSERT(again == 1);
+    TEST_ASSERT(hpack_decode(&decoder, block, again, out, sizeof(out), headers, 8) == 1);
+    TEST_ASSERT(header_is(&headers[0], "content-type", "text/html"));
+
+    // Test 5: a smaller table from SETTINGS is announced before the next field
+    hpack_encoder_resize(&encoder, 0);
+    TEST_ASSERT(encoder.count == 0);
+    size_t resized = hpack_encode(&encoder, block, sizeof(block), "content-type", "text/html", 9,
+                                  true);
+    TEST_ASSERT(resized > 1 && block[0] == 0x20);
+    TEST_ASSERT(hpack_decode(&decoder, block, resized, out, sizeof(out), headers, 8) == 1);
+    TEST_ASSERT(decoder.count == 0 && decoder.max_size == 0);
+    hpack_table_free(&encoder);
+    hpack_table_free(&decoder);
+}
+
+typedef struct {
+    int fd;
+    int served;
+} h2_test_conn_t;
+
+static void* serve_h2_test(void* arg) {
+    h2_test_conn_t* conn = arg;
+    rio_t rio;
+    http_task_t task = {.client_fd = conn->fd};
+    rio_readinitb(&rio, conn->fd);
+    conn->served = http2_serve(conn->fd, &rio, docroot, &task, NULL);
+    return NULL;
+}
+
+// one whole frame from fd, its payload in payload
+static int read_h2_frame(int fd, uint8_t* type, uint8_t* flags, uint32_t* stream,
+                         uint8_t* payload, size_t cap) {
+    uint8_t header[H2_FRAME_HEADER];
+    if (recv(fd, header, sizeof(header), MSG_WAITALL) != (ssize_t) sizeof(header)) {
+        return -1;
+    }
+    size_t len = (size_t) header[0] << 16 | header[1] << 8 | header[2];
+    *type = header[3];
+    *flags = header[4];
+    *stream = ((uint32_t) header[5] << 24 | header[6] << 16 | header[7] << 8 | header[8]) &
+              0x7fffffff;
+    if (len > cap || (len > 0 && recv(fd, payload, len, MSG_WAITALL) != (ssize_t) len)) {
+        return -1;
+    }
+    return (int) len;
+}
+
+void test_http2(void) {
+    int fds[2];
+    TEST_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    h2_test_conn_t conn = {.fd = fds[1]};
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, serve_h2_test, &conn) == 0);
+
+    // Test 1: read_request() took the preface's first line, the rest follows
+    TEST_ASSERT(http2_is_preface("PRI * HTTP/2.0\r\n\r\n"));
+    TEST_ASSERT(!http2_is_preface("GET / HTTP/1.1\r\n\r\n"));
+    uint8_t request[256];
+    size_t len = H2_PREFACE_LEN - H2_PREFACE_LINE_LEN;
+    memcpy(request, H2_PREFACE + H2_PREFACE_LINE_LEN, len);
+    static const uint8_t settings[H2_FRAME_HEADER] = {0, 0, 0, H2_SETTINGS, 0, 0, 0, 0, 0};
+    memcpy(request + len, settings, sizeof(settings));
+    len += sizeof(settings);
+
+    // Test 2: a GET on stream 1
+    hpack_table_t encoder, decoder;
+    hpack_table_init(&encoder);
+    hpack_table_init(&decoder);
+    uint8_t* frame = request + len;
+    size_t block = H2_FRAME_HEADER;
+    block += hpack_encode(&encoder, frame + block, 64, ":method", "GET", 3, true);
+    block += hpack_encode(&encoder, frame + block, 64, ":scheme", "http", 4, true);
+    block += hpack_encode(&encoder, frame + block, 64, ":path", "/small.txt", 10, false);
+    block += hpack_encode(&encoder, frame + block, 64, ":authority", "localhost", 9, true);
+    size_t block_len = block - H2_FRAME_HEADER;
+    uint8_t header[H2_FRAME_HEADER] = {0, 0, (uint8_t) block_len, H2_HEADERS,
+                                       H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, 0, 0, 0, 1};
+    memcpy(frame, header, sizeof(header));
+    len += block;
+    TEST_ASSERT(send(fds[0], request, len, 0) == (ssize_t) len);
+
+    // our SETTINGS first, then the ACK of the client's, then the response
+    uint8_t type, flags, payload[H2_MAX_FRAME];
+    uint32_t stream;
+    int n = read_h2_frame(fds[0], &type, &flags, &stream, payload, sizeof(payload));
+    TEST_ASSERT(n >= 0 && type == H2_SETTINGS && flags == 0 && n % 6 == 0);
+    bool headers_seen = false;
+    char body[64] = {0};
+    size_t body_len = 0;
+    while ((n = read_h2_frame(fds[0], &type, &flags, &stream, payload, sizeof(payload))) >= 0) {
+        if (type == H2_HEADERS) {
+            header_view_t headers[16];
+            char decoded[1024];
+            TEST_ASSERT(stream == 1 && (flags & H2_FLAG_END_HEADERS));
+            int count = hpack_decode(&decoder, payload, n, decoded, sizeof(decoded), headers, 16);
+            TEST_ASSERT(count > 0 && header_is(&headers[0], ":status", "200"));
+            bool length_seen = false;
+            for (int i = 1; i < count; i++) {
+                length_seen |= header_is(&headers[i], "content-length", "4");
+            }
+            TEST_ASSERT(length_seen);
+            headers_seen = true;
+        } else if (type == H2_DATA) {
+            TEST_ASSERT(headers_seen && stream == 1 && body_len + n < sizeof(body));
+            memcpy(body + body_len, payload, n);
+            body_len += n;
+            if (flags & H2_FLAG_END_STREAM) {
+                break;
+            }
+        }
+    }
+    TEST_ASSERT(body_len == 4 && memcmp(body, "smol", 4) == 0);
+
+    // Test 3: PING is echoed, GOAWAY ends the connection
+    static const uint8_t ping[] = {0, 0, 8, H2_PING, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8};
+    TEST_ASSERT(send(fds[0], ping, sizeof(ping), 0) == (ssize_t) sizeof(ping));
+    n = read_h2_frame(fds[0], &type, &flags, &stream, payload, sizeof(payload));
+    TEST_ASSERT(n == 8 && type == H2_PING && flags == H2_FLAG_ACK && payload[7] == 8);
+    static const uint8_t goaway[] = {0, 0, 8, H2_GOAWAY, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    TEST_ASSERT(send(fds[0], goaway, sizeof(goaway), 0) == (ssize_t) sizeof(goaway));
+    pthread_join(thread, NULL);
+    TEST_ASSERT(conn.served == 1);
+
+    hpack_table_free(&encoder);
+    hpack_table_free(&decoder);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_zerocopy(void) {
+    // a cached body to lend to the kernel
+    char path[300];
+    snprintf(path, sizeof(path), "%s/zerocopy.bin", docroot);
+    size_t len = 48 * 1024;
+    char* data = malloc(len);
+    TEST_ASSERT(data != NULL);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char) (i * 31);
+    }
+    FILE* fp = fopen(path, "w");
+    TEST_ASSERT(fp != NULL && fwrite(data, 1, len, fp) == len);
+    fclose(fp);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    TEST_ASSERT(fd >= 0 && fstat(fd, &st) == 0);
+    cache_entry_t* entry = file_cache_fill(path, fd, &st);
+    close(fd);
+    TEST_ASSERT(entry != NULL && entry->content != NULL);
+    int refs = atomic_load(&entry->refs);
+
+    // Test 1: only cached bodies over the threshold qualify
+    zerocopy_init(32 * 1024);
+    http_response_t response = {.content = entry->content, .content_length = len,
+                                .cache_entry = entry};
+    TEST_ASSERT(zerocopy_eligible(&response));
+    response.content_length = 1024;
+    TEST_ASSERT(!zerocopy_eligible(&response));
+    http_response_t copy = {.content = data, .content_length = len};
+    TEST_ASSERT(!zerocopy_eligible(&copy));
+
+    // Test 2: each send holds a reference until its completion is reaped
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    TEST_ASSERT(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(listener, 4) == 0);
+    TEST_ASSERT(getsockname(listener, (struct sockaddr*) &addr, &addr_len) == 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT(connect(client, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    int server = accept(listener, NULL, NULL);
+    TEST_ASSERT(server >= 0);
+
+    unsigned long sends = STATS_GET(zerocopy_sends);
+    ssize_t sent = zerocopy_send(server, entry->content, len, entry);
+    TEST_ASSERT(sent > 0);
+    unsigned long made = STATS_GET(zerocopy_sends) - sends;
+    TEST_ASSERT(made > 0 && atomic_load(&entry->refs) == refs + (int) made);
+    char* received = malloc(len);
+    TEST_ASSERT(received != NULL);
+    TEST_ASSERT(recv(client, received, sent, MSG_WAITALL) == sent);
+    TEST_ASSERT(memcmp(received, data, sent) == 0);
+    for (int waited = 0; waited < 2000 && atomic_load(&entry->refs) > refs; waited += 10) {
+        struct pollfd pfd = {.fd = server, .events = 0};
+        poll(&pfd, 1, 10);
+        zerocopy_reap(server);
+    }
+    TEST_ASSERT(atomic_load(&entry->refs) == refs);
+    zerocopy_close(server);
+    close(client);
+
+    // Test 3: a connection closed while the peer has not taken the data stays
+    // open, holding the references, until the kernel reports the sends done
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    int small = 4096;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    TEST_ASSERT(connect(client, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    server = accept(listener, NULL, NULL);
+    TEST_ASSERT(server >= 0);
+    setsockopt(server, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    size_t queued = 0;
+    ssize_t n;
+    while (queued < 8 * len && (n = zerocopy_send(server, entry->content, len, entry)) > 0) {
+        queued += (size_t) n;
+    }
+    zerocopy_reap(server);
+    TEST_ASSERT(queued > 0 && atomic_load(&entry->refs) > refs);
+    long lingering = STATS_GET(zerocopy_lingering);
+    zerocopy_close(server);
+    TEST_ASSERT(STATS_GET(zerocopy_lingering) == lingering + 1 && atomic_load(&entry->refs) > refs);
+
+    // the reader takes everything up to the FIN, then the reaper lets go
+    size_t got = 0;
+    while ((n = recv(client, received, len, 0)) > 0) {
+        got += (size_t) n;
+    }
+    TEST_ASSERT(n == 0 && got == queued);
+    for (int waited = 0; waited < 5000 && STATS_GET(zerocopy_lingering) > lingering; waited += 10) {
+        usleep(10 * 1000);
+    }
+    TEST_ASSERT(STATS_GET(zerocopy_lingering) == lingering && atomic_load(&entry->refs) == refs);
+
+    close(client);
+    close(listener);
+    file_cache_release(entry);
+    free(received);
+    free(data);
+    remove(path);
+}
+
+void test_slab_arena(void) {
+    // Test 1: size classes step by quarters of a power of two
+    TEST_ASSERT(arena_class_size(1) == 64);
+    TEST_ASSERT(arena_class_size(65) == 80);
+    TEST_ASSERT(arena_class_size(128) == 128);
+    TEST_ASSERT(arena_class_size(129) == 160);
+    TEST_ASSERT(arena_class_size(16384) == 16384);
+    TEST_ASSERT(arena_class_size(SENDFILE_THRESHOLD + 1) == ARENA_MAX_CLASS);
+    TEST_ASSERT(arena_class_size(ARENA_MAX_CLASS + 1) == ARENA_MAX_CLASS + 1);
+    for (size_t size = 1; size <= ARENA_MAX_CLASS; size += 37) {
+        size_t chunk = arena_class_size(size);
+        TEST_ASSERT(chunk >= size && chunk % 16 == 0);
+        TEST_ASSERT(size <= ARENA_MIN_CLASS || (chunk - size) * 5 < chunk);
+    }
+
+    // Test 2: chunks are distinct, aligned and counted
+    long used = STATS_GET(arena_used_bytes);
+    long requested = STATS_GET(arena_requested_bytes);
+    char* small[100];
+    for (int i = 0; i < 100; i++) {
+        small[i] = arena_alloc(100);
+        TEST_ASSERT(small[i] != NULL && (uintptr_t) small[i] % 16 == 0);
+        memset(small[i], i, 100);
+    }
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT(small[i][0] == (char) i && small[i][99] == (char) i);
+    }
+    TEST_ASSERT(STATS_GET(arena_used_bytes) - used == 100 * 112);
+    TEST_ASSERT(STATS_GET(arena_requested_bytes) - requested == 100 * 100);
+    int kind = arena_page_kind(small[0], 100);
+    TEST_ASSERT(kind == ARENA_PAGES_HUGETLB || kind == ARENA_PAGES_THP || kind == ARENA_PAGES_SMALL);
+    for (int i = 0; i < 100; i++) {
+        arena_free(small[i], 100);
+    }
+    TEST_ASSERT(STATS_GET(arena_used_bytes) == used);
+
+    // Test 3: enough large chunks to need a second region, which is
+    // unmapped again once they are all back
+    long mapped = STATS_GET(arena_mapped_bytes);
+    char* large[40];
+    for (int i = 0; i < 40; i++) {
+        large[i] = arena_alloc(SENDFILE_THRESHOLD + 1);
+        TEST_ASSERT(large[i] != NULL);
+        large[i][SENDFILE_THRESHOLD] = '\0';
+    }
+    TEST_ASSERT(STATS_GET(arena_mapped_bytes) > mapped);
+    for (int i = 0; i < 40; i++) {
+        arena_free(large[i], SENDFILE_THRESHOLD + 1);
+    }
+    TEST_ASSERT(STATS_GET(arena_mapped_bytes) <= (mapped > 0 ? mapped : ARENA_REGION_SIZE));
+    TEST_ASSERT(STATS_GET(arena_used_bytes) == used);
+
+    // Test 4: sizes past the largest class go to malloc
+    unsigned long oversized = STATS_GET(arena_oversized);
+    char* big = arena_alloc(ARENA_MAX_CLASS + 1);
+    TEST_ASSERT(big != NULL && arena_page_kind(big, ARENA_MAX_CLASS + 1) == -1);
+    TEST_ASSERT(STATS_GET(arena_oversized) == oversized + 1);
+    arena_free(big, ARENA_MAX_CLASS + 1);
+}
+
+void test_vhost(void) {
+    // two sites side by side, the second one's name extending the first's
+    char base[] = "/tmp/vhost_test_XXXXXX";
+    TEST_ASSERT(mkdtemp(base) != NULL);
+    char site[300], site2[300], file[400], conf[300];
+    snprintf(site, sizeof(site), "%s/site", base);
+    snprintf(site2, sizeof(site2), "%s/site2", base);
+    TEST_ASSERT(mkdir(site, 0755) == 0 && mkdir(site2, 0755) == 0);
+    snprintf(file, sizeof(file), "%s/index.html", site);
+    FILE* fp = fopen(file, "w");
+    TEST_ASSERT(fp != NULL && fputs("site one", fp) >= 0);
+    fclose(fp);
+    snprintf(file, sizeof(file), "%s/index.html", site2);
+    fp = fopen(file, "w");
+    TEST_ASSERT(fp != NULL && fputs("site two", fp) >= 0);
+    fclose(fp);
+    snprintf(conf, sizeof(conf), "%s/vhosts.conf", base);
+    fp = fopen(conf, "w");
+    TEST_ASSERT(fp != NULL);
+    fprintf(fp, "# test hosts\n\n"
+                "example.com www.example.com  %s\n"
+                "*.example.com                %s   # any subdomain\n"
+                "*.deep.example.com           %s\n", site, site2, site);
+    fclose(fp);
+
+    // Test 1: exact names, case and port ignored
+    TEST_ASSERT(vhost_load(conf) == 4);
+    const vhost_t* host = vhost_find("www.example.com");
+    TEST_ASSERT(host != NULL && strcmp(host->docroot, site) == 0);
+    host = vhost_find("Example.COM:8080");
+    TEST_ASSERT(host != NULL && strcmp(host->docroot, site) == 0);
+    TEST_ASSERT(vhost_find("example.com.") == vhost_find("example.com"));
+
+    // Test 2: wildcards match subdomains, the longest suffix first, but not the bare domain
+    host = vhost_find("img.example.com");
+    TEST_ASSERT(host != NULL && strcmp(host->docroot, site2) == 0);
+    host = vhost_find("a.b.example.com");
+    TEST_ASSERT(host != NULL && strcmp(host->docroot, site2) == 0);
+    host = vhost_find("x.deep.example.com");
+    TEST_ASSERT(host != NULL && strcmp(host->docroot, site) == 0);
+    TEST_ASSERT(vhost_find("deep.example.com") != NULL);
+    TEST_ASSERT(vhost_find("example.org") == NULL && vhost_find("") == NULL);
+    TEST_ASSERT(vhost_find(".example.com") == NULL);
+
+    // Test 3: unknown hosts fall back to the default docroot
+    unsigned long unmatched = STATS_GET(vhost_unmatched);
+    TEST_ASSERT(strcmp(vhost_docroot("other.net", "/fallback"), "/fallback") == 0);
+    TEST_ASSERT(STATS_GET(vhost_unmatched) == unmatched + 1);
+
+    // Test 4: each host is served from its own docroot
+    http_request_t request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.method, "GET");
+    strcpy(request.uri, "/");
+    strcpy(request.host, "img.example.com");
+    http_response_t response;
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(generate_response(&request, &response, vhost_docroot(request.host, docroot)) == 0);
+    TEST_ASSERT(response.content != NULL && memcmp(response.content, "site two", 8) == 0);
+    release_response_body(&response);
+    strcpy(request.host, "example.com");
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(generate_response(&request, &response, vhost_docroot(request.host, docroot)) == 0);
+    TEST_ASSERT(response.content != NULL && memcmp(response.content, "site one", 8) == 0);
+    release_response_body(&response);
+
+    // Test 5: a path into a sibling docroot that shares the prefix is not served
+    strcpy(request.uri, "/../site2/index.html");
+    memset(&response, 0, sizeof(response));
+    TEST_ASSERT(generate_response(&request, &response, vhost_docroot(request.host, docroot)) < 0);
+    TEST_ASSERT(response.status_code == 404);
+
+    // Test 6: names given twice and missing docroots are refused
+    fp = fopen(conf, "w");
+    TEST_ASSERT(fp != NULL);
+    fprintf(fp, "a.test %s\nA.test %s\n", site, site2);
+    fclose(fp);
+    TEST_ASSERT(vhost_load(conf) < 0 && vhost_find("a.test") == NULL);
+    fp = fopen(conf, "w");
+    TEST_ASSERT(fp != NULL);
+    fprintf(fp, "a.test %s/missing\n", base);
+    fclose(fp);
+    TEST_ASSERT(vhost_load(conf) < 0);
+    fp = fopen(conf, "w");
+    TEST_ASSERT(fp != NULL);
+    fprintf(fp, "a.*.test %s\n", site);
+    fclose(fp);
+    TEST_ASSERT(vhost_load(conf) < 0);
+
+    vhost_cleanup();
+    snprintf(file, sizeof(file), "rm -rf %s", base);
+    TEST_ASSERT(system(file) == 0);
+}
+
+void test_capture(void) {
+    char path[] = "/tmp/capture_test_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    close(fd);
+
+    // Test 1: a new file starts with the magic, reopening does not repeat it
+    TEST_ASSERT(!capture_enabled());
+    TEST_ASSERT(capture_open(path) == 0 && capture_enabled());
+    TEST_ASSERT(capture_open(path) == 0);
+
+    // Test 2: requests are buffered until flushed, credentials left out
+    const char* raw[] = {
+        "POST /upload HTTP/1.1\r\nHost: example.com\r\nCookie: session=secret\r\n"
+        "Content-Length: 42\r\n\r\n",
+        "PUT /log HTTP/1.1\r\nAuthorization: Basic c2VjcmV0\r\nHost: example.com\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n",
+    };
+    uint64_t conn_id = capture_connection_id();
+    TEST_ASSERT(conn_id >> 32 == (uint64_t) getpid() && capture_connection_id() != conn_id);
+    for (int i = 0; i < 2; i++) {
+        char buffer[512];
+        strcpy(buffer, raw[i]);
+        http_request_t request;
+        TEST_ASSERT(parse_request(buffer, &request) == 0);
+        capture_request(conn_id, raw[i], &request);
+    }
+    struct stat st;
+    TEST_ASSERT(stat(path, &st) == 0 && st.st_size == CAPTURE_MAGIC_LEN);
+    capture_flush();
+
+    // Test 3: the records read back with their lengths and header blocks
+    char data[1024];
+    fd = open(path, O_RDONLY);
+    TEST_ASSERT(fd >= 0);
+    ssize_t len = read(fd, data, sizeof(data));
+    close(fd);
+    TEST_ASSERT(len > CAPTURE_MAGIC_LEN && memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) == 0);
+    capture_record_t first, second;
+    memcpy(&first, data + CAPTURE_MAGIC_LEN, sizeof(first));
+    const char* head = data + CAPTURE_MAGIC_LEN + sizeof(first);
+    const char* expected = "POST /upload HTTP/1.1\r\nHost: example.com\r\nContent-Length: 42\r\n\r\n";
+    TEST_ASSERT(first.conn_id == conn_id && first.body_len == 42 && first.flags == 0);
+    TEST_ASSERT(first.head_len == strlen(expected) && memcmp(head, expected, first.head_len) == 0);
+    memcpy(&second, head + first.head_len, sizeof(second));
+    head += first.head_len + sizeof(second);
+    expected = "PUT /log HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n\r\n";
+    TEST_ASSERT(second.body_len == 0 && second.flags == CAPTURE_CHUNKED);
+    TEST_ASSERT(second.head_len == strlen(expected) && memcmp(head, expected, second.head_len) == 0);
+    TEST_ASSERT(second.time_us >= first.time_us);
+    TEST_ASSERT(head + second.head_len == data + len);
+
+    remove(path);
+}
+
+void test_perf_counters(void) {
+    char buf[PERF_RENDER_MAX];
+    perf_sample_t sample;
+
+    // Test 1: off by default, stages cost nothing and count nothing
+    TEST_ASSERT(!perf_counters_enabled());
+    unsigned long parses = STATS_GET(perf_stages[PERF_STAGE_PARSE][PERF_SAMPLES]);
+    perf_stage_begin(&sample);
+    perf_stage_end(PERF_STAGE_PARSE, &sample);
+    TEST_ASSERT(STATS_GET(perf_stages[PERF_STAGE_PARSE][PERF_SAMPLES]) == parses);
+    TEST_ASSERT(perf_counters_render(buf, sizeof(buf)) == 0);
+
+    // Test 2: each stage counts its samples and wall time
+    perf_counters_init(true);
+    char raw[] = "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    http_request_t request;
+    perf_stage_begin(&sample);
+    TEST_ASSERT(parse_request(raw, &request) == 0);
+    perf_stage_end(PERF_STAGE_PARSE, &sample);
+    TEST_ASSERT(STATS_GET(perf_stages[PERF_STAGE_PARSE][PERF_SAMPLES]) == parses + 1);
+    TEST_ASSERT(STATS_GET(perf_stages[PERF_STAGE_PARSE][PERF_NANOSECONDS]) > 0);
+
+    // Test 3: a stage that sleeps is switched out, when the kernel lets us count that
+    unsigned long switches = STATS_GET(perf_stages[PERF_STAGE_READ][PERF_CONTEXT_SWITCHES]);
+    perf_stage_begin(&sample);
+    usleep(2000);
+    perf_stage_end(PERF_STAGE_READ, &sample);
+    TEST_ASSERT(STATS_GET(perf_stages[PERF_STAGE_READ][PERF_NANOSECONDS]) >= 2000000);
+    if (STATS_GET(perf_threads[PERF_CONTEXT_SWITCHES]) > 0) {
+        TEST_ASSERT(STATS_GET(perf_stages[PERF_STAGE_READ][PERF_CONTEXT_SWITCHES]) > switches);
+    }
+
+    // Test 4: the report has every stage; ratios without their counters read n/a
+    size_t len = perf_counters_render(buf, sizeof(buf));
+    TEST_ASSERT(len > 0 && len < sizeof(buf) && buf[len - 1] == '\n');
+    TEST_ASSERT(strstr(buf, "perf_read_samples: ") != NULL);
+    TEST_ASSERT(strstr(buf, "perf_send_context_switches: ") != NULL);
+    if (STATS_GET(perf_threads[PERF_CYCLES]) == 0) {
+        TEST_ASSERT(strstr(buf, "perf_parse_ipc: n/a") != NULL);
+    }
+
+    // Test 5: a thread that exits gives its counters back
+    long counting = STATS_GET(perf_threads[PERF_CONTEXT_SWITCHES]);
+    perf_counters_thread_exit();
+    TEST_ASSERT(counting == 0 || STATS_GET(perf_threads[PERF_CONTEXT_SWITCHES]) == counting - 1);
+    perf_counters_init(false);
+}
 
+// offset of text in a listing body, -1 if it is not there
+static long body_find(const dir_index_body_t* body, const char* text) {
+    size_t len = strlen(text);
+    for (size_t i = 0; i + len <= body->len; i++) {
+        if (memcmp(body->data + i, text, len) == 0) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+void test_dir_index(void) {
+    // Test 1: request paths are decoded, queries and bad escapes are not kept
+    char path[64];
+    TEST_ASSERT(decode_uri_path("/big%20dir/a%2Bb.txt?format=json", path, sizeof(path)) == 0);
+    TEST_ASSERT(strcmp(path, "/big dir/a+b.txt") == 0);
+    TEST_ASSERT(decode_uri_path("/a%00b", path, sizeof(path)) < 0);
+    TEST_ASSERT(decode_uri_path("/a%2", path, sizeof(path)) < 0);
+    TEST_ASSERT(decode_uri_path("/a%zz", path, sizeof(path)) < 0);
+
+    char base[] = "/tmp/dir_index_test_XXXXXX";
+    TEST_ASSERT(mkdtemp(base) != NULL);
+    char file[300];
+    snprintf(file, sizeof(file), "%s/b&<c>.txt", base);
+    FILE* fp = fopen(file, "w");
+    TEST_ASSERT(fp != NULL && fputs("twelve bytes", fp) >= 0);
+    fclose(fp);
+    snprintf(file, sizeof(file), "%s/a dir", base);
+    TEST_ASSERT(mkdir(file, 0755) == 0);
+    snprintf(file, sizeof(file), "%s/.hidden", base);
+    fp = fopen(file, "w");
+    TEST_ASSERT(fp != NULL);
+    fclose(fp);
+
+    // Test 2: HTML lists entries by name, escaped, without dot files
+    dir_index_init(true);
+    struct stat st;
+    TEST_ASSERT(stat(base, &st) == 0);
+    unsigned long scans = STATS_GET(dir_index_scans);
+    dir_index_body_t* html = dir_index_render(base, "/files/", &st, DIR_INDEX_HTML);
+    TEST_ASSERT(html != NULL && STATS_GET(dir_index_scans) == scans + 1);
+    long a_dir = body_find(html, "<a href=\"a%20dir/\">a dir/</a>");
+    long b_file = body_find(html, "<a href=\"b%26%3Cc%3E.txt\">b&amp;&lt;c&gt;.txt</a>");
+    TEST_ASSERT(a_dir >= 0 && b_file > a_dir);
+    TEST_ASSERT(body_find(html, "<td>12</td>") >= 0);
+    TEST_ASSERT(body_find(html, "hidden") < 0);
+    TEST_ASSERT(body_find(html, "Index of /files/") >= 0);
+
+    // Test 3: JSON of the same listing
+    dir_index_body_t* json = dir_index_render(base, "/files/", &st, DIR_INDEX_JSON);
+    TEST_ASSERT(json != NULL && json->data[0] == '[');
+    TEST_ASSERT(body_find(json, "{\"name\":\"a dir\",\"type\":\"directory\"") >= 0);
+    TEST_ASSERT(body_find(json, "\"size\":12}") >= 0);
+    TEST_ASSERT(strcmp(json->etag, html->etag) != 0);
+
+    // Test 4: an unchanged directory is neither read nor rendered again
+    unsigned long renders = STATS_GET(dir_index_renders);
+    dir_index_body_t* again = dir_index_render(base, "/files/", &st, DIR_INDEX_HTML);
+    TEST_ASSERT(again == html && STATS_GET(dir_index_renders) == renders);
+    dir_index_release(again);
+
+    // Test 5: a new file shows up; with inotify only that entry is looked at
+    snprintf(file, sizeof(file), "%s/c.txt", base);
+    fp = fopen(file, "w");
+    TEST_ASSERT(fp != NULL);
+    fclose(fp);
+    TEST_ASSERT(stat(base, &st) == 0);
+    unsigned long updates = STATS_GET(dir_index_updates);
+    again = dir_index_render(base, "/files/", &st, DIR_INDEX_HTML);
+    TEST_ASSERT(again != NULL && again != html);
+    TEST_ASSERT(body_find(again, ">c.txt</a>") >= 0);
+    TEST_ASSERT(strcmp(again->etag, html->etag) != 0);
+    TEST_ASSERT(STATS_GET(dir_index_updates) > updates || STATS_GET(dir_index_scans) == scans + 2);
+    // the old body stays valid for whoever still sends it
+    TEST_ASSERT(memcmp(html->data + b_file, "<a href", 7) == 0);
+    dir_index_release(html);
+    dir_index_release(json);
+    dir_index_release(again);
+
+    // Test 6: a deleted file goes away
+    TEST_ASSERT(unlink(file) == 0);
+    TEST_ASSERT(stat(base, &st) == 0);
+    again = dir_index_render(base, "/files/", &st, DIR_INDEX_HTML);
+    TEST_ASSERT(again != NULL && body_find(again, "c.txt") < 0);
+    dir_index_release(again);
+
+    // Test 7: the listing and its 304 both say they vary with Accept
+    int sv[2];
+    CHECK_OR_DIE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    TEST_ASSERT(chmod(base, 0755) == 0);
+    char get[] = "GET / HTTP/1.1\r\nHost: a\r\nAccept: application/json\r\n\r\n";
+    http_request_t request;
+    TEST_ASSERT(parse_request(get, &request) == 0);
+    TEST_ASSERT(dir_index_serve(sv[0], &request, base) == 0);
+    char reply[4096];
+    ssize_t len = recv(sv[1], reply, sizeof(reply) - 1, 0);
+    TEST_ASSERT(len > 0);
+    reply[len] = '\0';
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 200", 12) == 0 && strstr(reply, "\r\nVary: Accept\r\n"));
+    char* etag = strstr(reply, "ETag: ");
+    TEST_ASSERT(etag != NULL);
+    etag += 6;
+    *strstr(etag, "\r\n") = '\0';
+    char conditional[256];
+    snprintf(conditional, sizeof(conditional),
+             "GET / HTTP/1.1\r\nHost: a\r\nAccept: application/json\r\nIf-None-Match: %s\r\n\r\n",
+             etag);
+    TEST_ASSERT(parse_request(conditional, &request) == 0);
+    TEST_ASSERT(dir_index_serve(sv[0], &request, base) == 0);
+    len = recv(sv[1], reply, sizeof(reply) - 1, 0);
+    TEST_ASSERT(len > 0);
+    reply[len] = '\0';
+    TEST_ASSERT(strncmp(reply, "HTTP/1.1 304", 12) == 0 && strstr(reply, "\r\nVary: Accept\r\n"));
+    close(sv[0]);
+    close(sv[1]);
+
+    dir_index_cleanup();
+    dir_index_init(false);
+    snprintf(file, sizeof(file), "rm -rf %s", base);
+    TEST_ASSERT(system(file) == 0);
+}
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+
+typedef struct {
+    int fd;
+    bool plaintext;        // skip the handshake, send a plain HTTP request
+    bool handshake_ok;
+    char reply[8];
+} tls_test_client_t;
+
+static void* tls_client(void* arg) {
+    tls_test_client_t* client = arg;
+    if (client->plaintext) {
+        const char request[] = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+        send(client->fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+        return NULL;
+    }
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, client->fd);
+    client->handshake_ok = SSL_connect(ssl) == 1;
+    if (client->handshake_ok && SSL_write(ssl, "ping", 4) == 4) {
+        int n = SSL_read(ssl, client->reply, sizeof(client->reply) - 1);
+        client->reply[n > 0 ? n : 0] = '\0';
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+// a loopback TCP connection: the client end in *client, the accepted end returned
+static int tls_connect_pair(int* client) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    CHECK_OR_DIE(listener >= 0 && bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0 &&
+                 listen(listener, 1) == 0 &&
+                 getsockname(listener, (struct sockaddr*) &addr, &addr_len) == 0, "listen");
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_OR_DIE(connect(*client, (struct sockaddr*) &addr, sizeof(addr)) == 0, "connect");
+    int server = accept(listener, NULL, NULL);
+    CHECK_OR_DIE(server >= 0, "accept");
+    close(listener);
+    return server;
+}
+
+static bool ktls_available(void) {
+    char ulps[256] = "";
+    FILE* fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (fp != NULL) {
+        if (fgets(ulps, sizeof(ulps), fp) == NULL) {
+            ulps[0] = '\0';
+        }
+        fclose(fp);
+    }
+    return strstr(ulps, "tls") != NULL;
+}
+
+void test_tls(void) {
+    signal(SIGPIPE, SIG_IGN);  // as the server does; the client writes to refused connections
+    char base[] = "/tmp/tls_test_XXXXXX";
+    TEST_ASSERT(mkdtemp(base) != NULL);
+    char cert[64], key[64], command[256];
+    snprintf(cert, sizeof(cert), "%s/cert.pem", base);
+    snprintf(key, sizeof(key), "%s/key.pem", base);
+
+    // Test 1: a missing certificate leaves TLS off
+    TEST_ASSERT(tls_init(cert, key) == -1 && !tls_enabled());
+
+    // Test 2: a self-signed certificate is accepted
+    snprintf(command, sizeof(command),
+             "openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes "
+             "-subj /CN=localhost -days 1 -keyout %s -out %s 2>/dev/null", key, cert);
+    TEST_ASSERT(system(command) == 0);
+    TEST_ASSERT(tls_init(cert, key) == 0 && tls_enabled());
+
+    // Test 3: a handshake over loopback. With the tls ULP the kernel takes
+    // the session over; without it the connection is refused, never served
+    // by userspace encryption
+    tls_test_client_t client = {0};
+    int server = tls_connect_pair(&client.fd);
+    unsigned long handshakes = STATS_GET(tls_handshakes);
+    unsigned long ktls_failures = STATS_GET(tls_ktls_failures);
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, tls_client, &client) == 0);
+    int accepted = tls_accept(server);
+    TEST_ASSERT(STATS_GET(tls_handshakes) == handshakes + 1);
+    if (ktls_available()) {
+        TEST_ASSERT(accepted == 0 && STATS_GET(tls_ktls_failures) == ktls_failures);
+        char request[8] = "";
+        TEST_ASSERT(recv(server, request, 4, MSG_WAITALL) == 4 && memcmp(request, "ping", 4) == 0);
+        TEST_ASSERT(send(server, "pong", 4, MSG_NOSIGNAL) == 4);
+        pthread_join(thread, NULL);
+        TEST_ASSERT(client.handshake_ok && strcmp(client.reply, "pong") == 0);
+        close(server);
+    } else {
+        TEST_ASSERT(accepted == -1 && STATS_GET(tls_ktls_failures) == ktls_failures + 1);
+        close(server);  // the client's read ends here, with nothing
+        pthread_join(thread, NULL);
+        TEST_ASSERT(client.handshake_ok && client.reply[0] == '\0');
+    }
+    close(client.fd);
+
+    // Test 4: a client that does not speak TLS fails the handshake
+    tls_test_client_t plain = {.plaintext = true};
+    server = tls_connect_pair(&plain.fd);
+    unsigned long failures = STATS_GET(tls_handshake_failures);
+    handshakes = STATS_GET(tls_handshakes);
+    TEST_ASSERT(pthread_create(&thread, NULL, tls_client, &plain) == 0);
+    TEST_ASSERT(tls_accept(server) == -1);
+    pthread_join(thread, NULL);
+    TEST_ASSERT(STATS_GET(tls_handshake_failures) == failures + 1 &&
+                STATS_GET(tls_handshakes) == handshakes);
+    close(server);
+    close(plain.fd);
+
+    tls_cleanup();
+    TEST_ASSERT(!tls_enabled());
+    snprintf(command, sizeof(command), "rm -rf %s", base);
+    TEST_ASSERT(system(command) == 0);
+}
+#else
+void test_tls(void) {
+    // built without TLS=1: tls_init always refuses
+    TEST_ASSERT(tls_init("cert.pem", "key.pem") == -1 && !tls_enabled());
+}
+#endif /* WITH_TLS */